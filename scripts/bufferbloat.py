@@ -0,0 +1,529 @@
+#!/usr/bin/env python3
+#
+# End-to-end bufferbloat benchmark. The server and the client run in two
+# network namespaces joined by a veth pair, whose rate is limited with netem
+# (or tbf on kernels without netem). The tunnel is shaped a little below the
+# link rate, so the queue builds up in the tunnel and not in the link.
+#
+# Each phase runs a UDP latency probe and a small-flow workload (short TCP
+# transfers), next to saturating bulk TCP uploads, downloads or both. The
+# report gives the throughput, the round-trip time under load and the goodput
+# of each class, read from the stats files of both ends.
+#
+# It needs root, iproute2 and tc, and nothing outside the machine. The exit
+# status is 1 when latency under load or throughput is out of bounds, so it can
+# be run as a regression test.
+
+import argparse
+import fcntl
+import json
+import os
+import re
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+SERVER_NAMESPACE = 'vpnqos-srv'
+CLIENT_NAMESPACE = 'vpnqos-cli'
+SERVER_LINK = 'vqs0'
+CLIENT_LINK = 'vqc0'
+SERVER_ADDRESS = '10.199.0.1'
+CLIENT_ADDRESS = '10.199.0.2'
+SERVER_TUNNEL_ADDRESS = '10.8.0.1'
+CLIENT_TUNNEL_ADDRESS = '10.8.0.2'
+
+BULK_SINK_PORT = 5201
+BULK_SOURCE_PORT = 5202
+ECHO_PORT = 5203
+SMALL_FLOW_PORT = 5204
+
+# The link carries whole tunnel packets, which are larger than the MTU of the
+# tun device, so its MTU is raised to avoid fragmenting them.
+LINK_MTU = 1600
+
+# Bytes added to each packet on the link: the outer IPv4 and UDP headers and
+# the Ethernet header, which netem and tbf count
+TUNNEL_OVERHEAD = 20 + 8 + 14
+
+# Returns the bytes of a socket that were not acknowledged yet
+SIOCOUTQ = 0x5411
+
+PROBE_INTERVAL = 0.01
+SMALL_FLOW_INTERVAL = 0.1
+SMALL_FLOW_SIZE = 16384
+BULK_BUFFER_SIZE = 65536
+
+PHASES = [
+    ('idle', False, False),
+    ('upload', True, False),
+    ('download', False, True),
+    ('both', True, True)
+]
+
+
+def percentile(values, p):
+    if not values:
+        return float('nan')
+
+    ordered = sorted(values)
+    rank = max(0, min(len(ordered) - 1, int(round(p / 100.0 * len(ordered))) - 1))
+
+    return ordered[rank]
+
+
+def run(*command, check=True):
+    return subprocess.run(command, check=check, stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True)
+
+
+def inNamespace(namespace, *command):
+    return ('ip', 'netns', 'exec', namespace) + command
+
+
+# Services of the server side: bulk sink and source, UDP echo and the server
+# of the small flows. They run until the process is killed.
+def serveBulkSink(connection):
+    with connection:
+        while connection.recv(BULK_BUFFER_SIZE):
+            pass
+
+
+def serveBulkSource(connection):
+    data = b'\0' * BULK_BUFFER_SIZE
+
+    with connection:
+        try:
+            while True:
+                connection.sendall(data)
+        except OSError:
+            pass
+
+
+def serveSmallFlow(connection):
+    with connection:
+        request = connection.recv(4)
+
+        if len(request) == 4:
+            connection.sendall(b'\0' * struct.unpack('!I', request)[0])
+
+
+def acceptLoop(port, handler):
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(('0.0.0.0', port))
+    listener.listen(64)
+
+    while True:
+        connection, _ = listener.accept()
+        threading.Thread(target=handler, args=(connection,), daemon=True).start()
+
+
+def echoLoop():
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(('0.0.0.0', ECHO_PORT))
+
+    while True:
+        data, address = sock.recvfrom(2048)
+        sock.sendto(data, address)
+
+
+def runServices():
+    for port, handler in ((BULK_SINK_PORT, serveBulkSink), (BULK_SOURCE_PORT, serveBulkSource), (SMALL_FLOW_PORT, serveSmallFlow)):
+        threading.Thread(target=acceptLoop, args=(port, handler), daemon=True).start()
+
+    echoLoop()
+
+
+# Workloads of the client side, for one phase. The results are printed as JSON
+# for the main process.
+def runProbe(deadline, results):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(PROBE_INTERVAL)
+    sent = 0
+    rtts = []
+    nextTimestamp = time.monotonic()
+
+    while True:
+        now = time.monotonic()
+
+        if now >= deadline:
+            break
+
+        if now >= nextTimestamp:
+            sock.sendto(struct.pack('!Id', sent, now), (SERVER_TUNNEL_ADDRESS, ECHO_PORT))
+            sent += 1
+            nextTimestamp += PROBE_INTERVAL
+
+        try:
+            data = sock.recv(2048)
+            rtts.append(time.monotonic() - struct.unpack('!Id', data)[1])
+        except socket.timeout:
+            pass
+
+    # Late replies still count
+    sock.settimeout(1)
+
+    try:
+        while len(rtts) < sent:
+            data = sock.recv(2048)
+            rtts.append(time.monotonic() - struct.unpack('!Id', data)[1])
+    except socket.timeout:
+        pass
+
+    results['probe'] = {'sent': sent, 'rtts': rtts}
+
+
+def runSmallFlows(deadline, results):
+    times = []
+    failures = 0
+    received = 0
+    nextTimestamp = time.monotonic()
+
+    while nextTimestamp < deadline:
+        time.sleep(max(0, nextTimestamp - time.monotonic()))
+        start = time.monotonic()
+        nextTimestamp = start + SMALL_FLOW_INTERVAL
+
+        try:
+            with socket.create_connection((SERVER_TUNNEL_ADDRESS, SMALL_FLOW_PORT), timeout=5) as connection:
+                connection.sendall(struct.pack('!I', SMALL_FLOW_SIZE))
+                size = 0
+
+                while size < SMALL_FLOW_SIZE:
+                    data = connection.recv(BULK_BUFFER_SIZE)
+
+                    if not data:
+                        break
+
+                    size += len(data)
+
+                received += size
+
+                if size == SMALL_FLOW_SIZE:
+                    times.append(time.monotonic() - start)
+                else:
+                    failures += 1
+        except OSError:
+            failures += 1
+
+    results['smallFlows'] = {'times': times, 'failures': failures, 'bytes': received}
+
+
+def runUpload(deadline, streams, results):
+    counts = [0] * streams
+
+    def upload(index):
+        data = b'\0' * BULK_BUFFER_SIZE
+
+        try:
+            with socket.create_connection((SERVER_TUNNEL_ADDRESS, BULK_SINK_PORT), timeout=5) as connection:
+                connection.settimeout(1)
+                sent = 0
+
+                while time.monotonic() < deadline:
+                    try:
+                        sent += connection.send(data)
+                    except socket.timeout:
+                        pass
+
+                unacknowledged = struct.unpack('i', fcntl.ioctl(connection.fileno(), SIOCOUTQ, b'\0' * 4))[0]
+                counts[index] = sent - unacknowledged
+        except OSError:
+            pass
+
+    runStreams(upload, streams)
+    results['upload'] = sum(counts)
+
+
+def runDownload(deadline, streams, results):
+    counts = [0] * streams
+
+    def download(index):
+        try:
+            with socket.create_connection((SERVER_TUNNEL_ADDRESS, BULK_SOURCE_PORT), timeout=5) as connection:
+                connection.settimeout(1)
+
+                while time.monotonic() < deadline:
+                    try:
+                        counts[index] += len(connection.recv(BULK_BUFFER_SIZE))
+                    except socket.timeout:
+                        pass
+        except OSError:
+            pass
+
+    runStreams(download, streams)
+    results['download'] = sum(counts)
+
+
+def runStreams(function, streams):
+    threads = [threading.Thread(target=function, args=(i,)) for i in range(streams)]
+
+    for thread in threads:
+        thread.start()
+
+    for thread in threads:
+        thread.join()
+
+
+def runPhase(duration, upload, download, streams):
+    deadline = time.monotonic() + duration
+    results = {}
+    threads = [
+        threading.Thread(target=runProbe, args=(deadline, results)),
+        threading.Thread(target=runSmallFlows, args=(deadline, results))
+    ]
+
+    if upload:
+        threads.append(threading.Thread(target=runUpload, args=(deadline, streams, results)))
+
+    if download:
+        threads.append(threading.Thread(target=runDownload, args=(deadline, streams, results)))
+
+    for thread in threads:
+        thread.start()
+
+    for thread in threads:
+        thread.join()
+
+    json.dump(results, sys.stdout)
+
+
+# Setup of the namespaces and of the tunnel
+class Testbed:
+    def __init__(self, arguments):
+        self.arguments = arguments
+        self.processes = []
+        self.directory = tempfile.mkdtemp(prefix='vpnqos-bufferbloat-')
+        self.binaries = os.path.abspath(arguments.binaries)
+        self.linkQdisc = None
+
+    def start(self):
+        self.cleanNamespaces()
+
+        run('ip', 'netns', 'add', SERVER_NAMESPACE)
+        run('ip', 'netns', 'add', CLIENT_NAMESPACE)
+        run('ip', 'link', 'add', SERVER_LINK, 'netns', SERVER_NAMESPACE, 'mtu', str(LINK_MTU), 'type', 'veth', 'peer', 'name', CLIENT_LINK, 'netns', CLIENT_NAMESPACE, 'mtu', str(LINK_MTU))
+
+        for namespace, link, address in ((SERVER_NAMESPACE, SERVER_LINK, SERVER_ADDRESS), (CLIENT_NAMESPACE, CLIENT_LINK, CLIENT_ADDRESS)):
+            run('ip', '-n', namespace, 'addr', 'add', address + '/24', 'dev', link)
+            run('ip', '-n', namespace, 'link', 'set', link, 'up')
+            run('ip', '-n', namespace, 'link', 'set', 'lo', 'up')
+            self.limitLink(namespace, link)
+
+        bandwidth = str(int(self.arguments.link_rate * 1e6 / 8 * self.arguments.shaping_ratio))
+        common = ['--log-level', 'warning']
+
+        self.spawn(SERVER_NAMESPACE, 'server.log', os.path.join(self.binaries, 'server'), '--stats', self.path('server.stats'), '--max-bandwidth', bandwidth, *common)
+        self.configureTun(SERVER_NAMESPACE, SERVER_TUNNEL_ADDRESS)
+        self.spawn(CLIENT_NAMESPACE, 'client.log', os.path.join(self.binaries, 'client'), '--hostname', SERVER_ADDRESS, '--port', '5976', '--overhead', str(TUNNEL_OVERHEAD), '--upload-bandwidth', bandwidth, '--download-bandwidth', bandwidth, '--stats', self.path('client.stats'), *common, *self.arguments.client_arguments)
+        self.configureTun(CLIENT_NAMESPACE, CLIENT_TUNNEL_ADDRESS)
+        self.spawn(SERVER_NAMESPACE, 'services.log', sys.executable, os.path.abspath(__file__), '--role', 'services')
+        self.waitForTunnel()
+
+    def stop(self):
+        for process in self.processes:
+            process.send_signal(signal.SIGTERM)
+
+        for process in self.processes:
+            try:
+                process.wait(timeout=2)
+            except subprocess.TimeoutExpired:
+                process.kill()
+
+        self.cleanNamespaces()
+
+        if self.arguments.keep_logs:
+            print('Logs kept in %s' % self.directory)
+        else:
+            shutil.rmtree(self.directory, ignore_errors=True)
+
+    def cleanNamespaces(self):
+        for namespace in (SERVER_NAMESPACE, CLIENT_NAMESPACE):
+            run('ip', 'netns', 'del', namespace, check=False)
+
+    def path(self, name):
+        return os.path.join(self.directory, name)
+
+    def spawn(self, namespace, logName, *command):
+        log = open(self.path(logName), 'w')
+        self.processes.append(subprocess.Popen(inNamespace(namespace, *command), stdout=log, stderr=subprocess.STDOUT))
+
+    # netem also adds the propagation delay. Without it, tbf limits the rate
+    # and there is no added delay.
+    def limitLink(self, namespace, link):
+        rate = '%dbit' % (self.arguments.link_rate * 1e6)
+        netem = run('tc', '-n', namespace, 'qdisc', 'replace', 'dev', link, 'root', 'netem', 'rate', rate, 'delay', '%gms' % self.arguments.delay, 'limit', '10000', check=False)
+
+        if netem.returncode == 0:
+            self.linkQdisc = 'netem'
+            return
+
+        run('tc', '-n', namespace, 'qdisc', 'replace', 'dev', link, 'root', 'tbf', 'rate', rate, 'burst', '32kbit', 'latency', '500ms')
+        self.linkQdisc = 'tbf'
+
+    def configureTun(self, namespace, address):
+        for _ in range(50):
+            links = run('ip', '-n', namespace, '-o', 'link', 'show').stdout
+            match = re.search(r'^\d+: (tun\d+):', links, re.M)
+
+            if match:
+                run('ip', '-n', namespace, 'addr', 'add', address + '/24', 'dev', match.group(1))
+                run('ip', '-n', namespace, 'link', 'set', match.group(1), 'up')
+                return
+
+            time.sleep(0.1)
+
+        raise RuntimeError('No tun device showed up in %s, see the logs in %s' % (namespace, self.directory))
+
+    # The server learns the route to the client from the first packet it
+    # sends, so the client pings the echo service until it answers.
+    def waitForTunnel(self):
+        script = 'import socket,sys\n' \
+                 's=socket.socket(2,2);s.settimeout(0.2)\n' \
+                 'for i in range(50):\n' \
+                 ' s.sendto(b"x",("%s",%d))\n' \
+                 ' try:\n' \
+                 '  s.recv(16);sys.exit(0)\n' \
+                 ' except socket.timeout:pass\n' \
+                 'sys.exit(1)\n' % (SERVER_TUNNEL_ADDRESS, ECHO_PORT)
+
+        if subprocess.run(inNamespace(CLIENT_NAMESPACE, sys.executable, '-c', script)).returncode:
+            raise RuntimeError('The tunnel does not carry packets, see the logs in %s' % self.directory)
+
+    def readClassBytes(self, statsName):
+        output = run(os.path.join(self.binaries, 'vpnqos-stat'), '--prometheus', self.path(statsName)).stdout
+        counts = {}
+
+        for match in re.finditer(r'^vpnqos_dequeued_bytes_total\{.*class="(\d+)"\} (\d+)$', output, re.M):
+            counts[int(match.group(1))] = counts.get(int(match.group(1)), 0) + int(match.group(2))
+
+        return counts
+
+    def runPhase(self, upload, download):
+        before = (self.readClassBytes('client.stats'), self.readClassBytes('server.stats'))
+        command = inNamespace(CLIENT_NAMESPACE, sys.executable, os.path.abspath(__file__), '--role', 'phase', '--duration', str(self.arguments.duration), '--streams', str(self.arguments.streams))
+
+        if upload:
+            command += ('--upload',)
+
+        if download:
+            command += ('--download',)
+
+        results = json.loads(run(*command).stdout)
+        after = (self.readClassBytes('client.stats'), self.readClassBytes('server.stats'))
+
+        results['classes'] = [
+            {c: (after[i].get(c, 0) - before[i].get(c, 0)) / self.arguments.duration for c in after[i]}
+            for i in range(2)
+        ]
+
+        return results
+
+
+def formatMilliseconds(value):
+    return '%8.1f' % (value * 1000)
+
+
+def report(arguments, testbed, phases):
+    shapedRate = arguments.link_rate * arguments.shaping_ratio
+    idleRtt = percentile(phases['idle']['probe']['rtts'], 50)
+    failures = []
+
+    print('Link: %g Mbit/s with %s, %g ms of delay, tunnel shaped to %.2f Mbit/s' % (arguments.link_rate, testbed.linkQdisc, arguments.delay if testbed.linkQdisc == 'netem' else 0, shapedRate))
+    print()
+    print('%-9s %9s %9s %8s %8s %8s %8s %6s %8s %8s' % ('Phase', 'Up Mb/s', 'Down Mb/s', 'RTT p50', 'RTT p90', 'RTT p99', 'RTT max', 'Loss', 'Flow p50', 'Flow p99'))
+
+    for name, upload, download in PHASES:
+        results = phases[name]
+        rtts = results['probe']['rtts']
+        sent = results['probe']['sent']
+        flowTimes = results['smallFlows']['times']
+        uploadRate = results.get('upload', 0) * 8 / arguments.duration / 1e6
+        downloadRate = results.get('download', 0) * 8 / arguments.duration / 1e6
+
+        print('%-9s %9.2f %9.2f %s %s %s %s %5.1f%% %s %s' % (
+            name, uploadRate, downloadRate,
+            formatMilliseconds(percentile(rtts, 50)), formatMilliseconds(percentile(rtts, 90)),
+            formatMilliseconds(percentile(rtts, 99)), formatMilliseconds(max(rtts) if rtts else float('nan')),
+            100.0 * (sent - len(rtts)) / sent if sent else 0,
+            formatMilliseconds(percentile(flowTimes, 50)), formatMilliseconds(percentile(flowTimes, 99))))
+
+        if name != 'idle' and percentile(rtts, 99) - idleRtt > arguments.max_latency / 1000:
+            failures.append('%s: the RTT p99 is %.1f ms above the idle RTT' % (name, (percentile(rtts, 99) - idleRtt) * 1000))
+
+        for direction, enabled, rate in (('upload', upload, uploadRate), ('download', download, downloadRate)):
+            if enabled and rate < shapedRate * arguments.min_throughput:
+                failures.append('%s: the %s rate is %.2f Mbit/s' % (name, direction, rate))
+
+        if results['smallFlows']['failures']:
+            failures.append('%s: %d small flows failed' % (name, results['smallFlows']['failures']))
+
+    print()
+    print('Goodput of each class (Mbit/s)')
+
+    for name, _, _ in PHASES:
+        for label, counts in zip(('up', 'down'), phases[name]['classes']):
+            print('  %-9s %-5s %s' % (name, label, '  '.join('class %d: %.2f' % (c, counts[c] * 8 / 1e6) for c in sorted(counts))))
+
+    print()
+
+    for failure in failures:
+        print('FAIL %s' % failure)
+
+    if not failures:
+        print('PASS')
+
+    return 1 if failures else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description='End-to-end bufferbloat benchmark of the tunnel.')
+    parser.add_argument('--binaries', default=os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'bin'), help='directory of server, client and vpnqos-stat')
+    parser.add_argument('--link-rate', type=float, default=20, help='rate of the link in Mbit/s (default: 20)')
+    parser.add_argument('--delay', type=float, default=10, help='one-way delay of the link in ms, with netem (default: 10)')
+    parser.add_argument('--shaping-ratio', type=float, default=0.95, help='rate of the tunnel relative to the link (default: 0.95)')
+    parser.add_argument('--duration', type=float, default=15, help='duration of each phase in seconds (default: 15)')
+    parser.add_argument('--streams', type=int, default=4, help='bulk TCP streams in each direction (default: 4)')
+    parser.add_argument('--max-latency', type=float, default=30, help='highest RTT p99 under load above the idle RTT, in ms (default: 30)')
+    parser.add_argument('--min-throughput', type=float, default=0.8, help='lowest bulk rate relative to the shaped rate (default: 0.8)')
+    parser.add_argument('--keep-logs', action='store_true', help='keep the logs and stats files')
+    parser.add_argument('--role', choices=('services', 'phase'), help=argparse.SUPPRESS)
+    parser.add_argument('--upload', action='store_true', help=argparse.SUPPRESS)
+    parser.add_argument('--download', action='store_true', help=argparse.SUPPRESS)
+    parser.add_argument('client_arguments', nargs='*', help='extra arguments of the client, after --')
+    arguments = parser.parse_args()
+
+    if arguments.role == 'services':
+        runServices()
+        return 0
+
+    if arguments.role == 'phase':
+        runPhase(arguments.duration, arguments.upload, arguments.download, arguments.streams)
+        return 0
+
+    if os.geteuid() != 0:
+        print('This benchmark needs root to create network namespaces.', file=sys.stderr)
+        return 2
+
+    testbed = Testbed(arguments)
+    phases = {}
+
+    try:
+        testbed.start()
+
+        for name, upload, download in PHASES:
+            print('Running the %s phase...' % name, file=sys.stderr)
+            phases[name] = testbed.runPhase(upload, download)
+    finally:
+        testbed.stop()
+
+    return report(arguments, testbed, phases)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,832 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include <capture.h>
+#include <common.h>
+#include <log.h>
+#include <protocol.h>
+#include <stats.h>
+#include <tunnel.h>
+
+// Offline benchmark of the queueing discipline. Synthetic traffic takes the
+// same path as packets read from the tun device (tunnel_handleTunPacket(),
+// then tunnel_pollDuePackets()), but time comes from a virtual clock that
+// jumps from one event to the next, so a run does not depend on the load of
+// the machine and the same seed always gives the same results. Only the cost
+// of the calls is measured with the real clock.
+
+#define BENCH_DEFAULT_BANDWIDTH 1000000
+#define BENCH_DEFAULT_DURATION 10
+#define BENCH_DEFAULT_SEED 1
+
+#define BENCH_MAX_TRAFFIC_COUNT 4
+#define BENCH_MAX_GENERATOR_COUNT 64
+
+// Percentiles of the latencies that are shown
+#define PERCENTILE_COUNT 3
+
+// A kind of traffic, made of flowCount flows. Bulk traffic offers a share
+// (load) of the bandwidth, whatever it is, while real-time traffic sends at a
+// fixed interval. The flows are open loop: they do not slow down when their
+// packets are dropped.
+typedef struct {
+    const char *name;
+    uint8_t protocol;
+    uint8_t dscp;
+    uint16_t port;
+    int flowCount;
+    uint32_t minimumSize;
+    uint32_t maximumSize;
+    double load;
+    uint64_t interval;
+    uint64_t jitter;
+} traffic_t;
+
+typedef struct {
+    const char *name;
+    const char *description;
+    const traffic_t *traffics[BENCH_MAX_TRAFFIC_COUNT];
+} scenario_t;
+
+typedef struct {
+    const traffic_t *traffic;
+    int index;
+    int flow;
+    uint64_t interval;
+    uint64_t jitter;
+    uint64_t nextTimestamp;
+    uint32_t ackNumber;
+} generator_t;
+
+typedef struct {
+    uint64_t offeredPackets;
+    uint64_t offeredBytes;
+    uint64_t sentPackets;
+    uint64_t sentBytes;
+    stats_histogram_t latencies;
+} traffic_results_t;
+
+typedef struct {
+    uint64_t callCount;
+    uint64_t operationCount;
+    uint64_t duration;
+} timing_t;
+
+typedef struct {
+    tunnel_t tunnel;
+    queue_element_t *element;
+    uint8_t discardBuffer[TUNNEL_MAX_PACKET_SIZE];
+    traffic_results_t results[BENCH_MAX_TRAFFIC_COUNT];
+    timing_t enqueueTiming;
+    timing_t dequeueTiming;
+    uint64_t wireBytes;
+    uint64_t random;
+} bench_t;
+
+static const traffic_t bulk = {"bulk", IPPROTO_TCP, 0, 443, 4, 1500, 1500, 1.2, 0, 0};
+static const traffic_t voip = {"voip", IPPROTO_UDP, 46, 5004, 4, 200, 200, 0, 20000000, 0};
+static const traffic_t gaming = {"gaming", IPPROTO_UDP, 0, 27015, 2, 60, 250, 0, 16666667, 2000000};
+static const traffic_t acks = {"acks", IPPROTO_TCP, 0, 443, 4, 52, 52, 0.05, 0, 0};
+static const traffic_t ackFlood = {"ackflood", IPPROTO_TCP, 0, 80, 32, 52, 52, 0.8, 0, 0};
+static const traffic_t udpFlood = {"udpflood", IPPROTO_UDP, 0, 9000, 4, 1200, 1200, 1.2, 0, 0};
+
+static const scenario_t scenarios[] = {
+    {"bulk", "bulk TCP above the shaping rate", {&bulk}},
+    {"voip", "VoIP calls next to bulk TCP", {&voip, &bulk}},
+    {"gaming", "game traffic next to bulk TCP", {&gaming, &bulk}},
+    {"ackflood", "a flood of TCP ACKs next to bulk TCP", {&ackFlood, &bulk}},
+    {"udpflood", "a UDP flood next to bulk TCP", {&udpFlood, &bulk}},
+    {"mix", "bulk TCP, ACKs, VoIP and game traffic", {&bulk, &acks, &voip, &gaming}}
+};
+
+static const double percentiles[PERCENTILE_COUNT] = {50, 99, 99.9};
+
+static const char *scenarioName;
+static const char *rulesFileName;
+static const char *replayFileName;
+static double speed = 1;
+static int bandwidth = BENCH_DEFAULT_BANDWIDTH;
+static int overhead;
+static int linkType = PACER_LINK_ETHERNET;
+static int mpu;
+static int batchSize = TUNNEL_DEFAULT_BATCH_SIZE;
+static bool aggregate;
+static bool ackFilter;
+static unsigned int duration = BENCH_DEFAULT_DURATION;
+static uint64_t seed = BENCH_DEFAULT_SEED;
+static classifier_t classifier;
+static stats_file_t stats;
+
+// xorshift64*, which is plenty for traffic patterns and gives the same
+// sequence on every machine
+static uint64_t getRandom(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint64_t getRandomBelow(uint64_t *state, uint64_t limit) {
+    return limit ? getRandom(state) % limit : 0;
+}
+
+static void writeShort(uint8_t *buffer, uint16_t value) {
+    buffer[0] = value >> 8;
+    buffer[1] = value;
+}
+
+static void writeLong(uint8_t *buffer, uint32_t value) {
+    writeShort(buffer, value >> 16);
+    writeShort(buffer + 2, value);
+}
+
+// Builds an IPv4 packet of the generator after the packet information. The
+// identification field holds the index of the traffic, so that the latency
+// of each kind of traffic can be told apart when the packet is sent. TCP
+// packets acknowledge two more segments each time, and carry timestamps when
+// they have room for them, so that small ones are pure ACKs as a receiver
+// sends them.
+static uint32_t buildPacket(uint8_t *buffer, generator_t *generator, uint64_t *random) {
+    const traffic_t *traffic = generator->traffic;
+    uint32_t size = traffic->minimumSize + getRandomBelow(random, traffic->maximumSize - traffic->minimumSize + 1);
+    uint8_t *header = buffer + TUNNEL_PACKET_INFORMATION_SIZE;
+    uint8_t *transportHeader = header + 20;
+
+    memset(buffer, 0, TUNNEL_PACKET_INFORMATION_SIZE + 52);
+    writeShort(buffer + 2, 0x0800);
+
+    header[0] = 0x45;
+    header[1] = traffic->dscp << 2;
+    writeShort(header + 2, size);
+    writeShort(header + 4, generator->index);
+    header[8] = 64;
+    header[9] = traffic->protocol;
+    header[12] = 10;
+    header[14] = 1;
+    header[15] = 2;
+    header[16] = 10;
+    header[17] = 2;
+    header[18] = generator->index;
+    header[19] = 1;
+
+    writeShort(transportHeader, 40000 + generator->flow);
+    writeShort(transportHeader + 2, traffic->port);
+
+    if(traffic->protocol == IPPROTO_TCP) {
+        unsigned int headerSize = size >= 52 ? 32 : 20;
+
+        writeLong(transportHeader + 8, generator->ackNumber);
+        transportHeader[12] = headerSize / 4 << 4;
+        transportHeader[13] = 0x10;
+
+        if(headerSize == 32) {
+            transportHeader[20] = 1;
+            transportHeader[21] = 1;
+            transportHeader[22] = 8;
+            transportHeader[23] = 10;
+        }
+
+        generator->ackNumber += 2 * 1448;
+    } else {
+        writeShort(transportHeader + 4, size - 20);
+    }
+
+    return TUNNEL_PACKET_INFORMATION_SIZE + size;
+}
+
+static int initGenerators(const scenario_t *scenario, const pacer_link_t *link, generator_t *generators, uint64_t start, uint64_t *random) {
+    int generatorCount = 0;
+
+    for(int i = 0; i < BENCH_MAX_TRAFFIC_COUNT && scenario->traffics[i]; i++) {
+        const traffic_t *traffic = scenario->traffics[i];
+        uint64_t interval = traffic->interval;
+        uint64_t jitter = traffic->jitter;
+
+        // Bulk flows share the load evenly. Their packets are spread at
+        // random around the mean interval, so that flows do not stay in step.
+        if(traffic->load > 0) {
+            double meanSize = pacer_getWireSize(link, TUNNEL_PACKET_INFORMATION_SIZE + (traffic->minimumSize + traffic->maximumSize) / 2);
+
+            interval = meanSize * 1e9 * traffic->flowCount / (traffic->load * bandwidth);
+            jitter = interval / 2;
+        }
+
+        for(int j = 0; j < traffic->flowCount; j++) {
+            if(generatorCount == BENCH_MAX_GENERATOR_COUNT) {
+                fprintf(stderr, "Too many flows in scenario %s.\n", scenario->name);
+                return -1;
+            }
+
+            generator_t *generator = &generators[generatorCount++];
+
+            generator->traffic = traffic;
+            generator->index = i;
+            generator->flow = j;
+            generator->interval = interval;
+            generator->jitter = jitter;
+            generator->nextTimestamp = start + getRandomBelow(random, interval);
+            generator->ackNumber = 0;
+        }
+    }
+
+    return generatorCount;
+}
+
+static void scheduleNextPacket(generator_t *generator, uint64_t *random) {
+    generator->nextTimestamp += generator->interval - generator->jitter / 2 + getRandomBelow(random, generator->jitter + 1);
+}
+
+// Cost of reading the clock, which is taken out of the timings
+static uint64_t getClockOverhead() {
+    uint64_t startTimestamp = getNanoseconds();
+
+    for(int i = 0; i < 1000; i++) {
+        getNanoseconds();
+    }
+
+    return (getNanoseconds() - startTimestamp) / 1001;
+}
+
+static double getNanosecondsPerOperation(const timing_t *timing, uint64_t clockOverhead) {
+    if(!timing->operationCount) {
+        return 0;
+    }
+
+    double result = (double)timing->duration - (double)timing->callCount * clockOverhead;
+
+    return result > 0 ? result / timing->operationCount : 0;
+}
+
+static void printPercentiles(stats_histogram_t *histogram) {
+    for(int i = 0; i < PERCENTILE_COUNT; i++) {
+        printf(" %9.3f", stats_getPercentile(histogram, percentiles[i]) / 1e6);
+    }
+
+    printf("\n");
+}
+
+static void printResults(const scenario_t *scenario, bench_t *bench, uint64_t elapsed) {
+    uint64_t clockOverhead = getClockOverhead();
+    double seconds = elapsed / 1e9;
+    uint64_t sentBytes = bench->wireBytes;
+
+    printf("Scenario %s: %s, %d B/s for %.1f s\n", scenario->name, scenario->description, bandwidth, seconds);
+    printf("  Enqueue: %.1f ns/op over %llu packets\n", getNanosecondsPerOperation(&bench->enqueueTiming, clockOverhead), (unsigned long long)bench->enqueueTiming.operationCount);
+    printf("  Dequeue: %.1f ns/op over %llu packets\n", getNanosecondsPerOperation(&bench->dequeueTiming, clockOverhead), (unsigned long long)bench->dequeueTiming.operationCount);
+    printf("  Rate: %.0f B/s, %.2f%% of the configured rate\n\n", sentBytes / seconds, 100.0 * sentBytes / seconds / bandwidth);
+
+    printf("  %-10s %12s %12s %10s %10s %9s %9s %9s\n", "Traffic", "Offered B/s", "Sent B/s", "Packets", "Unsent", "p50 ms", "p99 ms", "p99.9 ms");
+
+    for(int i = 0; i < BENCH_MAX_TRAFFIC_COUNT && scenario->traffics[i]; i++) {
+        traffic_results_t *result = &bench->results[i];
+
+        printf("  %-10s %12.0f %12.0f %10llu %10llu", scenario->traffics[i]->name, result->offeredBytes / seconds, result->sentBytes / seconds, (unsigned long long)result->offeredPackets, (unsigned long long)(result->offeredPackets - result->sentPackets));
+        printPercentiles(&result->latencies);
+    }
+
+    printf("\n  %-10s %10s %10s %8s %8s %8s %10s %8s %9s %9s %9s\n", "Class", "Enqueued", "Dequeued", "Marked", "CoDel", "Full", "No buffer", "Acks", "p50 ms", "p99 ms", "p99.9 ms");
+
+    for(int i = 0; i < classifier.classCount; i++) {
+        unsigned long long counts[3 + STATS_DROP_REASON_COUNT] = {0};
+
+        for(int j = 0; j < STATS_THREAD_COUNT; j++) {
+            stats_class_t *class = &stats_getThread(bench->tunnel.stats, j)->classes[i];
+
+            counts[0] += stats_read(&class->enqueuedPackets);
+            counts[1] += stats_read(&class->dequeuedPackets);
+            counts[2] += stats_read(&class->markedPackets);
+
+            for(int k = 0; k < STATS_DROP_REASON_COUNT; k++) {
+                counts[3 + k] += stats_read(&class->droppedPackets[k]);
+            }
+        }
+
+        printf("  %-10d %10llu %10llu %8llu %8llu %8llu %10llu %8llu", i, counts[0], counts[1], counts[2], counts[3 + STATS_DROP_CODEL], counts[3 + STATS_DROP_QUEUE_FULL], counts[3 + STATS_DROP_NO_BUFFER], counts[3 + STATS_DROP_ACK_FILTER]);
+        printPercentiles(&bench->tunnel.stats->sojournTimes[i]);
+    }
+
+    printf("\n");
+}
+
+static int initBench(bench_t *bench) {
+    tunnel_parameters_t parameters = {
+        .queueCapacity = bandwidth / 10,
+        .overhead = overhead,
+        .linkType = linkType,
+        .mpu = mpu,
+        .bandwidth = bandwidth,
+        .burst = 0,
+        .batchSize = batchSize,
+        .engine = TUNNEL_ENGINE_THREADS,
+        .aggregate = aggregate,
+        .ackFilter = ackFilter,
+        .classifier = &classifier,
+        .stats = stats_acquireTunnel(&stats, PROTOCOL_NO_SESSION, classifier.classCount, bandwidth, overhead)
+    };
+    struct sockaddr address = {0};
+
+    // Without a socket, GSO is off and nothing else needs it
+    if(tunnel_init(&bench->tunnel, -1, (int[]){-1}, 1, &parameters, &address)) {
+        fprintf(stderr, "Tunnel initialization failed.\n");
+        stats_releaseTunnel(parameters.stats);
+        return 1;
+    }
+
+    bench->random = seed;
+
+    return 0;
+}
+
+static void destroyBench(bench_t *bench) {
+    if(bench->element) {
+        queue_release(&bench->tunnel.queue, bench->element);
+    }
+
+    queue_destroy(&bench->tunnel.queue);
+    stats_releaseTunnel(bench->tunnel.stats);
+}
+
+// Buffer of the next packet. As with a tun reader, the element is kept until
+// the queue takes it, and the packet goes to a discard buffer when the pool
+// is empty.
+static uint8_t *getBuffer(bench_t *bench) {
+    if(!bench->element) {
+        bench->element = queue_getFreeElement(&bench->tunnel.queue, 0);
+    }
+
+    return bench->element ? bench->element->packet.buffer : bench->discardBuffer;
+}
+
+static void enqueuePacket(bench_t *bench, int traffic, uint8_t *buffer, uint32_t size, uint64_t timestamp) {
+    bench->results[traffic].offeredPackets++;
+    bench->results[traffic].offeredBytes += size;
+
+    uint64_t startTimestamp = getNanoseconds();
+    bool queued = tunnel_handleTunPacket(&bench->tunnel, 0, bench->element, buffer, size, NULL, timestamp);
+    bench->enqueueTiming.duration += getNanoseconds() - startTimestamp;
+    bench->enqueueTiming.callCount++;
+    bench->enqueueTiming.operationCount++;
+
+    if(queued) {
+        bench->element = NULL;
+    }
+}
+
+// Takes the packets that the pacer lets go, as the dequeue thread would send
+// them. Returns the time of the next batch, or UINT64_MAX once the queue is
+// empty. The packets of an aggregate are counted one by one, with the latency
+// of the first one, which is the oldest.
+static uint64_t sendDuePackets(bench_t *bench, uint64_t now, bool identified) {
+    queue_element_t *batch[TUNNEL_MAX_BATCH_SIZE];
+    struct iovec packets[PROTOCOL_MAX_AGGREGATED_PACKETS];
+    bool drained;
+
+    uint64_t startTimestamp = getNanoseconds();
+    int count = tunnel_pollDuePackets(&bench->tunnel, batch, 0, now, &drained);
+    uint64_t callDuration = getNanoseconds() - startTimestamp;
+    int packetTotal = 0;
+
+    for(int i = 0; i < count; i++) {
+        queue_element_t *element = batch[i];
+        int packetCount = 1;
+
+        bench->wireBytes += pacer_getWireSize(&bench->tunnel.link, element->packet.packetSize);
+
+        if(element->packet.buffer[0] == PROTOCOL_TYPE_AGGREGATE) {
+            packetCount = protocol_splitAggregate(element->packet.buffer, element->packet.packetSize, packets);
+        } else {
+            packets[0].iov_base = element->packet.buffer;
+            packets[0].iov_len = element->packet.packetSize;
+        }
+
+        for(int j = 0; j < packetCount; j++) {
+            uint8_t *header = (uint8_t *)packets[j].iov_base + TUNNEL_PACKET_INFORMATION_SIZE;
+            traffic_results_t *result = &bench->results[identified ? header[4] << 8 | header[5] : 0];
+
+            result->sentPackets++;
+            result->sentBytes += packets[j].iov_len;
+            stats_record(&result->latencies, now - element->enqueueTimestamp);
+        }
+
+        packetTotal += packetCount;
+        queue_release(&bench->tunnel.queue, element);
+    }
+
+    // Calls that find the pacer not due yet are left out, as the dequeue
+    // thread sleeps instead of making them.
+    if(count) {
+        bench->dequeueTiming.duration += callDuration;
+        bench->dequeueTiming.callCount++;
+        bench->dequeueTiming.operationCount += packetTotal;
+    }
+
+    return drained ? UINT64_MAX : now + tunnel_getDelay(&bench->tunnel, now);
+}
+
+// Drives the tunnel the way the enqueue and dequeue threads do, except that
+// the clock moves straight to the next packet arrival or to the time the
+// pacer lets the next batch go.
+static int runScenario(const scenario_t *scenario) {
+    generator_t generators[BENCH_MAX_GENERATOR_COUNT];
+    bench_t *bench = calloc(1, sizeof(bench_t));
+
+    if(!bench) {
+        perror("An error occurred while allocating memory for the results");
+        return 1;
+    }
+
+    if(initBench(bench)) {
+        free(bench);
+        return 1;
+    }
+
+    // The pacer was started on the real clock, so the virtual clock starts
+    // from the same time.
+    uint64_t startTimestamp = getNanoseconds();
+    uint64_t endTimestamp = startTimestamp + duration * 1000000000ULL;
+    uint64_t now = startTimestamp;
+    int generatorCount = initGenerators(scenario, &bench->tunnel.link, generators, now, &bench->random);
+
+    if(generatorCount < 0) {
+        destroyBench(bench);
+        free(bench);
+        return 1;
+    }
+
+    while(now < endTimestamp) {
+        uint64_t nextTimestamp = endTimestamp;
+
+        for(int i = 0; i < generatorCount; i++) {
+            generator_t *generator = &generators[i];
+
+            while(generator->nextTimestamp <= now) {
+                uint8_t *buffer = getBuffer(bench);
+                uint32_t size = buildPacket(buffer, generator, &bench->random);
+
+                enqueuePacket(bench, generator->index, buffer, size, generator->nextTimestamp);
+                scheduleNextPacket(generator, &bench->random);
+            }
+
+            if(generator->nextTimestamp < nextTimestamp) {
+                nextTimestamp = generator->nextTimestamp;
+            }
+        }
+
+        uint64_t sendTimestamp = sendDuePackets(bench, now, true);
+
+        now = sendTimestamp < nextTimestamp ? sendTimestamp : nextTimestamp;
+    }
+
+    printResults(scenario, bench, endTimestamp - startTimestamp);
+    destroyBench(bench);
+    free(bench);
+
+    return 0;
+}
+
+// Replays a capture at its own pace, or speed times faster, then lets the
+// queue drain. Packets are classified again, so the rules and the shaping
+// under test may differ from the ones that were in use when it was recorded.
+static int runReplay() {
+    static const traffic_t capturedTraffic = {"capture", 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    char description[256];
+    capture_reader_t reader;
+    capture_packet_t packet = {0};
+    uint64_t oversizedCount = 0;
+    bench_t *bench;
+
+    if(capture_openReader(&reader, replayFileName)) {
+        return 1;
+    }
+
+    bench = calloc(1, sizeof(bench_t));
+
+    if(!bench) {
+        perror("An error occurred while allocating memory for the results");
+        capture_closeReader(&reader);
+        return 1;
+    }
+
+    if(initBench(bench)) {
+        capture_closeReader(&reader);
+        free(bench);
+        return 1;
+    }
+
+    snprintf(description, sizeof(description), "%s at %gx speed", replayFileName, speed);
+
+    scenario_t scenario = {"replay", description, {&capturedTraffic}};
+    uint64_t startTimestamp = getNanoseconds();
+    uint64_t now = startTimestamp;
+    bool ended = capture_read(&reader, &packet);
+    uint64_t captureStartTimestamp = packet.timestamp;
+
+    while(true) {
+        uint64_t nextTimestamp = UINT64_MAX;
+
+        while(!ended) {
+            uint64_t arrivalTimestamp = startTimestamp + (packet.timestamp > captureStartTimestamp ? (packet.timestamp - captureStartTimestamp) / speed : 0);
+
+            if(arrivalTimestamp > now) {
+                nextTimestamp = arrivalTimestamp;
+                break;
+            }
+
+            if(packet.size > TUNNEL_MTU) {
+                oversizedCount++;
+            } else {
+                uint8_t *buffer = getBuffer(bench);
+
+                memset(buffer, 0, TUNNEL_PACKET_INFORMATION_SIZE);
+                memcpy(buffer + TUNNEL_PACKET_INFORMATION_SIZE, packet.data, packet.size);
+                enqueuePacket(bench, 0, buffer, TUNNEL_PACKET_INFORMATION_SIZE + packet.size, arrivalTimestamp);
+            }
+
+            ended = capture_read(&reader, &packet);
+        }
+
+        uint64_t sendTimestamp = sendDuePackets(bench, now, false);
+
+        if(ended && sendTimestamp == UINT64_MAX) {
+            break;
+        }
+
+        now = sendTimestamp < nextTimestamp ? sendTimestamp : nextTimestamp;
+    }
+
+    if(oversizedCount) {
+        printf("Skipped %llu packets larger than the MTU of the tunnel\n", (unsigned long long)oversizedCount);
+    }
+
+    printResults(&scenario, bench, now > startTimestamp ? now - startTimestamp : 1);
+    destroyBench(bench);
+    free(bench);
+    capture_closeReader(&reader);
+
+    return 0;
+}
+
+// Writes a super-packet of the largest size between two small packets to a
+// capture, as offloads do, and checks that they all read back unchanged and
+// that nothing was written past the capture. Runs before the scenarios, as
+// it takes no time.
+static int checkCapture() {
+    static const uint32_t sizes[] = {TUNNEL_PACKET_INFORMATION_SIZE + 40, TUNNEL_MAX_OFFLOAD_PACKET_SIZE, TUNNEL_PACKET_INFORMATION_SIZE + 40};
+    static uint8_t buffer[TUNNEL_MAX_OFFLOAD_PACKET_SIZE];
+    char path[] = "/tmp/bench-capture-XXXXXX";
+    capture_reader_t reader;
+    capture_packet_t packet;
+    int result = 0;
+    int fd = mkstemp(path);
+
+    if(fd == -1) {
+        perror("Failed to create the capture of the check");
+        return 1;
+    }
+
+    close(fd);
+
+    struct {
+        capture_t capture;
+        uint8_t guard[64];
+    } *guarded = calloc(1, sizeof(*guarded));
+
+    if(!guarded) {
+        perror("An error occurred while allocating memory for the capture");
+        unlink(path);
+        return 1;
+    }
+
+    for(uint32_t i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = i * 7;
+    }
+
+    capture_t *capture = &guarded->capture;
+
+    if(capture_open(capture, path, 0, 1)) {
+        free(guarded);
+        unlink(path);
+        return 1;
+    }
+
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        capture_write(capture, buffer, sizes[i], i);
+    }
+
+    capture_close(capture);
+
+    for(size_t i = 0; i < sizeof(guarded->guard); i++) {
+        if(guarded->guard[i]) {
+            fprintf(stderr, "The capture wrote past its buffer.\n");
+            result = 1;
+            break;
+        }
+    }
+
+    free(guarded);
+
+    if(capture_openReader(&reader, path)) {
+        unlink(path);
+        return 1;
+    }
+
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && !result; i++) {
+        uint32_t size = sizes[i] - TUNNEL_PACKET_INFORMATION_SIZE;
+
+        if(capture_read(&reader, &packet) || packet.size != size || packet.class != (int)i || memcmp(packet.data, buffer + TUNNEL_PACKET_INFORMATION_SIZE, size)) {
+            fprintf(stderr, "Packet %zu of %u B did not read back from the capture.\n", i, size);
+            result = 1;
+        }
+    }
+
+    if(!result && !capture_read(&reader, &packet)) {
+        fprintf(stderr, "The capture has more packets than were written.\n");
+        result = 1;
+    }
+
+    capture_closeReader(&reader);
+    unlink(path);
+
+    return result;
+}
+
+static void printUsage(const char *programName) {
+    fprintf(stderr, "Usage: %s [--scenario NAME | --replay CAPTURE [--speed FACTOR]] [--bandwidth BYTES_PER_SECOND] [--duration SECONDS] [--overhead BYTES] [--link-layer ethernet|atm|ptm] [--mpu BYTES] [--batch-size N] [--aggregate] [--ack-filter] [--seed N] [--rules FILE]\n", programName);
+    fprintf(stderr, "Scenarios:");
+
+    for(size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        fprintf(stderr, " %s", scenarios[i].name);
+    }
+
+    fprintf(stderr, " (all of them by default)\n");
+}
+
+static int parseUnsigned(const char *string, unsigned long long minimum, unsigned long long maximum, unsigned long long *value) {
+    char *end;
+    unsigned long long result = strtoull(string, &end, 0);
+
+    if(end == string || *end || result < minimum || result > maximum) {
+        return 1;
+    }
+
+    *value = result;
+
+    return 0;
+}
+
+static int checkCommandLineParameters(int argc, const char *argv[]) {
+    for(int i = 1; i < argc; i++) {
+        unsigned long long value = 0;
+
+        if(strcmp(argv[i], "--aggregate") == 0) {
+            aggregate = true;
+            continue;
+        }
+
+        if(strcmp(argv[i], "--ack-filter") == 0) {
+            ackFilter = true;
+            continue;
+        }
+
+        if(i + 1 == argc) {
+            return 1;
+        }
+
+        if(strcmp(argv[i], "--scenario") == 0) {
+            scenarioName = argv[++i];
+        } else if(strcmp(argv[i], "--rules") == 0) {
+            rulesFileName = argv[++i];
+        } else if(strcmp(argv[i], "--replay") == 0) {
+            replayFileName = argv[++i];
+        } else if(strcmp(argv[i], "--speed") == 0) {
+            char *end;
+
+            speed = strtod(argv[++i], &end);
+
+            if(end == argv[i] || *end || !(speed > 0)) {
+                fprintf(stderr, "Invalid speed.\n");
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--bandwidth") == 0) {
+            if(parseUnsigned(argv[++i], 1000, 0x7fffffff, &value)) {
+                fprintf(stderr, "Invalid bandwidth.\n");
+                return 1;
+            }
+
+            bandwidth = value;
+        } else if(strcmp(argv[i], "--duration") == 0) {
+            if(parseUnsigned(argv[++i], 1, 3600, &value)) {
+                fprintf(stderr, "Invalid duration.\n");
+                return 1;
+            }
+
+            duration = value;
+        } else if(strcmp(argv[i], "--overhead") == 0) {
+            if(parseUnsigned(argv[++i], 0, 1000, &value)) {
+                fprintf(stderr, "Invalid overhead.\n");
+                return 1;
+            }
+
+            overhead = value;
+        } else if(strcmp(argv[i], "--link-layer") == 0) {
+            linkType = pacer_parseLinkType(argv[++i]);
+
+            if(linkType == -1) {
+                fprintf(stderr, "Invalid link layer.\n");
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--mpu") == 0) {
+            if(parseUnsigned(argv[++i], 0, 255, &value)) {
+                fprintf(stderr, "Invalid MPU.\n");
+                return 1;
+            }
+
+            mpu = value;
+        } else if(strcmp(argv[i], "--batch-size") == 0) {
+            if(parseUnsigned(argv[++i], 1, TUNNEL_MAX_BATCH_SIZE, &value)) {
+                fprintf(stderr, "Invalid batch size.\n");
+                return 1;
+            }
+
+            batchSize = value;
+        } else if(strcmp(argv[i], "--seed") == 0) {
+            if(parseUnsigned(argv[++i], 1, ~0ULL, &value)) {
+                fprintf(stderr, "Invalid seed.\n");
+                return 1;
+            }
+
+            seed = value;
+        } else {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, const char *argv[]) {
+    bool found = false;
+
+    if(checkCommandLineParameters(argc, argv)) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if(log_init(LOG_LEVEL_WARNING)) {
+        fprintf(stderr, "Failed to start logging.\n");
+        return EXIT_FAILURE;
+    }
+
+    classifier_init(&classifier);
+
+    if(rulesFileName && classifier_load(&classifier, rulesFileName)) {
+        fprintf(stderr, "Failed to load classifier rules.\n");
+        return EXIT_FAILURE;
+    }
+
+    if(stats_open(&stats, NULL, 1)) {
+        fprintf(stderr, "Failed to create the stats.\n");
+        return EXIT_FAILURE;
+    }
+
+    if(checkCapture()) {
+        fprintf(stderr, "The capture check failed.\n");
+        return EXIT_FAILURE;
+    }
+
+    if(replayFileName) {
+        if(runReplay()) {
+            return EXIT_FAILURE;
+        }
+
+        found = true;
+    }
+
+    for(size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]) && !replayFileName; i++) {
+        if(scenarioName && strcmp(scenarioName, scenarios[i].name)) {
+            continue;
+        }
+
+        found = true;
+
+        if(runScenario(&scenarios[i])) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(!found) {
+        fprintf(stderr, "Unknown scenario %s.\n", scenarioName);
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    stats_close(&stats);
+    log_close();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,532 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <capture.h>
+#include <common.h>
+
+#define PCAPNG_SECTION_HEADER 0x0a0d0d0a
+#define PCAPNG_INTERFACE_DESCRIPTION 1
+#define PCAPNG_SIMPLE_PACKET 3
+#define PCAPNG_ENHANCED_PACKET 6
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+
+#define PCAPNG_OPTION_END 0
+#define PCAPNG_OPTION_COMMENT 1
+#define PCAPNG_OPTION_TIMESTAMP_RESOLUTION 9
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_NANOSECOND_MAGIC 0xa1b23c4d
+
+// Blocks larger than this are taken as a sign of a damaged file
+#define CAPTURE_MAX_BLOCK_SIZE (16 * 1024 * 1024)
+
+#define CAPTURE_COMMENT_SIZE 16
+
+// An enhanced packet block with its comment and the end of its options
+#define CAPTURE_MAX_PACKET_BLOCK_SIZE (32 + TUNNEL_MAX_OFFLOAD_PACKET_SIZE + 3 + 4 + CAPTURE_COMMENT_SIZE + 4)
+
+_Static_assert(CAPTURE_BUFFER_SIZE >= CAPTURE_MAX_PACKET_BLOCK_SIZE, "The capture buffer cannot hold a block of the largest packet.");
+
+static uint32_t getPadding(uint32_t size) {
+    return (4 - (size & 3)) & 3;
+}
+
+static void append(capture_t *capture, const void *data, uint32_t size) {
+    memcpy(capture->buffer + capture->bufferSize, data, size);
+    capture->bufferSize += size;
+}
+
+static void append32(capture_t *capture, uint32_t value) {
+    append(capture, &value, sizeof(value));
+}
+
+static void append16(capture_t *capture, uint16_t value) {
+    append(capture, &value, sizeof(value));
+}
+
+static void appendPadding(capture_t *capture, uint32_t size) {
+    static const uint8_t zeros[4] = {0};
+
+    append(capture, zeros, getPadding(size));
+}
+
+static void flush(capture_t *capture) {
+    uint32_t offset = 0;
+
+    while(offset < capture->bufferSize) {
+        ssize_t result = write(capture->fd, capture->buffer + offset, capture->bufferSize - offset);
+
+        if(result < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            perror("Failed to write the capture file");
+            break;
+        }
+
+        offset += result;
+    }
+
+    capture->fileSize += capture->bufferSize;
+    capture->bufferSize = 0;
+}
+
+// Every file of the ring starts with its own section and interface, so that
+// each one can be read alone.
+static void appendHeader(capture_t *capture) {
+    append32(capture, PCAPNG_SECTION_HEADER);
+    append32(capture, 28);
+    append32(capture, PCAPNG_BYTE_ORDER_MAGIC);
+    append16(capture, 1);
+    append16(capture, 0);
+    append32(capture, 0xffffffff);
+    append32(capture, 0xffffffff);
+    append32(capture, 28);
+
+    append32(capture, PCAPNG_INTERFACE_DESCRIPTION);
+    append32(capture, 32);
+    append16(capture, CAPTURE_LINKTYPE_RAW);
+    append16(capture, 0);
+
+    // No snapshot length, as super-packets are larger than the MTU
+    append32(capture, 0);
+    append16(capture, PCAPNG_OPTION_TIMESTAMP_RESOLUTION);
+    append16(capture, 1);
+    append32(capture, 9);
+    append32(capture, PCAPNG_OPTION_END);
+    append32(capture, 32);
+}
+
+static int openFile(capture_t *capture) {
+    char path[4096];
+
+    if(capture->maximumSize) {
+        snprintf(path, sizeof(path), "%s.%d", capture->path, capture->fileIndex);
+    } else {
+        snprintf(path, sizeof(path), "%s", capture->path);
+    }
+
+    capture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if(capture->fd == -1) {
+        perror("Failed to open the capture file");
+        return 1;
+    }
+
+    capture->fileSize = 0;
+    appendHeader(capture);
+
+    return 0;
+}
+
+int capture_open(capture_t *capture, const char *path, uint64_t maximumSize, int fileCount) {
+    if(fileCount <= 0) {
+        fprintf(stderr, "capture_open() failed because the specified file count (%d) was invalid.\n", fileCount);
+        return 1;
+    }
+
+    capture->path = path;
+    capture->maximumSize = maximumSize;
+    capture->fileCount = fileCount;
+    capture->fileIndex = 0;
+    capture->bufferSize = 0;
+    capture->lastFlushTimestamp = getNanoseconds();
+
+    if(pthread_mutex_init(&capture->mutex, NULL)) {
+        fprintf(stderr, "pthread_mutex_init() failed for the capture.\n");
+        return 1;
+    }
+
+    if(openFile(capture)) {
+        pthread_mutex_destroy(&capture->mutex);
+        return 1;
+    }
+
+    return 0;
+}
+
+void capture_close(capture_t *capture) {
+    pthread_mutex_lock(&capture->mutex);
+    flush(capture);
+    close(capture->fd);
+    pthread_mutex_unlock(&capture->mutex);
+    pthread_mutex_destroy(&capture->mutex);
+}
+
+// Writes an enhanced packet block. The packet information in front of the
+// packet is left out, as the link type is raw IP.
+void capture_write(capture_t *capture, const uint8_t *buffer, uint32_t size, int class) {
+    struct timespec ts;
+    char comment[CAPTURE_COMMENT_SIZE];
+
+    if(size <= TUNNEL_PACKET_INFORMATION_SIZE || size > TUNNEL_MAX_OFFLOAD_PACKET_SIZE) {
+        return;
+    }
+
+    buffer += TUNNEL_PACKET_INFORMATION_SIZE;
+    size -= TUNNEL_PACKET_INFORMATION_SIZE;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    uint64_t timestamp = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    uint32_t commentSize = snprintf(comment, sizeof(comment), "class %d", class);
+    uint32_t blockSize = 32 + size + getPadding(size) + 4 + commentSize + getPadding(commentSize) + 4;
+
+    pthread_mutex_lock(&capture->mutex);
+
+    if(capture->bufferSize + blockSize > CAPTURE_BUFFER_SIZE) {
+        flush(capture);
+    }
+
+    if(capture->maximumSize && capture->fileSize + capture->bufferSize + blockSize > capture->maximumSize) {
+        flush(capture);
+        close(capture->fd);
+        capture->fileIndex = (capture->fileIndex + 1) % capture->fileCount;
+
+        if(openFile(capture)) {
+            pthread_mutex_unlock(&capture->mutex);
+            return;
+        }
+    }
+
+    append32(capture, PCAPNG_ENHANCED_PACKET);
+    append32(capture, blockSize);
+    append32(capture, 0);
+    append32(capture, timestamp >> 32);
+    append32(capture, timestamp);
+    append32(capture, size);
+    append32(capture, size);
+    append(capture, buffer, size);
+    appendPadding(capture, size);
+    append16(capture, PCAPNG_OPTION_COMMENT);
+    append16(capture, commentSize);
+    append(capture, comment, commentSize);
+    appendPadding(capture, commentSize);
+    append32(capture, PCAPNG_OPTION_END);
+    append32(capture, blockSize);
+
+    uint64_t now = getNanoseconds();
+
+    if(now - capture->lastFlushTimestamp >= CAPTURE_FLUSH_PERIOD) {
+        flush(capture);
+        capture->lastFlushTimestamp = now;
+    }
+
+    pthread_mutex_unlock(&capture->mutex);
+}
+
+static uint32_t read32(const capture_reader_t *reader, const uint8_t *data) {
+    uint32_t value;
+
+    memcpy(&value, data, sizeof(value));
+
+    return reader->swapped ? __builtin_bswap32(value) : value;
+}
+
+static uint16_t read16(const capture_reader_t *reader, const uint8_t *data) {
+    uint16_t value;
+
+    memcpy(&value, data, sizeof(value));
+
+    return reader->swapped ? __builtin_bswap16(value) : value;
+}
+
+static int readBytes(capture_reader_t *reader, uint8_t *data, uint32_t size) {
+    return fread(data, 1, size, reader->file) != size;
+}
+
+static int reserveBlock(capture_reader_t *reader, uint32_t size) {
+    if(size > CAPTURE_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "The capture has a block of %u B, it may be damaged.\n", size);
+        return 1;
+    }
+
+    if(size <= reader->blockSize) {
+        return 0;
+    }
+
+    uint8_t *block = realloc(reader->block, size);
+
+    if(!block) {
+        perror("An error occurred while allocating memory for the capture");
+        return 1;
+    }
+
+    reader->block = block;
+    reader->blockSize = size;
+
+    return 0;
+}
+
+int capture_openReader(capture_reader_t *reader, const char *path) {
+    uint8_t header[24];
+
+    memset(reader, 0, sizeof(capture_reader_t));
+    reader->file = fopen(path, "rb");
+
+    if(!reader->file) {
+        perror("Failed to open the capture");
+        return 1;
+    }
+
+    if(readBytes(reader, header, 4)) {
+        fprintf(stderr, "The capture is empty.\n");
+        capture_closeReader(reader);
+        return 1;
+    }
+
+    uint32_t magic = read32(reader, header);
+
+    // A pcapng file starts with a section header block, which is read along
+    // with the packets.
+    if(magic == PCAPNG_SECTION_HEADER) {
+        reader->pcapng = true;
+        rewind(reader->file);
+        return 0;
+    }
+
+    reader->swapped = magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_NANOSECOND_MAGIC);
+    magic = read32(reader, header);
+
+    if((magic != PCAP_MAGIC && magic != PCAP_NANOSECOND_MAGIC) || readBytes(reader, header + 4, 20)) {
+        fprintf(stderr, "The capture is neither a pcap nor a pcapng file.\n");
+        capture_closeReader(reader);
+        return 1;
+    }
+
+    reader->interfaceCount = 1;
+    reader->linkTypes[0] = read32(reader, header + 20);
+    reader->timestampUnits[0] = magic == PCAP_MAGIC ? 1000 : 1;
+
+    return 0;
+}
+
+void capture_closeReader(capture_reader_t *reader) {
+    fclose(reader->file);
+    free(reader->block);
+    reader->file = NULL;
+    reader->block = NULL;
+}
+
+// Options of an interface description block. Only the timestamp resolution
+// matters: a power of 10 or, with the high bit set, of 2.
+static uint64_t getTimestampUnit(capture_reader_t *reader, const uint8_t *options, uint32_t size) {
+    uint64_t unit = 1000;
+
+    for(uint32_t offset = 0; offset + 4 <= size;) {
+        uint16_t code = read16(reader, options + offset);
+        uint16_t length = read16(reader, options + offset + 2);
+
+        if(code == PCAPNG_OPTION_END || offset + 4 + length > size) {
+            break;
+        }
+
+        if(code == PCAPNG_OPTION_TIMESTAMP_RESOLUTION && length >= 1) {
+            uint8_t resolution = options[offset + 4];
+            uint64_t perSecond = 1;
+
+            for(int i = 0; i < (resolution & 0x7f) && perSecond < 1000000000; i++) {
+                perSecond *= resolution & 0x80 ? 2 : 10;
+            }
+
+            unit = perSecond < 1000000000 ? 1000000000 / perSecond : 1;
+        }
+
+        offset += 4 + length + getPadding(length);
+    }
+
+    return unit;
+}
+
+static int getCommentClass(capture_reader_t *reader, const uint8_t *options, uint32_t size) {
+    for(uint32_t offset = 0; offset + 4 <= size;) {
+        uint16_t code = read16(reader, options + offset);
+        uint16_t length = read16(reader, options + offset + 2);
+        char comment[CAPTURE_COMMENT_SIZE];
+        int class;
+
+        if(code == PCAPNG_OPTION_END || offset + 4 + length > size) {
+            break;
+        }
+
+        if(code == PCAPNG_OPTION_COMMENT && length < sizeof(comment)) {
+            memcpy(comment, options + offset + 4, length);
+            comment[length] = '\0';
+
+            if(sscanf(comment, "class %d", &class) == 1) {
+                return class;
+            }
+        }
+
+        offset += 4 + length + getPadding(length);
+    }
+
+    return -1;
+}
+
+// Strips the link-layer header. Returns 1 for packets that are not IP.
+static int getNetworkLayer(int linkType, capture_packet_t *packet) {
+    uint32_t headerSize;
+    uint16_t protocol;
+
+    switch(linkType) {
+        case CAPTURE_LINKTYPE_RAW:
+        case CAPTURE_LINKTYPE_IPV4:
+        case CAPTURE_LINKTYPE_IPV6:
+            return packet->size == 0;
+        case CAPTURE_LINKTYPE_NULL:
+            headerSize = 4;
+            break;
+        case CAPTURE_LINKTYPE_ETHERNET:
+            headerSize = 14;
+
+            // 802.1Q tags
+            while(packet->size >= headerSize && (packet->data[headerSize - 2] << 8 | packet->data[headerSize - 1]) == 0x8100) {
+                headerSize += 4;
+            }
+
+            break;
+        case CAPTURE_LINKTYPE_LINUX_SLL:
+            headerSize = 16;
+            break;
+        default:
+            return 1;
+    }
+
+    if(packet->size <= headerSize) {
+        return 1;
+    }
+
+    if(linkType != CAPTURE_LINKTYPE_NULL) {
+        protocol = packet->data[headerSize - 2] << 8 | packet->data[headerSize - 1];
+
+        if(protocol != 0x0800 && protocol != 0x86dd) {
+            return 1;
+        }
+    }
+
+    packet->data += headerSize;
+    packet->size -= headerSize;
+
+    return 0;
+}
+
+static int readPcapPacket(capture_reader_t *reader, capture_packet_t *packet) {
+    uint8_t header[16];
+
+    if(readBytes(reader, header, sizeof(header))) {
+        return 1;
+    }
+
+    uint32_t size = read32(reader, header + 8);
+
+    if(reserveBlock(reader, size) || readBytes(reader, reader->block, size)) {
+        return 1;
+    }
+
+    packet->timestamp = (uint64_t)read32(reader, header) * 1000000000 + (uint64_t)read32(reader, header + 4) * reader->timestampUnits[0];
+    packet->data = reader->block;
+    packet->size = size;
+    packet->class = -1;
+
+    return 0;
+}
+
+// Reads blocks until a packet comes. Returns -1 for a packet that is skipped.
+static int readPcapngPacket(capture_reader_t *reader, capture_packet_t *packet) {
+    uint8_t header[12];
+
+    if(readBytes(reader, header, 8)) {
+        return 1;
+    }
+
+    uint32_t type = read32(reader, header);
+
+    // The byte order is set by each section header
+    if(type == PCAPNG_SECTION_HEADER) {
+        if(readBytes(reader, header + 8, 4)) {
+            return 1;
+        }
+
+        reader->swapped = false;
+        reader->swapped = read32(reader, header + 8) != PCAPNG_BYTE_ORDER_MAGIC;
+        reader->interfaceCount = 0;
+    }
+
+    uint32_t blockSize = read32(reader, header + 4);
+    uint32_t headerSize = type == PCAPNG_SECTION_HEADER ? 12 : 8;
+
+    if(blockSize < headerSize + 4 || blockSize & 3 || reserveBlock(reader, blockSize) || readBytes(reader, reader->block, blockSize - headerSize)) {
+        fprintf(stderr, "The capture has a damaged block.\n");
+        return 1;
+    }
+
+    uint8_t *body = reader->block;
+    uint32_t bodySize = blockSize - headerSize - 4;
+
+    if(type == PCAPNG_INTERFACE_DESCRIPTION && bodySize >= 8 && reader->interfaceCount < CAPTURE_MAX_INTERFACE_COUNT) {
+        reader->linkTypes[reader->interfaceCount] = read16(reader, body);
+        reader->timestampUnits[reader->interfaceCount] = getTimestampUnit(reader, body + 8, bodySize - 8);
+        reader->interfaceCount++;
+        return -1;
+    }
+
+    if(type == PCAPNG_ENHANCED_PACKET && bodySize >= 20) {
+        uint32_t interface = read32(reader, body);
+        uint32_t size = read32(reader, body + 12);
+
+        if(interface >= (uint32_t)reader->interfaceCount || size > bodySize - 20) {
+            return -1;
+        }
+
+        uint64_t timestamp = (uint64_t)read32(reader, body + 4) << 32 | read32(reader, body + 8);
+        uint32_t optionsOffset = 20 + size + getPadding(size);
+
+        packet->timestamp = timestamp * reader->timestampUnits[interface];
+        packet->data = body + 20;
+        packet->size = size;
+        packet->class = optionsOffset < bodySize ? getCommentClass(reader, body + optionsOffset, bodySize - optionsOffset) : -1;
+
+        return getNetworkLayer(reader->linkTypes[interface], packet) ? -1 : 0;
+    }
+
+    // Simple packet blocks have no timestamp, so the previous one is kept
+    if(type == PCAPNG_SIMPLE_PACKET && bodySize >= 4 && reader->interfaceCount > 0) {
+        uint32_t size = read32(reader, body);
+
+        packet->data = body + 4;
+        packet->size = size < bodySize - 4 ? size : bodySize - 4;
+        packet->class = -1;
+
+        return getNetworkLayer(reader->linkTypes[0], packet) ? -1 : 0;
+    }
+
+    return -1;
+}
+
+int capture_read(capture_reader_t *reader, capture_packet_t *packet) {
+    while(true) {
+        int result;
+
+        if(reader->pcapng) {
+            result = readPcapngPacket(reader, packet);
+        } else {
+            result = readPcapPacket(reader, packet);
+
+            if(!result && getNetworkLayer(reader->linkTypes[0], packet)) {
+                result = -1;
+            }
+        }
+
+        if(result >= 0) {
+            return result;
+        }
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef __CAPTURE_H_INCLUDED__
+#define __CAPTURE_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <pthread.h>
+
+#include <packet.h>
+
+// Packets read from the tun device are written to a pcapng file, as raw IP
+// packets with a nanosecond timestamp and a comment that gives their class.
+// With a maximum size, the capture is a ring of fileCount files (FILE.0,
+// FILE.1...): when a file is full, the oldest one is overwritten, so the last
+// minutes of traffic are always on disk.
+#define CAPTURE_DEFAULT_FILE_COUNT 4
+
+// The buffer holds at least one block of the largest packet, a TSO
+// super-packet with offloads
+#define CAPTURE_BUFFER_SIZE (2 * TUNNEL_MAX_OFFLOAD_PACKET_SIZE)
+
+// Buffered packets are written when the last write is this old and another
+// packet comes
+#define CAPTURE_FLUSH_PERIOD 1000000000
+
+#define CAPTURE_MAX_INTERFACE_COUNT 16
+
+// Link types of the pcap formats
+#define CAPTURE_LINKTYPE_NULL 0
+#define CAPTURE_LINKTYPE_ETHERNET 1
+#define CAPTURE_LINKTYPE_RAW 101
+#define CAPTURE_LINKTYPE_LINUX_SLL 113
+#define CAPTURE_LINKTYPE_IPV4 228
+#define CAPTURE_LINKTYPE_IPV6 229
+
+typedef struct {
+    const char *path;
+    uint64_t maximumSize;
+    int fileCount;
+    int fileIndex;
+    int fd;
+    uint64_t fileSize;
+    uint64_t lastFlushTimestamp;
+    uint32_t bufferSize;
+    uint8_t buffer[CAPTURE_BUFFER_SIZE];
+    pthread_mutex_t mutex;
+} capture_t;
+
+// Reads pcapng files (such as the ones written above) and classic pcap files,
+// in either byte order
+typedef struct {
+    FILE *file;
+    bool pcapng;
+    bool swapped;
+    int interfaceCount;
+    uint16_t linkTypes[CAPTURE_MAX_INTERFACE_COUNT];
+    uint64_t timestampUnits[CAPTURE_MAX_INTERFACE_COUNT];
+    uint8_t *block;
+    uint32_t blockSize;
+} capture_reader_t;
+
+// A packet of a capture, without its link-layer header. The class is -1 when
+// the capture does not tell it.
+typedef struct {
+    uint64_t timestamp;
+    const uint8_t *data;
+    uint32_t size;
+    int class;
+} capture_packet_t;
+
+int capture_open(capture_t *capture, const char *path, uint64_t maximumSize, int fileCount);
+void capture_close(capture_t *capture);
+void capture_write(capture_t *capture, const uint8_t *buffer, uint32_t size, int class);
+
+int capture_openReader(capture_reader_t *reader, const char *path);
+void capture_closeReader(capture_reader_t *reader);
+
+// Returns 0 when a packet was read, or 1 at the end of the capture or when it
+// is damaged. Packets that are not IP are skipped.
+int capture_read(capture_reader_t *reader, capture_packet_t *packet);
+
+#endif
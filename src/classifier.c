@@ -0,0 +1,464 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <classifier.h>
+
+#define CLASSIFIER_MAX_LINE_LENGTH 512
+#define CLASSIFIER_FLOW_LABEL_MASK 0xfffff
+
+static void setDefaultClassParameters(classifier_t *classifier) {
+    for(int i = 0; i < TUNNEL_MAX_CLASS_COUNT; i++) {
+        classifier->classes[i].codelTarget = CODEL_DEFAULT_TARGET;
+        classifier->classes[i].codelInterval = CODEL_DEFAULT_INTERVAL;
+        classifier->classes[i].ecn = true;
+        classifier->classes[i].rate = 0;
+        classifier->classes[i].ceiling = 100;
+    }
+}
+
+void classifier_init(classifier_t *classifier) {
+    memset(classifier, 0, sizeof(classifier_t));
+    setDefaultClassParameters(classifier);
+
+    // Historical behavior: TCP goes after everything else
+    classifier->classCount = 2;
+    classifier->defaultClass = 0;
+    classifier->ruleCount = 1;
+    classifier->rules[0].class = 1;
+    classifier->rules[0].matchProtocol = true;
+    classifier->rules[0].protocol = PACKET_PROTOCOL_TCP;
+
+    classifier_compile(classifier);
+}
+
+static int parseInteger(const char *string, uint32_t maximum, uint32_t *value) {
+    char *end;
+    unsigned long result = strtoul(string, &end, 0);
+
+    if(end == string || *end || result > maximum) {
+        return 1;
+    }
+
+    *value = result;
+
+    return 0;
+}
+
+static int parseRange(const char *string, uint32_t maximum, classifier_range_t *range) {
+    char buffer[64];
+    const char *separator = strchr(string, '-');
+
+    range->enabled = true;
+
+    if(!separator) {
+        if(parseInteger(string, maximum, &range->minimum)) {
+            return 1;
+        }
+
+        range->maximum = range->minimum;
+
+        return 0;
+    }
+
+    size_t length = separator - string;
+
+    if(length >= sizeof(buffer)) {
+        return 1;
+    }
+
+    memcpy(buffer, string, length);
+    buffer[length] = 0;
+
+    if(parseInteger(buffer, maximum, &range->minimum) || parseInteger(separator + 1, maximum, &range->maximum)) {
+        return 1;
+    }
+
+    return range->minimum > range->maximum;
+}
+
+static int parseProtocol(const char *string, uint8_t *protocol) {
+    uint32_t value;
+
+    if(strcmp(string, "tcp") == 0) {
+        *protocol = PACKET_PROTOCOL_TCP;
+    } else if(strcmp(string, "udp") == 0) {
+        *protocol = PACKET_PROTOCOL_UDP;
+    } else if(strcmp(string, "icmp") == 0) {
+        *protocol = 1;
+    } else if(strcmp(string, "icmpv6") == 0) {
+        *protocol = 58;
+    } else if(parseInteger(string, 255, &value) == 0) {
+        *protocol = value;
+    } else {
+        return 1;
+    }
+
+    return 0;
+}
+
+static int parseRule(classifier_rule_t *rule, char **savePointer) {
+    char *keyword;
+
+    while((keyword = strtok_r(NULL, " \t\r\n", savePointer))) {
+        char *value = strtok_r(NULL, " \t\r\n", savePointer);
+
+        if(!value) {
+            fprintf(stderr, "Missing value after \"%s\".\n", keyword);
+            return 1;
+        }
+
+        int result;
+
+        if(strcmp(keyword, "dscp") == 0) {
+            result = parseRange(value, 63, &rule->dscp);
+        } else if(strcmp(keyword, "protocol") == 0) {
+            rule->matchProtocol = true;
+            result = parseProtocol(value, &rule->protocol);
+        } else if(strcmp(keyword, "sport") == 0) {
+            result = parseRange(value, 65535, &rule->sourcePort);
+        } else if(strcmp(keyword, "dport") == 0) {
+            result = parseRange(value, 65535, &rule->destinationPort);
+        } else if(strcmp(keyword, "size") == 0) {
+            result = parseRange(value, 65535, &rule->size);
+        } else if(strcmp(keyword, "flowlabel") == 0) {
+            rule->matchFlowLabel = true;
+            result = parseInteger(value, CLASSIFIER_FLOW_LABEL_MASK, &rule->flowLabel);
+        } else {
+            fprintf(stderr, "Unknown match \"%s\".\n", keyword);
+            return 1;
+        }
+
+        if(result) {
+            fprintf(stderr, "Bad value \"%s\" for \"%s\".\n", value, keyword);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int parseClass(classifier_class_t *class, char **savePointer) {
+    char *keyword;
+
+    while((keyword = strtok_r(NULL, " \t\r\n", savePointer))) {
+        char *value = strtok_r(NULL, " \t\r\n", savePointer);
+        uint32_t microseconds;
+        int result = 0;
+
+        if(!value) {
+            fprintf(stderr, "Missing value after \"%s\".\n", keyword);
+            return 1;
+        }
+
+        if(strcmp(keyword, "target") == 0) {
+            result = parseInteger(value, UINT32_MAX, &microseconds) || microseconds == 0;
+            class->codelTarget = (uint64_t)microseconds * 1000;
+        } else if(strcmp(keyword, "interval") == 0) {
+            result = parseInteger(value, UINT32_MAX, &microseconds) || microseconds == 0;
+            class->codelInterval = (uint64_t)microseconds * 1000;
+        } else if(strcmp(keyword, "ecn") == 0) {
+            if(strcmp(value, "on") == 0) {
+                class->ecn = true;
+            } else if(strcmp(value, "off") == 0) {
+                class->ecn = false;
+            } else {
+                result = 1;
+            }
+        } else if(strcmp(keyword, "rate") == 0) {
+            result = parseInteger(value, 100, &class->rate);
+        } else if(strcmp(keyword, "ceil") == 0) {
+            result = parseInteger(value, 100, &class->ceiling) || class->ceiling == 0;
+        } else {
+            fprintf(stderr, "Unknown class parameter \"%s\".\n", keyword);
+            return 1;
+        }
+
+        if(result) {
+            fprintf(stderr, "Bad value \"%s\" for \"%s\".\n", value, keyword);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// The rule file contains one statement per line:
+//   classes <count>
+//   default <class>
+//   class <class> [target <us>] [interval <us>] [ecn on|off]
+//                 [rate <percent>] [ceil <percent>]
+//   rule <class> [dscp <a>[-<b>]] [protocol <p>] [sport <a>[-<b>]]
+//                [dport <a>[-<b>]] [size <a>[-<b>]] [flowlabel <label>]
+// Rules are evaluated in order and the first matching rule wins. Empty lines
+// and lines starting with '#' are ignored.
+int classifier_load(classifier_t *classifier, const char *fileName) {
+    FILE *file = fopen(fileName, "r");
+
+    if(!file) {
+        perror("Failed to open classifier rule file");
+        return 1;
+    }
+
+    char line[CLASSIFIER_MAX_LINE_LENGTH];
+    int lineNumber = 0;
+    uint32_t value;
+
+    memset(classifier, 0, sizeof(classifier_t));
+    setDefaultClassParameters(classifier);
+    classifier->classCount = 1;
+
+    while(fgets(line, sizeof(line), file)) {
+        char *savePointer;
+        char *keyword = strtok_r(line, " \t\r\n", &savePointer);
+
+        lineNumber++;
+
+        if(!keyword || keyword[0] == '#') {
+            continue;
+        }
+
+        char *argument = strtok_r(NULL, " \t\r\n", &savePointer);
+
+        if(!argument) {
+            fprintf(stderr, "%s:%d: missing value after \"%s\".\n", fileName, lineNumber, keyword);
+            fclose(file);
+            return 1;
+        }
+
+        if(strcmp(keyword, "classes") == 0) {
+            if(parseInteger(argument, TUNNEL_MAX_CLASS_COUNT, &value) || value == 0) {
+                fprintf(stderr, "%s:%d: bad class count. Expected an integer between 1 and %d.\n", fileName, lineNumber, TUNNEL_MAX_CLASS_COUNT);
+                fclose(file);
+                return 1;
+            }
+
+            classifier->classCount = value;
+        } else if(strcmp(keyword, "default") == 0) {
+            if(parseInteger(argument, TUNNEL_MAX_CLASS_COUNT - 1, &value)) {
+                fprintf(stderr, "%s:%d: bad default class.\n", fileName, lineNumber);
+                fclose(file);
+                return 1;
+            }
+
+            classifier->defaultClass = value;
+        } else if(strcmp(keyword, "class") == 0) {
+            if(parseInteger(argument, TUNNEL_MAX_CLASS_COUNT - 1, &value)) {
+                fprintf(stderr, "%s:%d: bad class.\n", fileName, lineNumber);
+                fclose(file);
+                return 1;
+            }
+
+            if(parseClass(&classifier->classes[value], &savePointer)) {
+                fprintf(stderr, "%s:%d: failed to parse class parameters.\n", fileName, lineNumber);
+                fclose(file);
+                return 1;
+            }
+        } else if(strcmp(keyword, "rule") == 0) {
+            if(classifier->ruleCount == CLASSIFIER_MAX_RULE_COUNT) {
+                fprintf(stderr, "%s:%d: too many rules (the maximum is %d).\n", fileName, lineNumber, CLASSIFIER_MAX_RULE_COUNT);
+                fclose(file);
+                return 1;
+            }
+
+            classifier_rule_t *rule = &classifier->rules[classifier->ruleCount];
+
+            if(parseInteger(argument, TUNNEL_MAX_CLASS_COUNT - 1, &value)) {
+                fprintf(stderr, "%s:%d: bad rule class.\n", fileName, lineNumber);
+                fclose(file);
+                return 1;
+            }
+
+            rule->class = value;
+
+            if(parseRule(rule, &savePointer)) {
+                fprintf(stderr, "%s:%d: failed to parse rule.\n", fileName, lineNumber);
+                fclose(file);
+                return 1;
+            }
+
+            classifier->ruleCount++;
+        } else {
+            fprintf(stderr, "%s:%d: unknown statement \"%s\".\n", fileName, lineNumber, keyword);
+            fclose(file);
+            return 1;
+        }
+    }
+
+    fclose(file);
+
+    if(classifier->defaultClass >= classifier->classCount) {
+        fprintf(stderr, "%s: the default class %d does not exist.\n", fileName, classifier->defaultClass);
+        return 1;
+    }
+
+    for(int i = 0; i < classifier->ruleCount; i++) {
+        if(classifier->rules[i].class >= classifier->classCount) {
+            fprintf(stderr, "%s: rule %d uses class %d, which does not exist.\n", fileName, i, classifier->rules[i].class);
+            return 1;
+        }
+    }
+
+    uint32_t guaranteedRate = 0;
+
+    for(int i = 0; i < classifier->classCount; i++) {
+        if(classifier->classes[i].rate > classifier->classes[i].ceiling) {
+            fprintf(stderr, "%s: the rate of class %d is above its ceiling.\n", fileName, i);
+            return 1;
+        }
+
+        guaranteedRate += classifier->classes[i].rate;
+    }
+
+    if(guaranteedRate > 100) {
+        fprintf(stderr, "%s: the rates of the classes add up to more than 100%%.\n", fileName);
+        return 1;
+    }
+
+    classifier_compile(classifier);
+
+    return 0;
+}
+
+static int compareIntegers(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Splits [0, 65535] into the elementary intervals delimited by the bounds of
+// the rules, and computes the set of rules that accept each interval.
+static void compileRangeField(classifier_t *classifier, size_t fieldOffset, uint8_t *indexes, uint64_t *masks) {
+    uint32_t bounds[CLASSIFIER_MAX_INTERVAL_COUNT + 1];
+    int boundCount = 0;
+
+    bounds[boundCount++] = 0;
+
+    for(int i = 0; i < classifier->ruleCount; i++) {
+        const classifier_range_t *range = (const classifier_range_t *)((const uint8_t *)&classifier->rules[i] + fieldOffset);
+
+        if(range->enabled) {
+            bounds[boundCount++] = range->minimum;
+            bounds[boundCount++] = range->maximum + 1;
+        }
+    }
+
+    qsort(bounds, boundCount, sizeof(uint32_t), compareIntegers);
+
+    int intervalCount = 0;
+
+    for(int b = 0; b < boundCount; b++) {
+        uint32_t start = bounds[b];
+
+        if(start > 65535 || (b > 0 && start == bounds[b - 1])) {
+            continue;
+        }
+
+        uint32_t end = 65536;
+
+        for(int n = b + 1; n < boundCount; n++) {
+            if(bounds[n] != start) {
+                end = bounds[n] > 65536 ? 65536 : bounds[n];
+                break;
+            }
+        }
+
+        uint64_t mask = 0;
+
+        for(int i = 0; i < classifier->ruleCount; i++) {
+            const classifier_range_t *range = (const classifier_range_t *)((const uint8_t *)&classifier->rules[i] + fieldOffset);
+
+            if(!range->enabled || (range->minimum <= start && start <= range->maximum)) {
+                mask |= 1ULL << i;
+            }
+        }
+
+        masks[intervalCount] = mask;
+        memset(indexes + start, intervalCount, end - start);
+        intervalCount++;
+    }
+}
+
+void classifier_compile(classifier_t *classifier) {
+    uint64_t allRules = classifier->ruleCount == 64 ? ~0ULL : (1ULL << classifier->ruleCount) - 1;
+
+    for(int value = 0; value < 64; value++) {
+        classifier->dscpMasks[value] = allRules;
+    }
+
+    for(int value = 0; value < 256; value++) {
+        classifier->protocolMasks[value] = allRules;
+    }
+
+    classifier->portlessMask = allRules;
+    classifier->flowLabelWildcardMask = allRules;
+    classifier->flowLabelCount = 0;
+
+    for(int i = 0; i < classifier->ruleCount; i++) {
+        const classifier_rule_t *rule = &classifier->rules[i];
+        uint64_t bit = 1ULL << i;
+
+        classifier->ruleClasses[i] = rule->class;
+
+        if(rule->dscp.enabled) {
+            for(int value = 0; value < 64; value++) {
+                if((uint32_t)value < rule->dscp.minimum || (uint32_t)value > rule->dscp.maximum) {
+                    classifier->dscpMasks[value] &= ~bit;
+                }
+            }
+        }
+
+        if(rule->matchProtocol) {
+            for(int value = 0; value < 256; value++) {
+                if(value != rule->protocol) {
+                    classifier->protocolMasks[value] &= ~bit;
+                }
+            }
+        }
+
+        // A rule that looks at ports never matches a packet without ports
+        if(rule->sourcePort.enabled || rule->destinationPort.enabled) {
+            classifier->portlessMask &= ~bit;
+        }
+
+        if(rule->matchFlowLabel) {
+            classifier->flowLabelWildcardMask &= ~bit;
+
+            int j = 0;
+
+            while(j < classifier->flowLabelCount && classifier->flowLabels[j] != rule->flowLabel) {
+                j++;
+            }
+
+            if(j == classifier->flowLabelCount) {
+                classifier->flowLabels[j] = rule->flowLabel;
+                classifier->flowLabelMasks[j] = 0;
+                classifier->flowLabelCount++;
+            }
+
+            classifier->flowLabelMasks[j] |= bit;
+        }
+    }
+
+    // Sort the flow labels for the binary search
+    for(int i = 1; i < classifier->flowLabelCount; i++) {
+        uint32_t label = classifier->flowLabels[i];
+        uint64_t mask = classifier->flowLabelMasks[i];
+        int j = i - 1;
+
+        while(j >= 0 && classifier->flowLabels[j] > label) {
+            classifier->flowLabels[j + 1] = classifier->flowLabels[j];
+            classifier->flowLabelMasks[j + 1] = classifier->flowLabelMasks[j];
+            j--;
+        }
+
+        classifier->flowLabels[j + 1] = label;
+        classifier->flowLabelMasks[j + 1] = mask;
+    }
+
+    compileRangeField(classifier, offsetof(classifier_rule_t, sourcePort), classifier->sourcePortIndexes, classifier->sourcePortMasks);
+    compileRangeField(classifier, offsetof(classifier_rule_t, destinationPort), classifier->destinationPortIndexes, classifier->destinationPortMasks);
+    compileRangeField(classifier, offsetof(classifier_rule_t, size), classifier->sizeIndexes, classifier->sizeMasks);
+}
@@ -0,0 +1,115 @@
+#ifndef __CLASSIFIER_H_INCLUDED__
+#define __CLASSIFIER_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <codel.h>
+#include <packet.h>
+
+#define CLASSIFIER_MAX_RULE_COUNT 64
+#define CLASSIFIER_MAX_INTERVAL_COUNT (2 * CLASSIFIER_MAX_RULE_COUNT + 1)
+
+typedef struct {
+    bool enabled;
+    uint32_t minimum;
+    uint32_t maximum;
+} classifier_range_t;
+
+typedef struct {
+    int class;
+    classifier_range_t dscp;
+    classifier_range_t sourcePort;
+    classifier_range_t destinationPort;
+    classifier_range_t size;
+    bool matchProtocol;
+    uint8_t protocol;
+    bool matchFlowLabel;
+    uint32_t flowLabel;
+} classifier_rule_t;
+
+// Queueing parameters of a traffic class. The rate is guaranteed to the
+// class, and the class may borrow the bandwidth that the others leave unused
+// up to its ceiling. Both are percentages of the bandwidth of the tunnel.
+typedef struct {
+    uint64_t codelTarget;
+    uint64_t codelInterval;
+    bool ecn;
+    uint32_t rate;
+    uint32_t ceiling;
+} classifier_class_t;
+
+// Rules are compiled into one bit vector per field value, where bit i is set
+// if rule i accepts that value. Classifying a packet is then a handful of
+// table lookups ANDed together, and the first matching rule is the lowest bit
+// left, whatever the number of rules. Ports and sizes are first mapped to the
+// elementary interval they fall into, which keeps the bit vectors small.
+typedef struct {
+    classifier_class_t classes[TUNNEL_MAX_CLASS_COUNT];
+    classifier_rule_t rules[CLASSIFIER_MAX_RULE_COUNT];
+    int ruleCount;
+    int classCount;
+    int defaultClass;
+
+    uint64_t dscpMasks[64];
+    uint64_t protocolMasks[256];
+    uint8_t sourcePortIndexes[65536];
+    uint64_t sourcePortMasks[CLASSIFIER_MAX_INTERVAL_COUNT];
+    uint8_t destinationPortIndexes[65536];
+    uint64_t destinationPortMasks[CLASSIFIER_MAX_INTERVAL_COUNT];
+    uint8_t sizeIndexes[65536];
+    uint64_t sizeMasks[CLASSIFIER_MAX_INTERVAL_COUNT];
+    uint64_t portlessMask;
+    uint64_t flowLabelWildcardMask;
+    uint32_t flowLabels[CLASSIFIER_MAX_RULE_COUNT];
+    uint64_t flowLabelMasks[CLASSIFIER_MAX_RULE_COUNT];
+    int flowLabelCount;
+    uint8_t ruleClasses[CLASSIFIER_MAX_RULE_COUNT];
+} classifier_t;
+
+void classifier_init(classifier_t *classifier);
+int classifier_load(classifier_t *classifier, const char *fileName);
+void classifier_compile(classifier_t *classifier);
+
+static inline uint64_t classifier_getFlowLabelMask(const classifier_t *classifier, uint32_t flowLabel) {
+    int low = 0;
+    int high = classifier->flowLabelCount - 1;
+
+    while(low <= high) {
+        int middle = (low + high) / 2;
+
+        if(classifier->flowLabels[middle] == flowLabel) {
+            return classifier->flowLabelWildcardMask | classifier->flowLabelMasks[middle];
+        } else if(classifier->flowLabels[middle] < flowLabel) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    return classifier->flowLabelWildcardMask;
+}
+
+static inline int classifier_classify(const classifier_t *classifier, const packet_info_t *info) {
+    uint32_t size = info->ipLength > 65535 ? 65535 : info->ipLength;
+    uint64_t mask = classifier->dscpMasks[info->dscp] & classifier->protocolMasks[info->protocol] & classifier->sizeMasks[classifier->sizeIndexes[size]];
+
+    if(info->hasPorts) {
+        mask &= classifier->sourcePortMasks[classifier->sourcePortIndexes[info->sourcePort]];
+        mask &= classifier->destinationPortMasks[classifier->destinationPortIndexes[info->destinationPort]];
+    } else {
+        mask &= classifier->portlessMask;
+    }
+
+    if(mask & ~classifier->flowLabelWildcardMask) {
+        if(info->ipVersion == 6) {
+            mask &= classifier_getFlowLabelMask(classifier, info->flowLabel);
+        } else {
+            mask &= classifier->flowLabelWildcardMask;
+        }
+    }
+
+    return mask ? classifier->ruleClasses[__builtin_ctzll(mask)] : classifier->defaultClass;
+}
+
+#endif
@@ -5,22 +5,59 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <arpa/inet.h>
 
 #include <pthread.h>
 
+#include <capture.h>
 #include <libtun/libtun.h>
+#include <log.h>
+#include <protocol.h>
 #include <tunnel.h>
 
+// A path as given on the command line. A negative overhead and an empty
+// hostname mean those of the tunnel.
+typedef struct {
+    char localAddress[16];
+    char hostname[256];
+    int uploadBandwidth;
+    int downloadBandwidth;
+    int overhead;
+} path_parameters_t;
+
 int overhead;
+int linkType = PACER_LINK_ETHERNET;
+int mpu;
 int waitScale;
 const char *hostname;
 int port;
 char tunDeviceName[16];
-int tun_fd;
+int tun_fds[TUNNEL_MAX_QUEUE_COUNT];
+int tunQueueCount = 1;
 tunnel_t tunnel;
 struct sockaddr serverAddress;
 int downloadBandwidth;
 int uploadBandwidth;
+int downloadBandwidthRange[2];
+int uploadBandwidthRange[2];
+bool adaptive;
+path_parameters_t pathParameters[PATH_MAX_COUNT];
+int pathCount;
+int burst;
+int batchSize = TUNNEL_DEFAULT_BATCH_SIZE;
+int engine = TUNNEL_ENGINE_THREADS;
+bool offload;
+bool aggregate;
+bool ackFilter;
+int logLevel = LOG_DEFAULT_LEVEL;
+const char *rulesFileName;
+const char *statsFileName;
+stats_file_t stats;
+const char *captureFileName;
+int captureSize;
+int captureFileCount = CAPTURE_DEFAULT_FILE_COUNT;
+capture_t capture;
+classifier_t classifier;
 
 int checkCommandLineParameters(int argc, const char *argv[]);
 int connectToTheServer();
@@ -43,9 +80,40 @@ int main(int argc, const char *argv[]) {
         return EXIT_FAILURE;
     }
 
+    if(log_init(logLevel)) {
+        fprintf(stderr, "Failed to start logging.\n");
+        return EXIT_FAILURE;
+    }
+
+    classifier_init(&classifier);
+
+    if(rulesFileName && classifier_load(&classifier, rulesFileName)) {
+        fprintf(stderr, "Failed to load classifier rules.\n");
+        return EXIT_FAILURE;
+    }
+
     printf("Download bandwidth: %d Bps\n", downloadBandwidth);
     printf("Upload bandwidth: %d Bps\n", uploadBandwidth);
+
+    if(adaptive) {
+        printf("Download bandwidth range: %d-%d Bps\n", downloadBandwidthRange[0], downloadBandwidthRange[1]);
+        printf("Upload bandwidth range: %d-%d Bps\n", uploadBandwidthRange[0], uploadBandwidthRange[1]);
+    }
+
     printf("Overhead: %d B\n", overhead);
+    printf("Link layer: %s\n", pacer_getLinkName(linkType));
+
+    if(mpu > 0) {
+        printf("MPU: %d B\n", mpu);
+    }
+
+    if(burst > 0) {
+        printf("Burst: %d B\n", burst);
+    }
+
+    for(int i = 0; i < pathCount; i++) {
+        printf("Path %d: from %s to %s, %d Bps up, %d Bps down, %d B of overhead\n", i, pathParameters[i].localAddress, pathParameters[i].hostname, pathParameters[i].uploadBandwidth, pathParameters[i].downloadBandwidth, pathParameters[i].overhead);
+    }
 
     // Create the socket to the server
     int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
@@ -68,19 +136,77 @@ int main(int argc, const char *argv[]) {
     serverSocketAddress->sin_family = AF_INET;
     serverSocketAddress->sin_port = htons(port);
 
-    // Create the tun device
-    tun_fd = libtun_open(tunDeviceName);
+    // Create the tun device, with one queue per reader thread
+    int tunError;
 
-    if(tun_fd < 0) {
+    if(tunQueueCount > 1) {
+        tunError = libtun_openMultiQueue(tunDeviceName, tun_fds, tunQueueCount, offload);
+    } else {
+        tun_fds[0] = libtun_open(tunDeviceName, offload);
+        tunError = tun_fds[0] < 0;
+    }
+
+    if(tunError) {
         fprintf(stderr, "Failed to open tun device.\n");
         return EXIT_FAILURE;
     }
 
-    if(tunnel_init(&tunnel, sock, tun_fd, uploadBandwidth / 10, overhead, uploadBandwidth, &serverAddress)) {
+    if(stats_open(&stats, statsFileName, 1)) {
+        fprintf(stderr, "Failed to create the stats file.\n");
+        return EXIT_FAILURE;
+    }
+
+    // With a capture size, the capture is a ring of files of that many MiB
+    if(captureFileName && capture_open(&capture, captureFileName, (uint64_t)captureSize * 1048576, captureFileCount)) {
+        fprintf(stderr, "Failed to open the capture file.\n");
+        return EXIT_FAILURE;
+    }
+
+    // With adaptive rates, the tunnel is sized for the highest one, and
+    // shaped at the others once probes start
+    int maximumUploadBandwidth = adaptive ? uploadBandwidthRange[1] : uploadBandwidth;
+
+    tunnel_parameters_t parameters = {
+        .queueCapacity = maximumUploadBandwidth / 10,
+        .overhead = overhead,
+        .linkType = linkType,
+        .mpu = mpu,
+        .bandwidth = maximumUploadBandwidth,
+        .burst = burst,
+        .batchSize = batchSize,
+        .engine = engine,
+        .offload = offload,
+        .aggregate = aggregate,
+        .ackFilter = ackFilter,
+        .classifier = &classifier,
+        .capture = captureFileName ? &capture : NULL,
+        .stats = stats_acquireTunnel(&stats, PROTOCOL_NO_SESSION, classifier.classCount, maximumUploadBandwidth, overhead)
+    };
+
+    if(tunnel_init(&tunnel, sock, tun_fds, tunQueueCount, &parameters, &serverAddress)) {
         fprintf(stderr, "tunnel_init() failed.\n");
         return EXIT_FAILURE;
     }
 
+    for(int i = 0; i < pathCount; i++) {
+        struct sockaddr_in pathServerAddress;
+        struct in_addr localAddress;
+
+        memcpy(&pathServerAddress, serverSocketAddress, sizeof(struct sockaddr_in));
+
+        if(resolveHostname(pathParameters[i].hostname, &pathServerAddress.sin_addr.s_addr)) {
+            fprintf(stderr, "Failed to resolve the server hostname of path %d.\n", i);
+            return EXIT_FAILURE;
+        }
+
+        inet_pton(AF_INET, pathParameters[i].localAddress, &localAddress);
+
+        if(tunnel_addPath(&tunnel, &pathServerAddress, localAddress, pathParameters[i].overhead, pathParameters[i].uploadBandwidth, pathParameters[i].downloadBandwidth)) {
+            fprintf(stderr, "Failed to add path %d.\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
     while(true) {
         // Connect to the server and negociate connection parameters
         if(connectToTheServer()) {
@@ -97,21 +223,40 @@ int main(int argc, const char *argv[]) {
     }
 
     // Close tun device
-    libtun_close(tun_fd);
+    for(int i = 0; i < tunQueueCount; i++) {
+        libtun_close(tun_fds[i]);
+    }
 
     return EXIT_SUCCESS;
 }
 
 int checkCommandLineParameters(int argc, const char *argv[]) {
     bool flag_overhead = false;
+    bool flag_linkType = false;
+    bool flag_mpu = false;
     bool flag_downloadBandwidth = false;
     bool flag_uploadBandwidth = false;
+    bool flag_downloadBandwidthRange = false;
+    bool flag_uploadBandwidthRange = false;
+    bool flag_path = false;
     bool flag_hostname = false;
     bool flag_port = false;
+    bool flag_burst = false;
+    bool flag_rules = false;
+    bool flag_stats = false;
+    bool flag_batchSize = false;
+    bool flag_tunQueueCount = false;
+    bool flag_logLevel = false;
+    bool flag_engine = false;
+    bool flag_capture = false;
+    bool flag_captureSize = false;
+    bool flag_captureFileCount = false;
 
     bool flag_set_overhead = false;
     bool flag_set_downloadBandwidth = false;
     bool flag_set_uploadBandwidth = false;
+    bool flag_set_downloadBandwidthRange = false;
+    bool flag_set_uploadBandwidthRange = false;
     bool flag_set_hostname = false;
     bool flag_set_port = false;
 
@@ -130,6 +275,26 @@ int checkCommandLineParameters(int argc, const char *argv[]) {
             }
 
             flag_set_overhead = true;
+        } else if(flag_linkType) {
+            flag_linkType = false;
+            linkType = pacer_parseLinkType(argv[i]);
+
+            if(linkType == -1) {
+                fprintf(stderr, "Bad link layer value. Expected ethernet, atm or ptm.\n");
+                return -1;
+            }
+        } else if(flag_mpu) {
+            flag_mpu = false;
+
+            if(sscanf(argv[i], "%d", &mpu) == EOF) {
+                fprintf(stderr, "Failed to parse MPU value.\n");
+                return -1;
+            }
+
+            if(mpu < 0 || mpu > 255) {
+                fprintf(stderr, "Bad MPU value. Expected an integer between 0 and 255.\n");
+                return -1;
+            }
         } else if(flag_downloadBandwidth) {
             flag_downloadBandwidth = false;
 
@@ -158,6 +323,67 @@ int checkCommandLineParameters(int argc, const char *argv[]) {
             }
 
             flag_set_uploadBandwidth = true;
+        } else if(flag_downloadBandwidthRange) {
+            flag_downloadBandwidthRange = false;
+
+            if(sscanf(argv[i], "%d:%d", &downloadBandwidthRange[0], &downloadBandwidthRange[1]) != 2) {
+                fprintf(stderr, "Failed to parse download bandwidth range value.\n");
+                return -1;
+            }
+
+            if(downloadBandwidthRange[0] <= 0 || downloadBandwidthRange[1] < downloadBandwidthRange[0]) {
+                fprintf(stderr, "Bad download bandwidth range value. Expected MIN:MAX, with 0 < MIN <= MAX.\n");
+                return -1;
+            }
+
+            flag_set_downloadBandwidthRange = true;
+        } else if(flag_uploadBandwidthRange) {
+            flag_uploadBandwidthRange = false;
+
+            if(sscanf(argv[i], "%d:%d", &uploadBandwidthRange[0], &uploadBandwidthRange[1]) != 2) {
+                fprintf(stderr, "Failed to parse upload bandwidth range value.\n");
+                return -1;
+            }
+
+            if(uploadBandwidthRange[0] <= 0 || uploadBandwidthRange[1] < uploadBandwidthRange[0]) {
+                fprintf(stderr, "Bad upload bandwidth range value. Expected MIN:MAX, with 0 < MIN <= MAX.\n");
+                return -1;
+            }
+
+            flag_set_uploadBandwidthRange = true;
+        } else if(flag_path) {
+            flag_path = false;
+
+            if(pathCount == PATH_MAX_COUNT) {
+                fprintf(stderr, "Too many paths. Expected at most %d.\n", PATH_MAX_COUNT);
+                return -1;
+            }
+
+            path_parameters_t *path = &pathParameters[pathCount++];
+            struct in_addr localAddress;
+
+            path->overhead = -1;
+            path->hostname[0] = 0;
+
+            if(sscanf(argv[i], "%15[^:]:%d:%d:%d:%255s", path->localAddress, &path->uploadBandwidth, &path->downloadBandwidth, &path->overhead, path->hostname) < 3) {
+                fprintf(stderr, "Failed to parse path value.\n");
+                return -1;
+            }
+
+            if(inet_pton(AF_INET, path->localAddress, &localAddress) != 1) {
+                fprintf(stderr, "Bad path value. Expected an IPv4 local address, 0.0.0.0 for any.\n");
+                return -1;
+            }
+
+            if(path->uploadBandwidth <= 0 || path->downloadBandwidth <= 0) {
+                fprintf(stderr, "Bad path value. Expected strictly positive bandwidths.\n");
+                return -1;
+            }
+
+            if(path->overhead > 255) {
+                fprintf(stderr, "Bad path value. Expected an overhead between 0 and 255.\n");
+                return -1;
+            }
         } else if(flag_hostname) {
             flag_hostname = false;
             hostname = argv[i];
@@ -176,16 +402,142 @@ int checkCommandLineParameters(int argc, const char *argv[]) {
             }
 
             flag_set_port = true;
+        } else if(flag_burst) {
+            flag_burst = false;
+
+            if(sscanf(argv[i], "%d", &burst) == EOF) {
+                fprintf(stderr, "Failed to parse burst value.\n");
+                return -1;
+            }
+
+            if(burst <= 0) {
+                fprintf(stderr, "Bad burst value. Expected a strictly positive integer.\n");
+                return -1;
+            }
+        } else if(flag_rules) {
+            flag_rules = false;
+            rulesFileName = argv[i];
+        } else if(flag_stats) {
+            flag_stats = false;
+            statsFileName = argv[i];
+        } else if(flag_capture) {
+            flag_capture = false;
+            captureFileName = argv[i];
+        } else if(flag_captureSize) {
+            flag_captureSize = false;
+
+            if(sscanf(argv[i], "%d", &captureSize) == EOF) {
+                fprintf(stderr, "Failed to parse capture size value.\n");
+                return -1;
+            }
+
+            if(captureSize <= 0) {
+                fprintf(stderr, "Bad capture size value. Expected a strictly positive integer.\n");
+                return -1;
+            }
+        } else if(flag_captureFileCount) {
+            flag_captureFileCount = false;
+
+            if(sscanf(argv[i], "%d", &captureFileCount) == EOF) {
+                fprintf(stderr, "Failed to parse capture file count value.\n");
+                return -1;
+            }
+
+            if(captureFileCount <= 0) {
+                fprintf(stderr, "Bad capture file count value. Expected a strictly positive integer.\n");
+                return -1;
+            }
+        } else if(flag_engine) {
+            flag_engine = false;
+
+            if(strcmp(argv[i], "threads") == 0) {
+                engine = TUNNEL_ENGINE_THREADS;
+            } else if(strcmp(argv[i], "epoll") == 0) {
+                engine = TUNNEL_ENGINE_EPOLL;
+            } else if(strcmp(argv[i], "io_uring") == 0) {
+                engine = TUNNEL_ENGINE_IO_URING;
+            } else {
+                fprintf(stderr, "Bad engine value. Expected threads, epoll or io_uring.\n");
+                return -1;
+            }
+        } else if(flag_tunQueueCount) {
+            flag_tunQueueCount = false;
+
+            if(sscanf(argv[i], "%d", &tunQueueCount) == EOF) {
+                fprintf(stderr, "Failed to parse tun queue count value.\n");
+                return -1;
+            }
+
+            if(tunQueueCount <= 0 || tunQueueCount > TUNNEL_MAX_QUEUE_COUNT) {
+                fprintf(stderr, "Bad tun queue count value. Expected an integer between 1 and %d.\n", TUNNEL_MAX_QUEUE_COUNT);
+                return -1;
+            }
+        } else if(flag_logLevel) {
+            flag_logLevel = false;
+            logLevel = log_parseLevel(argv[i]);
+
+            if(logLevel == -1) {
+                fprintf(stderr, "Bad log level value. Expected error, warning, info, debug or trace.\n");
+                return 1;
+            }
+        } else if(flag_batchSize) {
+            flag_batchSize = false;
+
+            if(sscanf(argv[i], "%d", &batchSize) == EOF) {
+                fprintf(stderr, "Failed to parse batch size value.\n");
+                return -1;
+            }
+
+            if(batchSize <= 0 || batchSize > TUNNEL_MAX_BATCH_SIZE) {
+                fprintf(stderr, "Bad batch size value. Expected an integer between 1 and %d.\n", TUNNEL_MAX_BATCH_SIZE);
+                return -1;
+            }
         } else if(strcmp(argv[i], "--overhead") == 0) {
             flag_overhead = true;
+        } else if(strcmp(argv[i], "--link-layer") == 0) {
+            flag_linkType = true;
+        } else if(strcmp(argv[i], "--mpu") == 0) {
+            flag_mpu = true;
         } else if(strcmp(argv[i], "--download-bandwidth") == 0) {
             flag_downloadBandwidth = true;
+        } else if(strcmp(argv[i], "--download-bandwidth-range") == 0) {
+            flag_downloadBandwidthRange = true;
+        } else if(strcmp(argv[i], "--upload-bandwidth-range") == 0) {
+            flag_uploadBandwidthRange = true;
+        } else if(strcmp(argv[i], "--path") == 0) {
+            flag_path = true;
         } else if(strcmp(argv[i], "--hostname") == 0) {
             flag_hostname = true;
         } else if(strcmp(argv[i], "--port") == 0) {
             flag_port = true;
         } else if(strcmp(argv[i], "--upload-bandwidth") == 0) {
             flag_uploadBandwidth = true;
+        } else if(strcmp(argv[i], "--burst") == 0) {
+            flag_burst = true;
+        } else if(strcmp(argv[i], "--rules") == 0) {
+            flag_rules = true;
+        } else if(strcmp(argv[i], "--stats") == 0) {
+            flag_stats = true;
+        } else if(strcmp(argv[i], "--batch-size") == 0) {
+            flag_batchSize = true;
+        } else if(strcmp(argv[i], "--tun-queues") == 0) {
+            flag_tunQueueCount = true;
+        } else if(strcmp(argv[i], "--log-level") == 0) {
+            flag_logLevel = true;
+        } else if(strcmp(argv[i], "--engine") == 0) {
+            flag_engine = true;
+        } else if(strcmp(argv[i], "--capture") == 0) {
+            flag_capture = true;
+        } else if(strcmp(argv[i], "--capture-size") == 0) {
+            flag_captureSize = true;
+        } else if(strcmp(argv[i], "--capture-files") == 0) {
+            flag_captureFileCount = true;
+        } else if(strcmp(argv[i], "--offload") == 0) {
+            offload = true;
+        } else if(strcmp(argv[i], "--aggregate") == 0) {
+            aggregate = true;
+        } else if(strcmp(argv[i], "--ack-filter") == 0) {
+            ackFilter = true;
         } else {
             fprintf(stderr, "Failed to parse argument \"%s\".", argv[i]);
             return 1;
@@ -197,6 +549,27 @@ int checkCommandLineParameters(int argc, const char *argv[]) {
         return -1;
     }
 
+    // Over several paths, the tunnel is shaped at the sum of their rates
+    if(pathCount) {
+        if(flag_set_downloadBandwidth || flag_set_uploadBandwidth || flag_set_downloadBandwidthRange || flag_set_uploadBandwidthRange) {
+            fprintf(stderr, "With several paths, the bandwidths are given for each path and do not adapt.\n");
+            return -1;
+        }
+
+        for(int i = 0; i < pathCount; i++) {
+            if((int64_t)downloadBandwidth + pathParameters[i].downloadBandwidth > INT32_MAX || (int64_t)uploadBandwidth + pathParameters[i].uploadBandwidth > INT32_MAX) {
+                fprintf(stderr, "The sum of the bandwidths of the paths is too large.\n");
+                return -1;
+            }
+
+            downloadBandwidth += pathParameters[i].downloadBandwidth;
+            uploadBandwidth += pathParameters[i].uploadBandwidth;
+        }
+
+        flag_set_downloadBandwidth = true;
+        flag_set_uploadBandwidth = true;
+    }
+
     if(!flag_set_downloadBandwidth) {
         fprintf(stderr, "The bandwidth value was not specified.\n");
         return -1;
@@ -207,6 +580,30 @@ int checkCommandLineParameters(int argc, const char *argv[]) {
         return -1;
     }
 
+    // The bandwidths are where the rates start. A direction without a range
+    // keeps its bandwidth.
+    adaptive = flag_set_downloadBandwidthRange || flag_set_uploadBandwidthRange;
+
+    if(!flag_set_downloadBandwidthRange) {
+        downloadBandwidthRange[0] = downloadBandwidth;
+        downloadBandwidthRange[1] = downloadBandwidth;
+    }
+
+    if(!flag_set_uploadBandwidthRange) {
+        uploadBandwidthRange[0] = uploadBandwidth;
+        uploadBandwidthRange[1] = uploadBandwidth;
+    }
+
+    if(downloadBandwidth < downloadBandwidthRange[0] || downloadBandwidth > downloadBandwidthRange[1]) {
+        fprintf(stderr, "The download bandwidth is out of the download bandwidth range.\n");
+        return -1;
+    }
+
+    if(uploadBandwidth < uploadBandwidthRange[0] || uploadBandwidth > uploadBandwidthRange[1]) {
+        fprintf(stderr, "The upload bandwidth is out of the upload bandwidth range.\n");
+        return -1;
+    }
+
     if(!flag_set_hostname) {
         fprintf(stderr, "The hostname value was not specified.\n");
         return -1;
@@ -217,34 +614,148 @@ int checkCommandLineParameters(int argc, const char *argv[]) {
         return -1;
     }
 
+    for(int i = 0; i < pathCount; i++) {
+        if(pathParameters[i].overhead < 0) {
+            pathParameters[i].overhead = overhead;
+        }
+
+        if(!pathParameters[i].hostname[0]) {
+            snprintf(pathParameters[i].hostname, sizeof(pathParameters[i].hostname), "%s", hostname);
+        }
+    }
+
+    // The tunnel is shaped with the largest overhead of the paths, so that
+    // none of them is overrun
+    for(int i = 0; i < pathCount; i++) {
+        if(pathParameters[i].overhead > overhead) {
+            overhead = pathParameters[i].overhead;
+        }
+    }
+
+    return 0;
+}
+
+// Every path but the first joins the session with its own handshake, which
+// gives the download rate and the overhead of the path
+static int joinPath(int index, uint16_t sessionId) {
+    uint8_t buffer[PROTOCOL_LINK_HANDSHAKE_SIZE];
+    protocol_handshake_t handshake = {
+        .bandwidth = pathParameters[index].downloadBandwidth,
+        .overhead = pathParameters[index].overhead,
+        .linkType = linkType,
+        .mpu = mpu,
+        .flags = PROTOCOL_FLAG_MULTIPATH
+    };
+    size_t handshakeSize = protocol_writeHandshake(buffer, sessionId, &handshake);
+
+    if(path_send(tunnel.sock_fd, &tunnel.paths[index], buffer, handshakeSize) == -1) {
+        perror("sendmsg() failed while joining a path.\n");
+        return 1;
+    }
+
+    ssize_t size = recv(tunnel.sock_fd, buffer, PROTOCOL_LINK_HANDSHAKE_SIZE, 0);
+
+    if(size == -1) {
+        perror("recv() failed while joining a path.\n");
+        return 1;
+    }
+
+    uint16_t replySessionId;
+
+    if(protocol_readHandshake(buffer, size, &replySessionId, &handshake) || replySessionId != sessionId) {
+        fprintf(stderr, "Received an invalid handshake from the server for path %d.\n", index);
+        return 1;
+    }
+
     return 0;
 }
 
 int attemptConnection() {
-    uint8_t buffer[5];
+    uint8_t buffer[PROTOCOL_LINK_HANDSHAKE_SIZE];
+    protocol_handshake_t handshake = {
+        .bandwidth = adaptive ? downloadBandwidthRange[1] : downloadBandwidth,
+        .overhead = overhead,
+        .linkType = linkType,
+        .mpu = mpu,
+        .flags = (aggregate ? PROTOCOL_FLAG_AGGREGATE : 0) | (adaptive ? PROTOCOL_FLAG_PROBE : 0)
+    };
+
+    // The session is opened on the first path, at the rate of that path
+    if(pathCount) {
+        handshake.bandwidth = pathParameters[0].downloadBandwidth;
+        handshake.overhead = pathParameters[0].overhead;
+        handshake.flags |= PROTOCOL_FLAG_MULTIPATH;
+    }
 
-    *(uint32_t *)buffer = htonl(downloadBandwidth);
-    buffer[4] = overhead;
+    size_t handshakeSize = protocol_writeHandshake(buffer, PROTOCOL_NO_SESSION, &handshake);
 
-    if(sendto(tunnel.sock_fd, buffer, 5, 0, &serverAddress, sizeof(struct sockaddr_in)) == -1) {
+    if(pathCount ? path_send(tunnel.sock_fd, &tunnel.paths[0], buffer, handshakeSize) == -1 : sendto(tunnel.sock_fd, buffer, handshakeSize, 0, &serverAddress, sizeof(struct sockaddr_in)) == -1) {
         perror("sendto() failed while logging in.\n");
         return 1;
     }
 
     struct sockaddr socketAddress;
-    socklen_t socklen;
-    if(recvfrom(tunnel.sock_fd, buffer, 5, 0, &socketAddress, &socklen) == -1) {
+    socklen_t socklen = sizeof(struct sockaddr);
+    ssize_t size = recvfrom(tunnel.sock_fd, buffer, PROTOCOL_LINK_HANDSHAKE_SIZE, 0, &socketAddress, &socklen);
+
+    if(size == -1) {
         perror("recvfrom() failed while logging in.\n");
         return 1;
     }
 
+    uint16_t sessionId;
+
+    if(protocol_readHandshake(buffer, size, &sessionId, &handshake)) {
+        fprintf(stderr, "Received an invalid handshake from the server.\n");
+        return 1;
+    }
+
+    // A server that does not know aggregates does not echo the flag
+    if(aggregate && !(handshake.flags & PROTOCOL_FLAG_AGGREGATE)) {
+        fprintf(stderr, "The server does not support aggregates, sending packets one by one.\n");
+        tunnel.aggregatePool = NULL;
+    }
+
+    // The session of a server without probes would be shaped at the highest
+    // download rate for good, so a new one is asked for at the start rates
+    if(adaptive && !(handshake.flags & PROTOCOL_FLAG_PROBE)) {
+        fprintf(stderr, "The server does not support probes, the bandwidths will not adapt.\n");
+        adaptive = false;
+        atomic_store(&tunnel.uploadBandwidth, uploadBandwidth);
+        return 1;
+    }
+
+    if(pathCount && !(handshake.flags & PROTOCOL_FLAG_MULTIPATH)) {
+        fprintf(stderr, "The server does not support several paths.\n");
+        return 1;
+    }
+
+    for(int i = 1; i < pathCount; i++) {
+        if(joinPath(i, sessionId)) {
+            return 1;
+        }
+    }
+
+    // The session ID is written in every packet sent from now on
+    tunnel.sessionId = sessionId;
+    tunnel.stats->sessionId = sessionId;
+
+    if(adaptive) {
+        probe_controller_t uploadController;
+        probe_controller_t downloadController;
+
+        probe_initController(&uploadController, uploadBandwidth, uploadBandwidthRange[0], uploadBandwidthRange[1]);
+        probe_initController(&downloadController, downloadBandwidth, downloadBandwidthRange[0], downloadBandwidthRange[1]);
+        tunnel_startProbing(&tunnel, &uploadController, &downloadController);
+    }
+
     return 0;
 }
 
 int connectToTheServer() {
     for(int i = 0; i < 3; i++) {
         if(!attemptConnection()) {
-            printf("Connected to the server.\n");
+            printf("Connected to the server (session %u).\n", tunnel.sessionId);
             return 0;
         }
     }
@@ -0,0 +1,52 @@
+#include <codel.h>
+
+static uint64_t squareRoot(uint64_t value) {
+    uint64_t result = 0;
+    uint64_t bit = 1ULL << 62;
+
+    while(bit > value) {
+        bit >>= 2;
+    }
+
+    while(bit) {
+        if(value >= result + bit) {
+            value -= result + bit;
+            result = (result >> 1) + bit;
+        } else {
+            result >>= 1;
+        }
+
+        bit >>= 2;
+    }
+
+    return result;
+}
+
+// Called for the packet at the head of the queue, once it has been removed
+// from the queue: backlog is what remains behind it.
+bool codel_shouldDrop(codel_t *codel, const codel_parameters_t *parameters, uint64_t enqueueTimestamp, unsigned int backlog, uint64_t now) {
+    uint64_t sojournTime = now > enqueueTimestamp ? now - enqueueTimestamp : 0;
+
+    if(sojournTime < parameters->target || backlog <= parameters->mtu) {
+        codel->firstAboveTime = 0;
+        return false;
+    }
+
+    if(codel->firstAboveTime == 0) {
+        codel->firstAboveTime = now + parameters->interval;
+    } else if(now >= codel->firstAboveTime) {
+        return true;
+    }
+
+    return false;
+}
+
+// Time of the next drop: t + interval / sqrt(count), with 8 bits of fraction
+// in the square root. This only runs when a packet is dropped.
+uint64_t codel_controlLaw(const codel_parameters_t *parameters, uint64_t t, uint32_t count) {
+    if(count == 0) {
+        count = 1;
+    }
+
+    return t + parameters->interval * 256 / squareRoot((uint64_t)count << 16);
+}
@@ -0,0 +1,30 @@
+#ifndef __CODEL_H_INCLUDED__
+#define __CODEL_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Defaults recommended by RFC 8289, in nanoseconds
+#define CODEL_DEFAULT_TARGET 5000000
+#define CODEL_DEFAULT_INTERVAL 100000000
+
+typedef struct {
+    uint64_t target;
+    uint64_t interval;
+    unsigned int mtu;
+    bool ecn;
+} codel_parameters_t;
+
+// State of the CoDel controller (RFC 8289) of one queue
+typedef struct {
+    uint64_t firstAboveTime;
+    uint64_t dropNext;
+    uint32_t count;
+    uint32_t lastCount;
+    bool dropping;
+} codel_t;
+
+bool codel_shouldDrop(codel_t *codel, const codel_parameters_t *parameters, uint64_t enqueueTimestamp, unsigned int backlog, uint64_t now);
+uint64_t codel_controlLaw(const codel_parameters_t *parameters, uint64_t t, uint32_t count);
+
+#endif
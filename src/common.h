@@ -4,5 +4,14 @@
 #define UNUSED_PARAMETER(x) ((void)x)
 
 #include <stdint.h>
+#include <time.h>
+
+// Returns the value of the monotonic clock in nanoseconds. Unlike
+// gettimeofday(), this clock never jumps when the wall-clock time is changed.
+static inline uint64_t getNanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
 #endif
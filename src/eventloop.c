@@ -0,0 +1,761 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+
+#include <common.h>
+#include <eventloop.h>
+#include <log.h>
+#include <protocol.h>
+#include <uring.h>
+
+// Sources of events in epoll, and kinds of operations in io_uring
+#define EVENT_TUN 0
+#define EVENT_SOCKET 1
+#define EVENT_TIMER 2
+#define EVENT_TUN_WRITE 3
+#define EVENT_SEND 4
+
+#define makeUserData(type, index) ((uint64_t)(type) << 32 | (uint32_t)(index))
+#define getEventType(userData) ((uint32_t)((userData) >> 32))
+#define getEventIndex(userData) ((uint32_t)(userData))
+
+// Index of a read posted on a tun queue
+#define makeReadIndex(reader, slot) ((reader) << 16 | (slot))
+#define getReader(index) ((index) >> 16)
+#define getReadSlot(index) ((index) & 0xffff)
+
+static int setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+
+    return flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1;
+}
+
+static void setTimerSlack() {
+    // The default timer slack of 50 us would make every pacing timer late
+    if(prctl(PR_SET_TIMERSLACK, 1)) {
+        perror("prctl(PR_SET_TIMERSLACK) failed");
+    }
+}
+
+typedef struct {
+    tunnel_t *tunnel;
+    int epollFd;
+    int timerFd;
+    uint64_t armedDeadline;
+    queue_element_t *readElements[TUNNEL_MAX_QUEUE_COUNT];
+} epoll_loop_t;
+
+static int addToEpoll(epoll_loop_t *loop, int fd, uint64_t userData) {
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u64 = userData
+    };
+
+    return epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// A timer that is already armed for an earlier deadline is left alone: when it
+// fires, the deadline is computed again.
+static void armTimer(epoll_loop_t *loop, uint64_t deadline) {
+    if(deadline >= loop->armedDeadline) {
+        return;
+    }
+
+    struct itimerspec timerSpec = {
+        .it_value = {
+            .tv_sec = deadline / 1000000000,
+            .tv_nsec = deadline % 1000000000
+        }
+    };
+
+    if(timerfd_settime(loop->timerFd, TFD_TIMER_ABSTIME, &timerSpec, NULL)) {
+        perror("timerfd_settime() failed");
+        return;
+    }
+
+    loop->armedDeadline = deadline;
+}
+
+static int readFromTun(epoll_loop_t *loop, tunnel_reader_t *reader) {
+    tunnel_t *tunnel = loop->tunnel;
+    queue_element_t **element = &loop->readElements[reader->index];
+    uint8_t discardBuffer[TUNNEL_MAX_OFFLOAD_PACKET_SIZE];
+    struct virtio_net_hdr vnetHeader;
+
+    for(int i = 0; i < tunnel->batchSize; i++) {
+        if(!*element) {
+            *element = queue_getFreeElement(&tunnel->queue, reader->index);
+        }
+
+        uint8_t *buffer = *element ? (*element)->packet.buffer : discardBuffer;
+        ssize_t size = tunnel_readTun(tunnel, reader->tun_fd, buffer, *element ? (*element)->packet.bufferSize : sizeof(discardBuffer), &vnetHeader);
+
+        if(size == -1) {
+            if(errno == EAGAIN || errno == EINTR) {
+                return 0;
+            }
+
+            perror("An error occurred while reading from tun device");
+            return 1;
+        } else if(size == 0) {
+            fprintf(stderr, "Exiting event loop because EOF was received from tun device.\n");
+            return 1;
+        }
+
+        if(tunnel_handleTunPacket(tunnel, reader->index, *element, buffer, size, tunnel->offload ? &vnetHeader : NULL, getNanoseconds())) {
+            *element = NULL;
+        }
+    }
+
+    return 0;
+}
+
+static int receiveFromSocket(epoll_loop_t *loop) {
+    tunnel_t *tunnel = loop->tunnel;
+    uint8_t packetBuffers[TUNNEL_MAX_BATCH_SIZE][TUNNEL_MAX_DATAGRAM_SIZE];
+    struct mmsghdr messages[TUNNEL_MAX_BATCH_SIZE];
+    struct iovec iovecs[TUNNEL_MAX_BATCH_SIZE];
+    struct sockaddr addresses[TUNNEL_MAX_BATCH_SIZE];
+
+    memset(messages, 0, tunnel->batchSize * sizeof(struct mmsghdr));
+
+    for(int i = 0; i < tunnel->batchSize; i++) {
+        iovecs[i].iov_base = packetBuffers[i];
+        iovecs[i].iov_len = TUNNEL_MAX_DATAGRAM_SIZE;
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = &addresses[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    // The socket stays blocking for the sends, so only this call is not
+    int count = recvmmsg(tunnel->sock_fd, messages, tunnel->batchSize, MSG_DONTWAIT, NULL);
+
+    if(count == -1) {
+        if(errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+
+        perror("An error occurred while reading from socket");
+        return 1;
+    }
+
+    // An empty datagram is not an end of file on a UDP socket, and is ignored
+    // for lack of a header like any other invalid one
+    for(int i = 0; i < count; i++) {
+        tunnel_receiveDatagram(tunnel, &addresses[i], messages[i].msg_hdr.msg_namelen, packetBuffers[i], messages[i].msg_len);
+    }
+
+    tunnel_flushTun(tunnel);
+
+    return 0;
+}
+
+// Sends everything the pacer allows, then arms the timer for the next packet
+static int sendDuePackets(epoll_loop_t *loop) {
+    tunnel_t *tunnel = loop->tunnel;
+    queue_element_t *batch[TUNNEL_MAX_BATCH_SIZE];
+    uint64_t now = getNanoseconds();
+    bool drained;
+    int count;
+
+    do {
+        count = tunnel_pollDuePackets(tunnel, batch, 0, now, &drained);
+
+        int result = count ? tunnel_sendBatch(tunnel, batch, count) : 0;
+
+        for(int i = 0; i < count; i++) {
+            queue_release(&tunnel->queue, batch[i]);
+        }
+
+        if(result) {
+            return 1;
+        }
+    } while(count == tunnel->batchSize);
+
+    if(!drained) {
+        armTimer(loop, now + tunnel_getDelay(tunnel, now));
+    }
+
+    armTimer(loop, tunnel_probe(tunnel, now));
+
+    return 0;
+}
+
+// Runs the tunnel on the calling thread: one epoll loop waits for the tun
+// queues, the socket and a timerfd that fires when the pacer allows the next
+// packet to leave.
+int eventloop_run(tunnel_t *tunnel) {
+    epoll_loop_t loop;
+
+    memset(&loop, 0, sizeof(loop));
+    loop.tunnel = tunnel;
+    loop.armedDeadline = UINT64_MAX;
+    loop.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    loop.timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if(loop.epollFd == -1 || loop.timerFd == -1) {
+        perror("Failed to create the event loop");
+        return 1;
+    }
+
+    if(addToEpoll(&loop, tunnel->sock_fd, makeUserData(EVENT_SOCKET, 0)) || addToEpoll(&loop, loop.timerFd, makeUserData(EVENT_TIMER, 0))) {
+        perror("Failed to add the socket to the event loop");
+        return 1;
+    }
+
+    for(int i = 0; i < tunnel->readerCount; i++) {
+        if(setNonBlocking(tunnel->readers[i].tun_fd) || addToEpoll(&loop, tunnel->readers[i].tun_fd, makeUserData(EVENT_TUN, i))) {
+            perror("Failed to add the tun device to the event loop");
+            return 1;
+        }
+    }
+
+    setTimerSlack();
+
+    bool stop = false;
+
+    while(!stop) {
+        struct epoll_event events[TUNNEL_MAX_QUEUE_COUNT + 2];
+        uint64_t idleTimestamp = getNanoseconds();
+        int eventCount = epoll_wait(loop.epollFd, events, TUNNEL_MAX_QUEUE_COUNT + 2, -1);
+
+        stats_add(&stats_getThread(tunnel->stats, STATS_THREAD_CONSUMER)->idleTime, getNanoseconds() - idleTimestamp);
+
+        if(eventCount == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            perror("epoll_wait() failed");
+            break;
+        }
+
+        for(int i = 0; i < eventCount && !stop; i++) {
+            uint64_t userData = events[i].data.u64;
+
+            switch(getEventType(userData)) {
+                case EVENT_TUN:
+                    stop = readFromTun(&loop, &tunnel->readers[getEventIndex(userData)]);
+                    break;
+
+                case EVENT_SOCKET:
+                    stop = receiveFromSocket(&loop);
+                    break;
+
+                case EVENT_TIMER: {
+                    uint64_t expirations;
+
+                    if(read(loop.timerFd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+                        perror("read() failed on timerfd");
+                    }
+
+                    loop.armedDeadline = UINT64_MAX;
+                    break;
+                }
+            }
+        }
+
+        if(!stop) {
+            stop = sendDuePackets(&loop);
+        }
+    }
+
+    close(loop.timerFd);
+    close(loop.epollFd);
+
+    return 0;
+}
+
+typedef struct {
+    struct msghdr message;
+    struct iovec iovec;
+    struct sockaddr_in address;
+    uint8_t buffer[TUNNEL_MAX_PACKET_SIZE];
+} receive_slot_t;
+
+typedef struct {
+    struct msghdr message;
+    struct iovec iovec;
+    queue_element_t *element;
+} send_slot_t;
+
+typedef struct {
+    tunnel_t *tunnel;
+    uring_t ring;
+    bool fixedBuffers;
+    queue_element_t *readElements[TUNNEL_MAX_QUEUE_COUNT][EVENTLOOP_READS_PER_QUEUE];
+    bool readPosted[TUNNEL_MAX_QUEUE_COUNT][EVENTLOOP_READS_PER_QUEUE];
+    bool missingReads;
+    receive_slot_t *receiveSlots;
+    send_slot_t sendSlots[EVENTLOOP_MAX_SENDS];
+    int freeSendSlots[EVENTLOOP_MAX_SENDS];
+    int freeSendSlotCount;
+    struct __kernel_timespec timeout;
+    uint64_t armedDeadline;
+    struct __kernel_timespec probeTimeout;
+    uint64_t probeDeadline;
+} uring_loop_t;
+
+static const uint8_t requiredOperations[] = {
+    IORING_OP_READ,
+    IORING_OP_WRITE,
+    IORING_OP_READ_FIXED,
+    IORING_OP_WRITE_FIXED,
+    IORING_OP_RECVMSG,
+    IORING_OP_SENDMSG,
+    IORING_OP_TIMEOUT
+};
+
+static struct io_uring_sqe *getSqe(uring_loop_t *loop) {
+    struct io_uring_sqe *sqe = uring_getSqe(&loop->ring);
+
+    if(!sqe) {
+        fprintf(stderr, "The io_uring submission queue is full.\n");
+    }
+
+    return sqe;
+}
+
+// Packets are read straight into pool elements. Without a free element, the
+// read is not posted until packets have been sent: the tun device then holds
+// the packets, instead of the tunnel reading them only to drop them.
+static int postRead(uring_loop_t *loop, int reader, int slot) {
+    tunnel_t *tunnel = loop->tunnel;
+    queue_element_t **element = &loop->readElements[reader][slot];
+
+    if(!*element) {
+        *element = queue_getFreeElement(&tunnel->queue, reader);
+
+        if(!*element) {
+            loop->missingReads = true;
+            return 0;
+        }
+    }
+
+    struct io_uring_sqe *sqe = getSqe(loop);
+
+    if(!sqe) {
+        return 1;
+    }
+
+    sqe->opcode = loop->fixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = tunnel->readers[reader].tun_fd;
+    sqe->addr = (uintptr_t)(*element)->packet.buffer;
+    sqe->len = (*element)->packet.bufferSize;
+    sqe->buf_index = reader;
+    sqe->user_data = makeUserData(EVENT_TUN, makeReadIndex(reader, slot));
+    loop->readPosted[reader][slot] = true;
+
+    return 0;
+}
+
+static int postMissingReads(uring_loop_t *loop) {
+    loop->missingReads = false;
+
+    for(int reader = 0; reader < loop->tunnel->readerCount; reader++) {
+        for(int slot = 0; slot < EVENTLOOP_READS_PER_QUEUE; slot++) {
+            if(!loop->readPosted[reader][slot] && postRead(loop, reader, slot)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int postReceive(uring_loop_t *loop, int slotIndex) {
+    receive_slot_t *slot = &loop->receiveSlots[slotIndex];
+    struct io_uring_sqe *sqe = getSqe(loop);
+
+    if(!sqe) {
+        return 1;
+    }
+
+    slot->iovec.iov_base = slot->buffer;
+    slot->iovec.iov_len = TUNNEL_MAX_PACKET_SIZE;
+    slot->message.msg_name = &slot->address;
+    slot->message.msg_namelen = sizeof(struct sockaddr_in);
+    slot->message.msg_iov = &slot->iovec;
+    slot->message.msg_iovlen = 1;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = loop->tunnel->sock_fd;
+    sqe->addr = (uintptr_t)&slot->message;
+    sqe->len = 1;
+    sqe->user_data = makeUserData(EVENT_SOCKET, slotIndex);
+
+    return 0;
+}
+
+static int postTunWrite(uring_loop_t *loop, int slotIndex, uint32_t size) {
+    receive_slot_t *slot = &loop->receiveSlots[slotIndex];
+    struct io_uring_sqe *sqe = getSqe(loop);
+
+    if(!sqe) {
+        return 1;
+    }
+
+    sqe->opcode = loop->fixedBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = loop->tunnel->tun_fd;
+    sqe->addr = (uintptr_t)slot->buffer;
+    sqe->len = size;
+    sqe->buf_index = loop->tunnel->readerCount;
+    sqe->user_data = makeUserData(EVENT_TUN_WRITE, slotIndex);
+
+    return 0;
+}
+
+static int postSend(uring_loop_t *loop, queue_element_t *element) {
+    int slotIndex = loop->freeSendSlots[--loop->freeSendSlotCount];
+    send_slot_t *slot = &loop->sendSlots[slotIndex];
+    struct io_uring_sqe *sqe = getSqe(loop);
+
+    if(!sqe) {
+        return 1;
+    }
+
+    slot->element = element;
+    slot->iovec.iov_base = element->packet.buffer;
+    slot->iovec.iov_len = element->packet.packetSize;
+    slot->message.msg_name = &loop->tunnel->otherEndSocketAddress;
+    slot->message.msg_namelen = sizeof(struct sockaddr_in);
+    slot->message.msg_iov = &slot->iovec;
+    slot->message.msg_iovlen = 1;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = loop->tunnel->sock_fd;
+    sqe->addr = (uintptr_t)&slot->message;
+    sqe->len = 1;
+    sqe->user_data = makeUserData(EVENT_SEND, slotIndex);
+
+    return 0;
+}
+
+static int armTimeout(uring_loop_t *loop, uint64_t deadline) {
+    if(deadline >= loop->armedDeadline) {
+        return 0;
+    }
+
+    struct io_uring_sqe *sqe = getSqe(loop);
+
+    if(!sqe) {
+        return 1;
+    }
+
+    // The kernel copies the time when the entry is submitted, so the same
+    // storage can be used by every timeout.
+    loop->timeout.tv_sec = deadline / 1000000000;
+    loop->timeout.tv_nsec = deadline % 1000000000;
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&loop->timeout;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    sqe->user_data = makeUserData(EVENT_TIMER, 0);
+    loop->armedDeadline = deadline;
+
+    return 0;
+}
+
+// Probes have a timeout of their own, so that the pacing one is never held
+// back by them, and the other way around
+static int armProbeTimeout(uring_loop_t *loop, uint64_t deadline) {
+    if(deadline == UINT64_MAX || deadline == loop->probeDeadline) {
+        return 0;
+    }
+
+    struct io_uring_sqe *sqe = getSqe(loop);
+
+    if(!sqe) {
+        return 1;
+    }
+
+    loop->probeTimeout.tv_sec = deadline / 1000000000;
+    loop->probeTimeout.tv_nsec = deadline % 1000000000;
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&loop->probeTimeout;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    sqe->user_data = makeUserData(EVENT_TIMER, 1);
+    loop->probeDeadline = deadline;
+
+    return 0;
+}
+
+static int handleTunRead(uring_loop_t *loop, uint32_t index, int result) {
+    int reader = getReader(index);
+    int slot = getReadSlot(index);
+    queue_element_t *element = loop->readElements[reader][slot];
+
+    loop->readPosted[reader][slot] = false;
+
+    if(result == 0) {
+        fprintf(stderr, "Exiting event loop because EOF was received from tun device.\n");
+        return 1;
+    } else if(result < 0 && result != -EAGAIN && result != -EINTR) {
+        fprintf(stderr, "An error occurred while reading from tun device: %s\n", strerror(-result));
+        return 1;
+    }
+
+    if(result > 0 && tunnel_handleTunPacket(loop->tunnel, reader, element, element->packet.buffer, result, NULL, getNanoseconds())) {
+        loop->readElements[reader][slot] = NULL;
+    }
+
+    return postRead(loop, reader, slot);
+}
+
+static int handleReceive(uring_loop_t *loop, int slotIndex, int result) {
+    receive_slot_t *slot = &loop->receiveSlots[slotIndex];
+
+    if(result == -EAGAIN || result == -EINTR) {
+        return postReceive(loop, slotIndex);
+    } else if(result < 0) {
+        fprintf(stderr, "An error occurred while reading from socket: %s\n", strerror(-result));
+        return 1;
+    }
+
+    struct iovec packets[PROTOCOL_MAX_AGGREGATED_PACKETS];
+    int packetCount = tunnel_acceptDatagram(loop->tunnel, &slot->address, slot->message.msg_namelen, slot->buffer, result, packets);
+
+    // The buffer is written to the tun device before it is used again. The
+    // packets of an aggregate are written right away instead, as the ring has
+    // no room for one write per packet of every slot.
+    if(packetCount == 1) {
+        return postTunWrite(loop, slotIndex, result);
+    }
+
+    for(int i = 0; i < packetCount; i++) {
+        tunnel_writeTun(loop->tunnel, packets[i].iov_base, packets[i].iov_len);
+    }
+
+    return postReceive(loop, slotIndex);
+}
+
+static int handleTunWrite(uring_loop_t *loop, int slotIndex, int result) {
+    if(result < 0) {
+        stats_add(&stats_getThread(loop->tunnel->stats, STATS_THREAD_RECEIVER)->tunWriteErrors, 1);
+        log_countEvent(LOG_EVENT_TUN_WRITE_ERROR);
+        log_debug("write() failed on tun device: %s", strerror(-result));
+    } else {
+        log_trace("Successfully received packet.");
+    }
+
+    return postReceive(loop, slotIndex);
+}
+
+static int handleSend(uring_loop_t *loop, int slotIndex, int result) {
+    send_slot_t *slot = &loop->sendSlots[slotIndex];
+    stats_thread_t *stats = stats_getThread(loop->tunnel->stats, STATS_THREAD_CONSUMER);
+
+    queue_release(&loop->tunnel->queue, slot->element);
+    slot->element = NULL;
+    loop->freeSendSlots[loop->freeSendSlotCount++] = slotIndex;
+
+    if(result < 0) {
+        fprintf(stderr, "An error occurred sending data through the socket: %s\n", strerror(-result));
+        return 1;
+    }
+
+    stats_add(&stats->sentPackets, 1);
+    stats_add(&stats->sentBytes, result);
+
+    return 0;
+}
+
+// Same as with epoll, except that each packet is a send operation, and that
+// all of them go to the kernel with the next io_uring_enter() call.
+static int postDuePackets(uring_loop_t *loop) {
+    tunnel_t *tunnel = loop->tunnel;
+    queue_element_t *batch[TUNNEL_MAX_BATCH_SIZE];
+    uint64_t now = getNanoseconds();
+    bool drained = true;
+    int count = 0;
+
+    if(armProbeTimeout(loop, tunnel_probe(tunnel, now))) {
+        return 1;
+    }
+
+    while(loop->freeSendSlotCount >= tunnel->batchSize) {
+        count = tunnel_pollDuePackets(tunnel, batch, 0, now, &drained);
+
+        for(int i = 0; i < count; i++) {
+            if(postSend(loop, batch[i])) {
+                return 1;
+            }
+        }
+
+        if(count < tunnel->batchSize) {
+            break;
+        }
+    }
+
+    // Without free send slots, the next completion wakes the loop anyway
+    if(!drained && count < tunnel->batchSize) {
+        return armTimeout(loop, now + tunnel_getDelay(tunnel, now));
+    }
+
+    return 0;
+}
+
+static int handleCompletion(uring_loop_t *loop, uint64_t userData, int result) {
+    uint32_t index = getEventIndex(userData);
+
+    switch(getEventType(userData)) {
+        case EVENT_TUN:
+            return handleTunRead(loop, index, result);
+
+        case EVENT_SOCKET:
+            return handleReceive(loop, index, result);
+
+        case EVENT_TUN_WRITE:
+            return handleTunWrite(loop, index, result);
+
+        case EVENT_SEND:
+            return handleSend(loop, index, result);
+
+        case EVENT_TIMER:
+            if(index) {
+                loop->probeDeadline = UINT64_MAX;
+            } else {
+                loop->armedDeadline = UINT64_MAX;
+            }
+
+            return 0;
+    }
+
+    return 0;
+}
+
+// The pool arenas and the receive buffers are registered once, so that reads
+// from and writes to the tun device do not pin and map them every time.
+static void registerBuffers(uring_loop_t *loop) {
+    tunnel_t *tunnel = loop->tunnel;
+    struct iovec iovecs[TUNNEL_MAX_QUEUE_COUNT + 1];
+
+    for(int i = 0; i < tunnel->readerCount; i++) {
+        pool_t *pool = queue_getPool(&tunnel->queue, i);
+
+        iovecs[i].iov_base = pool->arena;
+        iovecs[i].iov_len = pool->arenaSize;
+    }
+
+    iovecs[tunnel->readerCount].iov_base = loop->receiveSlots;
+    iovecs[tunnel->readerCount].iov_len = tunnel->batchSize * sizeof(receive_slot_t);
+
+    loop->fixedBuffers = !uring_registerBuffers(&loop->ring, iovecs, tunnel->readerCount + 1);
+
+    if(!loop->fixedBuffers) {
+        perror("Failed to register buffers with io_uring, using regular reads and writes");
+    }
+}
+
+static int startUringLoop(uring_loop_t *loop) {
+    tunnel_t *tunnel = loop->tunnel;
+
+    for(int i = 0; i < EVENTLOOP_MAX_SENDS; i++) {
+        loop->freeSendSlots[i] = i;
+    }
+
+    loop->freeSendSlotCount = EVENTLOOP_MAX_SENDS;
+    loop->armedDeadline = UINT64_MAX;
+    loop->probeDeadline = UINT64_MAX;
+
+    for(int reader = 0; reader < tunnel->readerCount; reader++) {
+        for(int slot = 0; slot < EVENTLOOP_READS_PER_QUEUE; slot++) {
+            if(postRead(loop, reader, slot)) {
+                return 1;
+            }
+        }
+    }
+
+    for(int i = 0; i < tunnel->batchSize; i++) {
+        if(postReceive(loop, i)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Runs the tunnel on the calling thread with io_uring: reads, receives, sends
+// and the pacing timeout are all operations of one ring, so a single system
+// call per loop submits new work and waits for completions. Returns 1 without
+// doing anything if the kernel cannot run it.
+int eventloop_runIoUring(tunnel_t *tunnel) {
+    uring_loop_t *loop = calloc(1, sizeof(uring_loop_t));
+
+    if(!loop) {
+        perror("An error occurred while allocating memory for the event loop");
+        return 1;
+    }
+
+    loop->tunnel = tunnel;
+    loop->receiveSlots = calloc(tunnel->batchSize, sizeof(receive_slot_t));
+
+    if(!loop->receiveSlots || uring_init(&loop->ring, EVENTLOOP_URING_ENTRIES)) {
+        free(loop->receiveSlots);
+        free(loop);
+        return 1;
+    }
+
+    if(!uring_supportsOperations(&loop->ring, requiredOperations, sizeof(requiredOperations))) {
+        uring_destroy(&loop->ring);
+        free(loop->receiveSlots);
+        free(loop);
+        return 1;
+    }
+
+    registerBuffers(loop);
+    setTimerSlack();
+
+    bool stop = startUringLoop(loop);
+
+    while(!stop) {
+        uint64_t idleTimestamp = getNanoseconds();
+
+        if(uring_submit(&loop->ring, 1) == -1) {
+            break;
+        }
+
+        stats_add(&stats_getThread(tunnel->stats, STATS_THREAD_CONSUMER)->idleTime, getNanoseconds() - idleTimestamp);
+
+        struct io_uring_cqe *cqe;
+
+        while(!stop && (cqe = uring_peekCqe(&loop->ring))) {
+            uint64_t userData = cqe->user_data;
+            int result = cqe->res;
+
+            uring_advanceCq(&loop->ring);
+            stop = handleCompletion(loop, userData, result);
+        }
+
+        if(!stop && loop->missingReads) {
+            stop = postMissingReads(loop);
+        }
+
+        if(!stop) {
+            stop = postDuePackets(loop);
+        }
+    }
+
+    // Closing the ring cancels the operations still in flight
+    uring_destroy(&loop->ring);
+    free(loop->receiveSlots);
+    free(loop);
+
+    return 0;
+}
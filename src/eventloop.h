@@ -0,0 +1,15 @@
+#ifndef __EVENTLOOP_H_INCLUDED__
+#define __EVENTLOOP_H_INCLUDED__
+
+#include <tunnel.h>
+
+// Number of reads posted on each tun queue, and of send operations in flight,
+// with io_uring
+#define EVENTLOOP_READS_PER_QUEUE 8
+#define EVENTLOOP_MAX_SENDS 256
+#define EVENTLOOP_URING_ENTRIES 512
+
+int eventloop_run(tunnel_t *tunnel);
+int eventloop_runIoUring(tunnel_t *tunnel);
+
+#endif
@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include <string.h>
 
 #include <fcntl.h>
@@ -6,7 +7,9 @@
 #include <linux/if.h>
 #include <linux/if_tun.h>
 
-int libtun_open(char *deviceName) {
+// With offloads, the kernel hands over TCP super-packets of up to 64 KiB with
+// a partial checksum, preceded by a virtio_net_hdr that describes them.
+static int openQueue(char *deviceName, short flags, bool offload) {
     struct ifreq ifr;
 
     int fd = open("/dev/net/tun", O_RDWR);
@@ -17,7 +20,7 @@ int libtun_open(char *deviceName) {
 
     memset(&ifr, 0, sizeof(ifr));
 
-    ifr.ifr_flags = IFF_TUN;
+    ifr.ifr_flags = offload ? flags | IFF_VNET_HDR : flags;
 
     if(*deviceName) {
         strncpy(ifr.ifr_name, deviceName, IFNAMSIZ - 1);
@@ -25,6 +28,10 @@ int libtun_open(char *deviceName) {
 
     int err = ioctl(fd, TUNSETIFF, &ifr);
 
+    if(!err && offload) {
+        err = ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6);
+    }
+
     if(err) {
         close(fd);
         return err;
@@ -35,6 +42,30 @@ int libtun_open(char *deviceName) {
     return fd;
 }
 
+int libtun_open(char *deviceName, bool offload) {
+    return openQueue(deviceName, IFF_TUN, offload);
+}
+
+// Opens queueCount queues of the same device. The kernel spreads packets
+// between them by flow, so each queue can be read by its own thread.
+int libtun_openMultiQueue(char *deviceName, int *fds, int queueCount, bool offload) {
+    for(int i = 0; i < queueCount; i++) {
+        fds[i] = openQueue(deviceName, IFF_TUN | IFF_MULTI_QUEUE, offload);
+
+        if(fds[i] < 0) {
+            int err = fds[i];
+
+            while(i--) {
+                close(fds[i]);
+            }
+
+            return err;
+        }
+    }
+
+    return 0;
+}
+
 int libtun_close(int fd) {
     return close(fd);
 }
@@ -1,7 +1,10 @@
 #ifndef __LIBTUN_H_INCLUDED__
 #define __LIBTUN_H_INCLUDED__
 
-extern int libtun_open(char *deviceName);
+#include <stdbool.h>
+
+extern int libtun_open(char *deviceName, bool offload);
+extern int libtun_openMultiQueue(char *deviceName, int *fds, int queueCount, bool offload);
 extern int libtun_close(int fd);
 
 #endif
@@ -0,0 +1,379 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include <common.h>
+#include <log.h>
+
+// Time the logging thread sleeps when there is nothing to write
+#define LOG_IDLE_DURATION 10000000
+
+#define LOG_LINE_SIZE 512
+
+// Slot of the ring. As in Dmitry Vyukov's bounded queue, the sequence number
+// tells whether the slot is free for the producer of a given position or
+// filled for the consumer, so producers only contend on the enqueue position.
+typedef struct {
+    atomic_size_t sequence;
+    uint64_t timestamp;
+    const char *format;
+    int level;
+    int argumentCount;
+    log_argument_t arguments[LOG_MAX_ARGUMENTS];
+    char strings[LOG_STRING_SPACE];
+} log_entry_t;
+
+static const char *levelNames[] = {"error", "warning", "info", "debug", "trace"};
+
+static const char *eventDescriptions[LOG_EVENT_COUNT] = {
+    "packets dropped because the queue was full",
+    "packets dropped by CoDel",
+    "packets dropped because no buffer was free",
+    "packets of unknown IP version ignored",
+    "packets ignored because no session has their destination",
+    "datagrams ignored because they belong to no session",
+    "packets that could not be written to the tun device"
+};
+
+int log_level = LOG_DEFAULT_LEVEL;
+atomic_ulong log_eventCounts[LOG_EVENT_COUNT];
+
+static log_entry_t *entries;
+static _Alignas(64) atomic_size_t enqueuePosition;
+static _Alignas(64) size_t dequeuePosition;
+static atomic_ulong lostMessageCount;
+static atomic_bool started;
+static atomic_bool running;
+static pthread_t thread;
+
+// String arguments are copied, as they may not live until the message is
+// formatted. The value of the argument becomes an offset in the entry.
+static void captureArguments(log_entry_t *entry, int argumentCount, const log_argument_t *arguments) {
+    size_t stringsSize = 0;
+
+    if(argumentCount > LOG_MAX_ARGUMENTS) {
+        argumentCount = LOG_MAX_ARGUMENTS;
+    }
+
+    entry->argumentCount = argumentCount;
+
+    for(int i = 0; i < argumentCount; i++) {
+        entry->arguments[i] = arguments[i];
+
+        if(arguments[i].type == LOG_ARGUMENT_STRING) {
+            const char *string = arguments[i].value.p ? arguments[i].value.p : "(null)";
+            size_t length = strlen(string);
+
+            if(stringsSize >= LOG_STRING_SPACE) {
+                entry->arguments[i].value.u = LOG_STRING_SPACE - 1;
+                continue;
+            }
+
+            if(length > LOG_STRING_SPACE - 1 - stringsSize) {
+                length = LOG_STRING_SPACE - 1 - stringsSize;
+            }
+
+            memcpy(entry->strings + stringsSize, string, length);
+            entry->strings[stringsSize + length] = '\0';
+            entry->arguments[i].value.u = stringsSize;
+            stringsSize += length + 1;
+        }
+    }
+
+    entry->strings[LOG_STRING_SPACE - 1] = '\0';
+}
+
+static long long getSigned(const log_argument_t *argument) {
+    return argument->type == LOG_ARGUMENT_DOUBLE ? (long long)argument->value.d : argument->value.i;
+}
+
+static double getDouble(const log_argument_t *argument) {
+    switch(argument->type) {
+        case LOG_ARGUMENT_DOUBLE:
+            return argument->value.d;
+
+        case LOG_ARGUMENT_SIGNED:
+            return argument->value.i;
+
+        default:
+            return argument->value.u;
+    }
+}
+
+// Formats one conversion at a time. Length modifiers of the format are
+// replaced by the ones that match the captured type, so a message formats
+// the same whatever the type of the expressions that were passed.
+static void formatMessage(const log_entry_t *entry, char *output, size_t size) {
+    const char *c = entry->format;
+    size_t length = 0;
+    int argumentIndex = 0;
+
+    while(*c && length + 1 < size) {
+        if(*c != '%') {
+            output[length++] = *c++;
+            continue;
+        }
+
+        if(c[1] == '%') {
+            output[length++] = '%';
+            c += 2;
+            continue;
+        }
+
+        char specification[32];
+        size_t specificationLength = 0;
+
+        specification[specificationLength++] = *c++;
+
+        while(*c && strchr("-+ #0123456789.", *c) && specificationLength < sizeof(specification) - 4) {
+            specification[specificationLength++] = *c++;
+        }
+
+        while(*c && strchr("hlLqjzt", *c)) {
+            c++;
+        }
+
+        char conversion = *c;
+
+        if(!conversion) {
+            break;
+        }
+
+        c++;
+
+        if(argumentIndex >= entry->argumentCount) {
+            output[length++] = '?';
+            continue;
+        }
+
+        const log_argument_t *argument = &entry->arguments[argumentIndex++];
+        int written = 0;
+
+        if(strchr("di", conversion)) {
+            specification[specificationLength++] = 'l';
+            specification[specificationLength++] = 'l';
+            specification[specificationLength++] = conversion;
+            specification[specificationLength] = '\0';
+            written = snprintf(output + length, size - length, specification, getSigned(argument));
+        } else if(strchr("uoxX", conversion)) {
+            specification[specificationLength++] = 'l';
+            specification[specificationLength++] = 'l';
+            specification[specificationLength++] = conversion;
+            specification[specificationLength] = '\0';
+            written = snprintf(output + length, size - length, specification, (unsigned long long)getSigned(argument));
+        } else if(strchr("fFeEgGaA", conversion)) {
+            specification[specificationLength++] = conversion;
+            specification[specificationLength] = '\0';
+            written = snprintf(output + length, size - length, specification, getDouble(argument));
+        } else if(conversion == 'c') {
+            specification[specificationLength++] = conversion;
+            specification[specificationLength] = '\0';
+            written = snprintf(output + length, size - length, specification, (int)getSigned(argument));
+        } else if(conversion == 's') {
+            specification[specificationLength++] = conversion;
+            specification[specificationLength] = '\0';
+            written = snprintf(output + length, size - length, specification, argument->type == LOG_ARGUMENT_STRING ? entry->strings + argument->value.u : "?");
+        } else if(conversion == 'p') {
+            specification[specificationLength++] = conversion;
+            specification[specificationLength] = '\0';
+            written = snprintf(output + length, size - length, specification, argument->value.p);
+        }
+
+        if(written > 0) {
+            length += (size_t)written < size - length ? (size_t)written : size - length - 1;
+        }
+    }
+
+    output[length] = '\0';
+}
+
+static void printLine(int level, uint64_t timestamp, const char *message) {
+    FILE *stream = level <= LOG_LEVEL_WARNING ? stderr : stdout;
+
+    fprintf(stream, "[%llu.%06llu] %s: %s\n", (unsigned long long)(timestamp / 1000000000), (unsigned long long)(timestamp % 1000000000 / 1000), levelNames[level], message);
+}
+
+static void printEntry(const log_entry_t *entry) {
+    char message[LOG_LINE_SIZE];
+
+    formatMessage(entry, message, sizeof(message));
+    printLine(entry->level, entry->timestamp, message);
+}
+
+static void printSummary(uint64_t now, uint64_t period) {
+    char message[LOG_LINE_SIZE];
+    unsigned long lostCount = atomic_exchange(&lostMessageCount, 0);
+
+    for(int i = 0; i < LOG_EVENT_COUNT; i++) {
+        unsigned long count = atomic_exchange_explicit(&log_eventCounts[i], 0, memory_order_relaxed);
+
+        if(count && log_level >= LOG_LEVEL_INFO) {
+            snprintf(message, sizeof(message), "%lu %s in the last %.1f s", count, eventDescriptions[i], period / 1e9);
+            printLine(LOG_LEVEL_INFO, now, message);
+        }
+    }
+
+    if(lostCount) {
+        snprintf(message, sizeof(message), "%lu log messages were lost because the log ring was full", lostCount);
+        printLine(LOG_LEVEL_WARNING, now, message);
+    }
+}
+
+// Writes the pending messages, and returns how many there were
+static int drainRing() {
+    int count = 0;
+
+    while(true) {
+        log_entry_t *entry = &entries[dequeuePosition & (LOG_RING_SIZE - 1)];
+
+        if(atomic_load_explicit(&entry->sequence, memory_order_acquire) != dequeuePosition + 1) {
+            return count;
+        }
+
+        printEntry(entry);
+        atomic_store_explicit(&entry->sequence, dequeuePosition + LOG_RING_SIZE, memory_order_release);
+        dequeuePosition++;
+        count++;
+    }
+}
+
+static void *threadMain(void *arg) {
+    UNUSED_PARAMETER(arg);
+
+    uint64_t lastSummaryTimestamp = getNanoseconds();
+
+    while(true) {
+        // Read before draining, so that every message written before
+        // log_close() is printed.
+        bool stopping = !atomic_load(&running);
+        int count = drainRing();
+
+        if(count) {
+            fflush(stdout);
+        }
+
+        uint64_t now = getNanoseconds();
+
+        if(stopping || now - lastSummaryTimestamp >= LOG_SUMMARY_PERIOD) {
+            printSummary(now, now - lastSummaryTimestamp);
+            fflush(stdout);
+            lastSummaryTimestamp = now;
+        }
+
+        if(stopping) {
+            break;
+        }
+
+        if(!count) {
+            struct timespec idleDuration = {
+                .tv_sec = 0,
+                .tv_nsec = LOG_IDLE_DURATION
+            };
+
+            nanosleep(&idleDuration, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+// Starts the logging thread. Until then, and for errors and warnings, which
+// must not be lost if the program exits right after, messages are written
+// synchronously.
+int log_init(int level) {
+    log_level = level;
+
+    entries = calloc(LOG_RING_SIZE, sizeof(log_entry_t));
+
+    if(!entries) {
+        perror("An error occurred while allocating memory for the log ring");
+        return 1;
+    }
+
+    for(size_t i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&entries[i].sequence, i);
+    }
+
+    atomic_init(&enqueuePosition, 0);
+    dequeuePosition = 0;
+    atomic_store(&running, true);
+
+    if(pthread_create(&thread, NULL, &threadMain, NULL)) {
+        fprintf(stderr, "pthread_create() failed while creating logging thread.\n");
+        return 1;
+    }
+
+    atomic_store(&started, true);
+    atexit(&log_close);
+
+    return 0;
+}
+
+// The ring is not freed, as other threads may still be logging
+void log_close() {
+    if(!atomic_exchange(&started, false)) {
+        return;
+    }
+
+    atomic_store(&running, false);
+    pthread_join(thread, NULL);
+}
+
+int log_parseLevel(const char *name) {
+    for(int i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_TRACE; i++) {
+        if(strcmp(name, levelNames[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void log_write(int level, const char *format, int argumentCount, const log_argument_t *arguments) {
+    uint64_t timestamp = getNanoseconds();
+
+    if(level <= LOG_LEVEL_WARNING || !atomic_load_explicit(&started, memory_order_relaxed)) {
+        log_entry_t entry;
+
+        entry.timestamp = timestamp;
+        entry.format = format;
+        entry.level = level;
+        captureArguments(&entry, argumentCount, arguments);
+        printEntry(&entry);
+
+        return;
+    }
+
+    size_t position = atomic_load_explicit(&enqueuePosition, memory_order_relaxed);
+    log_entry_t *entry;
+
+    while(true) {
+        entry = &entries[position & (LOG_RING_SIZE - 1)];
+
+        size_t sequence = atomic_load_explicit(&entry->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+        if(difference == 0) {
+            if(atomic_compare_exchange_weak_explicit(&enqueuePosition, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if(difference < 0) {
+            // The ring is full: the message is lost rather than blocking
+            atomic_fetch_add_explicit(&lostMessageCount, 1, memory_order_relaxed);
+            return;
+        } else {
+            position = atomic_load_explicit(&enqueuePosition, memory_order_relaxed);
+        }
+    }
+
+    entry->timestamp = timestamp;
+    entry->format = format;
+    entry->level = level;
+    captureArguments(entry, argumentCount, arguments);
+
+    atomic_store_explicit(&entry->sequence, position + 1, memory_order_release);
+}
@@ -0,0 +1,144 @@
+#ifndef __LOG_H_INCLUDED__
+#define __LOG_H_INCLUDED__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+#define LOG_LEVEL_TRACE 4
+
+// Messages above this level are removed at compile time, so that per-packet
+// messages cost nothing in release builds.
+#ifndef LOG_COMPILE_LEVEL
+#ifdef DEBUG
+#define LOG_COMPILE_LEVEL LOG_LEVEL_TRACE
+#else
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+#endif
+
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_INFO
+
+// Size of the ring of pending messages (a power of 2), number of arguments
+// of a message, and room for the copies of its string arguments
+#define LOG_RING_SIZE 4096
+#define LOG_MAX_ARGUMENTS 6
+#define LOG_STRING_SPACE 128
+
+// Period of the summaries of counted events
+#define LOG_SUMMARY_PERIOD 1000000000
+
+// Events that may happen for every packet. They are counted instead of being
+// logged one by one, and the logging thread prints how many happened in each
+// summary period.
+#define LOG_EVENT_QUEUE_FULL 0
+#define LOG_EVENT_CODEL_DROP 1
+#define LOG_EVENT_NO_BUFFER 2
+#define LOG_EVENT_UNKNOWN_PACKET 3
+#define LOG_EVENT_NO_ROUTE 4
+#define LOG_EVENT_IGNORED_DATAGRAM 5
+#define LOG_EVENT_TUN_WRITE_ERROR 6
+#define LOG_EVENT_COUNT 7
+
+#define LOG_ARGUMENT_SIGNED 0
+#define LOG_ARGUMENT_UNSIGNED 1
+#define LOG_ARGUMENT_DOUBLE 2
+#define LOG_ARGUMENT_STRING 3
+#define LOG_ARGUMENT_POINTER 4
+
+// Arguments are captured with their type, and the message is only formatted
+// by the logging thread.
+typedef struct {
+    uint8_t type;
+    union {
+        long long i;
+        unsigned long long u;
+        double d;
+        const void *p;
+    } value;
+} log_argument_t;
+
+extern int log_level;
+extern atomic_ulong log_eventCounts[LOG_EVENT_COUNT];
+
+int log_init(int level);
+void log_close();
+int log_parseLevel(const char *name);
+void log_write(int level, const char *format, int argumentCount, const log_argument_t *arguments);
+
+static inline void log_countEvent(int event) {
+    atomic_fetch_add_explicit(&log_eventCounts[event], 1, memory_order_relaxed);
+}
+
+static inline log_argument_t log_signedArgument(long long x) {
+    return (log_argument_t){.type = LOG_ARGUMENT_SIGNED, .value.i = x};
+}
+
+static inline log_argument_t log_unsignedArgument(unsigned long long x) {
+    return (log_argument_t){.type = LOG_ARGUMENT_UNSIGNED, .value.u = x};
+}
+
+static inline log_argument_t log_doubleArgument(double x) {
+    return (log_argument_t){.type = LOG_ARGUMENT_DOUBLE, .value.d = x};
+}
+
+static inline log_argument_t log_stringArgument(const char *x) {
+    return (log_argument_t){.type = LOG_ARGUMENT_STRING, .value.p = x};
+}
+
+static inline log_argument_t log_pointerArgument(const void *x) {
+    return (log_argument_t){.type = LOG_ARGUMENT_POINTER, .value.p = x};
+}
+
+#define LOG_ARGUMENT(x) _Generic((x), \
+    _Bool: log_unsignedArgument, \
+    char: log_signedArgument, \
+    signed char: log_signedArgument, \
+    short: log_signedArgument, \
+    int: log_signedArgument, \
+    long: log_signedArgument, \
+    long long: log_signedArgument, \
+    unsigned char: log_unsignedArgument, \
+    unsigned short: log_unsignedArgument, \
+    unsigned int: log_unsignedArgument, \
+    unsigned long: log_unsignedArgument, \
+    unsigned long long: log_unsignedArgument, \
+    float: log_doubleArgument, \
+    double: log_doubleArgument, \
+    char *: log_stringArgument, \
+    const char *: log_stringArgument, \
+    default: log_pointerArgument)(x)
+
+// The format is counted with the arguments, so that a message without
+// arguments does not need an empty variadic list.
+#define LOG_COUNT(...) LOG_COUNT_(__VA_ARGS__, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_COUNT_(_1, _2, _3, _4, _5, _6, _7, n, ...) n
+#define LOG_CONCATENATE(a, b) LOG_CONCATENATE_(a, b)
+#define LOG_CONCATENATE_(a, b) a##b
+
+#define LOG_WRITE_1(level, format) log_write(level, format, 0, 0)
+#define LOG_WRITE_2(level, format, a) log_write(level, format, 1, (log_argument_t[]){LOG_ARGUMENT(a)})
+#define LOG_WRITE_3(level, format, a, b) log_write(level, format, 2, (log_argument_t[]){LOG_ARGUMENT(a), LOG_ARGUMENT(b)})
+#define LOG_WRITE_4(level, format, a, b, c) log_write(level, format, 3, (log_argument_t[]){LOG_ARGUMENT(a), LOG_ARGUMENT(b), LOG_ARGUMENT(c)})
+#define LOG_WRITE_5(level, format, a, b, c, d) log_write(level, format, 4, (log_argument_t[]){LOG_ARGUMENT(a), LOG_ARGUMENT(b), LOG_ARGUMENT(c), LOG_ARGUMENT(d)})
+#define LOG_WRITE_6(level, format, a, b, c, d, e) log_write(level, format, 5, (log_argument_t[]){LOG_ARGUMENT(a), LOG_ARGUMENT(b), LOG_ARGUMENT(c), LOG_ARGUMENT(d), LOG_ARGUMENT(e)})
+#define LOG_WRITE_7(level, format, a, b, c, d, e, f) log_write(level, format, 6, (log_argument_t[]){LOG_ARGUMENT(a), LOG_ARGUMENT(b), LOG_ARGUMENT(c), LOG_ARGUMENT(d), LOG_ARGUMENT(e), LOG_ARGUMENT(f)})
+
+#define LOG(level, ...) do { \
+    if((level) <= LOG_COMPILE_LEVEL && (level) <= log_level) { \
+        LOG_CONCATENATE(LOG_WRITE_, LOG_COUNT(__VA_ARGS__))(level, __VA_ARGS__); \
+    } \
+} while(0)
+
+// The format has to be a string literal, as it is used after the call
+#define log_error(...) LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warning(...) LOG(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_info(...) LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_trace(...) LOG(LOG_LEVEL_TRACE, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,390 @@
+#include <string.h>
+
+#include <unistd.h>
+
+#include <offload.h>
+
+#define IPV4_HEADER_MINIMUM_SIZE 20
+#define IPV6_HEADER_SIZE 40
+#define TCP_HEADER_MINIMUM_SIZE 20
+#define TCP_CHECKSUM_OFFSET 16
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_ACK 0x10
+#define TCP_FLAG_ECE 0x40
+#define TCP_FLAG_CWR 0x80
+
+static inline uint16_t readShort(const uint8_t *data) {
+    return (data[0] << 8) | data[1];
+}
+
+static inline void writeShort(uint8_t *data, uint16_t value) {
+    data[0] = value >> 8;
+    data[1] = value;
+}
+
+static inline uint32_t readLong(const uint8_t *data) {
+    return ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static inline void writeLong(uint8_t *data, uint32_t value) {
+    data[0] = value >> 24;
+    data[1] = value >> 16;
+    data[2] = value >> 8;
+    data[3] = value;
+}
+
+// One's complement sum of big-endian 16-bit words (RFC 1071), folded later
+static uint64_t addWords(uint64_t sum, const uint8_t *data, uint32_t size) {
+    uint32_t i = 0;
+
+    for(; i + 1 < size; i += 2) {
+        sum += readShort(data + i);
+    }
+
+    if(i < size) {
+        sum += data[i] << 8;
+    }
+
+    return sum;
+}
+
+static uint16_t foldSum(uint64_t sum) {
+    while(sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return sum;
+}
+
+static uint32_t getIpHeaderSize(const uint8_t *ipHeader) {
+    return ipHeader[0] >> 4 == 4 ? (ipHeader[0] & 0x0f) * 4 : IPV6_HEADER_SIZE;
+}
+
+// Sum of the pseudo-header of a TCP segment of the given size
+static uint64_t addPseudoHeader(const uint8_t *ipHeader, uint32_t tcpSize) {
+    uint64_t sum = PACKET_PROTOCOL_TCP + tcpSize;
+
+    if(ipHeader[0] >> 4 == 4) {
+        return addWords(sum, ipHeader + 12, 8);
+    }
+
+    return addWords(sum, ipHeader + 8, 32);
+}
+
+// Sets the total length of an IP header, and its checksum for IPv4
+static void setIpLength(uint8_t *ipHeader, uint32_t ipHeaderSize, uint32_t length) {
+    if(ipHeader[0] >> 4 == 4) {
+        writeShort(ipHeader + 2, length);
+        writeShort(ipHeader + 10, 0);
+        writeShort(ipHeader + 10, ~foldSum(addWords(0, ipHeader, ipHeaderSize)));
+    } else {
+        writeShort(ipHeader + 4, length - ipHeaderSize);
+    }
+}
+
+// The packet information header comes first, then the virtio_net_hdr, which
+// is read aside so that the IP header stays where it is without offloads.
+ssize_t offload_read(int fd, uint8_t *buffer, uint32_t size, struct virtio_net_hdr *vnetHeader) {
+    struct iovec iovecs[3] = {
+        { .iov_base = buffer, .iov_len = TUNNEL_PACKET_INFORMATION_SIZE },
+        { .iov_base = vnetHeader, .iov_len = OFFLOAD_VNET_HEADER_SIZE },
+        { .iov_base = buffer + TUNNEL_PACKET_INFORMATION_SIZE, .iov_len = size - TUNNEL_PACKET_INFORMATION_SIZE }
+    };
+
+    ssize_t result = readv(fd, iovecs, 3);
+
+    return result < (ssize_t)OFFLOAD_VNET_HEADER_SIZE ? result : result - (ssize_t)OFFLOAD_VNET_HEADER_SIZE;
+}
+
+// The checksum field of a packet that needs one holds the sum of the
+// pseudo-header, so summing from the start of the transport header is
+// enough, as in skb_checksum_help().
+static int completeChecksum(packet_t *packet, const struct virtio_net_hdr *vnetHeader) {
+    uint32_t start = TUNNEL_PACKET_INFORMATION_SIZE + vnetHeader->csum_start;
+    uint32_t field = start + vnetHeader->csum_offset;
+
+    if(field + 2 > packet->packetSize) {
+        return 1;
+    }
+
+    uint16_t checksum = ~foldSum(addWords(0, packet->buffer + start, packet->packetSize - start));
+
+    writeShort(packet->buffer + field, checksum ? checksum : 0xffff);
+
+    return 0;
+}
+
+int offload_preparePacket(packet_t *packet, const packet_info_t *info, const struct virtio_net_hdr *vnetHeader, uint16_t *segmentSize, uint16_t *headerSize) {
+    uint8_t gsoType = vnetHeader->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+
+    *segmentSize = 0;
+    *headerSize = 0;
+
+    if(gsoType == VIRTIO_NET_HDR_GSO_NONE) {
+        return (vnetHeader->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && completeChecksum(packet, vnetHeader);
+    }
+
+    // Only TSO is enabled on the device, and segments repeat the IP header,
+    // so IPv6 extension headers are not supported.
+    if((gsoType != VIRTIO_NET_HDR_GSO_TCPV4 && gsoType != VIRTIO_NET_HDR_GSO_TCPV6) || info->protocol != PACKET_PROTOCOL_TCP || vnetHeader->gso_size == 0) {
+        return 1;
+    }
+
+    uint32_t ipHeaderSize = getIpHeaderSize(packet->buffer + TUNNEL_PACKET_INFORMATION_SIZE);
+
+    if(info->transportOffset != TUNNEL_PACKET_INFORMATION_SIZE + ipHeaderSize || (uint32_t)info->transportOffset + TCP_HEADER_MINIMUM_SIZE > packet->packetSize) {
+        return 1;
+    }
+
+    uint32_t tcpHeaderSize = (packet->buffer[info->transportOffset + 12] >> 4) * 4;
+    uint32_t size = ipHeaderSize + tcpHeaderSize;
+
+    // Segments go through the same buffers as regular packets
+    if(tcpHeaderSize < TCP_HEADER_MINIMUM_SIZE || size > OFFLOAD_MAX_HEADER_SIZE || TUNNEL_PACKET_INFORMATION_SIZE + size >= packet->packetSize || size + vnetHeader->gso_size > TUNNEL_MTU) {
+        return 1;
+    }
+
+    *segmentSize = vnetHeader->gso_size;
+    *headerSize = size;
+
+    return 0;
+}
+
+// Each segment gets a copy of the headers, with the lengths, the IPv4 ID and
+// the sequence number of the segment. FIN and PSH only stay on the last
+// segment and CWR on the first one, as in tcp_gso_segment(), and the
+// checksums are computed in full.
+uint32_t offload_writeSegment(const queue_element_t *superPacket, uint32_t offset, uint8_t *buffer) {
+    uint32_t headerEnd = TUNNEL_PACKET_INFORMATION_SIZE + superPacket->headerSize;
+    uint32_t payloadSize = superPacket->packet.packetSize - headerEnd - offset;
+    bool last = payloadSize <= superPacket->segmentSize;
+
+    if(!last) {
+        payloadSize = superPacket->segmentSize;
+    }
+
+    memcpy(buffer, superPacket->packet.buffer, headerEnd);
+    memcpy(buffer + headerEnd, superPacket->packet.buffer + headerEnd + offset, payloadSize);
+
+    uint8_t *ipHeader = buffer + TUNNEL_PACKET_INFORMATION_SIZE;
+    uint32_t ipHeaderSize = getIpHeaderSize(ipHeader);
+    uint8_t *tcpHeader = ipHeader + ipHeaderSize;
+    uint32_t tcpSize = superPacket->headerSize - ipHeaderSize + payloadSize;
+
+    if(ipHeader[0] >> 4 == 4) {
+        writeShort(ipHeader + 4, readShort(ipHeader + 4) + offset / superPacket->segmentSize);
+    }
+
+    setIpLength(ipHeader, ipHeaderSize, superPacket->headerSize + payloadSize);
+
+    writeLong(tcpHeader + 4, readLong(tcpHeader + 4) + offset);
+
+    if(!last) {
+        tcpHeader[13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+    }
+
+    if(offset) {
+        tcpHeader[13] &= ~TCP_FLAG_CWR;
+    }
+
+    writeShort(tcpHeader + TCP_CHECKSUM_OFFSET, 0);
+    writeShort(tcpHeader + TCP_CHECKSUM_OFFSET, ~foldSum(addWords(addPseudoHeader(ipHeader, tcpSize), tcpHeader, tcpSize)));
+
+    return headerEnd + payloadSize;
+}
+
+// Returns the size of the IP and TCP headers of a packet that may be
+// coalesced: a TCP segment with data and no other flag than ACK, PSH or ECE,
+// that is not a fragment. Returns 0 for any other packet.
+static uint32_t getCoalescableHeaderSize(const uint8_t *buffer, uint32_t size) {
+    if(size < TUNNEL_PACKET_INFORMATION_SIZE + IPV4_HEADER_MINIMUM_SIZE) {
+        return 0;
+    }
+
+    const uint8_t *ipHeader = buffer + TUNNEL_PACKET_INFORMATION_SIZE;
+    uint32_t ipSize = size - TUNNEL_PACKET_INFORMATION_SIZE;
+    uint32_t ipHeaderSize = getIpHeaderSize(ipHeader);
+
+    if(ipHeader[0] >> 4 == 4) {
+        if(ipHeaderSize < IPV4_HEADER_MINIMUM_SIZE || ipHeader[9] != PACKET_PROTOCOL_TCP || (readShort(ipHeader + 6) & 0x3fff) || readShort(ipHeader + 2) != ipSize) {
+            return 0;
+        }
+    } else if(ipHeader[0] >> 4 == 6) {
+        if(ipSize < IPV6_HEADER_SIZE || ipHeader[6] != PACKET_PROTOCOL_TCP || IPV6_HEADER_SIZE + (uint32_t)readShort(ipHeader + 4) != ipSize) {
+            return 0;
+        }
+    } else {
+        return 0;
+    }
+
+    if(ipHeaderSize + TCP_HEADER_MINIMUM_SIZE > ipSize) {
+        return 0;
+    }
+
+    const uint8_t *tcpHeader = ipHeader + ipHeaderSize;
+    uint32_t tcpHeaderSize = (tcpHeader[12] >> 4) * 4;
+    uint32_t headerSize = ipHeaderSize + tcpHeaderSize;
+
+    if(tcpHeaderSize < TCP_HEADER_MINIMUM_SIZE || headerSize > OFFLOAD_MAX_HEADER_SIZE || headerSize >= ipSize) {
+        return 0;
+    }
+
+    if((tcpHeader[13] & ~(TCP_FLAG_PSH | TCP_FLAG_ECE)) != TCP_FLAG_ACK) {
+        return 0;
+    }
+
+    return headerSize;
+}
+
+// A packet follows the pending ones if its headers only differ by the fields
+// that change from one segment to the next, if its data comes right after
+// theirs, and if it is not larger than the first one.
+static bool canCoalesce(const offload_coalescer_t *coalescer, const uint8_t *buffer, uint32_t size, uint32_t headerSize) {
+    if(!coalescer->packetCount || coalescer->closed || coalescer->headerSize != headerSize || coalescer->packetCount == OFFLOAD_MAX_COALESCED_PACKETS) {
+        return false;
+    }
+
+    uint32_t payloadSize = size - TUNNEL_PACKET_INFORMATION_SIZE - headerSize;
+
+    if(payloadSize > coalescer->segmentSize || headerSize + coalescer->payloadSize + payloadSize > 65535) {
+        return false;
+    }
+
+    const uint8_t *first = coalescer->firstPacket + TUNNEL_PACKET_INFORMATION_SIZE;
+    const uint8_t *ipHeader = buffer + TUNNEL_PACKET_INFORMATION_SIZE;
+    uint32_t ipHeaderSize = getIpHeaderSize(ipHeader);
+
+    if(ipHeader[0] != first[0]) {
+        return false;
+    }
+
+    if(ipHeader[0] >> 4 == 4) {
+        if(ipHeader[1] != first[1] || memcmp(ipHeader + 6, first + 6, 4) || memcmp(ipHeader + 12, first + 12, ipHeaderSize - 12)) {
+            return false;
+        }
+    } else if(memcmp(ipHeader, first, 4) || memcmp(ipHeader + 6, first + 6, IPV6_HEADER_SIZE - 6)) {
+        return false;
+    }
+
+    const uint8_t *tcpHeader = ipHeader + ipHeaderSize;
+    const uint8_t *firstTcpHeader = first + ipHeaderSize;
+
+    return readLong(tcpHeader + 4) == coalescer->nextSequence
+        && !memcmp(tcpHeader, firstTcpHeader, 4)
+        && !memcmp(tcpHeader + 8, firstTcpHeader + 8, 5)
+        && !((tcpHeader[13] ^ firstTcpHeader[13]) & ~TCP_FLAG_PSH)
+        && !memcmp(tcpHeader + 14, firstTcpHeader + 14, 2)
+        && !memcmp(tcpHeader + 18, firstTcpHeader + 18, headerSize - ipHeaderSize - 18);
+}
+
+static void addPayload(offload_coalescer_t *coalescer, uint8_t *buffer, uint32_t size) {
+    uint32_t headerEnd = TUNNEL_PACKET_INFORMATION_SIZE + coalescer->headerSize;
+    uint32_t payloadSize = size - headerEnd;
+
+    const uint8_t *ipHeader = buffer + TUNNEL_PACKET_INFORMATION_SIZE;
+    uint8_t tcpFlags = ipHeader[getIpHeaderSize(ipHeader) + 13];
+
+    coalescer->iovecs[coalescer->packetCount + 3].iov_base = buffer + headerEnd;
+    coalescer->iovecs[coalescer->packetCount + 3].iov_len = payloadSize;
+    coalescer->packetCount++;
+    coalescer->payloadSize += payloadSize;
+    coalescer->nextSequence += payloadSize;
+
+    // A shorter segment or PSH ends the super-packet, as in tcp_gro_receive()
+    coalescer->push = tcpFlags & TCP_FLAG_PSH;
+    coalescer->closed = coalescer->push || payloadSize < coalescer->segmentSize;
+}
+
+static void startSuperPacket(offload_coalescer_t *coalescer, uint8_t *buffer, uint32_t size, uint32_t headerSize) {
+    coalescer->firstPacket = buffer;
+    coalescer->firstPacketSize = size;
+    coalescer->headerSize = headerSize;
+    coalescer->payloadSize = 0;
+    coalescer->packetCount = 0;
+
+    if(headerSize) {
+        const uint8_t *ipHeader = buffer + TUNNEL_PACKET_INFORMATION_SIZE;
+
+        coalescer->segmentSize = size - TUNNEL_PACKET_INFORMATION_SIZE - headerSize;
+        coalescer->nextSequence = readLong(ipHeader + getIpHeaderSize(ipHeader) + 4);
+
+        addPayload(coalescer, buffer, size);
+    } else {
+        coalescer->packetCount = 1;
+        coalescer->closed = true;
+    }
+
+    coalescer->iovecs[0].iov_base = buffer;
+}
+
+void offload_initCoalescer(offload_coalescer_t *coalescer) {
+    memset(coalescer, 0, sizeof(offload_coalescer_t));
+
+    coalescer->iovecs[0].iov_len = TUNNEL_PACKET_INFORMATION_SIZE;
+    coalescer->iovecs[1].iov_base = &coalescer->vnetHeader;
+    coalescer->iovecs[1].iov_len = OFFLOAD_VNET_HEADER_SIZE;
+}
+
+int offload_coalesce(offload_coalescer_t *coalescer, int fd, uint8_t *buffer, uint32_t size) {
+    uint32_t headerSize = getCoalescableHeaderSize(buffer, size);
+
+    if(headerSize && canCoalesce(coalescer, buffer, size, headerSize)) {
+        addPayload(coalescer, buffer, size);
+        return 0;
+    }
+
+    int result = offload_flush(coalescer, fd);
+
+    startSuperPacket(coalescer, buffer, size, headerSize);
+
+    return result;
+}
+
+// A single packet is written as it is. Several ones are written as a
+// super-packet with the headers of the first one, whose TCP checksum is left
+// for the kernel to complete, like the packets built by GRO.
+int offload_flush(offload_coalescer_t *coalescer, int fd) {
+    int packetCount = coalescer->packetCount;
+
+    if(!packetCount) {
+        return 0;
+    }
+
+    coalescer->packetCount = 0;
+    memset(&coalescer->vnetHeader, 0, sizeof(struct virtio_net_hdr));
+
+    if(packetCount == 1) {
+        coalescer->iovecs[2].iov_base = coalescer->firstPacket + TUNNEL_PACKET_INFORMATION_SIZE;
+        coalescer->iovecs[2].iov_len = coalescer->firstPacketSize - TUNNEL_PACKET_INFORMATION_SIZE;
+
+        return writev(fd, coalescer->iovecs, 3) == -1;
+    }
+
+    uint8_t *ipHeader = coalescer->header;
+    uint32_t ipHeaderSize = getIpHeaderSize(coalescer->firstPacket + TUNNEL_PACKET_INFORMATION_SIZE);
+    uint8_t *tcpHeader = ipHeader + ipHeaderSize;
+    uint32_t tcpSize = coalescer->headerSize - ipHeaderSize + coalescer->payloadSize;
+
+    memcpy(ipHeader, coalescer->firstPacket + TUNNEL_PACKET_INFORMATION_SIZE, coalescer->headerSize);
+    setIpLength(ipHeader, ipHeaderSize, coalescer->headerSize + coalescer->payloadSize);
+
+    if(coalescer->push) {
+        tcpHeader[13] |= TCP_FLAG_PSH;
+    }
+
+    writeShort(tcpHeader + TCP_CHECKSUM_OFFSET, foldSum(addPseudoHeader(ipHeader, tcpSize)));
+
+    coalescer->vnetHeader.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    coalescer->vnetHeader.gso_type = ipHeader[0] >> 4 == 4 ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+    coalescer->vnetHeader.hdr_len = coalescer->headerSize;
+    coalescer->vnetHeader.gso_size = coalescer->segmentSize;
+    coalescer->vnetHeader.csum_start = ipHeaderSize;
+    coalescer->vnetHeader.csum_offset = TCP_CHECKSUM_OFFSET;
+
+    coalescer->iovecs[2].iov_base = coalescer->header;
+    coalescer->iovecs[2].iov_len = coalescer->headerSize;
+
+    return writev(fd, coalescer->iovecs, packetCount + 3) == -1;
+}
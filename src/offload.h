@@ -0,0 +1,64 @@
+#ifndef __OFFLOAD_H_INCLUDED__
+#define __OFFLOAD_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/virtio_net.h>
+
+#include <packet.h>
+#include <pool.h>
+
+// With offloads, the tun device is opened with IFF_VNET_HDR: every packet
+// read from or written to it has a virtio_net_hdr (in host byte order)
+// between the packet information header and the IP header. Packets read may
+// then be TCP super-packets of up to 64 KiB, with a partial checksum, that
+// the tunnel segments itself when they leave.
+#define OFFLOAD_VNET_HEADER_SIZE sizeof(struct virtio_net_hdr)
+
+// Largest IP and TCP headers that a segment repeats
+#define OFFLOAD_MAX_HEADER_SIZE 120
+
+// Largest number of received packets that are written as one super-packet
+#define OFFLOAD_MAX_COALESCED_PACKETS 64
+
+// Consecutive segments of a TCP flow, as received from the other end, are
+// held back to be written to the tun device as one super-packet. The packets
+// are not copied: their buffers have to stay valid until the next flush.
+typedef struct {
+    int packetCount;
+    uint8_t *firstPacket;
+    uint32_t firstPacketSize;
+    uint16_t headerSize;
+    uint16_t segmentSize;
+    uint32_t payloadSize;
+    uint32_t nextSequence;
+    bool push;
+    bool closed;
+    struct virtio_net_hdr vnetHeader;
+    uint8_t header[OFFLOAD_MAX_HEADER_SIZE];
+    struct iovec iovecs[OFFLOAD_MAX_COALESCED_PACKETS + 3];
+} offload_coalescer_t;
+
+// Reads a packet and its virtio_net_hdr. Returns the size of the packet
+// (packet information header included) as read() would.
+ssize_t offload_read(int fd, uint8_t *buffer, uint32_t size, struct virtio_net_hdr *vnetHeader);
+
+// Completes the checksum of a regular packet, or checks that a super-packet
+// can be segmented and gives the size of its segments and of their headers
+// (segmentSize is 0 for a regular packet). Returns 1 if the packet has to be
+// dropped.
+int offload_preparePacket(packet_t *packet, const packet_info_t *info, const struct virtio_net_hdr *vnetHeader, uint16_t *segmentSize, uint16_t *headerSize);
+
+// Writes to buffer the segment of a super-packet that starts at the given
+// offset of its payload, and returns the size of the segment
+uint32_t offload_writeSegment(const queue_element_t *superPacket, uint32_t offset, uint8_t *buffer);
+
+void offload_initCoalescer(offload_coalescer_t *coalescer);
+
+// Both return 1 if writing a pending super-packet failed
+int offload_coalesce(offload_coalescer_t *coalescer, int fd, uint8_t *buffer, uint32_t size);
+int offload_flush(offload_coalescer_t *coalescer, int fd);
+
+#endif
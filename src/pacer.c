@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <common.h>
+#include <pacer.h>
+
+int pacer_init(pacer_t *pacer, uint64_t rate, uint64_t burst, uint64_t now) {
+    if(rate == 0) {
+        fprintf(stderr, "pacer_init() failed because the specified rate was invalid.\n");
+        return 1;
+    }
+
+    if(burst == 0) {
+        fprintf(stderr, "pacer_init() failed because the specified burst was invalid.\n");
+        return 1;
+    }
+
+    pacer->rate = rate;
+    pacer->burst = burst;
+    pacer->maximumCredit = burst * PACER_CREDIT_SCALE;
+    pacer->credit = pacer->maximumCredit;
+    pacer->lastRefillTimestamp = now;
+
+    return 0;
+}
+
+// Changes the rate of a running pacer. The credit is brought up to date at
+// the old rate first, and a debt is kept as it is: the bytes that were sent
+// ahead are still owed, only now at the new rate.
+void pacer_setRate(pacer_t *pacer, uint64_t rate, uint64_t burst, uint64_t now) {
+    pacer_refill(pacer, now);
+
+    pacer->rate = rate;
+    pacer->burst = burst;
+    pacer->maximumCredit = burst * PACER_CREDIT_SCALE;
+
+    if(pacer->credit > pacer->maximumCredit) {
+        pacer->credit = pacer->maximumCredit;
+    }
+}
+
+uint64_t pacer_getDefaultBurst(uint64_t rate, unsigned int maximumPacketSize) {
+    uint64_t burst = rate * PACER_DEFAULT_BURST_DURATION / 1000000000;
+    uint64_t minimumBurst = (uint64_t)maximumPacketSize * PACER_MINIMUM_BURST_PACKETS;
+
+    return burst < minimumBurst ? minimumBurst : burst;
+}
+
+void pacer_refill(pacer_t *pacer, uint64_t now) {
+    if(now <= pacer->lastRefillTimestamp) {
+        return;
+    }
+
+    uint64_t elapsed = now - pacer->lastRefillTimestamp;
+    pacer->lastRefillTimestamp = now;
+
+    // Past this point the bucket is full anyway, and clamping the elapsed time
+    // keeps the multiplication below from overflowing after a long idle time.
+    uint64_t timeToFill = (uint64_t)(pacer->maximumCredit - pacer->credit) / pacer->rate + 1;
+
+    if(elapsed >= timeToFill) {
+        pacer->credit = pacer->maximumCredit;
+    } else {
+        pacer->credit += elapsed * pacer->rate;
+
+        if(pacer->credit > pacer->maximumCredit) {
+            pacer->credit = pacer->maximumCredit;
+        }
+    }
+}
+
+uint64_t pacer_getDelay(pacer_t *pacer, uint64_t now) {
+    pacer_refill(pacer, now);
+
+    if(pacer->credit >= 0) {
+        return 0;
+    }
+
+    return ((uint64_t)-pacer->credit + pacer->rate - 1) / pacer->rate;
+}
+
+// Tells whether a packet could be sent within the lookahead time. Sending it
+// now only moves it ahead by that much, so the long-term rate is unchanged.
+bool pacer_isDue(pacer_t *pacer, uint64_t now, uint64_t lookahead) {
+    pacer_refill(pacer, now);
+
+    return pacer->credit + (int64_t)(lookahead * pacer->rate) >= 0;
+}
+
+void pacer_consume(pacer_t *pacer, unsigned int size) {
+    // The credit is allowed to go negative: a packet is sent as soon as the
+    // credit is positive, and the next one waits until the debt is paid. This
+    // keeps the long-term rate exact even for packets larger than the burst.
+    pacer->credit -= (int64_t)size * PACER_CREDIT_SCALE;
+}
+
+// Sleeps until the credit is positive again, and returns how long it slept
+uint64_t pacer_wait(pacer_t *pacer) {
+    uint64_t startTimestamp = getNanoseconds();
+    uint64_t now = startTimestamp;
+    uint64_t delay;
+
+    while((delay = pacer_getDelay(pacer, now)) != 0) {
+        uint64_t deadline = now + delay;
+        struct timespec ts = {
+            .tv_sec = deadline / 1000000000,
+            .tv_nsec = deadline % 1000000000
+        };
+
+        int result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+        if(result && result != EINTR) {
+            fprintf(stderr, "clock_nanosleep() failed while pacing.\n");
+            break;
+        }
+
+        now = getNanoseconds();
+    }
+
+    return now - startTimestamp;
+}
+
+static const char *linkNames[PACER_LINK_COUNT] = {"ethernet", "atm", "ptm"};
+
+uint32_t pacer_computeWireSize(const pacer_link_t *link, uint32_t size) {
+    uint32_t wireSize = size + link->overhead;
+
+    if(wireSize < (uint32_t)link->mpu) {
+        wireSize = link->mpu;
+    }
+
+    switch(link->type) {
+        case PACER_LINK_ATM:
+            return (wireSize + PACER_ATM_CELL_PAYLOAD_SIZE - 1) / PACER_ATM_CELL_PAYLOAD_SIZE * PACER_ATM_CELL_SIZE;
+
+        case PACER_LINK_PTM:
+            return wireSize + (wireSize + 63) / 64;
+
+        default:
+            return wireSize;
+    }
+}
+
+// The wire size of every packet size that the tunnel sends is computed once,
+// so that charging a packet is a single lookup whatever the link layer is.
+void pacer_initLink(pacer_link_t *link, int type, int overhead, int mpu) {
+    link->type = type;
+    link->overhead = overhead;
+    link->mpu = mpu;
+
+    for(uint32_t size = 0; size < PACER_LINK_TABLE_SIZE; size++) {
+        link->wireSizes[size] = pacer_computeWireSize(link, size);
+    }
+}
+
+int pacer_parseLinkType(const char *name) {
+    for(int i = 0; i < PACER_LINK_COUNT; i++) {
+        if(strcmp(name, linkNames[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+const char *pacer_getLinkName(int type) {
+    return type >= 0 && type < PACER_LINK_COUNT ? linkNames[type] : "unknown";
+}
@@ -0,0 +1,67 @@
+#ifndef __PACER_H_INCLUDED__
+#define __PACER_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The credit is stored in byte-nanoseconds so that refilling it never needs a
+// division and never loses precision, whatever the rate is.
+#define PACER_CREDIT_SCALE 1000000000LL
+
+// Burst allowance used when none is configured: 1 ms worth of data, but never
+// less than two full-sized packets.
+#define PACER_DEFAULT_BURST_DURATION 1000000
+#define PACER_MINIMUM_BURST_PACKETS 2
+
+// Link layers that the wire size of a packet is computed for. The overhead
+// is added first, then the size is raised to the minimum packet unit (MPU),
+// then the encoding of the link applies: ATM carries 48 bytes in each 53-byte
+// cell, and PTM (VDSL2) adds one byte for every 64 bytes.
+#define PACER_LINK_ETHERNET 0
+#define PACER_LINK_ATM 1
+#define PACER_LINK_PTM 2
+#define PACER_LINK_COUNT 3
+
+#define PACER_ATM_CELL_SIZE 53
+#define PACER_ATM_CELL_PAYLOAD_SIZE 48
+
+// Wire sizes of packets below this size are read from a table. Larger ones
+// are computed.
+#define PACER_LINK_TABLE_SIZE 2048
+
+typedef struct {
+    int type;
+    int overhead;
+    int mpu;
+    uint16_t wireSizes[PACER_LINK_TABLE_SIZE];
+} pacer_link_t;
+
+typedef struct {
+    uint64_t rate;
+    uint64_t burst;
+    int64_t credit;
+    int64_t maximumCredit;
+    uint64_t lastRefillTimestamp;
+} pacer_t;
+
+int pacer_init(pacer_t *pacer, uint64_t rate, uint64_t burst, uint64_t now);
+void pacer_setRate(pacer_t *pacer, uint64_t rate, uint64_t burst, uint64_t now);
+uint64_t pacer_getDefaultBurst(uint64_t rate, unsigned int maximumPacketSize);
+void pacer_refill(pacer_t *pacer, uint64_t now);
+uint64_t pacer_getDelay(pacer_t *pacer, uint64_t now);
+bool pacer_isDue(pacer_t *pacer, uint64_t now, uint64_t lookahead);
+void pacer_consume(pacer_t *pacer, unsigned int size);
+uint64_t pacer_wait(pacer_t *pacer);
+
+void pacer_initLink(pacer_link_t *link, int type, int overhead, int mpu);
+uint32_t pacer_computeWireSize(const pacer_link_t *link, uint32_t size);
+
+// Returns -1 if the name is unknown
+int pacer_parseLinkType(const char *name);
+const char *pacer_getLinkName(int type);
+
+static inline uint32_t pacer_getWireSize(const pacer_link_t *link, uint32_t size) {
+    return size < PACER_LINK_TABLE_SIZE ? link->wireSizes[size] : pacer_computeWireSize(link, size);
+}
+
+#endif
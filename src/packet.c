@@ -0,0 +1,344 @@
+#include <string.h>
+
+#include <packet.h>
+
+#define IPV4_HEADER_MINIMUM_SIZE 20
+#define IPV6_HEADER_SIZE 40
+
+#define IPV6_EXTENSION_HOP_BY_HOP 0
+#define IPV6_EXTENSION_ROUTING 43
+#define IPV6_EXTENSION_FRAGMENT 44
+#define IPV6_EXTENSION_AUTHENTICATION 51
+#define IPV6_EXTENSION_DESTINATION 60
+
+#define TCP_HEADER_MINIMUM_SIZE 20
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_ACK 0x10
+
+#define TCP_OPTION_END 0
+#define TCP_OPTION_NOP 1
+#define TCP_OPTION_SACK 5
+#define TCP_OPTION_TIMESTAMPS 8
+
+// One round of MurmurHash3
+static inline uint32_t mixHash(uint32_t hash, uint32_t value) {
+    value *= 0xcc9e2d51;
+    value = (value << 15) | (value >> 17);
+    value *= 0x1b873593;
+
+    hash ^= value;
+    hash = (hash << 13) | (hash >> 19);
+
+    return hash * 5 + 0xe6546b64;
+}
+
+static inline uint32_t finalizeHash(uint32_t hash) {
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+// Hashes the 5-tuple of the packet, addresses being given as 32-bit words
+static uint32_t hashFlow(const uint8_t *addresses, int addressWordCount, const packet_info_t *info) {
+    uint32_t hash = 0;
+
+    for(int i = 0; i < addressWordCount; i++) {
+        uint32_t word;
+
+        memcpy(&word, addresses + i * 4, 4);
+        hash = mixHash(hash, word);
+    }
+
+    hash = mixHash(hash, ((uint32_t)info->sourcePort << 16) | info->destinationPort);
+    hash = mixHash(hash, info->protocol);
+
+    return finalizeHash(hash);
+}
+
+static void parseTransportHeader(const uint8_t *buffer, uint32_t size, packet_info_t *info) {
+    if(info->protocol != PACKET_PROTOCOL_TCP && info->protocol != PACKET_PROTOCOL_UDP) {
+        return;
+    }
+
+    if((uint32_t)info->transportOffset + 4 > size) {
+        return;
+    }
+
+    const uint8_t *header = buffer + info->transportOffset;
+
+    info->sourcePort = (header[0] << 8) | header[1];
+    info->destinationPort = (header[2] << 8) | header[3];
+    info->hasPorts = true;
+}
+
+static int parseIpv4(const uint8_t *buffer, uint32_t size, packet_info_t *info) {
+    const uint8_t *header = buffer + info->networkOffset;
+
+    if((uint32_t)info->networkOffset + IPV4_HEADER_MINIMUM_SIZE > size) {
+        return 1;
+    }
+
+    unsigned int headerSize = (header[0] & 0x0f) * 4;
+
+    if(headerSize < IPV4_HEADER_MINIMUM_SIZE) {
+        return 1;
+    }
+
+    info->dscp = header[1] >> 2;
+    info->ecn = header[1] & 0x03;
+    info->ipLength = (header[2] << 8) | header[3];
+    info->protocol = header[9];
+    info->transportOffset = info->networkOffset + headerSize;
+
+    // Only the first fragment carries the transport header
+    if((((header[6] & 0x1f) << 8) | header[7]) == 0) {
+        parseTransportHeader(buffer, size, info);
+    }
+
+    info->flowHash = hashFlow(header + 12, 2, info);
+
+    return 0;
+}
+
+static int parseIpv6(const uint8_t *buffer, uint32_t size, packet_info_t *info) {
+    const uint8_t *header = buffer + info->networkOffset;
+
+    if((uint32_t)info->networkOffset + IPV6_HEADER_SIZE > size) {
+        return 1;
+    }
+
+    uint8_t trafficClass = (header[0] << 4) | (header[1] >> 4);
+
+    info->dscp = trafficClass >> 2;
+    info->ecn = trafficClass & 0x03;
+    info->flowLabel = ((header[1] & 0x0f) << 16) | (header[2] << 8) | header[3];
+    info->ipLength = IPV6_HEADER_SIZE + ((header[4] << 8) | header[5]);
+
+    // Walk the extension header chain to find the transport protocol
+    uint8_t nextHeader = header[6];
+    uint32_t offset = info->networkOffset + IPV6_HEADER_SIZE;
+    bool firstFragment = true;
+
+    while(true) {
+        if(nextHeader == IPV6_EXTENSION_HOP_BY_HOP || nextHeader == IPV6_EXTENSION_ROUTING || nextHeader == IPV6_EXTENSION_DESTINATION) {
+            if(offset + 2 > size) {
+                break;
+            }
+
+            nextHeader = buffer[offset];
+            offset += (buffer[offset + 1] + 1) * 8;
+        } else if(nextHeader == IPV6_EXTENSION_FRAGMENT) {
+            if(offset + 8 > size) {
+                break;
+            }
+
+            firstFragment = ((buffer[offset + 2] << 8 | buffer[offset + 3]) & 0xfff8) == 0;
+            nextHeader = buffer[offset];
+            offset += 8;
+        } else if(nextHeader == IPV6_EXTENSION_AUTHENTICATION) {
+            if(offset + 2 > size) {
+                break;
+            }
+
+            nextHeader = buffer[offset];
+            offset += (buffer[offset + 1] + 2) * 4;
+        } else {
+            break;
+        }
+    }
+
+    info->protocol = nextHeader;
+    info->transportOffset = offset;
+
+    if(firstFragment) {
+        parseTransportHeader(buffer, size, info);
+    }
+
+    info->flowHash = hashFlow(header + 8, 8, info);
+
+    return 0;
+}
+
+int packet_parse(const packet_t *packet, packet_info_t *info) {
+    memset(info, 0, sizeof(packet_info_t));
+
+    if(packet->packetSize <= TUNNEL_PACKET_INFORMATION_SIZE) {
+        return 1;
+    }
+
+    info->networkOffset = TUNNEL_PACKET_INFORMATION_SIZE;
+    info->ipVersion = packet->buffer[info->networkOffset] >> 4;
+
+    if(info->ipVersion == 4) {
+        return parseIpv4(packet->buffer, packet->packetSize, info);
+    } else if(info->ipVersion == 6) {
+        return parseIpv6(packet->buffer, packet->packetSize, info);
+    } else {
+        return 1;
+    }
+}
+
+// Sets the ECN field of an ECN-capable packet to CE. Returns 1 if the packet
+// is not ECN-capable, in which case it has to be dropped instead.
+int packet_setCongestionExperienced(packet_t *packet) {
+    if(packet->packetSize < TUNNEL_PACKET_INFORMATION_SIZE + IPV4_HEADER_MINIMUM_SIZE) {
+        return 1;
+    }
+
+    uint8_t *header = packet->buffer + TUNNEL_PACKET_INFORMATION_SIZE;
+    int ipVersion = header[0] >> 4;
+
+    if(ipVersion == 4) {
+        if((header[1] & 0x03) == 0) {
+            return 1;
+        }
+
+        // Incremental update of the header checksum (RFC 1624)
+        uint16_t oldWord = (header[0] << 8) | header[1];
+        header[1] |= 0x03;
+        uint16_t newWord = (header[0] << 8) | header[1];
+        uint32_t sum = (uint16_t)~((header[10] << 8) | header[11]) + (uint16_t)~oldWord + newWord;
+
+        sum = (sum & 0xffff) + (sum >> 16);
+        sum = (sum & 0xffff) + (sum >> 16);
+        sum = ~sum;
+
+        header[10] = sum >> 8;
+        header[11] = sum;
+    } else if(ipVersion == 6) {
+        if((header[1] & 0x30) == 0) {
+            return 1;
+        }
+
+        header[1] |= 0x30;
+    } else {
+        return 1;
+    }
+
+    return 0;
+}
+
+static uint32_t readLong(const uint8_t *buffer) {
+    return ((uint32_t)buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) | buffer[3];
+}
+
+// Sequence numbers wrap around, so they are compared as in RFC 1982
+static inline bool isAfter(uint32_t sequence, uint32_t reference) {
+    return (int32_t)(sequence - reference) > 0;
+}
+
+static int parseAckOptions(const uint8_t *options, unsigned int size, packet_ack_t *ack) {
+    unsigned int offset = 0;
+
+    ack->sackBlockCount = 0;
+
+    while(offset < size && options[offset] != TCP_OPTION_END) {
+        if(options[offset] == TCP_OPTION_NOP) {
+            offset++;
+            continue;
+        }
+
+        if(offset + 2 > size || options[offset + 1] < 2 || offset + options[offset + 1] > size) {
+            return 1;
+        }
+
+        unsigned int length = options[offset + 1];
+
+        if(options[offset] == TCP_OPTION_SACK) {
+            if((length - 2) % 8 || (length - 2) / 8 > PACKET_MAX_SACK_BLOCK_COUNT) {
+                return 1;
+            }
+
+            for(unsigned int i = 2; i < length; i += 8) {
+                ack->sackBlocks[ack->sackBlockCount][0] = readLong(options + offset + i);
+                ack->sackBlocks[ack->sackBlockCount][1] = readLong(options + offset + i + 4);
+                ack->sackBlockCount++;
+            }
+        } else if(options[offset] != TCP_OPTION_TIMESTAMPS) {
+            return 1;
+        }
+
+        offset += length;
+    }
+
+    return 0;
+}
+
+int packet_parseAck(const packet_t *packet, const packet_info_t *info, packet_ack_t *ack) {
+    if(info->protocol != PACKET_PROTOCOL_TCP || !info->hasPorts || (uint32_t)info->transportOffset + TCP_HEADER_MINIMUM_SIZE > packet->packetSize) {
+        return 1;
+    }
+
+    const uint8_t *header = packet->buffer + info->transportOffset;
+    unsigned int headerSize = (header[12] >> 4) * 4;
+    uint8_t flags = header[13];
+
+    if((flags & ~TCP_FLAG_PSH) != TCP_FLAG_ACK || headerSize < TCP_HEADER_MINIMUM_SIZE || (uint32_t)info->transportOffset + headerSize > packet->packetSize) {
+        return 1;
+    }
+
+    // Padding of short IPv4 packets is not counted, as it is not data
+    if(info->networkOffset + info->ipLength != info->transportOffset + headerSize) {
+        return 1;
+    }
+
+    ack->ackNumber = readLong(header + 8);
+
+    return parseAckOptions(header + TCP_HEADER_MINIMUM_SIZE, headerSize - TCP_HEADER_MINIMUM_SIZE, ack);
+}
+
+static bool isSameConnection(const packet_t *packet, const packet_info_t *info, const packet_t *otherPacket, const packet_info_t *otherInfo) {
+    // Source and destination addresses are contiguous in both IP versions
+    unsigned int addressOffset = info->ipVersion == 4 ? 12 : 8;
+    unsigned int addressesSize = info->ipVersion == 4 ? 8 : 32;
+
+    return info->ipVersion == otherInfo->ipVersion
+        && info->sourcePort == otherInfo->sourcePort
+        && info->destinationPort == otherInfo->destinationPort
+        && !memcmp(packet->buffer + info->networkOffset + addressOffset, otherPacket->buffer + otherInfo->networkOffset + addressOffset, addressesSize);
+}
+
+static bool isSackBlockCovered(const uint32_t *block, const packet_ack_t *ack) {
+    if(!isAfter(block[1], ack->ackNumber)) {
+        return true;
+    }
+
+    for(int i = 0; i < ack->sackBlockCount; i++) {
+        if(!isAfter(ack->sackBlocks[i][0], block[0]) && !isAfter(block[1], ack->sackBlocks[i][1])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool packet_isRedundantAck(const packet_t *olderPacket, const packet_t *newerPacket) {
+    packet_info_t olderInfo;
+    packet_info_t newerInfo;
+    packet_ack_t olderAck;
+    packet_ack_t newerAck;
+
+    if(packet_parse(olderPacket, &olderInfo) || packet_parseAck(olderPacket, &olderInfo, &olderAck)) {
+        return false;
+    }
+
+    if(packet_parse(newerPacket, &newerInfo) || packet_parseAck(newerPacket, &newerInfo, &newerAck)) {
+        return false;
+    }
+
+    if(!isSameConnection(olderPacket, &olderInfo, newerPacket, &newerInfo) || !isAfter(newerAck.ackNumber, olderAck.ackNumber)) {
+        return false;
+    }
+
+    for(int i = 0; i < olderAck.sackBlockCount; i++) {
+        if(!isSackBlockCovered(olderAck.sackBlocks[i], &newerAck)) {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,75 @@
+#ifndef __PACKET_H_INCLUDED__
+#define __PACKET_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The tun device is opened without IFF_NO_PI, so every packet read from it
+// starts with a 4-byte packet information header.
+#define TUNNEL_PACKET_INFORMATION_SIZE 4
+#define TUNNEL_MTU 1500
+#define TUNNEL_MAX_PACKET_SIZE (TUNNEL_MTU + TUNNEL_PACKET_INFORMATION_SIZE)
+
+// Over several paths, datagrams end with a sequence number. Packet buffers
+// have room for it past their size, so that it is written in place.
+#define TUNNEL_SEQUENCE_SIZE 2
+#define TUNNEL_MAX_DATAGRAM_SIZE (TUNNEL_MAX_PACKET_SIZE + TUNNEL_SEQUENCE_SIZE)
+
+// With offloads, packets read from the tun device may be TCP super-packets of
+// up to 64 KiB
+#define TUNNEL_MAX_OFFLOAD_PACKET_SIZE (65535 + TUNNEL_PACKET_INFORMATION_SIZE)
+#define TUNNEL_MAX_CLASS_COUNT 8
+
+#define PACKET_PROTOCOL_TCP 6
+#define PACKET_PROTOCOL_UDP 17
+
+// A TCP header carries at most 4 SACK blocks (3 next to timestamps)
+#define PACKET_MAX_SACK_BLOCK_COUNT 4
+
+// View of a packet stored in a pool buffer
+typedef struct {
+    uint8_t *buffer;
+    uint32_t packetSize;
+    uint32_t bufferSize;
+} packet_t;
+
+// Header fields of a packet, as found by packet_parse(). Offsets are relative
+// to the start of the buffer, packet information header included.
+typedef struct {
+    uint8_t ipVersion;
+    uint8_t protocol;
+    uint8_t dscp;
+    uint8_t ecn;
+    bool hasPorts;
+    uint16_t sourcePort;
+    uint16_t destinationPort;
+    uint32_t flowLabel;
+    uint32_t flowHash;
+    uint32_t ipLength;
+    uint16_t networkOffset;
+    uint16_t transportOffset;
+} packet_info_t;
+
+// Acknowledgment of a pure TCP ACK, as found by packet_parseAck(). SACK
+// blocks are pairs of left and right edges.
+typedef struct {
+    uint32_t ackNumber;
+    int sackBlockCount;
+    uint32_t sackBlocks[PACKET_MAX_SACK_BLOCK_COUNT][2];
+} packet_ack_t;
+
+int packet_parse(const packet_t *packet, packet_info_t *info);
+int packet_setCongestionExperienced(packet_t *packet);
+
+// Returns 1 if the packet is not a pure ACK that a newer one may replace: it
+// has to carry no data, no other flag than ACK and PSH, and no other option
+// than timestamps and SACK.
+int packet_parseAck(const packet_t *packet, const packet_info_t *info, packet_ack_t *ack);
+
+// Tells whether a pure ACK makes an older one of the same connection useless:
+// it acknowledges more, and everything the older one selectively
+// acknowledged. Duplicate ACKs are never redundant, as they trigger fast
+// retransmit.
+bool packet_isRedundantAck(const packet_t *olderPacket, const packet_t *newerPacket);
+
+#endif
@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include <packet.h>
+#include <path.h>
+
+int path_init(path_t *path, const struct sockaddr_in *address, struct in_addr localAddress, int linkType, int overhead, int mpu, int bandwidth, uint64_t now) {
+    memcpy(&path->address, address, sizeof(struct sockaddr_in));
+    path->localAddress = localAddress;
+    pacer_initLink(&path->link, linkType, overhead, mpu);
+    path->bandwidth = bandwidth;
+    atomic_init(&path->delay, PATH_UNKNOWN_DELAY);
+    atomic_init(&path->probeTimestamp, 0);
+
+    return pacer_init(&path->pacer, bandwidth, pacer_getDefaultBurst(bandwidth, pacer_getWireSize(&path->link, TUNNEL_MAX_PACKET_SIZE)), now);
+}
+
+int path_find(const path_t *paths, int count, const struct sockaddr_in *address) {
+    for(int i = 0; i < count; i++) {
+        if(paths[i].address.sin_addr.s_addr == address->sin_addr.s_addr && paths[i].address.sin_port == address->sin_port) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// A datagram reaches the other end once the path has paid for it at its rate,
+// plus the delay of the path. Paths in debt are then only used when their
+// delay makes up for it, and each path ends up carrying its share of the
+// total rate. Delays are only compared once every path has been measured.
+int path_select(path_t *paths, int count, uint32_t size, uint64_t now) {
+    int64_t delays[PATH_MAX_COUNT];
+    int64_t minimumDelay = INT64_MAX;
+    int selected = 0;
+    uint64_t earliestArrival = UINT64_MAX;
+
+    for(int i = 0; i < count; i++) {
+        delays[i] = atomic_load_explicit(&paths[i].delay, memory_order_relaxed);
+
+        if(delays[i] == PATH_UNKNOWN_DELAY) {
+            minimumDelay = PATH_UNKNOWN_DELAY;
+        } else if(minimumDelay != PATH_UNKNOWN_DELAY && delays[i] < minimumDelay) {
+            minimumDelay = delays[i];
+        }
+    }
+
+    for(int i = 0; i < count; i++) {
+        pacer_t *pacer = &paths[i].pacer;
+        int64_t owed = (int64_t)pacer_getWireSize(&paths[i].link, size) * PACER_CREDIT_SCALE;
+        uint64_t arrival = 0;
+
+        pacer_refill(pacer, now);
+
+        if(owed > pacer->credit) {
+            arrival = (owed - pacer->credit) / pacer->rate;
+        }
+
+        if(minimumDelay != PATH_UNKNOWN_DELAY) {
+            arrival += delays[i] - minimumDelay;
+        }
+
+        if(arrival < earliestArrival) {
+            earliestArrival = arrival;
+            selected = i;
+        }
+    }
+
+    pacer_consume(&paths[selected].pacer, pacer_getWireSize(&paths[selected].link, size));
+
+    return selected;
+}
+
+void path_updateDelay(path_t *path, int64_t delay) {
+    int64_t smoothedDelay = atomic_load_explicit(&path->delay, memory_order_relaxed);
+
+    if(smoothedDelay != PATH_UNKNOWN_DELAY) {
+        delay = smoothedDelay + ((delay - smoothedDelay) >> PATH_DELAY_GAIN_SHIFT);
+    }
+
+    atomic_store_explicit(&path->delay, delay, memory_order_relaxed);
+}
+
+size_t path_writeSource(const path_t *path, struct cmsghdr *cmsg) {
+    if(path->localAddress.s_addr == INADDR_ANY) {
+        return 0;
+    }
+
+    struct in_pktinfo info = {
+        .ipi_spec_dst = path->localAddress
+    };
+
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(info));
+    memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+
+    return PATH_SOURCE_CONTROL_SIZE;
+}
+
+struct in_addr path_readDestination(struct msghdr *message) {
+    struct in_addr address = {
+        .s_addr = INADDR_ANY
+    };
+
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(message); cmsg; cmsg = CMSG_NXTHDR(message, cmsg)) {
+        if(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            struct in_pktinfo info;
+
+            memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+            address = info.ipi_addr;
+        }
+    }
+
+    return address;
+}
+
+ssize_t path_send(int sock_fd, const path_t *path, const void *buffer, size_t size) {
+    struct {
+        _Alignas(struct cmsghdr) char buffer[PATH_SOURCE_CONTROL_SIZE];
+    } control;
+    struct iovec iovec = {
+        .iov_base = (void *)buffer,
+        .iov_len = size
+    };
+    struct msghdr message = {
+        .msg_name = (void *)&path->address,
+        .msg_namelen = sizeof(struct sockaddr_in),
+        .msg_iov = &iovec,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer
+    };
+
+    message.msg_controllen = path_writeSource(path, (struct cmsghdr *)control.buffer);
+
+    if(!message.msg_controllen) {
+        message.msg_control = NULL;
+    }
+
+    return sendmsg(sock_fd, &message, 0);
+}
@@ -0,0 +1,68 @@
+#ifndef __PATH_H_INCLUDED__
+#define __PATH_H_INCLUDED__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <pacer.h>
+
+// A tunnel may be bonded over several paths, each one being a pair of
+// addresses that goes through its own uplink
+#define PATH_MAX_COUNT 4
+
+// Space of the control message that gives the source address of a datagram
+#define PATH_SOURCE_CONTROL_SIZE CMSG_SPACE(sizeof(struct in_pktinfo))
+
+// Delay of a path that has not been measured yet
+#define PATH_UNKNOWN_DELAY INT64_MIN
+
+// Weight of a new sample in the smoothed delay of a path, as a shift (1/8,
+// the gain of the smoothed RTT of TCP)
+#define PATH_DELAY_GAIN_SHIFT 3
+
+// The pacer of a path does not hold packets back, the pacer of the tunnel
+// does that for all of them at the sum of their rates. It only tells how far
+// ahead of its rate the path is, which the scheduler weighs against its
+// delay.
+typedef struct {
+    struct sockaddr_in address;
+    struct in_addr localAddress;
+    pacer_link_t link;
+    pacer_t pacer;
+    int bandwidth;
+
+    // One-way delay, smoothed, on the clock of the receiving end minus the
+    // clock of the sending end. The clocks are not synchronized, so only the
+    // differences between the delays of the paths mean something.
+    _Atomic int64_t delay;
+
+    // Clock of the last probe sent on the path, to match its reply
+    _Atomic uint64_t probeTimestamp;
+} path_t;
+
+int path_init(path_t *path, const struct sockaddr_in *address, struct in_addr localAddress, int linkType, int overhead, int mpu, int bandwidth, uint64_t now);
+
+// Returns the index of the path of the given remote address, or -1
+int path_find(const path_t *paths, int count, const struct sockaddr_in *address);
+
+// Picks the path a datagram of that size reaches the other end the soonest
+// on, and charges its pacer for it
+int path_select(path_t *paths, int count, uint32_t size, uint64_t now);
+
+void path_updateDelay(path_t *path, int64_t delay);
+
+// Writes the control message that makes a datagram leave from the local
+// address of the path, if it has one. Returns the size it takes.
+size_t path_writeSource(const path_t *path, struct cmsghdr *cmsg);
+
+// Returns the local address a datagram was received on, from its IP_PKTINFO
+// control message, or INADDR_ANY
+struct in_addr path_readDestination(struct msghdr *message);
+
+// Sends a datagram that is not paced (handshakes and probes) on a path
+ssize_t path_send(int sock_fd, const path_t *path, const void *buffer, size_t size);
+
+#endif
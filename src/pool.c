@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include <pool.h>
+
+#define POOL_CACHE_LINE_SIZE 64
+#define POOL_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#define alignToCacheLine(x) (((x) + POOL_CACHE_LINE_SIZE - 1) & ~(size_t)(POOL_CACHE_LINE_SIZE - 1))
+
+static const unsigned int sizeClasses[POOL_SIZE_CLASS_COUNT] = POOL_SIZE_CLASSES;
+static const unsigned int smallClassShares[POOL_SIZE_CLASS_COUNT - 1] = POOL_SMALL_CLASS_SHARES;
+
+static inline size_t getSlotSize(int sizeClass) {
+    return alignToCacheLine(sizeof(queue_element_t)) + alignToCacheLine(sizeClasses[sizeClass] + TUNNEL_SEQUENCE_SIZE);
+}
+
+static void *allocateArena(size_t *size) {
+    // Explicit huge pages are only available if the administrator reserved
+    // some, so fall back to regular pages and ask for transparent huge pages.
+    if(*size >= POOL_HUGE_PAGE_SIZE) {
+        size_t hugeSize = (*size + POOL_HUGE_PAGE_SIZE - 1) & ~(size_t)(POOL_HUGE_PAGE_SIZE - 1);
+        void *arena = mmap(NULL, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if(arena != MAP_FAILED) {
+            *size = hugeSize;
+            return arena;
+        }
+    }
+
+    void *arena = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(arena == MAP_FAILED) {
+        return NULL;
+    }
+
+    madvise(arena, *size, MADV_HUGEPAGE);
+
+    return arena;
+}
+
+int pool_init(pool_t *pool, unsigned int capacity, unsigned int bandwidth, unsigned int maximumPacketSize) {
+    pool->readSizeClass = -1;
+
+    for(int c = 0; c < POOL_SIZE_CLASS_COUNT; c++) {
+        if(sizeClasses[c] >= maximumPacketSize) {
+            pool->readSizeClass = c;
+            break;
+        }
+    }
+
+    if(pool->readSizeClass == -1) {
+        fprintf(stderr, "pool_init() failed because the maximum packet size (%u) is larger than the largest size class.\n", maximumPacketSize);
+        return 1;
+    }
+
+    // A packet whose class has run out stays in the buffer it was read into
+    // (see pool_copybreak()), or takes one of the next larger class (see
+    // pool_getForSize()).
+    uint64_t budget = capacity + (uint64_t)bandwidth * POOL_HEADROOM_DURATION / 1000000000;
+    uint64_t readClassBudget = budget;
+
+    pool->arenaSize = 0;
+    pool->elementCount = 0;
+
+    for(int c = 0; c < POOL_SIZE_CLASS_COUNT; c++) {
+        uint64_t classBudget = 0;
+
+        if(c < pool->readSizeClass) {
+            classBudget = budget * smallClassShares[c] / POOL_SHARE_UNIT;
+            readClassBudget -= classBudget;
+        } else if(c == pool->readSizeClass) {
+            classBudget = readClassBudget;
+        }
+
+        if(classBudget) {
+            uint64_t elementCount = (classBudget + sizeClasses[c] - 1) / sizeClasses[c];
+            unsigned int minimumElementCount = sizeClasses[c] > TUNNEL_MAX_PACKET_SIZE ? POOL_MINIMUM_SUPER_PACKET_ELEMENTS : POOL_MINIMUM_CLASS_ELEMENTS;
+
+            pool->elementCounts[c] = elementCount > minimumElementCount ? elementCount : minimumElementCount;
+        } else {
+            pool->elementCounts[c] = 0;
+        }
+
+        pool->arenaSize += pool->elementCounts[c] * getSlotSize(c);
+        pool->elementCount += pool->elementCounts[c];
+    }
+
+    pool->arena = allocateArena(&pool->arenaSize);
+
+    if(!pool->arena) {
+        perror("An error occurred while allocating memory for packet pool");
+        return 1;
+    }
+
+    uint8_t *slot = pool->arena;
+
+    for(int c = 0; c < POOL_SIZE_CLASS_COUNT; c++) {
+        if(ring_init(&pool->freeRings[c], pool->elementCounts[c])) {
+            fprintf(stderr, "ring_init() failed while creating pool ring %d.\n", c);
+
+            for(int i = 0; i < c; i++) {
+                ring_destroy(&pool->freeRings[i]);
+            }
+
+            munmap(pool->arena, pool->arenaSize);
+
+            return 1;
+        }
+
+        for(unsigned int i = 0; i < pool->elementCounts[c]; i++) {
+            queue_element_t *element = (queue_element_t *)slot;
+
+            element->packet.buffer = slot + alignToCacheLine(sizeof(queue_element_t));
+            element->packet.bufferSize = sizeClasses[c];
+            element->packet.packetSize = 0;
+            element->segmentSize = 0;
+            element->sizeClass = c;
+            element->next = NULL;
+            element->pool = pool;
+
+            ring_push(&pool->freeRings[c], element);
+
+            slot += getSlotSize(c);
+        }
+    }
+
+    return 0;
+}
+
+void pool_destroy(pool_t *pool) {
+    for(int c = 0; c < POOL_SIZE_CLASS_COUNT; c++) {
+        ring_destroy(&pool->freeRings[c]);
+    }
+
+    munmap(pool->arena, pool->arenaSize);
+    pool->arena = NULL;
+    pool->arenaSize = 0;
+    pool->elementCount = 0;
+}
+
+// Packets are always read into a buffer of the largest size class in use. A
+// small packet is then copied into a buffer of the smallest size class that
+// fits it, like the copybreak of network drivers, so that a 40-byte ACK does
+// not hold a full MTU-sized buffer while it waits in the queue. The large
+// buffer stays with the reader for the next packet.
+queue_element_t *pool_copybreak(pool_t *pool, queue_element_t *element) {
+    uint32_t packetSize = element->packet.packetSize;
+
+    for(int c = 0; c < element->sizeClass; c++) {
+        if(packetSize <= sizeClasses[c]) {
+            queue_element_t *smallElement = ring_pop(&pool->freeRings[c]);
+
+            if(smallElement) {
+                memcpy(smallElement->packet.buffer, element->packet.buffer, packetSize);
+                smallElement->packet.packetSize = packetSize;
+                return smallElement;
+            }
+        }
+    }
+
+    return element;
+}
+
+// For a producer that reads packets before it knows which pool they go to:
+// returns a free element of the smallest size class that can hold the packet.
+queue_element_t *pool_getForSize(pool_t *pool, uint32_t packetSize) {
+    for(int c = 0; c <= pool->readSizeClass; c++) {
+        if(packetSize <= sizeClasses[c]) {
+            queue_element_t *element = ring_pop(&pool->freeRings[c]);
+
+            if(element) {
+                return element;
+            }
+        }
+    }
+
+    return NULL;
+}
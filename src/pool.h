@@ -0,0 +1,86 @@
+#ifndef __POOL_H_INCLUDED__
+#define __POOL_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <packet.h>
+#include <ring.h>
+
+#define POOL_SIZE_CLASS_COUNT 4
+
+// Slots also hold the sequence number past the buffer, so the small classes
+// leave room for it in their cache lines
+#define POOL_SIZE_CLASSES {128 - TUNNEL_SEQUENCE_SIZE, 576 - TUNNEL_SEQUENCE_SIZE, TUNNEL_MAX_PACKET_SIZE, TUNNEL_MAX_OFFLOAD_PACKET_SIZE}
+
+// The pool has to hold the queue capacity plus what is in flight between the
+// reader and the pacer, which is estimated as this much time at the shaping
+// rate.
+#define POOL_HEADROOM_DURATION 50000000
+#define POOL_MINIMUM_CLASS_ELEMENTS 32
+
+// A super-packet holds as much as dozens of packets, so fewer of them are
+// enough for the reader to go on while some are queued
+#define POOL_MINIMUM_SUPER_PACKET_ELEMENTS 8
+
+// The size classes share one byte budget. Each class below the one packets
+// are read into gets this many 64ths of it, and that class the rest. ACKs are
+// many but small, and few packets fall between them and the MTU. With
+// offloads, the MTU class holds everything but TCP next to the super-packets.
+#define POOL_SMALL_CLASS_SHARES {11, 1, 24}
+#define POOL_SHARE_UNIT 64
+
+struct queue_element_s;
+struct pool_s;
+
+typedef struct queue_element_s {
+    packet_t packet;
+    struct queue_element_s *next;
+    struct pool_s *pool;
+    uint64_t enqueueTimestamp;
+    uint32_t flowHash;
+
+    // A super-packet gives the size of its segments and of the IP and TCP
+    // headers that each of them repeats. The segment size is 0 for a regular
+    // packet.
+    uint16_t segmentSize;
+    uint16_t headerSize;
+    uint8_t sizeClass;
+
+    // Set by the producer on pure TCP ACKs that a newer ACK of the same
+    // connection may replace while they are queued
+    bool pureAck;
+} queue_element_t;
+
+// Packet buffers are carved out of one contiguous arena. Each slot holds the
+// element header immediately followed by the packet data, and slots of the
+// same size class are adjacent. Free slots of each size class are handed
+// back from the consumer to the producer through a ring. Each element points
+// back to its pool, as there is one pool per producer.
+typedef struct pool_s {
+    uint8_t *arena;
+    size_t arenaSize;
+    ring_t freeRings[POOL_SIZE_CLASS_COUNT];
+    unsigned int elementCounts[POOL_SIZE_CLASS_COUNT];
+    unsigned int elementCount;
+    int readSizeClass;
+} pool_t;
+
+int pool_init(pool_t *pool, unsigned int capacity, unsigned int bandwidth, unsigned int maximumPacketSize);
+void pool_destroy(pool_t *pool);
+
+// Producer side
+queue_element_t *pool_copybreak(pool_t *pool, queue_element_t *element);
+queue_element_t *pool_getForSize(pool_t *pool, uint32_t packetSize);
+
+static inline queue_element_t *pool_get(pool_t *pool) {
+    return ring_pop(&pool->freeRings[pool->readSizeClass]);
+}
+
+// Consumer side
+static inline void pool_release(queue_element_t *element) {
+    ring_push(&element->pool->freeRings[element->sizeClass], element);
+}
+
+#endif
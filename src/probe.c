@@ -0,0 +1,92 @@
+#include <probe.h>
+
+void probe_initController(probe_controller_t *controller, uint32_t rate, uint32_t minimumRate, uint32_t maximumRate) {
+    controller->rate = rate;
+    controller->minimumRate = minimumRate;
+    controller->maximumRate = maximumRate;
+
+    for(int i = 0; i < PROBE_BASE_DELAY_BUCKET_COUNT; i++) {
+        controller->baseDelays[i] = INT64_MAX;
+    }
+
+    controller->baseDelayIndex = 0;
+    controller->baseDelayTimestamp = 0;
+    controller->lastByteCount = 0;
+    controller->lastTimestamp = 0;
+    controller->holdUntil = 0;
+}
+
+// Records the delay in the current bucket, and returns the smallest delay of
+// all the buckets
+static int64_t updateBaseDelay(probe_controller_t *controller, int64_t delay, uint64_t timestamp) {
+    if(timestamp - controller->baseDelayTimestamp >= PROBE_BASE_DELAY_BUCKET_DURATION) {
+        controller->baseDelayIndex = (controller->baseDelayIndex + 1) % PROBE_BASE_DELAY_BUCKET_COUNT;
+        controller->baseDelays[controller->baseDelayIndex] = INT64_MAX;
+        controller->baseDelayTimestamp = timestamp;
+    }
+
+    if(delay < controller->baseDelays[controller->baseDelayIndex]) {
+        controller->baseDelays[controller->baseDelayIndex] = delay;
+    }
+
+    int64_t baseDelay = INT64_MAX;
+
+    for(int i = 0; i < PROBE_BASE_DELAY_BUCKET_COUNT; i++) {
+        if(controller->baseDelays[i] < baseDelay) {
+            baseDelay = controller->baseDelays[i];
+        }
+    }
+
+    return baseDelay;
+}
+
+static uint32_t clampRate(const probe_controller_t *controller, uint64_t rate) {
+    if(rate < controller->minimumRate) {
+        return controller->minimumRate;
+    }
+
+    if(rate > controller->maximumRate) {
+        return controller->maximumRate;
+    }
+
+    return rate;
+}
+
+bool probe_update(probe_controller_t *controller, int64_t delay, uint64_t byteCount, uint64_t timestamp) {
+    int64_t queueingDelay = delay - updateBaseDelay(controller, delay, timestamp);
+
+    // Replies that come out of order are too late to tell the delivery rate
+    if(controller->lastTimestamp && (int64_t)(timestamp - controller->lastTimestamp) <= 0) {
+        return false;
+    }
+
+    uint64_t interval = timestamp - controller->lastTimestamp;
+    uint64_t deliveryRate = (byteCount - controller->lastByteCount) * 1000000000 / interval;
+    bool firstSample = !controller->lastTimestamp;
+
+    controller->lastByteCount = byteCount;
+    controller->lastTimestamp = timestamp;
+
+    if(firstSample || timestamp < controller->holdUntil) {
+        return false;
+    }
+
+    uint32_t rate = controller->rate;
+
+    if(queueingDelay > PROBE_DELAY_THRESHOLD) {
+        uint64_t achievedRate = deliveryRate < rate ? deliveryRate : rate;
+
+        rate = clampRate(controller, achievedRate * (100 - PROBE_DECREASE) / 100);
+        controller->holdUntil = timestamp + PROBE_DECREASE_HOLD;
+    } else if(deliveryRate * 100 >= (uint64_t)rate * PROBE_LOAD_THRESHOLD) {
+        rate = clampRate(controller, (uint64_t)rate * (100 + PROBE_INCREASE) / 100);
+    }
+
+    if(rate == controller->rate) {
+        return false;
+    }
+
+    controller->rate = rate;
+
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef __PROBE_H_INCLUDED__
+#define __PROBE_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The client sends a timestamped probe this often, and the reply of the
+// server gives one sample of each direction: the one-way delay of the probe
+// or of the reply, and how many bytes the receiving end got so far.
+#define PROBE_INTERVAL 100000000
+
+// Queueing delay above which the bottleneck of a direction is deemed to be
+// in a buffer outside the tunnel, and the rate is cut
+#define PROBE_DELAY_THRESHOLD 15000000
+
+// The clocks of the two ends are not synchronized, so a one-way delay is
+// only known up to a constant: the queueing delay is how far it is above the
+// smallest delay seen in the last buckets. Old buckets are forgotten so that
+// the base follows route changes and the drift between the clocks.
+#define PROBE_BASE_DELAY_BUCKET_COUNT 6
+#define PROBE_BASE_DELAY_BUCKET_DURATION 10000000000
+
+// Without bloat, a direction whose delivery rate reaches this share of its
+// rate (in percent) may have more: its rate is raised by the increase at each
+// sample. With bloat, the rate is cut to the delivery rate, minus the
+// decrease, then held for a while so that the queue has time to drain.
+#define PROBE_LOAD_THRESHOLD 75
+#define PROBE_INCREASE 5
+#define PROBE_DECREASE 10
+#define PROBE_DECREASE_HOLD 300000000
+
+// Rate controller of one direction, in bytes per second
+typedef struct {
+    uint32_t rate;
+    uint32_t minimumRate;
+    uint32_t maximumRate;
+    int64_t baseDelays[PROBE_BASE_DELAY_BUCKET_COUNT];
+    int baseDelayIndex;
+    uint64_t baseDelayTimestamp;
+    uint64_t lastByteCount;
+    uint64_t lastTimestamp;
+    uint64_t holdUntil;
+} probe_controller_t;
+
+void probe_initController(probe_controller_t *controller, uint32_t rate, uint32_t minimumRate, uint32_t maximumRate);
+
+// Takes one sample: the one-way delay of a probe, and the number of bytes
+// received in total by the timestamp, both on the clock of the receiving end.
+// Returns true if the rate changed.
+bool probe_update(probe_controller_t *controller, int64_t delay, uint64_t byteCount, uint64_t timestamp);
+
+#endif
@@ -0,0 +1,294 @@
+#ifndef __PROTOCOL_H_INCLUDED__
+#define __PROTOCOL_H_INCLUDED__
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+
+#include <packet.h>
+
+// Every datagram exchanged between the client and the server starts with this
+// header. Packets read from the tun device start with a packet information
+// header of the same size, which the receiver rebuilds from the IP version,
+// so the tunnel header is written over it and packets are sent in place.
+#define PROTOCOL_HEADER_SIZE TUNNEL_PACKET_INFORMATION_SIZE
+
+#define PROTOCOL_TYPE_HANDSHAKE 1
+#define PROTOCOL_TYPE_DATA 2
+#define PROTOCOL_TYPE_AGGREGATE 3
+#define PROTOCOL_TYPE_PROBE 4
+#define PROTOCOL_TYPE_PROBE_REPLY 5
+
+// Session ID of a handshake request, as the server has not assigned one yet
+#define PROTOCOL_NO_SESSION 0
+
+// A handshake carries the bandwidth (32 bits) and the overhead (8 bits) that
+// the server has to shape the session with, then the link layer (8 bits) and
+// the MPU (8 bits). These two are left out when they are the defaults
+// (ethernet, no MPU), so that older servers still understand the handshake.
+#define PROTOCOL_HANDSHAKE_SIZE (PROTOCOL_HEADER_SIZE + 5)
+#define PROTOCOL_LINK_HANDSHAKE_SIZE (PROTOCOL_HANDSHAKE_SIZE + 2)
+
+// Flags of a handshake: the client asks for the features it wants, and the
+// server answers with the ones it agrees to
+#define PROTOCOL_FLAG_AGGREGATE 0x01
+#define PROTOCOL_FLAG_PROBE 0x02
+#define PROTOCOL_FLAG_MULTIPATH 0x04
+
+// With several paths, the client opens the session on the first one, then
+// sends on each other path a handshake with the session ID, that gives the
+// bandwidth and the overhead of the path. Every data packet and aggregate
+// then ends with its sequence number (16 bits), so that the receiver puts
+// them back in order.
+
+// With probes, the client sends its clock (64 bits) and the rate that the
+// server has to shape the session with from now on (32 bits, 0 to keep it).
+// The server answers at once with the clock of the probe, its own clock and
+// the number of bytes it received from the session so far (64 bits each).
+// The bandwidth of the handshake is then the highest rate allowed.
+#define PROTOCOL_PROBE_SIZE (PROTOCOL_HEADER_SIZE + 12)
+#define PROTOCOL_PROBE_REPLY_SIZE (PROTOCOL_HEADER_SIZE + 24)
+
+// An aggregate carries several small packets in one datagram. After the
+// header, each packet comes after a prefix of the size of a packet
+// information header that gives its length, so the receiver turns the
+// prefixes back into packet information headers and writes the packets
+// where they are. Every packet has at least an IPv4 header, which bounds the
+// number of packets of an aggregate.
+#define PROTOCOL_AGGREGATE_PREFIX_SIZE TUNNEL_PACKET_INFORMATION_SIZE
+#define PROTOCOL_MAX_AGGREGATED_PACKETS ((TUNNEL_MAX_PACKET_SIZE - PROTOCOL_HEADER_SIZE) / (PROTOCOL_AGGREGATE_PREFIX_SIZE + 20))
+
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t sessionId;
+} protocol_header_t;
+
+typedef struct {
+    uint32_t bandwidth;
+    uint8_t overhead;
+    uint8_t linkType;
+    uint8_t mpu;
+    uint8_t flags;
+} protocol_handshake_t;
+
+typedef struct {
+    uint64_t timestamp;
+    uint32_t bandwidth;
+} protocol_probe_t;
+
+typedef struct {
+    uint64_t probeTimestamp;
+    uint64_t timestamp;
+    uint64_t receivedBytes;
+} protocol_probe_reply_t;
+
+static inline void protocol_writeHeader(uint8_t *buffer, uint8_t type, uint16_t sessionId) {
+    uint16_t networkSessionId = htons(sessionId);
+
+    buffer[0] = type;
+    buffer[1] = 0;
+    memcpy(buffer + 2, &networkSessionId, sizeof(networkSessionId));
+}
+
+// Returns 1 if the datagram is too short to hold a header
+static inline int protocol_readHeader(const uint8_t *buffer, size_t size, protocol_header_t *header) {
+    uint16_t networkSessionId;
+
+    if(size < PROTOCOL_HEADER_SIZE) {
+        return 1;
+    }
+
+    memcpy(&networkSessionId, buffer + 2, sizeof(networkSessionId));
+
+    header->type = buffer[0];
+    header->flags = buffer[1];
+    header->sessionId = ntohs(networkSessionId);
+
+    return 0;
+}
+
+// Appends the sequence number to a datagram, in the room that packet buffers
+// have for it. Returns the new size of the datagram.
+static inline uint32_t protocol_writeSequence(uint8_t *buffer, uint32_t size, uint16_t sequence) {
+    uint16_t networkSequence = htons(sequence);
+
+    memcpy(buffer + size, &networkSequence, sizeof(networkSequence));
+
+    return size + TUNNEL_SEQUENCE_SIZE;
+}
+
+// Removes the sequence number from the end of a datagram. Returns 1 if the
+// datagram is too short to hold one after its header.
+static inline int protocol_readSequence(const uint8_t *buffer, uint32_t *size, uint16_t *sequence) {
+    uint16_t networkSequence;
+
+    if(*size < PROTOCOL_HEADER_SIZE + TUNNEL_SEQUENCE_SIZE) {
+        return 1;
+    }
+
+    *size -= TUNNEL_SEQUENCE_SIZE;
+    memcpy(&networkSequence, buffer + *size, sizeof(networkSequence));
+    *sequence = ntohs(networkSequence);
+
+    return 0;
+}
+
+// Turns the tunnel header of a data packet back into the packet information
+// header that the tun device expects.
+static inline void protocol_restorePacketInformation(uint8_t *buffer, size_t size) {
+    uint16_t protocol = htons(ETH_P_IP);
+
+    if(size > PROTOCOL_HEADER_SIZE && buffer[PROTOCOL_HEADER_SIZE] >> 4 == 6) {
+        protocol = htons(ETH_P_IPV6);
+    }
+
+    buffer[0] = 0;
+    buffer[1] = 0;
+    memcpy(buffer + 2, &protocol, sizeof(protocol));
+}
+
+// Writes the prefix of a packet of the given size (prefix included) in an
+// aggregate
+static inline void protocol_writeAggregatePrefix(uint8_t *buffer, uint32_t size) {
+    uint16_t networkSize = htons(size - PROTOCOL_AGGREGATE_PREFIX_SIZE);
+
+    buffer[0] = 0;
+    buffer[1] = 0;
+    memcpy(buffer + 2, &networkSize, sizeof(networkSize));
+}
+
+// Turns the prefixes of an aggregate into packet information headers and
+// gives where each packet is. Returns the number of packets, or 0 if the
+// aggregate is malformed.
+static inline int protocol_splitAggregate(uint8_t *buffer, size_t size, struct iovec *packets) {
+    size_t offset = PROTOCOL_HEADER_SIZE;
+    int count = 0;
+
+    while(offset < size) {
+        uint16_t networkSize;
+
+        if(count == PROTOCOL_MAX_AGGREGATED_PACKETS || offset + PROTOCOL_AGGREGATE_PREFIX_SIZE >= size) {
+            return 0;
+        }
+
+        memcpy(&networkSize, buffer + offset + 2, sizeof(networkSize));
+
+        size_t packetSize = PROTOCOL_AGGREGATE_PREFIX_SIZE + ntohs(networkSize);
+
+        if(packetSize == PROTOCOL_AGGREGATE_PREFIX_SIZE || offset + packetSize > size) {
+            return 0;
+        }
+
+        protocol_restorePacketInformation(buffer + offset, packetSize);
+        packets[count].iov_base = buffer + offset;
+        packets[count].iov_len = packetSize;
+        count++;
+        offset += packetSize;
+    }
+
+    return count;
+}
+
+// Returns the size of the handshake
+static inline size_t protocol_writeHandshake(uint8_t *buffer, uint16_t sessionId, const protocol_handshake_t *handshake) {
+    uint32_t networkBandwidth = htonl(handshake->bandwidth);
+
+    protocol_writeHeader(buffer, PROTOCOL_TYPE_HANDSHAKE, sessionId);
+    buffer[1] = handshake->flags;
+    memcpy(buffer + PROTOCOL_HEADER_SIZE, &networkBandwidth, sizeof(networkBandwidth));
+    buffer[PROTOCOL_HEADER_SIZE + 4] = handshake->overhead;
+
+    if(!handshake->linkType && !handshake->mpu) {
+        return PROTOCOL_HANDSHAKE_SIZE;
+    }
+
+    buffer[PROTOCOL_HANDSHAKE_SIZE] = handshake->linkType;
+    buffer[PROTOCOL_HANDSHAKE_SIZE + 1] = handshake->mpu;
+
+    return PROTOCOL_LINK_HANDSHAKE_SIZE;
+}
+
+// Returns 1 if the datagram is not a valid handshake
+static inline int protocol_readHandshake(const uint8_t *buffer, size_t size, uint16_t *sessionId, protocol_handshake_t *handshake) {
+    protocol_header_t header;
+    uint32_t networkBandwidth;
+
+    if((size != PROTOCOL_HANDSHAKE_SIZE && size != PROTOCOL_LINK_HANDSHAKE_SIZE) || protocol_readHeader(buffer, size, &header) || header.type != PROTOCOL_TYPE_HANDSHAKE) {
+        return 1;
+    }
+
+    memcpy(&networkBandwidth, buffer + PROTOCOL_HEADER_SIZE, sizeof(networkBandwidth));
+
+    *sessionId = header.sessionId;
+    handshake->bandwidth = ntohl(networkBandwidth);
+    handshake->overhead = buffer[PROTOCOL_HEADER_SIZE + 4];
+    handshake->linkType = size == PROTOCOL_LINK_HANDSHAKE_SIZE ? buffer[PROTOCOL_HANDSHAKE_SIZE] : 0;
+    handshake->mpu = size == PROTOCOL_LINK_HANDSHAKE_SIZE ? buffer[PROTOCOL_HANDSHAKE_SIZE + 1] : 0;
+    handshake->flags = header.flags;
+
+    return 0;
+}
+
+static inline void protocol_writeUint64(uint8_t *buffer, uint64_t value) {
+    uint64_t networkValue = htobe64(value);
+
+    memcpy(buffer, &networkValue, sizeof(networkValue));
+}
+
+static inline uint64_t protocol_readUint64(const uint8_t *buffer) {
+    uint64_t networkValue;
+
+    memcpy(&networkValue, buffer, sizeof(networkValue));
+
+    return be64toh(networkValue);
+}
+
+static inline void protocol_writeProbe(uint8_t *buffer, uint16_t sessionId, const protocol_probe_t *probe) {
+    uint32_t networkBandwidth = htonl(probe->bandwidth);
+
+    protocol_writeHeader(buffer, PROTOCOL_TYPE_PROBE, sessionId);
+    protocol_writeUint64(buffer + PROTOCOL_HEADER_SIZE, probe->timestamp);
+    memcpy(buffer + PROTOCOL_HEADER_SIZE + 8, &networkBandwidth, sizeof(networkBandwidth));
+}
+
+// Returns 1 if the datagram is not a valid probe
+static inline int protocol_readProbe(const uint8_t *buffer, size_t size, protocol_probe_t *probe) {
+    uint32_t networkBandwidth;
+
+    if(size != PROTOCOL_PROBE_SIZE || buffer[0] != PROTOCOL_TYPE_PROBE) {
+        return 1;
+    }
+
+    memcpy(&networkBandwidth, buffer + PROTOCOL_HEADER_SIZE + 8, sizeof(networkBandwidth));
+
+    probe->timestamp = protocol_readUint64(buffer + PROTOCOL_HEADER_SIZE);
+    probe->bandwidth = ntohl(networkBandwidth);
+
+    return 0;
+}
+
+static inline void protocol_writeProbeReply(uint8_t *buffer, uint16_t sessionId, const protocol_probe_reply_t *reply) {
+    protocol_writeHeader(buffer, PROTOCOL_TYPE_PROBE_REPLY, sessionId);
+    protocol_writeUint64(buffer + PROTOCOL_HEADER_SIZE, reply->probeTimestamp);
+    protocol_writeUint64(buffer + PROTOCOL_HEADER_SIZE + 8, reply->timestamp);
+    protocol_writeUint64(buffer + PROTOCOL_HEADER_SIZE + 16, reply->receivedBytes);
+}
+
+// Returns 1 if the datagram is not a valid probe reply
+static inline int protocol_readProbeReply(const uint8_t *buffer, size_t size, protocol_probe_reply_t *reply) {
+    if(size != PROTOCOL_PROBE_REPLY_SIZE || buffer[0] != PROTOCOL_TYPE_PROBE_REPLY) {
+        return 1;
+    }
+
+    reply->probeTimestamp = protocol_readUint64(buffer + PROTOCOL_HEADER_SIZE);
+    reply->timestamp = protocol_readUint64(buffer + PROTOCOL_HEADER_SIZE + 8);
+    reply->receivedBytes = protocol_readUint64(buffer + PROTOCOL_HEADER_SIZE + 16);
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,703 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <common.h>
+#include <log.h>
+#include <queue.h>
+
+static inline void pushFlow(queue_flow_list_t *list, queue_flow_t *flow) {
+    flow->nextActive = NULL;
+
+    if(list->tail) {
+        list->tail->nextActive = flow;
+    } else {
+        list->head = flow;
+    }
+
+    list->tail = flow;
+}
+
+static inline void popFlow(queue_flow_list_t *list) {
+    list->head = list->head->nextActive;
+
+    if(!list->head) {
+        list->tail = NULL;
+    }
+}
+
+static inline void pushClassElement(queue_t *queue, int priority, queue_element_t *element) {
+    queue_class_t *class = &queue->classes[priority];
+    queue_flow_t *flow = &class->flows[element->flowHash % QUEUE_FLOW_COUNT];
+
+    element->next = NULL;
+
+    if(flow->tail) {
+        flow->tail->next = element;
+    } else {
+        flow->head = element;
+    }
+
+    flow->tail = element;
+    flow->packetCount++;
+    flow->byteCount += element->packet.packetSize;
+
+    if(!flow->active) {
+        flow->active = true;
+        flow->deficit = QUEUE_QUANTUM;
+        pushFlow(&class->newFlows, flow);
+    }
+
+    // Only an approximation of the fattest flow, as it is not updated when
+    // packets leave, but it is enough to pick which flow pays for a drop.
+    if(!class->fattestFlow || flow->byteCount > class->fattestFlow->byteCount) {
+        class->fattestFlow = flow;
+    }
+
+    class->packetCount++;
+    class->byteCount += element->packet.packetSize;
+    queue->size += element->packet.packetSize;
+    queue->backlogMask |= 1u << priority;
+
+    stats_class_t *classStats = &queue->stats->classes[priority];
+
+    stats_add(&classStats->enqueuedPackets, 1);
+    stats_add(&classStats->enqueuedBytes, element->packet.packetSize);
+    stats_set(&classStats->backlogPackets, class->packetCount);
+    stats_set(&classStats->backlogBytes, class->byteCount);
+}
+
+static inline queue_element_t *popFlowElement(queue_t *queue, int priority, queue_flow_t *flow) {
+    queue_class_t *class = &queue->classes[priority];
+    queue_element_t *element = flow->head;
+
+    if(element) {
+        flow->head = element->next;
+
+        if(!flow->head) {
+            flow->tail = NULL;
+
+            if(class->fattestFlow == flow) {
+                class->fattestFlow = NULL;
+            }
+        }
+
+        flow->packetCount--;
+        flow->byteCount -= element->packet.packetSize;
+        class->packetCount--;
+        class->byteCount -= element->packet.packetSize;
+        queue->size -= element->packet.packetSize;
+
+        if(!class->packetCount) {
+            queue->backlogMask &= ~(1u << priority);
+        }
+
+        stats_set(&queue->stats->classes[priority].backlogPackets, class->packetCount);
+        stats_set(&queue->stats->classes[priority].backlogBytes, class->byteCount);
+    }
+
+    return element;
+}
+
+static inline void countDrop(queue_t *queue, int priority, int reason, const queue_element_t *element) {
+    stats_class_t *classStats = &queue->stats->classes[priority];
+
+    stats_add(&classStats->droppedPackets[reason], 1);
+    stats_add(&classStats->droppedBytes[reason], element->packet.packetSize);
+}
+
+// CoDel drop (or mark) action. Returns the packet if it only had to be
+// marked and can still be sent.
+static queue_element_t *dropOrMark(queue_t *queue, int priority, queue_element_t *element) {
+    if(queue->classes[priority].codel.ecn && !packet_setCongestionExperienced(&element->packet)) {
+        stats_add(&queue->stats->classes[priority].markedPackets, 1);
+        return element;
+    }
+
+    countDrop(queue, priority, STATS_DROP_CODEL, element);
+    log_countEvent(LOG_EVENT_CODEL_DROP);
+    log_debug("CoDel dropped 1 packet from queue %d", priority);
+    queue_release(queue, element);
+
+    return NULL;
+}
+
+// Dequeues a packet from a flow and runs the CoDel controller of the flow on
+// it, as in the reference pseudocode of RFC 8289.
+static queue_element_t *codelDequeue(queue_t *queue, int priority, queue_flow_t *flow, uint64_t now) {
+    const codel_parameters_t *parameters = &queue->classes[priority].codel;
+    codel_t *codel = &flow->codel;
+    queue_element_t *element = popFlowElement(queue, priority, flow);
+
+    if(!element) {
+        codel->dropping = false;
+        return NULL;
+    }
+
+    bool drop = codel_shouldDrop(codel, parameters, element->enqueueTimestamp, queue->size, now);
+
+    if(codel->dropping) {
+        if(!drop) {
+            codel->dropping = false;
+        } else {
+            while(codel->dropping && now >= codel->dropNext) {
+                codel->count++;
+                codel->dropNext = codel_controlLaw(parameters, codel->dropNext, codel->count);
+
+                if(dropOrMark(queue, priority, element)) {
+                    return element;
+                }
+
+                element = popFlowElement(queue, priority, flow);
+
+                if(!element || !codel_shouldDrop(codel, parameters, element->enqueueTimestamp, queue->size, now)) {
+                    codel->dropping = false;
+                }
+            }
+        }
+    } else if(drop) {
+        if(!dropOrMark(queue, priority, element)) {
+            element = popFlowElement(queue, priority, flow);
+
+            if(element) {
+                codel_shouldDrop(codel, parameters, element->enqueueTimestamp, queue->size, now);
+            }
+        }
+
+        // Resume from the previous drop rate if the last dropping state ended
+        // recently, as the queue is most likely still congested. The next drop
+        // may still be in the future, so the times are compared signed.
+        uint32_t delta = codel->count - codel->lastCount;
+
+        codel->dropping = true;
+
+        if(delta > 1 && (int64_t)(now - codel->dropNext) < (int64_t)(16 * parameters->interval)) {
+            codel->count = delta;
+        } else {
+            codel->count = 1;
+        }
+
+        codel->lastCount = codel->count;
+        codel->dropNext = codel_controlLaw(parameters, now, codel->count);
+    }
+
+    return element;
+}
+
+// Deficit Round Robin over the flows of a class
+static queue_element_t *popClassElement(queue_t *queue, int priority, uint64_t now) {
+    queue_class_t *class = &queue->classes[priority];
+
+    while(true) {
+        queue_flow_list_t *list = class->newFlows.head ? &class->newFlows : &class->oldFlows;
+        queue_flow_t *flow = list->head;
+
+        if(!flow) {
+            return NULL;
+        }
+
+        if(flow->deficit <= 0) {
+            flow->deficit += QUEUE_QUANTUM;
+            popFlow(list);
+            pushFlow(&class->oldFlows, flow);
+            continue;
+        }
+
+        queue_element_t *element = codelDequeue(queue, priority, flow, now);
+
+        if(!element) {
+            popFlow(list);
+
+            // A new flow that empties goes through the old list once, so that
+            // a flow cannot stay ahead by sending one packet at a time.
+            if(list == &class->newFlows && class->oldFlows.head) {
+                pushFlow(&class->oldFlows, flow);
+            } else {
+                flow->active = false;
+            }
+
+            continue;
+        }
+
+        flow->deficit -= element->packet.packetSize;
+
+        return element;
+    }
+}
+
+// Drops the packet at the head of the fattest flow of the class
+static queue_element_t *dropClassElement(queue_t *queue, int priority) {
+    queue_class_t *class = &queue->classes[priority];
+    queue_flow_t *flow = class->fattestFlow;
+
+    if(!class->packetCount) {
+        return NULL;
+    }
+
+    // The fattest flow is forgotten when it empties. Empty flows stay in the
+    // lists until the round robin reaches them, so look for one that is not.
+    if(!flow) {
+        for(flow = class->newFlows.head; flow && !flow->head; flow = flow->nextActive);
+
+        if(!flow) {
+            for(flow = class->oldFlows.head; flow && !flow->head; flow = flow->nextActive);
+        }
+    }
+
+    return popFlowElement(queue, priority, flow);
+}
+
+static void freeFlows(queue_t *queue) {
+    for(int i = 0; i < TUNNEL_MAX_CLASS_COUNT; i++) {
+        free(queue->classes[i].flows);
+    }
+
+    memset(queue->classes, 0, sizeof(queue->classes));
+}
+
+static void destroyProducer(queue_producer_t *producer, int ringCount) {
+    for(int i = 0; i < ringCount; i++) {
+        ring_destroy(&producer->rings[i]);
+    }
+
+    pool_destroy(&producer->pool);
+}
+
+static void destroyProducers(queue_t *queue, int producerCount) {
+    for(int i = 0; i < producerCount; i++) {
+        destroyProducer(&queue->producers[i], queue->classCount);
+    }
+}
+
+// The producers share the budget of the queue, so each pool gets its part
+// of the capacity and of the bandwidth.
+static int initProducer(queue_t *queue, queue_producer_t *producer, int capacity, int bandwidth, int maximumPacketSize) {
+    if(pool_init(&producer->pool, capacity, bandwidth, maximumPacketSize)) {
+        fprintf(stderr, "pool_init() failed while creating queue.\n");
+        return 1;
+    }
+
+    // Every ring can hold the whole pool, so a push can never fail because a
+    // ring is full: the only limit is the number of free elements.
+    for(int i = 0; i < queue->classCount; i++) {
+        if(ring_init(&producer->rings[i], producer->pool.elementCount)) {
+            fprintf(stderr, "ring_init() failed while creating queue ring %d.\n", i);
+            destroyProducer(producer, i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int queue_init(queue_t *queue, int producerCount, int classCount, int capacity, int bandwidth, int maximumPacketSize) {
+    if(producerCount <= 0 || producerCount > QUEUE_MAX_PRODUCER_COUNT) {
+        fprintf(stderr, "queue_init() failed because the specified producer count (%d) was invalid.\n", producerCount);
+        return 1;
+    }
+
+    if(classCount <= 0 || classCount > TUNNEL_MAX_CLASS_COUNT) {
+        fprintf(stderr, "queue_init() failed because the specified class count (%d) was invalid.\n", classCount);
+        return 1;
+    }
+
+    if(capacity <= 0) {
+        fprintf(stderr, "queue_init() failed because the specified queue capacity (%d) was invalid.\n", capacity);
+        return 1;
+    }
+
+    queue->classCount = classCount;
+    memset(queue->classes, 0, sizeof(queue->classes));
+
+    queue->backlogMask = 0;
+    queue->guaranteedMask = 0;
+    queue->ceiledMask = 0;
+    queue->underRateMask = 0;
+    queue->underCeilingMask = ~0u;
+    queue->link = NULL;
+    queue->throttledUntil = 0;
+
+    for(int i = 0; i < classCount; i++) {
+        queue_configureClass(queue, i, CODEL_DEFAULT_TARGET, CODEL_DEFAULT_INTERVAL, true);
+        queue->classes[i].flows = calloc(QUEUE_FLOW_COUNT, sizeof(queue_flow_t));
+
+        if(!queue->classes[i].flows) {
+            perror("An error occurred while allocating memory for queue flows");
+            freeFlows(queue);
+            return 1;
+        }
+    }
+
+    atomic_init(&queue->consumerWaiting, false);
+
+    for(int i = 0; i < producerCount; i++) {
+        if(initProducer(queue, &queue->producers[i], (capacity + producerCount - 1) / producerCount, (bandwidth + producerCount - 1) / producerCount, maximumPacketSize)) {
+            destroyProducers(queue, i);
+            freeFlows(queue);
+            return 1;
+        }
+    }
+
+    queue->producerCount = producerCount;
+    queue->eventFd = eventfd(0, EFD_CLOEXEC);
+
+    if(queue->eventFd == -1) {
+        perror("eventfd() failed while creating queue");
+        destroyProducers(queue, queue->producerCount);
+        freeFlows(queue);
+        return 1;
+    }
+
+    queue->capacity = capacity;
+    queue->size = 0;
+
+    memset(&queue->localStats, 0, sizeof(stats_thread_t));
+    queue->stats = &queue->localStats;
+    queue->sojournTimes = NULL;
+
+    return 0;
+}
+
+void queue_destroy(queue_t *queue) {
+    close(queue->eventFd);
+    destroyProducers(queue, queue->producerCount);
+    freeFlows(queue);
+
+    queue->size = 0;
+    queue->capacity = 0;
+}
+
+void queue_configureClass(queue_t *queue, int priority, uint64_t codelTarget, uint64_t codelInterval, bool ecn) {
+    codel_parameters_t *parameters = &queue->classes[priority].codel;
+
+    parameters->target = codelTarget;
+    parameters->interval = codelInterval;
+    parameters->mtu = QUEUE_QUANTUM;
+    parameters->ecn = ecn;
+}
+
+// Gives a class a guaranteed rate and a ceiling, in bytes per second (0 for
+// none). Packets are charged their wire size on the link, as by the pacer.
+// When the class was already shaped, its buckets keep their credit, so the
+// rates can follow the rate of the tunnel while packets are queued.
+void queue_shapeClass(queue_t *queue, int priority, uint64_t rate, uint64_t ceiling, const pacer_link_t *link) {
+    queue_class_t *class = &queue->classes[priority];
+    uint32_t bit = 1u << priority;
+    uint32_t maximumWireSize = pacer_getWireSize(link, TUNNEL_MAX_PACKET_SIZE);
+    uint64_t now = getNanoseconds();
+
+    queue->link = link;
+
+    if(rate && (queue->guaranteedMask & bit)) {
+        pacer_setRate(&class->guarantee, rate, pacer_getDefaultBurst(rate, maximumWireSize), now);
+    } else {
+        queue->guaranteedMask &= ~bit;
+        queue->underRateMask &= ~bit;
+
+        if(rate && !pacer_init(&class->guarantee, rate, pacer_getDefaultBurst(rate, maximumWireSize), now)) {
+            queue->guaranteedMask |= bit;
+            queue->underRateMask |= bit;
+        }
+    }
+
+    if(ceiling && (queue->ceiledMask & bit)) {
+        pacer_setRate(&class->ceiling, ceiling, pacer_getDefaultBurst(ceiling, maximumWireSize), now);
+    } else {
+        queue->ceiledMask &= ~bit;
+        queue->underCeilingMask |= bit;
+
+        if(ceiling && !pacer_init(&class->ceiling, ceiling, pacer_getDefaultBurst(ceiling, maximumWireSize), now)) {
+            queue->ceiledMask |= bit;
+        }
+    }
+}
+
+// Classes that went over their rate or their ceiling come back once their
+// bucket is positive again. Only the backlogged ones are looked at: the
+// others are when packets come.
+static void refillClasses(queue_t *queue, uint64_t now) {
+    uint32_t mask = ((queue->guaranteedMask & ~queue->underRateMask) | (queue->ceiledMask & ~queue->underCeilingMask)) & queue->backlogMask;
+
+    for(; mask; mask &= mask - 1) {
+        int priority = __builtin_ctz(mask);
+        queue_class_t *class = &queue->classes[priority];
+        uint32_t bit = 1u << priority;
+
+        if((queue->guaranteedMask & bit) && !pacer_getDelay(&class->guarantee, now)) {
+            queue->underRateMask |= bit;
+        }
+
+        if((queue->ceiledMask & bit) && !pacer_getDelay(&class->ceiling, now)) {
+            queue->underCeilingMask |= bit;
+        }
+    }
+}
+
+static void chargeClass(queue_t *queue, int priority, const queue_element_t *element, uint64_t now) {
+    queue_class_t *class = &queue->classes[priority];
+    uint32_t bit = 1u << priority;
+    unsigned int size = pacer_getWireSize(queue->link, element->packet.packetSize);
+
+    if(queue->guaranteedMask & bit) {
+        pacer_refill(&class->guarantee, now);
+        pacer_consume(&class->guarantee, size);
+
+        if(class->guarantee.credit < 0) {
+            queue->underRateMask &= ~bit;
+        }
+    }
+
+    if(queue->ceiledMask & bit) {
+        pacer_refill(&class->ceiling, now);
+        pacer_consume(&class->ceiling, size);
+
+        if(class->ceiling.credit < 0) {
+            queue->underCeilingMask &= ~bit;
+        }
+    }
+}
+
+// Time until the first backlogged class is within its rate or below its
+// ceiling again, when none of them is
+static uint64_t getThrottleDelay(queue_t *queue, uint64_t now) {
+    uint64_t delay = UINT64_MAX;
+
+    for(uint32_t mask = queue->backlogMask; mask; mask &= mask - 1) {
+        int priority = __builtin_ctz(mask);
+        queue_class_t *class = &queue->classes[priority];
+        uint64_t classDelay = pacer_getDelay(&class->ceiling, now);
+
+        if(queue->guaranteedMask & (1u << priority)) {
+            uint64_t rateDelay = pacer_getDelay(&class->guarantee, now);
+
+            if(rateDelay < classDelay) {
+                classDelay = rateDelay;
+            }
+        }
+
+        if(classDelay < delay) {
+            delay = classDelay;
+        }
+    }
+
+    return delay;
+}
+
+static int queue_enqueue_tryReject(queue_t *queue, int priority) {
+    // Lower priority classes pay first. Within the class of the new packet,
+    // the fattest flow pays, so that a sparse flow is not dropped because a
+    // bulk flow filled the queue.
+    for(int p = queue->classCount - 1; p >= priority; p--) {
+        queue_element_t *e = dropClassElement(queue, p);
+
+        if(e) {
+            countDrop(queue, p, STATS_DROP_QUEUE_FULL, e);
+            queue_release(queue, e);
+
+            log_countEvent(LOG_EVENT_QUEUE_FULL);
+            log_debug("Dropped 1 packet from queue %d for a packet in queue %d", p, priority);
+
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void queue_enqueue(queue_t *queue, int producer, queue_element_t *element, int priority) {
+    ring_push(&queue->producers[producer].rings[priority], element);
+
+    // Only pay for a syscall when the consumer is actually asleep. The fence
+    // orders the push above against the load below; the consumer does the
+    // mirror image, so at least one side always sees the other.
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if(atomic_load_explicit(&queue->consumerWaiting, memory_order_relaxed) && atomic_exchange(&queue->consumerWaiting, false)) {
+        uint64_t value = 1;
+
+        if(write(queue->eventFd, &value, sizeof(value)) == -1) {
+            perror("write() failed on queue eventfd");
+        }
+    }
+}
+
+// ACK filtering: a pure ACK that comes right behind an older pure ACK of
+// the same connection, which it makes redundant, takes its place in the flow
+// queue. The tail of the flow is the only candidate, so there is nothing to
+// look up, and the ACK leaves as soon as the older one would have. Returns
+// true if the element was merged and released.
+static bool filterAck(queue_t *queue, int priority, queue_element_t *element) {
+    queue_class_t *class = &queue->classes[priority];
+    queue_flow_t *flow = &class->flows[element->flowHash % QUEUE_FLOW_COUNT];
+    queue_element_t *last = flow->tail;
+
+    if(!last || !last->pureAck || last->flowHash != element->flowHash || element->packet.packetSize > last->packet.bufferSize || !packet_isRedundantAck(&last->packet, &element->packet)) {
+        return false;
+    }
+
+    stats_class_t *classStats = &queue->stats->classes[priority];
+    int growth = (int)element->packet.packetSize - (int)last->packet.packetSize;
+
+    stats_add(&classStats->enqueuedPackets, 1);
+    stats_add(&classStats->enqueuedBytes, element->packet.packetSize);
+    countDrop(queue, priority, STATS_DROP_ACK_FILTER, last);
+
+    memcpy(last->packet.buffer, element->packet.buffer, element->packet.packetSize);
+    last->packet.packetSize = element->packet.packetSize;
+    flow->byteCount += growth;
+    class->byteCount += growth;
+    queue->size += growth;
+
+    stats_set(&classStats->backlogBytes, class->byteCount);
+    queue_release(queue, element);
+
+    return true;
+}
+
+static void drainRing(queue_t *queue, ring_t *ring, int priority) {
+    queue_element_t *element;
+
+    while((element = ring_pop(ring))) {
+        if(element->pureAck && filterAck(queue, priority, element)) {
+            continue;
+        }
+
+        while(element && (int)element->packet.packetSize + queue->size > queue->capacity) {
+            if(queue_enqueue_tryReject(queue, priority)) {
+                countDrop(queue, priority, STATS_DROP_QUEUE_FULL, element);
+                log_countEvent(LOG_EVENT_QUEUE_FULL);
+                log_debug("Failed to enqueue packet with priority %d (queue is saturated).", priority);
+                queue_release(queue, element);
+                element = NULL;
+            }
+        }
+
+        if(element) {
+            pushClassElement(queue, priority, element);
+        }
+    }
+}
+
+// Moves the packets handed over by the producers into the class FIFOs. This
+// is where the capacity is enforced, so a packet can still push out a packet
+// of lower priority that arrived through another ring.
+static void drainRings(queue_t *queue) {
+    for(int priority = 0; priority < queue->classCount; priority++) {
+        for(int producer = 0; producer < queue->producerCount; producer++) {
+            drainRing(queue, &queue->producers[producer].rings[priority], priority);
+        }
+    }
+}
+
+static bool ringsAreEmpty(queue_t *queue) {
+    for(int producer = 0; producer < queue->producerCount; producer++) {
+        for(int i = 0; i < queue->classCount; i++) {
+            if(!ring_isEmpty(&queue->producers[producer].rings[i])) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Waits for a producer to hand packets over, or until the deadline (when not
+// 0) at which a throttled class may send again
+static void waitForProducer(queue_t *queue, uint64_t deadline) {
+    atomic_store(&queue->consumerWaiting, true);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if(!ringsAreEmpty(queue)) {
+        atomic_store(&queue->consumerWaiting, false);
+        return;
+    }
+
+    uint64_t value;
+    uint64_t idleTimestamp = getNanoseconds();
+
+    if(deadline) {
+        uint64_t timeout = deadline > idleTimestamp ? deadline - idleTimestamp : 0;
+        struct timespec ts = {
+            .tv_sec = timeout / 1000000000,
+            .tv_nsec = timeout % 1000000000
+        };
+        struct pollfd pollFd = {
+            .fd = queue->eventFd,
+            .events = POLLIN
+        };
+
+        if(ppoll(&pollFd, 1, &ts, NULL) == 1 && read(queue->eventFd, &value, sizeof(value)) == -1 && errno != EINTR) {
+            perror("read() failed on queue eventfd");
+        }
+    } else if(read(queue->eventFd, &value, sizeof(value)) == -1 && errno != EINTR) {
+        perror("read() failed on queue eventfd");
+    }
+
+    stats_add(&queue->stats->idleTime, getNanoseconds() - idleTimestamp);
+
+    atomic_store(&queue->consumerWaiting, false);
+}
+
+// Without guarantees nor ceilings, this is strict priority: the first class
+// that has packets is served.
+queue_element_t *queue_poll(queue_t *queue, uint64_t now) {
+    drainRings(queue);
+    refillClasses(queue, now);
+
+    queue->throttledUntil = 0;
+
+    while(queue->backlogMask) {
+        uint32_t eligibleMask = queue->backlogMask & queue->underRateMask;
+
+        if(!eligibleMask) {
+            eligibleMask = queue->backlogMask & queue->underCeilingMask;
+        }
+
+        if(!eligibleMask) {
+            queue->throttledUntil = now + getThrottleDelay(queue, now);
+            return NULL;
+        }
+
+        int i = __builtin_ctz(eligibleMask);
+        queue_element_t *e = popClassElement(queue, i, now);
+
+        // CoDel may have dropped what was left in the class
+        if(!e) {
+            continue;
+        }
+
+        chargeClass(queue, i, e, now);
+
+        stats_add(&queue->stats->classes[i].dequeuedPackets, 1);
+        stats_add(&queue->stats->classes[i].dequeuedBytes, e->packet.packetSize);
+
+        if(queue->sojournTimes) {
+            stats_record(&queue->sojournTimes[i], now - e->enqueueTimestamp);
+        }
+
+        return e;
+    }
+
+    return NULL;
+}
+
+queue_element_t *queue_dequeue(queue_t *queue) {
+    while(true) {
+        queue_element_t *e = queue_poll(queue, getNanoseconds());
+
+        if(e) {
+            return e;
+        }
+
+        waitForProducer(queue, queue->throttledUntil);
+    }
+}
@@ -0,0 +1,157 @@
+#ifndef __QUEUE_H_INCLUDED__
+#define __QUEUE_H_INCLUDED__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include <codel.h>
+#include <common.h>
+#include <packet.h>
+#include <pacer.h>
+#include <pool.h>
+#include <ring.h>
+#include <stats.h>
+
+// Number of flow queues of each class. Flows are hashed into this table, so
+// its size bounds the state whatever the number of actual flows.
+#define QUEUE_FLOW_COUNT 256
+
+// Bytes a flow may send each time its turn comes in the round robin
+#define QUEUE_QUANTUM TUNNEL_MAX_PACKET_SIZE
+
+// Maximum number of threads that may feed the queue
+#define QUEUE_MAX_PRODUCER_COUNT STATS_MAX_PRODUCER_COUNT
+
+struct queue_flow_s;
+
+// FIFO of one flow. The tail pointer and the counters make every operation
+// O(1), so the list is never walked.
+typedef struct queue_flow_s {
+    queue_element_t *head;
+    queue_element_t *tail;
+    struct queue_flow_s *nextActive;
+    int deficit;
+    bool active;
+    unsigned int packetCount;
+    unsigned int byteCount;
+    codel_t codel;
+} queue_flow_t;
+
+typedef struct {
+    queue_flow_t *head;
+    queue_flow_t *tail;
+} queue_flow_list_t;
+
+// Each class serves its flows with Deficit Round Robin. As in fq_codel, flows
+// that were idle go to newFlows and are served before the backlogged flows
+// of oldFlows, so that sparse flows see almost no queueing delay, and each
+// flow runs its own CoDel controller with the parameters of the class. A
+// class may also have a guaranteed rate and a ceiling, each with its own
+// token bucket.
+typedef struct {
+    codel_parameters_t codel;
+    queue_flow_t *flows;
+    queue_flow_list_t newFlows;
+    queue_flow_list_t oldFlows;
+    queue_flow_t *fattestFlow;
+    unsigned int packetCount;
+    unsigned int byteCount;
+    pacer_t guarantee;
+    pacer_t ceiling;
+} queue_class_t;
+
+// State owned by one producer: its own pool of free elements, and one ring
+// per priority class to hand filled elements over to the consumer.
+typedef struct {
+    pool_t pool;
+    ring_t rings[TUNNEL_MAX_CLASS_COUNT];
+} queue_producer_t;
+
+// The queue is split between threads. Each producer (tun reader) takes free
+// elements from its pool and hands filled ones over through its rings, so
+// every ring has a single producer and a single consumer. Everything else,
+// including the flow queues and the capacity accounting, belongs to the
+// consumer (pacer), so no lock is ever taken.
+typedef struct {
+    queue_producer_t producers[QUEUE_MAX_PRODUCER_COUNT];
+    int producerCount;
+    _Alignas(RING_CACHE_LINE_SIZE) atomic_bool consumerWaiting;
+    int eventFd;
+
+    _Alignas(RING_CACHE_LINE_SIZE) queue_class_t classes[TUNNEL_MAX_CLASS_COUNT];
+    int classCount;
+    int capacity;
+    int size;
+
+    // Classes are scheduled as in HTB, with one level under the pacer of the
+    // tunnel: the first class that has packets and is within its guaranteed
+    // rate goes first, then the first one that is below its ceiling borrows
+    // what the others leave. Bit i of each mask stands for class i, so that
+    // picking a class is a single bit scan. Classes without a guarantee are
+    // never within it, and classes without a ceiling are always below it.
+    uint32_t backlogMask;
+    uint32_t guaranteedMask;
+    uint32_t ceiledMask;
+    uint32_t underRateMask;
+    uint32_t underCeilingMask;
+    const pacer_link_t *link;
+
+    // When only classes over their ceiling have packets, the time at which
+    // the first of them may send again (0 otherwise)
+    uint64_t throttledUntil;
+
+    // Counters of the consumer, which are kept in the queue itself until they
+    // are published with queue_setStats(). Sojourn times are only recorded
+    // once they are.
+    stats_thread_t *stats;
+    stats_thread_t localStats;
+    stats_histogram_t *sojournTimes;
+} queue_t;
+
+int queue_init(queue_t *queue, int producerCount, int classCount, int capacity, int bandwidth, int maximumPacketSize);
+void queue_destroy(queue_t *queue);
+void queue_configureClass(queue_t *queue, int priority, uint64_t codelTarget, uint64_t codelInterval, bool ecn);
+void queue_shapeClass(queue_t *queue, int priority, uint64_t rate, uint64_t ceiling, const pacer_link_t *link);
+
+static inline void queue_setStats(queue_t *queue, stats_thread_t *stats, stats_histogram_t *sojournTimes) {
+    queue->stats = stats;
+    queue->sojournTimes = sojournTimes;
+}
+
+// Producer side
+void queue_enqueue(queue_t *queue, int producer, queue_element_t *element, int priority);
+
+static inline pool_t *queue_getPool(queue_t *queue, int producer) {
+    return &queue->producers[producer].pool;
+}
+
+static inline queue_element_t *queue_getFreeElement(queue_t *queue, int producer) {
+    return pool_get(&queue->producers[producer].pool);
+}
+
+// Consumer side
+queue_element_t *queue_poll(queue_t *queue, uint64_t now);
+queue_element_t *queue_dequeue(queue_t *queue);
+
+static inline void queue_release(queue_t *queue, queue_element_t *element) {
+    UNUSED_PARAMETER(queue);
+    pool_release(element);
+}
+
+static inline bool queue_isThrottled(const queue_t *queue) {
+    return queue->throttledUntil != 0;
+}
+
+static inline uint64_t queue_getThrottleDelay(const queue_t *queue, uint64_t now) {
+    return queue->throttledUntil > now ? queue->throttledUntil - now : 0;
+}
+
+static inline unsigned int queue_getPacketCount(const queue_t *queue, int priority) {
+    return queue->classes[priority].packetCount;
+}
+
+static inline unsigned int queue_getByteCount(const queue_t *queue, int priority) {
+    return queue->classes[priority].byteCount;
+}
+
+#endif
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <resequencer.h>
+
+resequencer_t *resequencer_create() {
+    resequencer_t *resequencer = calloc(1, sizeof(resequencer_t));
+
+    if(!resequencer) {
+        perror("An error occurred while allocating memory for a resequencer");
+        return NULL;
+    }
+
+    resequencer->window = RESEQUENCER_MIN_WINDOW;
+    resequencer->slots = calloc(resequencer->window, sizeof(resequencer_slot_t));
+
+    if(!resequencer->slots) {
+        perror("An error occurred while allocating memory for a resequencer");
+        free(resequencer);
+        return NULL;
+    }
+
+    return resequencer;
+}
+
+void resequencer_destroy(resequencer_t *resequencer) {
+    if(resequencer) {
+        free(resequencer->slots);
+    }
+
+    free(resequencer);
+}
+
+// The window is a power of 2 that divides the space of the sequence numbers,
+// so a slot keeps its index when the sequence numbers wrap
+static inline resequencer_slot_t *getSlot(resequencer_t *resequencer, uint16_t sequence) {
+    return &resequencer->slots[sequence & (resequencer->window - 1)];
+}
+
+int resequencer_addBandwidth(resequencer_t *resequencer, int bandwidth) {
+    resequencer->bandwidth += bandwidth;
+
+    uint64_t datagramCount = resequencer->bandwidth * RESEQUENCER_TIMEOUT / 1000000000 / (TUNNEL_MAX_PACKET_SIZE / 2);
+    int window = resequencer->window;
+
+    while(window < RESEQUENCER_MAX_WINDOW && (uint64_t)window < datagramCount) {
+        window *= 2;
+    }
+
+    if(window == resequencer->window) {
+        return 0;
+    }
+
+    resequencer_slot_t *slots = calloc(window, sizeof(resequencer_slot_t));
+
+    if(!slots) {
+        perror("An error occurred while allocating memory for a resequencer");
+        return 1;
+    }
+
+    // The held datagrams are all within the old window, which fits in the new
+    // one
+    for(int i = 0; i < resequencer->window; i++) {
+        uint16_t sequence = resequencer->nextSequence + i;
+        resequencer_slot_t *slot = getSlot(resequencer, sequence);
+
+        if(slot->size) {
+            memcpy(&slots[sequence & (window - 1)], slot, sizeof(resequencer_slot_t));
+        }
+    }
+
+    free(resequencer->slots);
+    resequencer->slots = slots;
+    resequencer->window = window;
+
+    return 0;
+}
+
+// Delivers the held datagrams from the next sequence number on, up to the
+// first missing one
+static int drain(resequencer_t *resequencer, resequencer_deliver_t deliver, void *context) {
+    resequencer_slot_t *slot;
+    int count = 0;
+
+    while((slot = getSlot(resequencer, resequencer->nextSequence))->size) {
+        deliver(context, slot->buffer, slot->size);
+        slot->size = 0;
+        resequencer->heldCount--;
+        resequencer->nextSequence++;
+        count++;
+    }
+
+    return count;
+}
+
+// Moves the next sequence number to the given one, delivering the held
+// datagrams on the way
+static int skipTo(resequencer_t *resequencer, uint16_t sequence, resequencer_deliver_t deliver, void *context) {
+    int count = 0;
+
+    while(resequencer->nextSequence != sequence) {
+        resequencer_slot_t *slot = getSlot(resequencer, resequencer->nextSequence);
+
+        if(slot->size) {
+            deliver(context, slot->buffer, slot->size);
+            slot->size = 0;
+            resequencer->heldCount--;
+            count++;
+        }
+
+        resequencer->nextSequence++;
+    }
+
+    return count;
+}
+
+int resequencer_push(resequencer_t *resequencer, uint16_t sequence, uint8_t *buffer, uint32_t size, uint64_t now, resequencer_deliver_t deliver, void *context) {
+    int count = 0;
+
+    if(!resequencer->started) {
+        resequencer->started = true;
+        resequencer->nextSequence = sequence;
+    }
+
+    int16_t distance = (int16_t)(uint16_t)(sequence - resequencer->nextSequence);
+
+    if(distance < 0) {
+        deliver(context, buffer, size);
+        return 0;
+    }
+
+    if(distance >= resequencer->window) {
+        count += skipTo(resequencer, sequence - resequencer->window + 1, deliver, context);
+        count += drain(resequencer, deliver, context);
+    }
+
+    if(sequence == resequencer->nextSequence) {
+        deliver(context, buffer, size);
+        resequencer->nextSequence++;
+
+        return count + drain(resequencer, deliver, context);
+    }
+
+    resequencer_slot_t *slot = getSlot(resequencer, sequence);
+
+    if(!resequencer->heldCount) {
+        resequencer->oldestTimestamp = now;
+    }
+
+    if(!slot->size) {
+        resequencer->heldCount++;
+    }
+
+    memcpy(slot->buffer, buffer, size);
+    slot->size = size;
+    slot->timestamp = now;
+
+    return count;
+}
+
+int resequencer_expire(resequencer_t *resequencer, uint64_t now, resequencer_deliver_t deliver, void *context) {
+    if(!resequencer->heldCount || now - resequencer->oldestTimestamp < RESEQUENCER_TIMEOUT) {
+        return 0;
+    }
+
+    // Every datagram before the last one held for too long is given up on
+    int distance = 0;
+    uint64_t oldestTimestamp = now;
+
+    for(int i = 1; i < resequencer->window; i++) {
+        resequencer_slot_t *slot = getSlot(resequencer, resequencer->nextSequence + i);
+
+        if(!slot->size) {
+            continue;
+        }
+
+        if(now - slot->timestamp >= RESEQUENCER_TIMEOUT) {
+            distance = i;
+        } else if(slot->timestamp < oldestTimestamp) {
+            oldestTimestamp = slot->timestamp;
+        }
+    }
+
+    resequencer->oldestTimestamp = oldestTimestamp;
+
+    if(!distance) {
+        return 0;
+    }
+
+    int count = skipTo(resequencer, resequencer->nextSequence + distance, deliver, context);
+
+    return count + drain(resequencer, deliver, context);
+}
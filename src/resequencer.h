@@ -0,0 +1,64 @@
+#ifndef __RESEQUENCER_H_INCLUDED__
+#define __RESEQUENCER_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <packet.h>
+
+// Over several paths, datagrams carry a sequence number (16 bits) and the
+// receiver puts them back in order before writing them to the tun device.
+// Datagrams that come early are held, as copies, in a window of datagrams,
+// until the ones before them arrive. A datagram that is too far ahead pushes
+// the window forward, and the missing ones are given up on.
+//
+// Missing datagrams are also given up on once a datagram has been held for
+// this long: they were lost rather than late
+#define RESEQUENCER_TIMEOUT 20000000
+
+// The window holds what the paths bring during the timeout, counted in
+// datagrams of half the largest size, so that the window is not what gives up
+// on a late datagram. It is a power of 2 between these bounds.
+#define RESEQUENCER_MIN_WINDOW 64
+#define RESEQUENCER_MAX_WINDOW 4096
+
+typedef void (*resequencer_deliver_t)(void *context, uint8_t *buffer, uint32_t size);
+
+typedef struct {
+    uint32_t size;
+    uint64_t timestamp;
+    uint8_t buffer[TUNNEL_MAX_PACKET_SIZE];
+} resequencer_slot_t;
+
+typedef struct {
+    bool started;
+    uint16_t nextSequence;
+    int heldCount;
+
+    // No datagram has been held since before this time, so the window is
+    // only searched for expired datagrams from a timeout after it
+    uint64_t oldestTimestamp;
+
+    uint64_t bandwidth;
+    int window;
+    resequencer_slot_t *slots;
+} resequencer_t;
+
+resequencer_t *resequencer_create();
+void resequencer_destroy(resequencer_t *resequencer);
+
+// Counts the rate of one more path, in bytes per second, and widens the
+// window to match. Held datagrams are kept.
+int resequencer_addBandwidth(resequencer_t *resequencer, int bandwidth);
+
+// Delivers the datagram if it comes in order, along with the held datagrams
+// that follow it, or holds it. Datagrams that come after the ones following
+// them were given up on are delivered at once. Returns the number of held
+// datagrams that were delivered.
+int resequencer_push(resequencer_t *resequencer, uint16_t sequence, uint8_t *buffer, uint32_t size, uint64_t now, resequencer_deliver_t deliver, void *context);
+
+// Gives up on the missing datagrams before the ones held for too long, and
+// delivers what can then be. Returns the number of datagrams delivered.
+int resequencer_expire(resequencer_t *resequencer, uint64_t now, resequencer_deliver_t deliver, void *context);
+
+#endif
@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ring.h>
+
+int ring_init(ring_t *ring, unsigned int minimumSize) {
+    unsigned int size = 1;
+
+    while(size < minimumSize) {
+        size <<= 1;
+    }
+
+    ring->slots = malloc(size * sizeof(void *));
+
+    if(!ring->slots) {
+        perror("An error occurred while allocating memory for ring");
+        return 1;
+    }
+
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->cachedHead = 0;
+    ring->cachedTail = 0;
+
+    return 0;
+}
+
+void ring_destroy(ring_t *ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+}
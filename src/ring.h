@@ -0,0 +1,68 @@
+#ifndef __RING_H_INCLUDED__
+#define __RING_H_INCLUDED__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#define RING_CACHE_LINE_SIZE 64
+
+// Lock-free single-producer/single-consumer ring of pointers. The indices
+// written by each side live on their own cache line, and each side keeps a
+// cached copy of the other side's index so that it only touches the shared
+// line when its cached view says the ring is full (or empty).
+typedef struct {
+    _Alignas(RING_CACHE_LINE_SIZE) _Atomic unsigned int head;
+    unsigned int cachedTail;
+
+    _Alignas(RING_CACHE_LINE_SIZE) _Atomic unsigned int tail;
+    unsigned int cachedHead;
+
+    _Alignas(RING_CACHE_LINE_SIZE) void **slots;
+    unsigned int mask;
+} ring_t;
+
+int ring_init(ring_t *ring, unsigned int minimumSize);
+void ring_destroy(ring_t *ring);
+
+// Producer side
+static inline bool ring_push(ring_t *ring, void *value) {
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if(tail - ring->cachedHead > ring->mask) {
+        ring->cachedHead = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        if(tail - ring->cachedHead > ring->mask) {
+            return false;
+        }
+    }
+
+    ring->slots[tail & ring->mask] = value;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    return true;
+}
+
+// Consumer side
+static inline void *ring_pop(ring_t *ring) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if(head == ring->cachedTail) {
+        ring->cachedTail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        if(head == ring->cachedTail) {
+            return NULL;
+        }
+    }
+
+    void *value = ring->slots[head & ring->mask];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    return value;
+}
+
+// Consumer side
+static inline bool ring_isEmpty(ring_t *ring) {
+    return atomic_load_explicit(&ring->head, memory_order_relaxed) == atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+#endif
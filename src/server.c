@@ -1,23 +1,634 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-#include <pthread.h>
-
+#include <capture.h>
+#include <common.h>
 #include <libtun/libtun.h>
+#include <log.h>
+#include <protocol.h>
+#include <session.h>
 #include <tunnel.h>
 
-int tun_fd;
+#define SERVER_PORT 5976
+#define SERVER_MAX_EVENTS 16
+
+// Period of the search for idle sessions
+#define SERVER_EXPIRY_PERIOD 1000000000
+
+// Handshakes are not authenticated, so the memory they make the server commit
+// is bounded: the buffers of a session are sized from its bandwidth, which is
+// capped, and handshakes are dropped once there are that many sessions.
+#define SERVER_DEFAULT_MAX_SESSION_COUNT 64
+#define SERVER_DEFAULT_MAX_BANDWIDTH 12500000
+
+int tun_fds[TUNNEL_MAX_QUEUE_COUNT];
+int tunQueueCount = 1;
 char tunDeviceName[16];
-tunnel_t tunnel;
+const char *rulesFileName;
+const char *statsFileName;
+stats_file_t stats;
+const char *captureFileName;
+int captureSize;
+int captureFileCount = CAPTURE_DEFAULT_FILE_COUNT;
+capture_t capture;
+int batchSize = TUNNEL_DEFAULT_BATCH_SIZE;
+int logLevel = LOG_DEFAULT_LEVEL;
+bool ackFilter;
+int maximumSessionCount = SERVER_DEFAULT_MAX_SESSION_COUNT;
+int maximumBandwidth = SERVER_DEFAULT_MAX_BANDWIDTH;
+classifier_t classifier;
+
+int sock;
+int epollFd;
+int timerFd;
+uint64_t armedDeadline;
+session_table_t sessions;
+
+// Aggregates of the sessions that asked for them, which are only held until
+// their batch is sent
+pool_t aggregatePool;
+
+// Sessions that have packets waiting for their pacer
+session_t *backloggedSessions;
+
+int checkCommandLineParameters(int argc, const char *argv[]);
+
+static int setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+
+    return flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1;
+}
+
+static int addToEpoll(int fd) {
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.fd = fd
+    };
+
+    return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static void scheduleSession(session_t *session) {
+    if(!session->backlogged) {
+        session->backlogged = true;
+        session->nextBacklogged = backloggedSessions;
+        backloggedSessions = session;
+    }
+}
+
+// The timer only has to fire when no packet arrives before the next pacer of
+// a backlogged session allows it to send.
+static void armTimer(uint64_t deadline) {
+    if(deadline == armedDeadline) {
+        return;
+    }
+
+    struct itimerspec timerSpec = {
+        .it_value = {
+            .tv_sec = deadline == UINT64_MAX ? 0 : deadline / 1000000000,
+            .tv_nsec = deadline == UINT64_MAX ? 0 : deadline % 1000000000
+        }
+    };
+
+    if(timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &timerSpec, NULL)) {
+        perror("timerfd_settime() failed");
+        return;
+    }
+
+    armedDeadline = deadline;
+}
+
+// Sends the packets of a batch, which may belong to different sessions, with
+// one sendmmsg() call. The datagrams of sessions with several paths are
+// numbered and scheduled on a path first.
+static void sendBatch(queue_element_t **elements, session_t **elementSessions, int count) {
+    struct mmsghdr messages[TUNNEL_MAX_BATCH_SIZE];
+    struct iovec iovecs[TUNNEL_MAX_BATCH_SIZE];
+    struct {
+        _Alignas(struct cmsghdr) char buffer[PATH_SOURCE_CONTROL_SIZE];
+    } controls[TUNNEL_MAX_BATCH_SIZE];
+    uint64_t now = getNanoseconds();
+
+    memset(messages, 0, count * sizeof(struct mmsghdr));
+
+    for(int i = 0; i < count; i++) {
+        session_t *session = elementSessions[i];
+        struct msghdr *message = &messages[i].msg_hdr;
+
+        message->msg_name = &session->address;
+        message->msg_namelen = sizeof(struct sockaddr_in);
+        message->msg_iov = &iovecs[i];
+        message->msg_iovlen = 1;
+
+        if(session->pathCount) {
+            packet_t *packet = &elements[i]->packet;
+
+            packet->packetSize = protocol_writeSequence(packet->buffer, packet->packetSize, session->sequence++);
+
+            path_t *path = &session->paths[path_select(session->paths, session->pathCount, packet->packetSize, now)];
+
+            message->msg_name = &path->address;
+            message->msg_controllen = path_writeSource(path, (struct cmsghdr *)controls[i].buffer);
+
+            if(message->msg_controllen) {
+                message->msg_control = controls[i].buffer;
+            }
+        }
+
+        iovecs[i].iov_base = elements[i]->packet.buffer;
+        iovecs[i].iov_len = elements[i]->packet.packetSize;
+    }
+
+    int sent = 0;
+
+    while(sent < count) {
+        int result = sendmmsg(sock, messages + sent, count - sent, 0);
+
+        if(result == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            // The socket is non-blocking, so a full send buffer drops the
+            // rest of the batch like a full device queue would.
+            perror("An error occurred sending data through the socket");
+            break;
+        }
+
+        sent += result;
+    }
+
+    for(int i = 0; i < count; i++) {
+        if(i < sent) {
+            stats_thread_t *stats = stats_getThread(elementSessions[i]->stats, STATS_THREAD_CONSUMER);
+
+            stats_add(&stats->sentPackets, 1);
+            stats_add(&stats->sentBytes, elements[i]->packet.packetSize);
+        }
+
+        queue_release(&elementSessions[i]->queue, elements[i]);
+    }
+}
+
+// Sends every packet that the pacers of the backlogged sessions allow, then
+// arms the timer for the earliest session that still has to wait.
+static void sendDuePackets(uint64_t now) {
+    queue_element_t *batch[TUNNEL_MAX_BATCH_SIZE];
+    session_t *batchSessions[TUNNEL_MAX_BATCH_SIZE];
+    session_t **link = &backloggedSessions;
+    uint64_t nextDeadline = UINT64_MAX;
+    int count = 0;
+
+    while(*link) {
+        session_t *session = *link;
+        pool_t *sessionAggregatePool = session->aggregate ? &aggregatePool : NULL;
+        bool drained = false;
+
+        // Only the packets of the session, from the first one it put in the
+        // batch, may be aggregated together
+        int first = count;
+
+        while(pacer_isDue(&session->pacer, now, tunnel_getLookahead(sessionAggregatePool, batch + first, count - first, &session->pacer))) {
+            queue_element_t *element = queue_poll(&session->queue, now);
+
+            if(!element) {
+                drained = !queue_isThrottled(&session->queue);
+                break;
+            }
+
+            int sessionCount = count - first;
+
+            pacer_consume(&session->pacer, tunnel_addToBatch(sessionAggregatePool, batch + first, &sessionCount, element, &session->link));
+
+            count = first + sessionCount;
+            batchSessions[count - 1] = session;
+
+            if(count == batchSize) {
+                sendBatch(batch, batchSessions, count);
+                count = 0;
+                first = 0;
+            }
+        }
+
+        stats_set(&stats_getThread(session->stats, STATS_THREAD_CONSUMER)->pacerCredit, session->pacer.credit);
+
+        if(drained) {
+            session->backlogged = false;
+            *link = session->nextBacklogged;
+        } else {
+            uint64_t delay = pacer_getDelay(&session->pacer, now);
+            uint64_t deadline = now + (delay ? delay : queue_getThrottleDelay(&session->queue, now));
+
+            if(deadline < nextDeadline) {
+                nextDeadline = deadline;
+            }
+
+            link = &session->nextBacklogged;
+        }
+    }
+
+    if(count) {
+        sendBatch(batch, batchSessions, count);
+    }
+
+    armTimer(nextDeadline);
+}
+
+// Packets read from the tun device go to the session of their destination
+static void readFromTun(int fd) {
+    uint8_t buffer[TUNNEL_MAX_PACKET_SIZE];
+
+    for(int i = 0; i < batchSize; i++) {
+        ssize_t size = read(fd, buffer, sizeof(buffer));
+
+        if(size == -1) {
+            if(errno != EAGAIN && errno != EINTR) {
+                perror("An error occurred while reading from tun device");
+            }
+
+            return;
+        }
+
+        session_t *session = session_findRoute(&sessions, buffer, size);
+
+        if(!session) {
+            log_countEvent(LOG_EVENT_NO_ROUTE);
+            log_debug("Ignored packet for an unknown destination.");
+            continue;
+        }
+
+        packet_t packet = {
+            .buffer = buffer,
+            .packetSize = size
+        };
+        packet_info_t info;
+        packet_ack_t ack;
+        stats_thread_t *stats = stats_getThread(session->stats, STATS_THREAD_PRODUCER);
+
+        if(packet_parse(&packet, &info)) {
+            stats_add(&stats->ignoredPackets, 1);
+            log_countEvent(LOG_EVENT_UNKNOWN_PACKET);
+            log_debug("Ignored packet of unknown IP version.");
+            continue;
+        }
+
+        int priority = classifier_classify(&classifier, &info);
+
+        if(captureFileName) {
+            capture_write(&capture, buffer, size, priority);
+        }
+
+        // The session is only known once the packet has been read, so the
+        // packet is copied into a buffer of the pool of the session, of the
+        // smallest size that holds it.
+        queue_element_t *element = pool_getForSize(queue_getPool(&session->queue, 0), size);
+
+        if(!element) {
+            stats_add(&stats->classes[priority].droppedPackets[STATS_DROP_NO_BUFFER], 1);
+            stats_add(&stats->classes[priority].droppedBytes[STATS_DROP_NO_BUFFER], size);
+            log_countEvent(LOG_EVENT_NO_BUFFER);
+            log_debug("Failed to enqueue packet with priority %d (no remaining backlog).", priority);
+            continue;
+        }
+
+        memcpy(element->packet.buffer, buffer, size);
+        element->packet.packetSize = size;
+        protocol_writeHeader(element->packet.buffer, PROTOCOL_TYPE_DATA, session->id);
+        element->flowHash = info.flowHash;
+        element->enqueueTimestamp = getNanoseconds();
+        element->pureAck = ackFilter && !packet_parseAck(&packet, &info, &ack);
+
+        queue_enqueue(&session->queue, 0, element, priority);
+        scheduleSession(session);
+    }
+}
+
+// A handshake with the ID of a session opened over several paths adds the
+// path it comes from to the session. A handshake that is sent again is
+// answered again.
+static void handlePathHandshake(const struct sockaddr_in *address, struct in_addr localAddress, uint16_t sessionId, protocol_handshake_t *handshake, const tunnel_parameters_t *parameters, uint8_t *buffer) {
+    session_t *session = session_findById(&sessions, sessionId);
+    uint64_t now = getNanoseconds();
+
+    if(!session || !session->pathCount) {
+        log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+        log_debug("Ignored path handshake for session %u, which is unknown or has a single path.", sessionId);
+        return;
+    }
+
+    int index = path_find(session->paths, session->pathCount, address);
+
+    if(index == -1) {
+        if(session_addPath(session, address, localAddress, parameters, now)) {
+            log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+            log_debug("Ignored path handshake for session %u, which cannot take another path.", sessionId);
+            return;
+        }
+
+        index = session->pathCount - 1;
+        log_info("Path %d of session %u opened for %s:%d (%u Bps, %d bytes of overhead).", index, session->id, inet_ntoa(address->sin_addr), ntohs(address->sin_port), handshake->bandwidth, handshake->overhead);
+    }
+
+    session->lastActivityTimestamp = now;
+
+    handshake->flags &= PROTOCOL_FLAG_MULTIPATH;
+    size_t size = protocol_writeHandshake(buffer, session->id, handshake);
+
+    if(path_send(sock, &session->paths[index], buffer, size) == -1) {
+        perror("sendmsg() failed");
+    }
+}
+
+static void handleHandshake(const struct sockaddr_in *address, struct in_addr localAddress, uint8_t *buffer, ssize_t size) {
+    uint16_t sessionId;
+    protocol_handshake_t handshake;
+
+    if(protocol_readHandshake(buffer, size, &sessionId, &handshake)) {
+        log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+        log_debug("Ignored invalid handshake.");
+        return;
+    }
+
+    uint32_t bandwidth = handshake.bandwidth;
+
+    if(bandwidth == 0 || bandwidth > INT32_MAX) {
+        log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+        log_debug("Ignored handshake with invalid bandwidth %u.", bandwidth);
+        return;
+    }
+
+    if(handshake.linkType >= PACER_LINK_COUNT) {
+        log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+        log_debug("Ignored handshake with unknown link layer %u.", handshake.linkType);
+        return;
+    }
+
+    if(bandwidth > (uint32_t)maximumBandwidth) {
+        log_debug("Bandwidth %u of handshake lowered to %d.", bandwidth, maximumBandwidth);
+        bandwidth = maximumBandwidth;
+    }
+
+    // CoDel keeps the standing queue short, so the capacity only has to
+    // absorb bursts: 100 ms worth of data, as on the client.
+    int capacity = bandwidth / 10;
+
+    if(capacity < 16384) {
+        capacity = 16384;
+    }
+
+    tunnel_parameters_t parameters = {
+        .queueCapacity = capacity,
+        .overhead = handshake.overhead,
+        .linkType = handshake.linkType,
+        .mpu = handshake.mpu,
+        .bandwidth = bandwidth,
+        .burst = 0,
+        .batchSize = batchSize,
+        .aggregate = handshake.flags & PROTOCOL_FLAG_AGGREGATE,
+        .classifier = &classifier
+    };
+
+    if(sessionId != PROTOCOL_NO_SESSION) {
+        handlePathHandshake(address, localAddress, sessionId, &handshake, &parameters, buffer);
+        return;
+    }
+
+    session_t *session = session_findByAddress(&sessions, address);
+    bool reopened = session;
+
+    if(reopened) {
+        session_reopen(session, &parameters, getNanoseconds());
+    } else if(sessions.sessionCount >= (unsigned int)maximumSessionCount) {
+        log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+        log_debug("Ignored handshake from %s:%d, the server already has %u sessions.", inet_ntoa(address->sin_addr), ntohs(address->sin_port), sessions.sessionCount);
+        return;
+    } else if(!(session = session_create(&sessions, address, &parameters, getNanoseconds()))) {
+        fprintf(stderr, "session_create() failed.\n");
+        return;
+    }
+
+    if((handshake.flags & PROTOCOL_FLAG_MULTIPATH) && session_addPath(session, address, localAddress, &parameters, getNanoseconds())) {
+        fprintf(stderr, "Failed to add the first path of session %u, which will only have one.\n", session->id);
+        handshake.flags &= ~PROTOCOL_FLAG_MULTIPATH;
+    }
+
+    log_info("Session %u %s for %s:%d (%u sessions).", session->id, reopened ? "reopened" : "opened", inet_ntoa(address->sin_addr), ntohs(address->sin_port), sessions.sessionCount);
+    log_info("Bandwidth: %d Bps", session->bandwidth);
+    log_info("Overhead: %d bytes", handshake.overhead);
+    log_info("Link layer: %s (MPU: %d bytes)", pacer_getLinkName(handshake.linkType), handshake.mpu);
+    log_info("Aggregates: %s", session->aggregate ? "yes" : "no");
+    log_info("Paths: %s", session->pathCount ? "several" : "one");
+
+    // The flags of the features the server supports are echoed
+    handshake.flags &= PROTOCOL_FLAG_AGGREGATE | PROTOCOL_FLAG_PROBE | PROTOCOL_FLAG_MULTIPATH;
+    size = protocol_writeHandshake(buffer, session->id, &handshake);
+
+    if(session->pathCount ? path_send(sock, &session->paths[0], buffer, size) == -1 : sendto(sock, buffer, size, 0, (const struct sockaddr *)address, sizeof(struct sockaddr_in)) == -1) {
+        perror("sendto() failed");
+    }
+}
+
+// Probes set the rate of the session, up to the bandwidth of the handshake,
+// and are answered at once, with how much the session received so far. Over
+// several paths, they also give the delay of the path they came on, and are
+// answered on it.
+static void handleProbe(session_t *session, const struct sockaddr_in *address, const uint8_t *buffer, ssize_t size, uint64_t now) {
+    protocol_probe_t probe;
+
+    if(protocol_readProbe(buffer, size, &probe)) {
+        log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+        log_debug("Ignored invalid probe.");
+        return;
+    }
+
+    int pathIndex = path_find(session->paths, session->pathCount, address);
+
+    if(pathIndex != -1) {
+        path_updateDelay(&session->paths[pathIndex], (int64_t)(now - probe.timestamp));
+    }
+
+    if(probe.bandwidth && probe.bandwidth <= (uint32_t)session->maximumBandwidth && probe.bandwidth != (uint32_t)session->bandwidth) {
+        session_setBandwidth(session, &classifier, probe.bandwidth, now);
+        log_debug("Session %u shaped at %u Bps.", session->id, probe.bandwidth);
+    }
+
+    session->lastActivityTimestamp = now;
+
+    uint8_t reply[PROTOCOL_PROBE_REPLY_SIZE];
+    protocol_probe_reply_t probeReply = {
+        .probeTimestamp = probe.timestamp,
+        .timestamp = now,
+        .receivedBytes = session->receivedBytes
+    };
+
+    protocol_writeProbeReply(reply, session->id, &probeReply);
+
+    if(pathIndex != -1 ? path_send(sock, &session->paths[pathIndex], reply, sizeof(reply)) == -1 : sendto(sock, reply, sizeof(reply), 0, (const struct sockaddr *)address, sizeof(struct sockaddr_in)) == -1) {
+        perror("sendto() failed");
+    }
+}
+
+// Writes the packets of a datagram of a session to the tun device
+static void deliverDatagram(void *context, uint8_t *buffer, uint32_t size) {
+    session_t *session = (session_t *)context;
+    stats_thread_t *stats = stats_getThread(session->stats, STATS_THREAD_RECEIVER);
+    struct iovec packets[PROTOCOL_MAX_AGGREGATED_PACKETS];
+    int packetCount = 1;
+
+    if(buffer[0] == PROTOCOL_TYPE_AGGREGATE) {
+        packetCount = protocol_splitAggregate(buffer, size, packets);
+
+        if(!packetCount) {
+            log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+            log_debug("Ignored malformed aggregate.");
+            return;
+        }
+    } else {
+        protocol_restorePacketInformation(buffer, size);
+        packets[0].iov_base = buffer;
+        packets[0].iov_len = size;
+    }
+
+    stats_add(&stats->receivedPackets, packetCount);
+    stats_add(&stats->receivedBytes, size);
+
+    for(int i = 0; i < packetCount; i++) {
+        session_learnRoute(&sessions, session, packets[i].iov_base, packets[i].iov_len);
+
+        if(write(tun_fds[0], packets[i].iov_base, packets[i].iov_len) == -1) {
+            stats_add(&stats->tunWriteErrors, 1);
+            log_countEvent(LOG_EVENT_TUN_WRITE_ERROR);
+            log_debug("write() failed on tun device: %s", strerror(errno));
+        } else {
+            log_trace("Successfully received packet.");
+        }
+    }
+}
+
+static void receiveFromSocket() {
+    uint8_t packetBuffers[TUNNEL_MAX_BATCH_SIZE][TUNNEL_MAX_DATAGRAM_SIZE];
+    struct mmsghdr messages[TUNNEL_MAX_BATCH_SIZE];
+    struct iovec iovecs[TUNNEL_MAX_BATCH_SIZE];
+    struct sockaddr_in addresses[TUNNEL_MAX_BATCH_SIZE];
+    struct {
+        _Alignas(struct cmsghdr) char buffer[PATH_SOURCE_CONTROL_SIZE];
+    } controls[TUNNEL_MAX_BATCH_SIZE];
+
+    memset(messages, 0, batchSize * sizeof(struct mmsghdr));
+
+    for(int i = 0; i < batchSize; i++) {
+        iovecs[i].iov_base = packetBuffers[i];
+        iovecs[i].iov_len = TUNNEL_MAX_DATAGRAM_SIZE;
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = &addresses[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        messages[i].msg_hdr.msg_control = controls[i].buffer;
+        messages[i].msg_hdr.msg_controllen = sizeof(controls[i].buffer);
+    }
+
+    int count = recvmmsg(sock, messages, batchSize, MSG_DONTWAIT, NULL);
+
+    if(count == -1) {
+        if(errno != EAGAIN && errno != EINTR) {
+            perror("An error occurred while reading from socket");
+        }
+
+        return;
+    }
+
+    uint64_t now = getNanoseconds();
+
+    for(int i = 0; i < count; i++) {
+        ssize_t size = messages[i].msg_len;
+        protocol_header_t header;
+
+        if(protocol_readHeader(packetBuffers[i], size, &header)) {
+            log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+            log_debug("Ignored packet without a tunnel header.");
+            continue;
+        }
+
+        // The local address the handshake came to is the one the path
+        // answers from
+        if(header.type == PROTOCOL_TYPE_HANDSHAKE) {
+            handleHandshake(&addresses[i], path_readDestination(&messages[i].msg_hdr), packetBuffers[i], size);
+            continue;
+        }
+
+        session_t *session = session_find(&sessions, &addresses[i], header.sessionId);
+
+        // Probes come on every path ten times a second, so missing datagrams
+        // are not waited for longer than that on an idle session
+        if(session && session->resequencer) {
+            resequencer_expire(session->resequencer, now, deliverDatagram, session);
+        }
+
+        if(session && header.type == PROTOCOL_TYPE_PROBE) {
+            handleProbe(session, &addresses[i], packetBuffers[i], size, now);
+            continue;
+        }
+
+        if(!session || (header.type != PROTOCOL_TYPE_DATA && header.type != PROTOCOL_TYPE_AGGREGATE)) {
+            log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+            log_debug("Ignored packet that does not belong to any session.");
+            continue;
+        }
+
+        session->lastActivityTimestamp = now;
+        session->receivedBytes += size;
+
+        if(session->resequencer) {
+            uint32_t datagramSize = size;
+            uint16_t sequence;
+
+            if(protocol_readSequence(packetBuffers[i], &datagramSize, &sequence)) {
+                log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+                log_debug("Ignored datagram without a sequence number.");
+                continue;
+            }
+
+            resequencer_push(session->resequencer, sequence, packetBuffers[i], datagramSize, now, deliverDatagram, session);
+        } else {
+            deliverDatagram(session, packetBuffers[i], size);
+        }
+    }
+}
+
+int main(int argc, const char *argv[]) {
+    if(checkCommandLineParameters(argc, argv)) {
+        fprintf(stderr, "Command-line parameters analysis failed.\n");
+        return EXIT_FAILURE;
+    }
+
+    if(log_init(logLevel)) {
+        fprintf(stderr, "Failed to start logging.\n");
+        return EXIT_FAILURE;
+    }
+
+    classifier_init(&classifier);
+
+    if(rulesFileName && classifier_load(&classifier, rulesFileName)) {
+        fprintf(stderr, "Failed to load classifier rules.\n");
+        return EXIT_FAILURE;
+    }
 
-int main() {
     // Create the socket to the server
-    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 
     if(sock < 0) {
         perror("Failed to create socket");
@@ -28,54 +639,266 @@ int main() {
     memset(&socketAddress, 0, sizeof(struct sockaddr_in));
     socketAddress.sin_addr.s_addr = htonl(INADDR_ANY);
     socketAddress.sin_family = AF_INET;
-    socketAddress.sin_port = htons(5976);
+    socketAddress.sin_port = htons(SERVER_PORT);
 
     if(bind(sock, (const struct sockaddr *)&socketAddress, sizeof(struct sockaddr_in))) {
         perror("Failed to bind socket");
         return EXIT_FAILURE;
     }
 
-    // Create the tun device
-    tun_fd = libtun_open(tunDeviceName);
+    // Sessions with several paths answer each path from the address it came
+    // to, which the socket then has to tell
+    int enable = 1;
 
-    printf("tun_fd=%d\n", tun_fd);
+    if(setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &enable, sizeof(enable))) {
+        perror("Failed to enable IP_PKTINFO");
+        return EXIT_FAILURE;
+    }
 
-    if(tun_fd < 0) {
+    // Create the tun device, which is shared by all sessions
+    int tunError;
+
+    if(tunQueueCount > 1) {
+        tunError = libtun_openMultiQueue(tunDeviceName, tun_fds, tunQueueCount, false);
+    } else {
+        tun_fds[0] = libtun_open(tunDeviceName, false);
+        tunError = tun_fds[0] < 0;
+    }
+
+    printf("tun_fd=%d\n", tun_fds[0]);
+
+    if(tunError) {
         fprintf(stderr, "Failed to open tun device.\n");
         return EXIT_FAILURE;
     }
 
-    socklen_t socklen = sizeof(struct sockaddr);
-    uint8_t buffer[5];
-    ssize_t packetSize = recvfrom(sock, buffer, 5, 0, (struct sockaddr *)&socketAddress, &socklen);
-
-    if(packetSize < 0) {
-        perror("recvfrom() failed.\n");
+    if(pool_init(&aggregatePool, TUNNEL_CONSUMER_POOL_SIZE, 0, TUNNEL_MAX_PACKET_SIZE)) {
+        fprintf(stderr, "Aggregate pool initialization failed.\n");
         return EXIT_FAILURE;
-    } else if(packetSize != 5) {
-        fprintf(stderr, "Wrong packet size, expected 5, got %d.\n", (int)packetSize);
-        return 0;
     }
 
-    int bandwidth = ntohl(*(uint32_t *)buffer);
-    int overhead = buffer[4];
+    // Every session is served by this thread: one epoll loop waits for the
+    // socket, the tun device and the pacing timer.
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
 
-    printf("Bandwidth: %d bps\n", bandwidth);
-    printf("Overhead: %d bytes\n", overhead);
+    if(epollFd == -1 || timerFd == -1) {
+        perror("Failed to create the event loop");
+        return EXIT_FAILURE;
+    }
 
-    if(tunnel_init(&tunnel, sock, tun_fd, 16384, overhead, bandwidth, (const struct sockaddr *)&socketAddress)) {
-        fprintf(stderr, "tunnel_init() failed.\n");
+    if(setNonBlocking(sock) || addToEpoll(sock) || addToEpoll(timerFd)) {
+        perror("Failed to add the socket to the event loop");
         return EXIT_FAILURE;
     }
 
-    ssize_t result = sendto(sock, buffer, 5, 0, (const struct sockaddr *)&socketAddress, sizeof(struct sockaddr_in));
+    for(int i = 0; i < tunQueueCount; i++) {
+        if(setNonBlocking(tun_fds[i]) || addToEpoll(tun_fds[i])) {
+            perror("Failed to add the tun device to the event loop");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The default timer slack of 50 us would make every pacing timer late
+    if(prctl(PR_SET_TIMERSLACK, 1)) {
+        perror("prctl(PR_SET_TIMERSLACK) failed");
+    }
+
+    if(stats_open(&stats, statsFileName, SESSION_STATS_COUNT)) {
+        fprintf(stderr, "Failed to create the stats file.\n");
+        return EXIT_FAILURE;
+    }
 
-    if(result == -1) {
-        perror("sendto() failed.\n");
+    // With a capture size, the capture is a ring of files of that many MiB
+    if(captureFileName && capture_open(&capture, captureFileName, (uint64_t)captureSize * 1048576, captureFileCount)) {
+        fprintf(stderr, "Failed to open the capture file.\n");
         return EXIT_FAILURE;
     }
 
-    tunnel_mainLoop(&tunnel);
+    session_table_init(&sessions, &stats);
+    armedDeadline = UINT64_MAX;
+
+    uint64_t lastExpiryTimestamp = getNanoseconds();
+
+    while(true) {
+        struct epoll_event events[SERVER_MAX_EVENTS];
+        int eventCount = epoll_wait(epollFd, events, SERVER_MAX_EVENTS, SERVER_EXPIRY_PERIOD / 1000000);
+
+        if(eventCount == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            perror("epoll_wait() failed");
+            break;
+        }
+
+        for(int i = 0; i < eventCount; i++) {
+            int fd = events[i].data.fd;
+
+            if(fd == sock) {
+                receiveFromSocket();
+            } else if(fd == timerFd) {
+                uint64_t expirations;
+
+                if(read(timerFd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+                    perror("read() failed on timerfd");
+                }
+
+                armedDeadline = UINT64_MAX;
+            } else {
+                readFromTun(fd);
+            }
+        }
+
+        uint64_t now = getNanoseconds();
+
+        sendDuePackets(now);
+
+        if(now - lastExpiryTimestamp >= SERVER_EXPIRY_PERIOD) {
+            session_expire(&sessions, now);
+            lastExpiryTimestamp = now;
+        }
+    }
+
+    session_table_destroy(&sessions);
+
+    for(int i = 0; i < tunQueueCount; i++) {
+        libtun_close(tun_fds[i]);
+    }
 
     return EXIT_SUCCESS;
 }
+
+int checkCommandLineParameters(int argc, const char *argv[]) {
+    bool flag_rules = false;
+    bool flag_stats = false;
+    bool flag_batchSize = false;
+    bool flag_tunQueueCount = false;
+    bool flag_logLevel = false;
+    bool flag_capture = false;
+    bool flag_captureSize = false;
+    bool flag_captureFileCount = false;
+    bool flag_maximumSessionCount = false;
+    bool flag_maximumBandwidth = false;
+
+    for(int i = 1; i < argc; i++) {
+        if(flag_rules) {
+            flag_rules = false;
+            rulesFileName = argv[i];
+        } else if(flag_stats) {
+            flag_stats = false;
+            statsFileName = argv[i];
+        } else if(flag_capture) {
+            flag_capture = false;
+            captureFileName = argv[i];
+        } else if(flag_captureSize) {
+            flag_captureSize = false;
+
+            if(sscanf(argv[i], "%d", &captureSize) == EOF) {
+                fprintf(stderr, "Failed to parse capture size value.\n");
+                return 1;
+            }
+
+            if(captureSize <= 0) {
+                fprintf(stderr, "Bad capture size value. Expected a strictly positive integer.\n");
+                return 1;
+            }
+        } else if(flag_captureFileCount) {
+            flag_captureFileCount = false;
+
+            if(sscanf(argv[i], "%d", &captureFileCount) == EOF) {
+                fprintf(stderr, "Failed to parse capture file count value.\n");
+                return 1;
+            }
+
+            if(captureFileCount <= 0) {
+                fprintf(stderr, "Bad capture file count value. Expected a strictly positive integer.\n");
+                return 1;
+            }
+        } else if(flag_tunQueueCount) {
+            flag_tunQueueCount = false;
+
+            if(sscanf(argv[i], "%d", &tunQueueCount) == EOF) {
+                fprintf(stderr, "Failed to parse tun queue count value.\n");
+                return 1;
+            }
+
+            if(tunQueueCount <= 0 || tunQueueCount > TUNNEL_MAX_QUEUE_COUNT) {
+                fprintf(stderr, "Bad tun queue count value. Expected an integer between 1 and %d.\n", TUNNEL_MAX_QUEUE_COUNT);
+                return 1;
+            }
+        } else if(flag_logLevel) {
+            flag_logLevel = false;
+            logLevel = log_parseLevel(argv[i]);
+
+            if(logLevel == -1) {
+                fprintf(stderr, "Bad log level value. Expected error, warning, info, debug or trace.\n");
+                return 1;
+            }
+        } else if(flag_maximumSessionCount) {
+            flag_maximumSessionCount = false;
+
+            if(sscanf(argv[i], "%d", &maximumSessionCount) == EOF) {
+                fprintf(stderr, "Failed to parse maximum session count value.\n");
+                return 1;
+            }
+
+            if(maximumSessionCount <= 0 || maximumSessionCount > SESSION_MAX_COUNT) {
+                fprintf(stderr, "Bad maximum session count value. Expected an integer between 1 and %d.\n", SESSION_MAX_COUNT);
+                return 1;
+            }
+        } else if(flag_maximumBandwidth) {
+            flag_maximumBandwidth = false;
+
+            if(sscanf(argv[i], "%d", &maximumBandwidth) == EOF) {
+                fprintf(stderr, "Failed to parse maximum bandwidth value.\n");
+                return 1;
+            }
+
+            if(maximumBandwidth <= 0) {
+                fprintf(stderr, "Bad maximum bandwidth value. Expected a strictly positive integer.\n");
+                return 1;
+            }
+        } else if(flag_batchSize) {
+            flag_batchSize = false;
+
+            if(sscanf(argv[i], "%d", &batchSize) == EOF) {
+                fprintf(stderr, "Failed to parse batch size value.\n");
+                return 1;
+            }
+
+            if(batchSize <= 0 || batchSize > TUNNEL_MAX_BATCH_SIZE) {
+                fprintf(stderr, "Bad batch size value. Expected an integer between 1 and %d.\n", TUNNEL_MAX_BATCH_SIZE);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--rules") == 0) {
+            flag_rules = true;
+        } else if(strcmp(argv[i], "--stats") == 0) {
+            flag_stats = true;
+        } else if(strcmp(argv[i], "--batch-size") == 0) {
+            flag_batchSize = true;
+        } else if(strcmp(argv[i], "--tun-queues") == 0) {
+            flag_tunQueueCount = true;
+        } else if(strcmp(argv[i], "--log-level") == 0) {
+            flag_logLevel = true;
+        } else if(strcmp(argv[i], "--capture") == 0) {
+            flag_capture = true;
+        } else if(strcmp(argv[i], "--capture-size") == 0) {
+            flag_captureSize = true;
+        } else if(strcmp(argv[i], "--capture-files") == 0) {
+            flag_captureFileCount = true;
+        } else if(strcmp(argv[i], "--max-sessions") == 0) {
+            flag_maximumSessionCount = true;
+        } else if(strcmp(argv[i], "--max-bandwidth") == 0) {
+            flag_maximumBandwidth = true;
+        } else if(strcmp(argv[i], "--ack-filter") == 0) {
+            ackFilter = true;
+        } else {
+            fprintf(stderr, "Failed to parse argument \"%s\".", argv[i]);
+            return 1;
+        }
+    }
+
+    return 0;
+}
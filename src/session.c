@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <log.h>
+#include <protocol.h>
+#include <session.h>
+
+#define IPV4_SOURCE_OFFSET 12
+#define IPV4_DESTINATION_OFFSET 16
+#define IPV4_HEADER_MINIMUM_SIZE 20
+#define IPV6_SOURCE_OFFSET 8
+#define IPV6_DESTINATION_OFFSET 24
+#define IPV6_HEADER_SIZE 40
+
+// Session IDs are unique, so that the other paths of a session find it from
+// their own addresses
+static inline unsigned int hashSession(uint16_t id) {
+    return ((uint64_t)id * 0x9e3779b97f4a7c15ULL) >> 54 & (SESSION_TABLE_SIZE - 1);
+}
+
+static inline unsigned int hashRoute(const uint8_t *address, uint8_t addressSize) {
+    uint32_t hash = 2166136261u;
+
+    for(int i = 0; i < addressSize; i++) {
+        hash = (hash ^ address[i]) * 16777619u;
+    }
+
+    return hash & (SESSION_TABLE_SIZE - 1);
+}
+
+static inline bool addressEquals(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// Finds the inner source or destination address of a tunneled packet. Returns
+// the index of the route it belongs to, or -1 if the packet is not IP.
+static int getInnerAddress(const uint8_t *buffer, uint32_t size, bool destination, const uint8_t **address, uint8_t *addressSize) {
+    const uint8_t *header = buffer + PROTOCOL_HEADER_SIZE;
+
+    if(size <= PROTOCOL_HEADER_SIZE) {
+        return -1;
+    }
+
+    size -= PROTOCOL_HEADER_SIZE;
+
+    if(header[0] >> 4 == 4 && size >= IPV4_HEADER_MINIMUM_SIZE) {
+        *address = header + (destination ? IPV4_DESTINATION_OFFSET : IPV4_SOURCE_OFFSET);
+        *addressSize = 4;
+        return SESSION_ROUTE_IPV4;
+    } else if(header[0] >> 4 == 6 && size >= IPV6_HEADER_SIZE) {
+        *address = header + (destination ? IPV6_DESTINATION_OFFSET : IPV6_SOURCE_OFFSET);
+        *addressSize = 16;
+        return SESSION_ROUTE_IPV6;
+    }
+
+    return -1;
+}
+
+static void removeRoute(session_table_t *table, session_route_t *route) {
+    if(!route->addressSize) {
+        return;
+    }
+
+    session_route_t **link = &table->routes[hashRoute(route->address, route->addressSize)];
+
+    while(*link != route) {
+        link = &(*link)->next;
+    }
+
+    *link = route->next;
+    route->addressSize = 0;
+}
+
+static void destroySession(session_table_t *table, session_t *session) {
+    for(int i = 0; i < 2; i++) {
+        removeRoute(table, &session->routes[i]);
+    }
+
+    stats_releaseTunnel(session->stats);
+    queue_destroy(&session->queue);
+    resequencer_destroy(session->resequencer);
+    free(session);
+}
+
+void session_table_init(session_table_t *table, stats_file_t *stats) {
+    memset(table, 0, sizeof(session_table_t));
+    table->stats = stats;
+}
+
+void session_table_destroy(session_table_t *table) {
+    for(int i = 0; i < SESSION_TABLE_SIZE; i++) {
+        while(table->sessions[i]) {
+            session_t *session = table->sessions[i];
+
+            table->sessions[i] = session->next;
+            destroySession(table, session);
+        }
+    }
+
+    table->sessionCount = 0;
+}
+
+session_t *session_create(session_table_t *table, const struct sockaddr_in *address, const tunnel_parameters_t *parameters, uint64_t now) {
+    // The search for a free ID below would never end
+    if(table->sessionCount >= SESSION_MAX_COUNT) {
+        fprintf(stderr, "No session ID is left.\n");
+        return NULL;
+    }
+
+    session_t *session = calloc(1, sizeof(session_t));
+
+    if(!session) {
+        perror("An error occurred while allocating memory for a session");
+        return NULL;
+    }
+
+    do {
+        table->lastId++;
+    } while(table->lastId == PROTOCOL_NO_SESSION || session_findById(table, table->lastId));
+
+    memcpy(&session->address, address, sizeof(struct sockaddr_in));
+    session->id = table->lastId;
+    pacer_initLink(&session->link, parameters->linkType, parameters->overhead, parameters->mpu);
+    session->bandwidth = parameters->bandwidth;
+    session->maximumBandwidth = parameters->bandwidth;
+    session->aggregate = parameters->aggregate;
+    session->lastActivityTimestamp = now;
+
+    for(int i = 0; i < 2; i++) {
+        session->routes[i].session = session;
+    }
+
+    int burst = parameters->burst;
+
+    if(burst <= 0) {
+        burst = pacer_getDefaultBurst(parameters->bandwidth, pacer_getWireSize(&session->link, TUNNEL_MAX_PACKET_SIZE));
+    }
+
+    if(pacer_init(&session->pacer, parameters->bandwidth, burst, now)) {
+        fprintf(stderr, "Pacer initialization failed.\n");
+        free(session);
+        return NULL;
+    }
+
+    if(queue_init(&session->queue, 1, parameters->classifier->classCount, parameters->queueCapacity, parameters->bandwidth, TUNNEL_MAX_PACKET_SIZE)) {
+        fprintf(stderr, "Queue initialization failed.\n");
+        free(session);
+        return NULL;
+    }
+
+    tunnel_configureQueue(&session->queue, parameters->classifier, &session->link, parameters->bandwidth);
+
+    session->stats = stats_acquireTunnel(table->stats, session->id, parameters->classifier->classCount, parameters->bandwidth, parameters->overhead);
+    queue_setStats(&session->queue, stats_getThread(session->stats, STATS_THREAD_CONSUMER), session->stats->sojournTimes);
+
+    unsigned int bucket = hashSession(session->id);
+
+    session->next = table->sessions[bucket];
+    table->sessions[bucket] = session;
+    table->sessionCount++;
+
+    return session;
+}
+
+// Same as tunnel_setBandwidth(), for the rate a client asks for in its probes
+void session_setBandwidth(session_t *session, const classifier_t *classifier, int bandwidth, uint64_t now) {
+    pacer_setRate(&session->pacer, bandwidth, pacer_getDefaultBurst(bandwidth, pacer_getWireSize(&session->link, TUNNEL_MAX_PACKET_SIZE)), now);
+    tunnel_configureQueue(&session->queue, classifier, &session->link, bandwidth);
+
+    session->bandwidth = bandwidth;
+    session->stats->bandwidth = bandwidth;
+}
+
+session_t *session_findById(const session_table_t *table, uint16_t id) {
+    session_t *session = table->sessions[hashSession(id)];
+
+    while(session && session->id != id) {
+        session = session->next;
+    }
+
+    return session;
+}
+
+session_t *session_findByAddress(const session_table_t *table, const struct sockaddr_in *address) {
+    for(int i = 0; i < SESSION_TABLE_SIZE; i++) {
+        for(session_t *session = table->sessions[i]; session; session = session->next) {
+            if(addressEquals(&session->address, address)) {
+                return session;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+session_t *session_find(const session_table_t *table, const struct sockaddr_in *address, uint16_t id) {
+    session_t *session = session_findById(table, id);
+
+    if(session && !addressEquals(&session->address, address) && path_find(session->paths, session->pathCount, address) == -1) {
+        return NULL;
+    }
+
+    return session;
+}
+
+// A client that opens a session again from the same address, because the
+// reply to its handshake was lost or because it asks for other features, gets
+// its session back. The session keeps the buffers it was opened with, so its
+// rate is never raised above the first one.
+void session_reopen(session_t *session, const tunnel_parameters_t *parameters, uint64_t now) {
+    int bandwidth = parameters->bandwidth < session->maximumBandwidth ? parameters->bandwidth : session->maximumBandwidth;
+
+    pacer_initLink(&session->link, parameters->linkType, parameters->overhead, parameters->mpu);
+    session->maximumBandwidth = bandwidth;
+    session->aggregate = parameters->aggregate;
+    session->lastActivityTimestamp = now;
+    session->pathCount = 0;
+    session->sequence = 0;
+    resequencer_destroy(session->resequencer);
+    session->resequencer = NULL;
+    session_setBandwidth(session, parameters->classifier, bandwidth, now);
+}
+
+// The first path of a session is added when the session is opened, and the
+// others when their handshakes arrive. The session is then shaped at the sum
+// of the rates of its paths.
+int session_addPath(session_t *session, const struct sockaddr_in *address, struct in_addr localAddress, const tunnel_parameters_t *parameters, uint64_t now) {
+    if(session->pathCount == PATH_MAX_COUNT) {
+        return 1;
+    }
+
+    if(!session->resequencer && !(session->resequencer = resequencer_create())) {
+        return 1;
+    }
+
+    path_t *path = &session->paths[session->pathCount];
+
+    if(path_init(path, address, localAddress, parameters->linkType, parameters->overhead, parameters->mpu, parameters->bandwidth, now)) {
+        return 1;
+    }
+
+    // The upload rates of the paths are not known, so the resequencer is
+    // sized from the download ones
+    if(resequencer_addBandwidth(session->resequencer, parameters->bandwidth)) {
+        return 1;
+    }
+
+    // The session is shaped at the sum of the rates of its paths, with the
+    // largest overhead of theirs so that none of them is overrun
+    if(session->pathCount++) {
+        if(parameters->overhead > session->link.overhead) {
+            pacer_initLink(&session->link, session->link.type, parameters->overhead, session->link.mpu);
+        }
+
+        session_setBandwidth(session, parameters->classifier, session->bandwidth + parameters->bandwidth, now);
+    }
+
+    return 0;
+}
+
+// A packet coming from a client tells which inner address it uses. An address
+// belongs to the first session that used it until that session expires, so
+// that a client cannot take the downstream traffic of another one by sending
+// a packet from its address.
+void session_learnRoute(session_table_t *table, session_t *session, const uint8_t *buffer, uint32_t size) {
+    const uint8_t *address;
+    uint8_t addressSize;
+    int index = getInnerAddress(buffer, size, false, &address, &addressSize);
+
+    if(index == -1) {
+        return;
+    }
+
+    session_route_t *route = &session->routes[index];
+
+    if(route->addressSize == addressSize && memcmp(route->address, address, addressSize) == 0) {
+        return;
+    }
+
+    unsigned int bucket = hashRoute(address, addressSize);
+
+    for(session_route_t *other = table->routes[bucket]; other; other = other->next) {
+        if(other->addressSize == addressSize && memcmp(other->address, address, addressSize) == 0) {
+            log_debug("Session %u did not get the route of session %u.", session->id, other->session->id);
+            return;
+        }
+    }
+
+    removeRoute(table, route);
+
+    memcpy(route->address, address, addressSize);
+    route->addressSize = addressSize;
+    route->next = table->routes[bucket];
+    table->routes[bucket] = route;
+}
+
+session_t *session_findRoute(const session_table_t *table, const uint8_t *buffer, uint32_t size) {
+    const uint8_t *address;
+    uint8_t addressSize;
+
+    if(getInnerAddress(buffer, size, true, &address, &addressSize) == -1) {
+        return NULL;
+    }
+
+    for(session_route_t *route = table->routes[hashRoute(address, addressSize)]; route; route = route->next) {
+        if(route->addressSize == addressSize && memcmp(route->address, address, addressSize) == 0) {
+            return route->session;
+        }
+    }
+
+    return NULL;
+}
+
+// Sessions that still have packets to send are kept until they are drained,
+// as the scheduler holds a pointer to them.
+void session_expire(session_table_t *table, uint64_t now) {
+    for(int i = 0; i < SESSION_TABLE_SIZE; i++) {
+        session_t **link = &table->sessions[i];
+
+        while(*link) {
+            session_t *session = *link;
+
+            if(!session->backlogged && now - session->lastActivityTimestamp > SESSION_TIMEOUT) {
+                log_info("Session %u expired.", session->id);
+                *link = session->next;
+                destroySession(table, session);
+                table->sessionCount--;
+            } else {
+                link = &session->next;
+            }
+        }
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef __SESSION_H_INCLUDED__
+#define __SESSION_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <pacer.h>
+#include <path.h>
+#include <queue.h>
+#include <resequencer.h>
+#include <stats.h>
+#include <tunnel.h>
+
+// Number of buckets of the session and route tables (a power of 2)
+#define SESSION_TABLE_SIZE 1024
+
+// Every session ID but PROTOCOL_NO_SESSION may be in use at once
+#define SESSION_MAX_COUNT 65535
+
+// Sessions that have not received anything for this long are removed
+#define SESSION_TIMEOUT 120000000000ULL
+
+// Sessions that get their own section in the stats file. The others share
+// the last section.
+#define SESSION_STATS_COUNT 64
+
+#define SESSION_ROUTE_IPV4 0
+#define SESSION_ROUTE_IPV6 1
+
+struct session_s;
+
+// Inner address of a client, learned from the source address of the packets
+// it sends through the tunnel. Packets read from the tun device are routed to
+// the session whose route matches their destination address.
+typedef struct session_route_s {
+    uint8_t address[16];
+    uint8_t addressSize;
+    struct session_s *session;
+    struct session_route_s *next;
+} session_route_t;
+
+// A client of the server. Each session is shaped on its own, with a queue and
+// a pacer sized from the bandwidth it negotiated.
+typedef struct session_s {
+    struct sockaddr_in address;
+    uint16_t id;
+    pacer_link_t link;
+    int bandwidth;
+    int maximumBandwidth;
+    bool aggregate;
+    uint64_t lastActivityTimestamp;
+    session_route_t routes[2];
+    struct session_s *next;
+    struct session_s *nextBacklogged;
+    bool backlogged;
+    stats_tunnel_t *stats;
+    queue_t queue;
+    pacer_t pacer;
+    uint64_t receivedBytes;
+
+    // A session opened over several paths has every one of them here, the
+    // first one included, and is shaped at the sum of their rates. Datagrams
+    // are numbered and scheduled as on the client.
+    path_t paths[PATH_MAX_COUNT];
+    int pathCount;
+    uint16_t sequence;
+    resequencer_t *resequencer;
+} session_t;
+
+typedef struct {
+    session_t *sessions[SESSION_TABLE_SIZE];
+    session_route_t *routes[SESSION_TABLE_SIZE];
+    unsigned int sessionCount;
+    uint16_t lastId;
+    stats_file_t *stats;
+} session_table_t;
+
+void session_table_init(session_table_t *table, stats_file_t *stats);
+void session_table_destroy(session_table_t *table);
+
+session_t *session_create(session_table_t *table, const struct sockaddr_in *address, const tunnel_parameters_t *parameters, uint64_t now);
+session_t *session_find(const session_table_t *table, const struct sockaddr_in *address, uint16_t id);
+session_t *session_findById(const session_table_t *table, uint16_t id);
+session_t *session_findByAddress(const session_table_t *table, const struct sockaddr_in *address);
+void session_reopen(session_t *session, const tunnel_parameters_t *parameters, uint64_t now);
+int session_addPath(session_t *session, const struct sockaddr_in *address, struct in_addr localAddress, const tunnel_parameters_t *parameters, uint64_t now);
+void session_setBandwidth(session_t *session, const classifier_t *classifier, int bandwidth, uint64_t now);
+void session_learnRoute(session_table_t *table, session_t *session, const uint8_t *buffer, uint32_t size);
+session_t *session_findRoute(const session_table_t *table, const uint8_t *buffer, uint32_t size);
+void session_expire(session_table_t *table, uint64_t now);
+
+#endif
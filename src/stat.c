@@ -0,0 +1,313 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <common.h>
+#include <pacer.h>
+#include <stats.h>
+
+#define METRIC_TUNNEL 0
+#define METRIC_CLASS 1
+#define METRIC_DROP 2
+
+// Percentiles of the sojourn times that are shown
+#define PERCENTILE_COUNT 3
+
+typedef struct {
+    int64_t enqueuedPackets;
+    int64_t enqueuedBytes;
+    int64_t dequeuedPackets;
+    int64_t dequeuedBytes;
+    int64_t markedPackets;
+    int64_t droppedPackets[STATS_DROP_REASON_COUNT];
+    int64_t droppedBytes[STATS_DROP_REASON_COUNT];
+    int64_t backlogPackets;
+    int64_t backlogBytes;
+    int64_t sojournCount;
+    int64_t sojournSum;
+    int64_t sojournPercentiles[PERCENTILE_COUNT];
+} class_totals_t;
+
+// Counters of a tunnel, added up over the threads
+typedef struct {
+    class_totals_t classes[TUNNEL_MAX_CLASS_COUNT];
+    int64_t sentPackets;
+    int64_t sentBytes;
+    int64_t receivedPackets;
+    int64_t receivedBytes;
+    int64_t ignoredPackets;
+    int64_t ignoredDatagrams;
+    int64_t tunWriteErrors;
+    int64_t idleTime;
+    int64_t upTime;
+    int64_t pacerCredit;
+} totals_t;
+
+typedef struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    int kind;
+    size_t offset;
+    bool seconds;
+} metric_t;
+
+static const metric_t metrics[] = {
+    {"vpnqos_uptime_seconds", "counter", "Time since the tunnel was created.", METRIC_TUNNEL, offsetof(totals_t, upTime), true},
+    {"vpnqos_idle_seconds_total", "counter", "Time the shaping thread spent waiting.", METRIC_TUNNEL, offsetof(totals_t, idleTime), true},
+    {"vpnqos_pacer_credit_bytes", "gauge", "Credit of the pacer, negative while it waits.", METRIC_TUNNEL, offsetof(totals_t, pacerCredit), false},
+    {"vpnqos_sent_packets_total", "counter", "Packets sent through the socket.", METRIC_TUNNEL, offsetof(totals_t, sentPackets), false},
+    {"vpnqos_sent_bytes_total", "counter", "Bytes sent through the socket.", METRIC_TUNNEL, offsetof(totals_t, sentBytes), false},
+    {"vpnqos_received_packets_total", "counter", "Packets received from the other end.", METRIC_TUNNEL, offsetof(totals_t, receivedPackets), false},
+    {"vpnqos_received_bytes_total", "counter", "Bytes received from the other end.", METRIC_TUNNEL, offsetof(totals_t, receivedBytes), false},
+    {"vpnqos_ignored_packets_total", "counter", "Packets read from the tun device that could not be parsed.", METRIC_TUNNEL, offsetof(totals_t, ignoredPackets), false},
+    {"vpnqos_ignored_datagrams_total", "counter", "Datagrams that did not belong to the tunnel.", METRIC_TUNNEL, offsetof(totals_t, ignoredDatagrams), false},
+    {"vpnqos_tun_write_errors_total", "counter", "Packets that could not be written to the tun device.", METRIC_TUNNEL, offsetof(totals_t, tunWriteErrors), false},
+    {"vpnqos_enqueued_packets_total", "counter", "Packets that entered the queue of the class.", METRIC_CLASS, offsetof(class_totals_t, enqueuedPackets), false},
+    {"vpnqos_enqueued_bytes_total", "counter", "Bytes that entered the queue of the class.", METRIC_CLASS, offsetof(class_totals_t, enqueuedBytes), false},
+    {"vpnqos_dequeued_packets_total", "counter", "Packets that left the queue of the class.", METRIC_CLASS, offsetof(class_totals_t, dequeuedPackets), false},
+    {"vpnqos_dequeued_bytes_total", "counter", "Bytes that left the queue of the class.", METRIC_CLASS, offsetof(class_totals_t, dequeuedBytes), false},
+    {"vpnqos_marked_packets_total", "counter", "Packets marked with ECN by CoDel.", METRIC_CLASS, offsetof(class_totals_t, markedPackets), false},
+    {"vpnqos_dropped_packets_total", "counter", "Packets dropped, by reason.", METRIC_DROP, offsetof(class_totals_t, droppedPackets), false},
+    {"vpnqos_dropped_bytes_total", "counter", "Bytes dropped, by reason.", METRIC_DROP, offsetof(class_totals_t, droppedBytes), false},
+    {"vpnqos_backlog_packets", "gauge", "Packets waiting in the queue of the class.", METRIC_CLASS, offsetof(class_totals_t, backlogPackets), false},
+    {"vpnqos_backlog_bytes", "gauge", "Bytes waiting in the queue of the class.", METRIC_CLASS, offsetof(class_totals_t, backlogBytes), false}
+};
+
+static const char *dropReasons[STATS_DROP_REASON_COUNT] = {"codel", "queue_full", "no_buffer", "ack_filter"};
+static const double percentiles[PERCENTILE_COUNT] = {50, 99, 99.9};
+static const char *quantileNames[PERCENTILE_COUNT] = {"0.5", "0.99", "0.999"};
+
+static void addThread(totals_t *totals, stats_thread_t *thread, int classCount) {
+    for(int i = 0; i < classCount; i++) {
+        stats_class_t *class = &thread->classes[i];
+        class_totals_t *classTotals = &totals->classes[i];
+
+        classTotals->enqueuedPackets += stats_read(&class->enqueuedPackets);
+        classTotals->enqueuedBytes += stats_read(&class->enqueuedBytes);
+        classTotals->dequeuedPackets += stats_read(&class->dequeuedPackets);
+        classTotals->dequeuedBytes += stats_read(&class->dequeuedBytes);
+        classTotals->markedPackets += stats_read(&class->markedPackets);
+
+        for(int j = 0; j < STATS_DROP_REASON_COUNT; j++) {
+            classTotals->droppedPackets[j] += stats_read(&class->droppedPackets[j]);
+            classTotals->droppedBytes[j] += stats_read(&class->droppedBytes[j]);
+        }
+
+        classTotals->backlogPackets += stats_readGauge(&class->backlogPackets);
+        classTotals->backlogBytes += stats_readGauge(&class->backlogBytes);
+    }
+
+    totals->sentPackets += stats_read(&thread->sentPackets);
+    totals->sentBytes += stats_read(&thread->sentBytes);
+    totals->receivedPackets += stats_read(&thread->receivedPackets);
+    totals->receivedBytes += stats_read(&thread->receivedBytes);
+    totals->ignoredPackets += stats_read(&thread->ignoredPackets);
+    totals->ignoredDatagrams += stats_read(&thread->ignoredDatagrams);
+    totals->tunWriteErrors += stats_read(&thread->tunWriteErrors);
+    totals->idleTime += stats_read(&thread->idleTime);
+    totals->pacerCredit += stats_readGauge(&thread->pacerCredit) / PACER_CREDIT_SCALE;
+}
+
+static int getClassCount(const stats_tunnel_t *tunnel) {
+    return tunnel->classCount > TUNNEL_MAX_CLASS_COUNT ? TUNNEL_MAX_CLASS_COUNT : (int)tunnel->classCount;
+}
+
+static void sumTunnel(totals_t *totals, stats_tunnel_t *tunnel, uint64_t now) {
+    memset(totals, 0, sizeof(totals_t));
+
+    for(int i = 0; i < STATS_THREAD_COUNT; i++) {
+        addThread(totals, &tunnel->threads[i], getClassCount(tunnel));
+    }
+
+    for(int i = 0; i < getClassCount(tunnel); i++) {
+        class_totals_t *classTotals = &totals->classes[i];
+        stats_histogram_t *histogram = &tunnel->sojournTimes[i];
+
+        classTotals->sojournCount = stats_getHistogramCount(histogram);
+        classTotals->sojournSum = stats_read(&histogram->sum);
+
+        for(int j = 0; j < PERCENTILE_COUNT; j++) {
+            classTotals->sojournPercentiles[j] = stats_getPercentile(histogram, percentiles[j]);
+        }
+    }
+
+    totals->upTime = now - tunnel->startTimestamp;
+}
+
+static void printText(stats_file_t *file, totals_t *totals) {
+    for(uint32_t i = 0; i < file->header->tunnelCount; i++) {
+        stats_tunnel_t *tunnel = &file->tunnels[i];
+        totals_t *t = &totals[i];
+
+        if(!atomic_load(&tunnel->active)) {
+            continue;
+        }
+
+        if(tunnel->shared) {
+            printf("Tunnel %u (shared by the sessions beyond the first %u)\n", i, file->header->tunnelCount - 1);
+        } else {
+            printf("Tunnel %u (session %u): %llu Bps, overhead %u B, up for %.1f s\n", i, tunnel->sessionId, (unsigned long long)tunnel->bandwidth, tunnel->overhead, t->upTime / 1e9);
+        }
+
+        if(t->idleTime) {
+            printf("  Shaper busy %.1f%% of the time\n", 100.0 - 100.0 * t->idleTime / t->upTime);
+        }
+
+        printf("  Pacer credit: %lld B\n", (long long)t->pacerCredit);
+        printf("  Sent: %lld packets (%lld B), received: %lld packets (%lld B)\n", (long long)t->sentPackets, (long long)t->sentBytes, (long long)t->receivedPackets, (long long)t->receivedBytes);
+        printf("  Ignored: %lld packets, %lld datagrams. Tun write errors: %lld\n", (long long)t->ignoredPackets, (long long)t->ignoredDatagrams, (long long)t->tunWriteErrors);
+        printf("  %-5s %12s %12s %8s %8s %8s %8s %8s %8s %10s\n", "Class", "Enqueued", "Dequeued", "Marked", "CoDel", "Full", "NoBuffer", "AckFilt", "Backlog", "Backlog B");
+
+        for(int j = 0; j < getClassCount(tunnel); j++) {
+            class_totals_t *c = &t->classes[j];
+
+            printf("  %-5d %12lld %12lld %8lld %8lld %8lld %8lld %8lld %8lld %10lld\n", j, (long long)c->enqueuedPackets, (long long)c->dequeuedPackets, (long long)c->markedPackets, (long long)c->droppedPackets[STATS_DROP_CODEL], (long long)c->droppedPackets[STATS_DROP_QUEUE_FULL], (long long)c->droppedPackets[STATS_DROP_NO_BUFFER], (long long)c->droppedPackets[STATS_DROP_ACK_FILTER], (long long)c->backlogPackets, (long long)c->backlogBytes);
+        }
+
+        printf("  %-5s %12s %12s %12s %12s\n", "Class", "Sojourn avg", "p50", "p99", "p99.9");
+
+        for(int j = 0; j < getClassCount(tunnel); j++) {
+            class_totals_t *c = &t->classes[j];
+
+            printf("  %-5d %9.3f ms %9.3f ms %9.3f ms %9.3f ms\n", j, c->sojournCount ? c->sojournSum / 1e6 / c->sojournCount : 0, c->sojournPercentiles[0] / 1e6, c->sojournPercentiles[1] / 1e6, c->sojournPercentiles[2] / 1e6);
+        }
+
+        printf("\n");
+    }
+}
+
+static void printValue(const metric_t *metric, int64_t value) {
+    if(metric->seconds) {
+        printf(" %.9f\n", value / 1e9);
+    } else {
+        printf(" %lld\n", (long long)value);
+    }
+}
+
+// Prometheus text exposition format: every metric is described once, followed
+// by one sample per tunnel (and class, and drop reason).
+static void printPrometheus(stats_file_t *file, totals_t *totals) {
+    for(size_t m = 0; m < sizeof(metrics) / sizeof(metric_t); m++) {
+        const metric_t *metric = &metrics[m];
+
+        printf("# HELP %s %s\n", metric->name, metric->help);
+        printf("# TYPE %s %s\n", metric->name, metric->type);
+
+        for(uint32_t i = 0; i < file->header->tunnelCount; i++) {
+            stats_tunnel_t *tunnel = &file->tunnels[i];
+
+            if(!atomic_load(&tunnel->active)) {
+                continue;
+            }
+
+            if(metric->kind == METRIC_TUNNEL) {
+                printf("%s{tunnel=\"%u\",session=\"%u\"}", metric->name, i, tunnel->sessionId);
+                printValue(metric, *(int64_t *)((uint8_t *)&totals[i] + metric->offset));
+                continue;
+            }
+
+            for(int j = 0; j < getClassCount(tunnel); j++) {
+                uint8_t *classTotals = (uint8_t *)&totals[i].classes[j];
+
+                if(metric->kind == METRIC_CLASS) {
+                    printf("%s{tunnel=\"%u\",session=\"%u\",class=\"%d\"}", metric->name, i, tunnel->sessionId, j);
+                    printValue(metric, *(int64_t *)(classTotals + metric->offset));
+                    continue;
+                }
+
+                for(int k = 0; k < STATS_DROP_REASON_COUNT; k++) {
+                    printf("%s{tunnel=\"%u\",session=\"%u\",class=\"%d\",reason=\"%s\"}", metric->name, i, tunnel->sessionId, j, dropReasons[k]);
+                    printValue(metric, ((int64_t *)(classTotals + metric->offset))[k]);
+                }
+            }
+        }
+    }
+}
+
+static void printSojournTimes(stats_file_t *file, totals_t *totals) {
+    const char *name = "vpnqos_sojourn_seconds";
+
+    printf("# HELP %s Time packets of the class spent in the queue.\n", name);
+    printf("# TYPE %s summary\n", name);
+
+    for(uint32_t i = 0; i < file->header->tunnelCount; i++) {
+        stats_tunnel_t *tunnel = &file->tunnels[i];
+
+        if(!atomic_load(&tunnel->active)) {
+            continue;
+        }
+
+        for(int j = 0; j < getClassCount(tunnel); j++) {
+            class_totals_t *c = &totals[i].classes[j];
+
+            for(int k = 0; k < PERCENTILE_COUNT; k++) {
+                printf("%s{tunnel=\"%u\",session=\"%u\",class=\"%d\",quantile=\"%s\"} %.9f\n", name, i, tunnel->sessionId, j, quantileNames[k], c->sojournPercentiles[k] / 1e9);
+            }
+
+            printf("%s_sum{tunnel=\"%u\",session=\"%u\",class=\"%d\"} %.9f\n", name, i, tunnel->sessionId, j, c->sojournSum / 1e9);
+            printf("%s_count{tunnel=\"%u\",session=\"%u\",class=\"%d\"} %lld\n", name, i, tunnel->sessionId, j, (long long)c->sojournCount);
+        }
+    }
+}
+
+static void printUsage(const char *name) {
+    fprintf(stderr, "Usage: %s [--prometheus] FILE\n", name);
+}
+
+int main(int argc, const char *argv[]) {
+    bool prometheus = false;
+    const char *path = NULL;
+
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--prometheus") == 0) {
+            prometheus = true;
+        } else if(!path) {
+            path = argv[i];
+        } else {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(!path) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    stats_file_t file;
+
+    if(stats_map(&file, path)) {
+        return EXIT_FAILURE;
+    }
+
+    // The counters keep changing while they are read, so each one is read
+    // once and every figure that is printed comes from the same reading.
+    totals_t *totals = calloc(file.header->tunnelCount, sizeof(totals_t));
+
+    if(!totals) {
+        perror("An error occurred while allocating memory for the stats");
+        return EXIT_FAILURE;
+    }
+
+    uint64_t now = getNanoseconds();
+
+    for(uint32_t i = 0; i < file.header->tunnelCount; i++) {
+        sumTunnel(&totals[i], &file.tunnels[i], now);
+    }
+
+    if(prometheus) {
+        printPrometheus(&file, totals);
+        printSojournTimes(&file, totals);
+    } else {
+        printf("Process %u, %u tunnel sections\n\n", file.header->pid, file.header->tunnelCount);
+        printText(&file, totals);
+    }
+
+    free(totals);
+    stats_close(&file);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <common.h>
+#include <stats.h>
+
+static size_t getFileSize(int tunnelCount) {
+    return sizeof(stats_header_t) + (size_t)tunnelCount * sizeof(stats_tunnel_t);
+}
+
+static void setPointers(stats_file_t *file, void *memory) {
+    file->header = memory;
+    file->tunnels = (stats_tunnel_t *)((uint8_t *)memory + sizeof(stats_header_t));
+}
+
+int stats_open(stats_file_t *file, const char *path, int tunnelCount) {
+    void *memory;
+
+    if(tunnelCount <= 0) {
+        fprintf(stderr, "stats_open() failed because the specified tunnel count (%d) was invalid.\n", tunnelCount);
+        return 1;
+    }
+
+    file->size = getFileSize(tunnelCount);
+
+    if(path) {
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if(fd == -1) {
+            perror("Failed to open the stats file");
+            return 1;
+        }
+
+        if(ftruncate(fd, file->size)) {
+            perror("Failed to resize the stats file");
+            close(fd);
+            return 1;
+        }
+
+        memory = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        memory = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if(memory == MAP_FAILED) {
+        perror("mmap() failed on the stats file");
+        return 1;
+    }
+
+    setPointers(file, memory);
+
+    // The magic number is written last, so a reader never sees a header that
+    // is only partly filled.
+    file->header->version = STATS_VERSION;
+    file->header->headerSize = sizeof(stats_header_t);
+    file->header->tunnelSize = sizeof(stats_tunnel_t);
+    file->header->tunnelCount = tunnelCount;
+    file->header->pid = getpid();
+    atomic_thread_fence(memory_order_release);
+    file->header->magic = STATS_MAGIC;
+
+    return 0;
+}
+
+void stats_close(stats_file_t *file) {
+    munmap(file->header, file->size);
+    file->header = NULL;
+    file->tunnels = NULL;
+}
+
+stats_tunnel_t *stats_acquireTunnel(stats_file_t *file, uint16_t sessionId, int classCount, int bandwidth, int overhead) {
+    int tunnelCount = file->header->tunnelCount;
+    stats_tunnel_t *tunnel = NULL;
+
+    for(int i = 0; i < tunnelCount && !tunnel; i++) {
+        if(!atomic_load(&file->tunnels[i].active)) {
+            tunnel = &file->tunnels[i];
+        }
+    }
+
+    if(!tunnel) {
+        tunnel = &file->tunnels[tunnelCount - 1];
+        tunnel->shared = true;
+        tunnel->sessionId = 0;
+
+        return tunnel;
+    }
+
+    memset(tunnel, 0, sizeof(stats_tunnel_t));
+    tunnel->sessionId = sessionId;
+    tunnel->classCount = classCount;
+    tunnel->bandwidth = bandwidth;
+    tunnel->overhead = overhead;
+    tunnel->startTimestamp = getNanoseconds();
+    atomic_store(&tunnel->active, true);
+
+    return tunnel;
+}
+
+// A shared section stays in use until the program exits, as there is no
+// telling which sessions still write to it.
+void stats_releaseTunnel(stats_tunnel_t *tunnel) {
+    if(!tunnel->shared) {
+        atomic_store(&tunnel->active, false);
+    }
+}
+
+int stats_map(stats_file_t *file, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat status;
+
+    if(fd == -1) {
+        perror("Failed to open the stats file");
+        return 1;
+    }
+
+    if(fstat(fd, &status)) {
+        perror("fstat() failed on the stats file");
+        close(fd);
+        return 1;
+    }
+
+    file->size = status.st_size;
+
+    void *memory = file->size >= sizeof(stats_header_t) ? mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+
+    close(fd);
+
+    if(memory == MAP_FAILED) {
+        fprintf(stderr, "Failed to map the stats file.\n");
+        return 1;
+    }
+
+    setPointers(file, memory);
+
+    stats_header_t *header = file->header;
+
+    if(header->magic != STATS_MAGIC || header->version != STATS_VERSION || header->headerSize != sizeof(stats_header_t) || header->tunnelSize != sizeof(stats_tunnel_t) || file->size < getFileSize(header->tunnelCount)) {
+        fprintf(stderr, "The stats file has an unknown format.\n");
+        stats_close(file);
+        return 1;
+    }
+
+    return 0;
+}
+
+uint64_t stats_getHistogramCount(stats_histogram_t *histogram) {
+    uint64_t count = 0;
+
+    for(int i = 0; i < STATS_HISTOGRAM_BUCKET_COUNT; i++) {
+        count += stats_read(&histogram->buckets[i]);
+    }
+
+    return count;
+}
+
+// Returns the highest value of the bucket that holds the given percentile of
+// the recorded values, or 0 if there are none.
+uint64_t stats_getPercentile(stats_histogram_t *histogram, double percentile) {
+    uint64_t count = stats_getHistogramCount(histogram);
+    uint64_t rank = count * percentile / 100.0 + 0.5;
+    uint64_t seen = 0;
+
+    if(!count) {
+        return 0;
+    }
+
+    if(rank == 0) {
+        rank = 1;
+    }
+
+    for(int i = 0; i < STATS_HISTOGRAM_BUCKET_COUNT; i++) {
+        seen += stats_read(&histogram->buckets[i]);
+
+        if(seen >= rank) {
+            return stats_getHistogramValue(i);
+        }
+    }
+
+    return stats_getHistogramValue(STATS_HISTOGRAM_BUCKET_COUNT - 1);
+}
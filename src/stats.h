@@ -0,0 +1,170 @@
+#ifndef __STATS_H_INCLUDED__
+#define __STATS_H_INCLUDED__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <packet.h>
+
+#define STATS_MAGIC 0x53514e56
+#define STATS_VERSION 3
+#define STATS_CACHE_LINE_SIZE 64
+
+// Threads that update the counters of a tunnel. Each thread only writes its
+// own slot, so a counter is updated with a relaxed load and store instead of
+// a locked instruction, and slots never share a cache line. Readers add up
+// the slots.
+#define STATS_THREAD_CONSUMER 0
+#define STATS_THREAD_RECEIVER 1
+#define STATS_THREAD_PRODUCER 2
+#define STATS_MAX_PRODUCER_COUNT 8
+#define STATS_THREAD_COUNT (STATS_THREAD_PRODUCER + STATS_MAX_PRODUCER_COUNT)
+
+#define STATS_DROP_CODEL 0
+#define STATS_DROP_QUEUE_FULL 1
+#define STATS_DROP_NO_BUFFER 2
+#define STATS_DROP_ACK_FILTER 3
+#define STATS_DROP_REASON_COUNT 4
+
+// Sojourn time histograms are log-linear, as in HdrHistogram: each power of 2
+// is split into 2^STATS_HISTOGRAM_SUB_BITS buckets, so a value is known
+// within 1/16 of itself whatever its magnitude. Values from 2^36 ns (about
+// 69 s) up go to the last bucket.
+#define STATS_HISTOGRAM_SUB_BITS 4
+#define STATS_HISTOGRAM_SUB_COUNT (1 << STATS_HISTOGRAM_SUB_BITS)
+#define STATS_HISTOGRAM_MAX_BITS 36
+#define STATS_HISTOGRAM_BUCKET_COUNT ((STATS_HISTOGRAM_MAX_BITS - STATS_HISTOGRAM_SUB_BITS + 1) * STATS_HISTOGRAM_SUB_COUNT)
+
+typedef _Atomic uint64_t stats_counter_t;
+typedef _Atomic int64_t stats_gauge_t;
+
+typedef struct {
+    stats_counter_t sum;
+    stats_counter_t buckets[STATS_HISTOGRAM_BUCKET_COUNT];
+} stats_histogram_t;
+
+typedef struct {
+    stats_counter_t enqueuedPackets;
+    stats_counter_t enqueuedBytes;
+    stats_counter_t dequeuedPackets;
+    stats_counter_t dequeuedBytes;
+    stats_counter_t markedPackets;
+    stats_counter_t droppedPackets[STATS_DROP_REASON_COUNT];
+    stats_counter_t droppedBytes[STATS_DROP_REASON_COUNT];
+    stats_gauge_t backlogPackets;
+    stats_gauge_t backlogBytes;
+} stats_class_t;
+
+typedef struct {
+    _Alignas(STATS_CACHE_LINE_SIZE) stats_class_t classes[TUNNEL_MAX_CLASS_COUNT];
+    stats_counter_t sentPackets;
+    stats_counter_t sentBytes;
+    stats_counter_t receivedPackets;
+    stats_counter_t receivedBytes;
+    stats_counter_t ignoredPackets;
+    stats_counter_t ignoredDatagrams;
+    stats_counter_t tunWriteErrors;
+    stats_counter_t idleTime;
+    stats_gauge_t pacerCredit;
+} stats_thread_t;
+
+// Counters of one tunnel (a client, or a session of the server). When the
+// file has no free section left, sessions share the last one, which is then
+// marked as shared. The histograms are only written by the consumer, so they
+// are not repeated in every thread slot.
+typedef struct {
+    _Alignas(STATS_CACHE_LINE_SIZE) _Atomic uint32_t active;
+    uint32_t shared;
+    uint32_t sessionId;
+    uint32_t classCount;
+    uint32_t overhead;
+    uint64_t bandwidth;
+    uint64_t startTimestamp;
+    stats_thread_t threads[STATS_THREAD_COUNT];
+    stats_histogram_t sojournTimes[TUNNEL_MAX_CLASS_COUNT];
+} stats_tunnel_t;
+
+// The sizes let a reader built from other sources refuse a file whose layout
+// it does not know.
+typedef struct {
+    _Alignas(STATS_CACHE_LINE_SIZE) uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t tunnelSize;
+    uint32_t tunnelCount;
+    uint32_t pid;
+} stats_header_t;
+
+typedef struct {
+    stats_header_t *header;
+    stats_tunnel_t *tunnels;
+    size_t size;
+} stats_file_t;
+
+// Writer side. Without a path, the counters live in anonymous memory.
+int stats_open(stats_file_t *file, const char *path, int tunnelCount);
+void stats_close(stats_file_t *file);
+stats_tunnel_t *stats_acquireTunnel(stats_file_t *file, uint16_t sessionId, int classCount, int bandwidth, int overhead);
+void stats_releaseTunnel(stats_tunnel_t *tunnel);
+
+// Reader side
+int stats_map(stats_file_t *file, const char *path);
+uint64_t stats_getHistogramCount(stats_histogram_t *histogram);
+uint64_t stats_getPercentile(stats_histogram_t *histogram, double percentile);
+
+static inline void stats_add(stats_counter_t *counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline void stats_set(stats_gauge_t *gauge, int64_t value) {
+    atomic_store_explicit(gauge, value, memory_order_relaxed);
+}
+
+static inline uint64_t stats_read(stats_counter_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static inline int64_t stats_readGauge(stats_gauge_t *gauge) {
+    return atomic_load_explicit(gauge, memory_order_relaxed);
+}
+
+static inline int stats_getHistogramIndex(uint64_t value) {
+    if(value < STATS_HISTOGRAM_SUB_COUNT) {
+        return value;
+    }
+
+    int exponent = 63 - __builtin_clzll(value);
+
+    if(exponent >= STATS_HISTOGRAM_MAX_BITS) {
+        return STATS_HISTOGRAM_BUCKET_COUNT - 1;
+    }
+
+    int shift = exponent - STATS_HISTOGRAM_SUB_BITS;
+
+    return (shift + 1) * STATS_HISTOGRAM_SUB_COUNT + (value >> shift & (STATS_HISTOGRAM_SUB_COUNT - 1));
+}
+
+// Highest value that falls in a bucket
+static inline uint64_t stats_getHistogramValue(int index) {
+    if(index < STATS_HISTOGRAM_SUB_COUNT) {
+        return index;
+    }
+
+    int shift = index / STATS_HISTOGRAM_SUB_COUNT - 1;
+    uint64_t lowest = (uint64_t)(STATS_HISTOGRAM_SUB_COUNT + index % STATS_HISTOGRAM_SUB_COUNT) << shift;
+
+    return lowest + ((uint64_t)1 << shift) - 1;
+}
+
+static inline void stats_record(stats_histogram_t *histogram, uint64_t value) {
+    stats_add(&histogram->buckets[stats_getHistogramIndex(value)], 1);
+    stats_add(&histogram->sum, value);
+}
+
+static inline stats_thread_t *stats_getThread(stats_tunnel_t *tunnel, int thread) {
+    return &tunnel->threads[thread];
+}
+
+#endif
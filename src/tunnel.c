@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -6,70 +8,108 @@
 #include <time.h>
 
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
+#include <sys/prctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/time.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 
+#include <common.h>
+#include <eventloop.h>
+#include <log.h>
+#include <protocol.h>
 #include <tunnel.h>
 
 static void *tunEnqueueThreadMain(void *arg);
 static void *tunDequeueThreadMain(void *arg);
 static void *tunReceivingThreadMain(void *arg);
+static void *tunProbingThreadMain(void *arg);
 
-static inline unsigned int getMicroseconds() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec * 1000000 + tv.tv_usec;
+static void cancelReaders(tunnel_t *tunnel, int readerCount) {
+    for(int i = 0; i < readerCount; i++) {
+        pthread_cancel(tunnel->readers[i].thread);
+        pthread_attr_destroy(&tunnel->readers[i].attributes);
+    }
 }
 
-static inline int getQueueBacklog(queue_element_t *queue) {
-    if(queue == NULL) {
-        return 0;
-    } else {
-        return 1 + getQueueBacklog(queue->next);
+// With several readers, each one is pinned to its own core, so that the
+// packets of a tun queue are classified and copied on the same core.
+static int startReader(tunnel_t *tunnel, tunnel_reader_t *reader) {
+    if(pthread_attr_init(&reader->attributes)) {
+        fprintf(stderr, "pthread_attr_init() failed for tun enqueue thread %d.\n", reader->index);
+        return 1;
     }
-}
 
-static inline queue_element_t *getLastQueueElement(queue_element_t *queue) {
-    if(queue) {
-        if(queue->next) {
-            return getLastQueueElement(queue->next);
-        } else {
-            return queue;
+    if(tunnel->readerCount > 1) {
+        long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t cpuSet;
+
+        CPU_ZERO(&cpuSet);
+        CPU_SET(reader->index % (cpuCount > 0 ? cpuCount : 1), &cpuSet);
+
+        if(pthread_attr_setaffinity_np(&reader->attributes, sizeof(cpuSet), &cpuSet)) {
+            fprintf(stderr, "pthread_attr_setaffinity_np() failed for tun enqueue thread %d.\n", reader->index);
         }
-    } else {
-        return NULL;
     }
+
+    if(pthread_create(&reader->thread, &reader->attributes, &tunEnqueueThreadMain, reader)) {
+        fprintf(stderr, "pthread_create() failed while creating tun enqueue thread %d.\n", reader->index);
+        pthread_attr_destroy(&reader->attributes);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Probes are sent for the rates to adapt, and to measure the delays of the
+// paths
+static bool sendsProbes(const tunnel_t *tunnel) {
+    return tunnel->probing || tunnel->pathCount;
 }
 
 void tunnel_mainLoop(tunnel_t *tunnel) {
-    // Create tun enqueue thread
-    if(pthread_attr_init(&tunnel->tunEnqueueThreadAttributes)) {
-        fprintf(stderr, "pthread_attr_init() failed for tun enqueue thread.\n");
-        return;
+    // Datagrams received by io_uring are written to the tun device from the
+    // buffers they were received in, which leaves no room to reorder them
+    if(tunnel->engine == TUNNEL_ENGINE_IO_URING && tunnel->pathCount) {
+        fprintf(stderr, "io_uring does not support several paths, falling back to epoll.\n");
+        tunnel->engine = TUNNEL_ENGINE_EPOLL;
     }
 
-    if(pthread_create(&tunnel->tunEnqueueThread, &tunnel->tunEnqueueThreadAttributes, &tunEnqueueThreadMain, tunnel)) {
-        fprintf(stderr, "pthread_create() failed while creating tun enqueue thread.\n");
-        pthread_attr_destroy(&tunnel->tunEnqueueThreadAttributes);
+    if(tunnel->engine == TUNNEL_ENGINE_IO_URING) {
+        if(!eventloop_runIoUring(tunnel)) {
+            return;
+        }
+
+        fprintf(stderr, "io_uring is not available, falling back to epoll.\n");
+        tunnel->engine = TUNNEL_ENGINE_EPOLL;
+    }
+
+    if(tunnel->engine == TUNNEL_ENGINE_EPOLL) {
+        eventloop_run(tunnel);
         return;
     }
 
+    // Create tun enqueue threads
+    for(int i = 0; i < tunnel->readerCount; i++) {
+        if(startReader(tunnel, &tunnel->readers[i])) {
+            cancelReaders(tunnel, i);
+            return;
+        }
+    }
+
     // Create tun dequeue thread
     if(pthread_attr_init(&tunnel->tunDequeueThreadAttributes)) {
         fprintf(stderr, "pthread_attr_init() failed for tun dequeue thread.\n");
-        pthread_attr_destroy(&tunnel->tunEnqueueThreadAttributes);
-        pthread_cancel(tunnel->tunEnqueueThread);
+        cancelReaders(tunnel, tunnel->readerCount);
         return;
     }
 
     if(pthread_create(&tunnel->tunDequeueThread, &tunnel->tunDequeueThreadAttributes, &tunDequeueThreadMain, tunnel)) {
         fprintf(stderr, "pthread_create() failed while creating tun dequeue thread.\n");
-        pthread_attr_destroy(&tunnel->tunEnqueueThreadAttributes);
-        pthread_cancel(tunnel->tunEnqueueThread);
+        cancelReaders(tunnel, tunnel->readerCount);
         pthread_attr_destroy(&tunnel->tunDequeueThreadAttributes);
         return;
     }
@@ -77,8 +117,7 @@ void tunnel_mainLoop(tunnel_t *tunnel) {
     // Create receiver thread
     if(pthread_attr_init(&tunnel->tunReceivingThreadAttributes)) {
         fprintf(stderr, "pthread_attr_init() failed to tun receiving thread.\n");
-        pthread_attr_destroy(&tunnel->tunEnqueueThreadAttributes);
-        pthread_cancel(tunnel->tunEnqueueThread);
+        cancelReaders(tunnel, tunnel->readerCount);
         pthread_attr_destroy(&tunnel->tunDequeueThreadAttributes);
         pthread_cancel(tunnel->tunDequeueThread);
         return;
@@ -86,214 +125,667 @@ void tunnel_mainLoop(tunnel_t *tunnel) {
 
     if(pthread_create(&tunnel->tunReceivingThread, &tunnel->tunReceivingThreadAttributes, &tunReceivingThreadMain, tunnel)) {
         fprintf(stderr, "pthread_create() failed while creating receiving thread.\n");
-        pthread_attr_destroy(&tunnel->tunEnqueueThreadAttributes);
-        pthread_cancel(tunnel->tunEnqueueThread);
+        cancelReaders(tunnel, tunnel->readerCount);
         pthread_attr_destroy(&tunnel->tunDequeueThreadAttributes);
         pthread_cancel(tunnel->tunDequeueThread);
         pthread_attr_destroy(&tunnel->tunReceivingThreadAttributes);
         return;
     }
 
-    pthread_join(tunnel->tunEnqueueThread, NULL);
+    // The other threads block, so probes are sent from a thread of their own
+    bool probingThread = false;
+
+    if(sendsProbes(tunnel)) {
+        probingThread = !pthread_create(&tunnel->tunProbingThread, NULL, &tunProbingThreadMain, tunnel);
+
+        if(!probingThread) {
+            fprintf(stderr, "pthread_create() failed while creating probing thread, no probe will be sent.\n");
+        }
+    }
+
+    for(int i = 0; i < tunnel->readerCount; i++) {
+        pthread_join(tunnel->readers[i].thread, NULL);
+    }
+
     pthread_join(tunnel->tunDequeueThread, NULL);
     pthread_join(tunnel->tunReceivingThread, NULL);
+
+    if(probingThread) {
+        pthread_cancel(tunnel->tunProbingThread);
+        pthread_join(tunnel->tunProbingThread, NULL);
+    }
+}
+
+// Applies the CoDel parameters, the rates and the ceilings of the classes to a
+// queue that is shaped at the given rate. CoDel cannot keep the delay below
+// the time it takes to send one packet, so at low rates the target is raised
+// to 1.5 MTU worth of time, and the interval by as much. A ceiling of 100%
+// is no ceiling, as the pacer enforces it anyway.
+void tunnel_configureQueue(queue_t *queue, const classifier_t *classifier, const pacer_link_t *link, int bandwidth) {
+    uint64_t minimumTarget = (uint64_t)pacer_getWireSize(link, TUNNEL_MAX_PACKET_SIZE) * 1500000000 / bandwidth;
+
+    for(int i = 0; i < classifier->classCount; i++) {
+        const classifier_class_t *class = &classifier->classes[i];
+        uint64_t target = class->codelTarget;
+        uint64_t interval = class->codelInterval;
+
+        if(target < minimumTarget) {
+            interval += minimumTarget - target;
+            target = minimumTarget;
+        }
+
+        queue_configureClass(queue, i, target, interval, class->ecn);
+        queue_shapeClass(queue, i, (uint64_t)bandwidth * class->rate / 100, class->ceiling < 100 ? (uint64_t)bandwidth * class->ceiling / 100 : 0, link);
+    }
+}
+
+// Changes the rate of a running tunnel. Queued packets stay where they are:
+// only the pacer, the CoDel targets and the rates of the classes follow. Has
+// to be called by the consumer.
+void tunnel_setBandwidth(tunnel_t *tunnel, int bandwidth, uint64_t now) {
+    int burst = tunnel->burst;
+
+    if(burst <= 0) {
+        burst = pacer_getDefaultBurst(bandwidth, pacer_getWireSize(&tunnel->link, TUNNEL_MAX_PACKET_SIZE));
+    }
+
+    pacer_setRate(&tunnel->pacer, bandwidth, burst, now);
+    tunnel_configureQueue(&tunnel->queue, tunnel->classifier, &tunnel->link, bandwidth);
+
+    tunnel->bandwidth = bandwidth;
+    tunnel->stats->bandwidth = bandwidth;
 }
 
-int queue_init(queue_t *queue, int capacity, int backlog) {
-    if(capacity <= 0) {
-        fprintf(stderr, "queue_init() failed because the specified queue capacity (%d) was invalid.\n", capacity);
+// Adds a path that datagrams may leave on. The bandwidth of the tunnel has to
+// be the sum of the bandwidths of its paths. The receive bandwidth of the path
+// sizes the resequencer.
+int tunnel_addPath(tunnel_t *tunnel, const struct sockaddr_in *address, struct in_addr localAddress, int overhead, int bandwidth, int receiveBandwidth) {
+    if(tunnel->pathCount == PATH_MAX_COUNT) {
+        fprintf(stderr, "A tunnel has at most %d paths.\n", PATH_MAX_COUNT);
         return 1;
     }
-    
-    if(backlog <= 0) {
-        fprintf(stderr, "queue_init() failed because the specified backlog value (%d) was invalid.\n", backlog);
+
+    if(!tunnel->resequencer && !(tunnel->resequencer = resequencer_create())) {
         return 1;
     }
 
-    if(sem_init(&queue->dequeueSemaphore, 0, 0)) {
-        fprintf(stderr, "sem_init() failed while creating queue semaphore.\n");
+    if(path_init(&tunnel->paths[tunnel->pathCount], address, localAddress, tunnel->link.type, overhead, tunnel->link.mpu, bandwidth, getNanoseconds())) {
+        fprintf(stderr, "Path initialization failed.\n");
         return 1;
     }
 
-    if(pthread_mutexattr_init(&queue->mutexAttributes)) {
-        fprintf(stderr, "pthread_mutexattr_init() failed while creating queue mutex.\n");
-        sem_destroy(&queue->dequeueSemaphore);
+    if(resequencer_addBandwidth(tunnel->resequencer, receiveBandwidth)) {
+        return 1;
+    }
+
+    tunnel->pathCount++;
+
+    return 0;
+}
+
+// The tunnel is then shaped at the rate of the upload controller, and the
+// server is asked for the rate of the download controller, from the first
+// probe on. The bandwidth the tunnel was created with is the highest rate.
+void tunnel_startProbing(tunnel_t *tunnel, const probe_controller_t *uploadController, const probe_controller_t *downloadController) {
+    tunnel->uploadController = *uploadController;
+    tunnel->downloadController = *downloadController;
+    tunnel->receivedBytes = 0;
+    tunnel->nextProbeTimestamp = 0;
+    atomic_store(&tunnel->uploadBandwidth, uploadController->rate);
+    atomic_store(&tunnel->downloadBandwidth, downloadController->rate);
+    tunnel->probing = true;
+}
+
+// UDP GSO is probed by setting a socket-wide segment size, which is then
+// cleared: the segment size is given with each batch instead.
+static bool probeGso(int sock_fd) {
+    int segmentSize = TUNNEL_MAX_PACKET_SIZE;
+
+    if(setsockopt(sock_fd, SOL_UDP, UDP_SEGMENT, &segmentSize, sizeof(segmentSize))) {
+        return false;
+    }
+
+    segmentSize = 0;
+    setsockopt(sock_fd, SOL_UDP, UDP_SEGMENT, &segmentSize, sizeof(segmentSize));
+
+    return true;
+}
+
+int tunnel_init(tunnel_t *tunnel, int sock_fd, const int *tun_fds, int tunQueueCount, const tunnel_parameters_t *parameters, const struct sockaddr *otherEndSocketAddress) {
+    const classifier_t *classifier = parameters->classifier;
+    int queueCapacity = parameters->queueCapacity;
+    int bandwidth = parameters->bandwidth;
+    int burst = parameters->burst;
+
+    if(parameters->batchSize <= 0 || parameters->batchSize > TUNNEL_MAX_BATCH_SIZE) {
+        fprintf(stderr, "tunnel_init() failed because the specified batch size (%d) was invalid.\n", parameters->batchSize);
         return 1;
     }
 
-    if(pthread_mutex_init(&queue->mutex, &queue->mutexAttributes)) {
-        fprintf(stderr, "pthread_mutex_init() failed while creating queue mutex.\n");
-        sem_destroy(&queue->dequeueSemaphore);
-        pthread_mutexattr_destroy(&queue->mutexAttributes);
+    if(tunQueueCount <= 0 || tunQueueCount > TUNNEL_MAX_QUEUE_COUNT) {
+        fprintf(stderr, "tunnel_init() failed because the specified tun queue count (%d) was invalid.\n", tunQueueCount);
         return 1;
     }
 
-    // Create queue backlog
-    for(int i = 0; i < backlog; i++) {
-        queue_element_t *element = malloc(sizeof(queue_element_t));
+    // Packets coming from the other end may be written to any queue
+    tunnel->sock_fd = sock_fd;
+    tunnel->tun_fd = tun_fds[0];
+    tunnel->sessionId = PROTOCOL_NO_SESSION;
+    tunnel->readerCount = tunQueueCount;
+
+    for(int i = 0; i < tunQueueCount; i++) {
+        tunnel->readers[i].tunnel = tunnel;
+        tunnel->readers[i].index = i;
+        tunnel->readers[i].tun_fd = tun_fds[i];
+    }
 
-        if(!element) {
-            perror("An error occurred while allocating memory for queue backlog");
+    pacer_initLink(&tunnel->link, parameters->linkType, parameters->overhead, parameters->mpu);
+    tunnel->bandwidth = bandwidth;
+    tunnel->burst = burst;
+    tunnel->batchSize = parameters->batchSize;
+    tunnel->engine = parameters->engine;
+    tunnel->offload = parameters->offload;
+    tunnel->ackFilter = parameters->ackFilter;
+    tunnel->gsoEnabled = tunnel->batchSize > 1 && probeGso(sock_fd);
+    tunnel->classifier = classifier;
+    tunnel->capture = parameters->capture;
 
-            while(queue->freeQueueElements) {
-                queue_element_t *next = queue->freeQueueElements->next;
-                free(queue->freeQueueElements);
-                queue->freeQueueElements = next;
-            }
-            
-            sem_destroy(&queue->dequeueSemaphore);
-            pthread_mutexattr_destroy(&queue->mutexAttributes);
-            pthread_mutex_destroy(&queue->mutex);
+    memcpy(&tunnel->otherEndSocketAddress, otherEndSocketAddress, sizeof(struct sockaddr));
 
-            return 1;
-        }
+    // Reads and writes of the io_uring engine have no room for the
+    // virtio_net_hdr
+    if(tunnel->offload && tunnel->engine == TUNNEL_ENGINE_IO_URING) {
+        fprintf(stderr, "The io_uring engine does not support offloads, using epoll instead.\n");
+        tunnel->engine = TUNNEL_ENGINE_EPOLL;
+    }
+
+    if(burst <= 0) {
+        burst = pacer_getDefaultBurst(bandwidth, pacer_getWireSize(&tunnel->link, TUNNEL_MAX_PACKET_SIZE));
+    }
 
-        element->next = queue->freeQueueElements;
-        queue->freeQueueElements = element;
+    if(pacer_init(&tunnel->pacer, bandwidth, burst, getNanoseconds())) {
+        fprintf(stderr, "Pacer initialization failed.\n");
+        return 1;
+    }
+    
+    if(queue_init(&tunnel->queue, tunQueueCount, classifier->classCount, queueCapacity, bandwidth, tunnel->offload ? TUNNEL_MAX_OFFLOAD_PACKET_SIZE : TUNNEL_MAX_PACKET_SIZE)) {
+        fprintf(stderr, "Queue initialization failed.\n");
+        return 1;
+    }
+
+    tunnel->probing = false;
+    tunnel->pathCount = 0;
+    tunnel->sequence = 0;
+    tunnel->resequencer = NULL;
+    atomic_init(&tunnel->uploadBandwidth, bandwidth);
+    atomic_init(&tunnel->downloadBandwidth, 0);
+
+    tunnel->superPacket = NULL;
+    tunnel->aggregatePool = parameters->aggregate ? &tunnel->consumerPool : NULL;
+    offload_initCoalescer(&tunnel->coalescer);
+
+    if((tunnel->offload || parameters->aggregate) && pool_init(&tunnel->consumerPool, TUNNEL_CONSUMER_POOL_SIZE, 0, TUNNEL_MAX_PACKET_SIZE)) {
+        fprintf(stderr, "Consumer pool initialization failed.\n");
+        return 1;
     }
 
-    queue->capacity = capacity;
-    queue->size = 0;
+    tunnel_configureQueue(&tunnel->queue, classifier, &tunnel->link, bandwidth);
+
+    tunnel->stats = parameters->stats;
+    queue_setStats(&tunnel->queue, stats_getThread(tunnel->stats, STATS_THREAD_CONSUMER), tunnel->stats->sojournTimes);
 
     return 0;
 }
 
-void queue_destroy(queue_t *queue) {
-    sem_destroy(&queue->dequeueSemaphore);
-    pthread_mutexattr_destroy(&queue->mutexAttributes);
-    pthread_mutex_destroy(&queue->mutex);
+// Reads a packet from a queue of the tun device, along with its
+// virtio_net_hdr when offloads are enabled
+ssize_t tunnel_readTun(tunnel_t *tunnel, int tun_fd, uint8_t *buffer, uint32_t size, struct virtio_net_hdr *vnetHeader) {
+    if(tunnel->offload) {
+        return offload_read(tun_fd, buffer, size, vnetHeader);
+    }
+
+    return read(tun_fd, buffer, size);
+}
+
+// Classifies a packet read from the tun device and queues it. The packet was
+// read into the buffer of the element or, when the pool was empty, into a
+// discard buffer. Returns true if the element now belongs to the queue, in
+// which case the reader needs a new one. The sojourn time of the packet is
+// counted from now, which the benchmark takes from a virtual clock. The
+// virtio_net_hdr is only given when offloads are enabled.
+bool tunnel_handleTunPacket(tunnel_t *tunnel, int producer, queue_element_t *element, uint8_t *buffer, uint32_t size, const struct virtio_net_hdr *vnetHeader, uint64_t now) {
+    packet_t packet = {
+        .buffer = buffer,
+        .packetSize = size
+    };
+    packet_info_t info;
+    packet_ack_t ack;
+    stats_thread_t *stats = stats_getThread(tunnel->stats, STATS_THREAD_PRODUCER + producer);
+    uint16_t segmentSize = 0;
+    uint16_t headerSize = 0;
+
+    if(packet_parse(&packet, &info)) {
+        stats_add(&stats->ignoredPackets, 1);
+        log_countEvent(LOG_EVENT_UNKNOWN_PACKET);
+        log_debug("Ignored packet of unknown IP version.");
+        return false;
+    }
+
+    if(vnetHeader && offload_preparePacket(&packet, &info, vnetHeader, &segmentSize, &headerSize)) {
+        stats_add(&stats->ignoredPackets, 1);
+        log_countEvent(LOG_EVENT_UNKNOWN_PACKET);
+        log_debug("Ignored offloaded packet that cannot be segmented (GSO type %u).", vnetHeader->gso_type);
+        return false;
+    }
+
+    int priority = classifier_classify(tunnel->classifier, &info);
+
+    if(tunnel->capture) {
+        capture_write(tunnel->capture, buffer, size, priority);
+    }
+
+    if(!element) {
+        stats_add(&stats->classes[priority].droppedPackets[STATS_DROP_NO_BUFFER], 1);
+        stats_add(&stats->classes[priority].droppedBytes[STATS_DROP_NO_BUFFER], size);
+        log_countEvent(LOG_EVENT_NO_BUFFER);
+        log_debug("Failed to enqueue packet with priority %d (no remaining backlog).", priority);
+        return false;
+    }
+
+    log_trace("Enqueuing packet with type %d and priority %d.", info.protocol, priority);
+
+    // The element now belongs to the queue, and it comes back to the pool
+    // once it has been sent or dropped. Small packets are moved to a
+    // smaller buffer, and the reader then keeps its buffer.
+    element->packet.packetSize = size;
+    protocol_writeHeader(element->packet.buffer, PROTOCOL_TYPE_DATA, tunnel->sessionId);
+
+    queue_element_t *queuedElement = pool_copybreak(queue_getPool(&tunnel->queue, producer), element);
+
+    queuedElement->flowHash = info.flowHash;
+    queuedElement->enqueueTimestamp = now;
+    queuedElement->segmentSize = segmentSize;
+    queuedElement->headerSize = headerSize;
+    queuedElement->pureAck = tunnel->ackFilter && !packet_parseAck(&packet, &info, &ack);
+
+    queue_enqueue(&tunnel->queue, producer, queuedElement, priority);
+
+    return queuedElement == element;
+}
+
+// Runs both rate controllers on the reply to a probe. The delay of the probe
+// and the bytes the server received give the upload sample, and the delay of
+// the reply and the bytes received here the download sample. Over several
+// paths, the delay of the probe is the delay of the path it was sent on.
+// Returns 1 if the reply is malformed.
+static int handleProbeReply(tunnel_t *tunnel, const uint8_t *buffer, uint32_t size) {
+    protocol_probe_reply_t reply;
+    uint64_t now = getNanoseconds();
+
+    if(protocol_readProbeReply(buffer, size, &reply)) {
+        return 1;
+    }
+
+    for(int i = 0; i < tunnel->pathCount; i++) {
+        if(atomic_load_explicit(&tunnel->paths[i].probeTimestamp, memory_order_relaxed) == reply.probeTimestamp) {
+            path_updateDelay(&tunnel->paths[i], (int64_t)(reply.timestamp - reply.probeTimestamp));
+            break;
+        }
+    }
+
+    if(!tunnel->probing) {
+        return 0;
+    }
+
+    if(probe_update(&tunnel->uploadController, (int64_t)(reply.timestamp - reply.probeTimestamp), reply.receivedBytes, reply.timestamp)) {
+        atomic_store_explicit(&tunnel->uploadBandwidth, tunnel->uploadController.rate, memory_order_relaxed);
+        log_debug("Upload rate set to %u Bps.", tunnel->uploadController.rate);
+    }
 
-    while(queue->freeQueueElements) {
-        queue_element_t *next = queue->freeQueueElements->next;
-        free(queue->freeQueueElements);
-        queue->freeQueueElements = next;
+    if(probe_update(&tunnel->downloadController, (int64_t)(now - reply.timestamp), tunnel->receivedBytes, now)) {
+        atomic_store_explicit(&tunnel->downloadBandwidth, tunnel->downloadController.rate, memory_order_relaxed);
+        log_debug("Download rate set to %u Bps.", tunnel->downloadController.rate);
     }
 
-    queue->size = 0;
-    queue->capacity = 0;
+    return 0;
 }
 
-int queue_enqueue_tryReject(queue_t *queue, int priority) {
-    printf("queue_enqueue_tryReject() called\n");
+// Checks that a datagram comes from the other end and belongs to the session,
+// and handles it if it is a probe reply. Returns true if it carries packets.
+static bool checkDatagram(tunnel_t *tunnel, const void *address, socklen_t addressLength, const uint8_t *buffer, uint32_t size) {
+    protocol_header_t header;
+    stats_thread_t *stats = stats_getThread(tunnel->stats, STATS_THREAD_RECEIVER);
+    bool knownAddress = tunnel->pathCount ? path_find(tunnel->paths, tunnel->pathCount, address) != -1 : !memcmp(address, &tunnel->otherEndSocketAddress, addressLength);
+
+    if(!knownAddress) {
+        stats_add(&stats->ignoredDatagrams, 1);
+        log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+        log_debug("Ignored packet with wrong socket address.");
+        return false;
+    }
 
-    for(int p = TUNNEL_QUEUE_COUNT - 1; p > priority; p--) {
-        if(queue->queues[p]) {
-            queue_element_t *e = queue->queues[p];
-            queue->queues[p] = e->next;
-            e->next = queue->freeQueueElements;
-            queue->freeQueueElements = e;
+    if(protocol_readHeader(buffer, size, &header) || (header.type != PROTOCOL_TYPE_DATA && header.type != PROTOCOL_TYPE_AGGREGATE && header.type != PROTOCOL_TYPE_PROBE_REPLY) || header.sessionId != tunnel->sessionId) {
+        stats_add(&stats->ignoredDatagrams, 1);
+        log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+        log_debug("Ignored packet that does not belong to the session.");
+        return false;
+    }
 
-            packet_t *packet = &e->packet;
+    if(header.type == PROTOCOL_TYPE_PROBE_REPLY) {
+        if(!sendsProbes(tunnel) || handleProbeReply(tunnel, buffer, size)) {
+            stats_add(&stats->ignoredDatagrams, 1);
+            log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+            log_debug("Ignored invalid probe reply.");
+        }
 
-            queue->size -= packet->packetSize;
+        return false;
+    }
 
-            printf("Dropped 1 packet from queue %d for a packet in queue %d\n", p, priority);
+    return true;
+}
+
+// Turns a datagram back into packets for the tun device, gives where they are
+// (an aggregate holds up to PROTOCOL_MAX_AGGREGATED_PACKETS of them), and
+// returns their number
+static int unpackDatagram(tunnel_t *tunnel, uint8_t *buffer, uint32_t size, struct iovec *packets) {
+    stats_thread_t *stats = stats_getThread(tunnel->stats, STATS_THREAD_RECEIVER);
+    int count = 1;
 
-            sem_wait(&queue->dequeueSemaphore);
+    if(buffer[0] == PROTOCOL_TYPE_AGGREGATE) {
+        count = protocol_splitAggregate(buffer, size, packets);
 
+        if(!count) {
+            stats_add(&stats->ignoredDatagrams, 1);
+            log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+            log_debug("Ignored malformed aggregate.");
             return 0;
         }
+    } else {
+        protocol_restorePacketInformation(buffer, size);
+        packets[0].iov_base = buffer;
+        packets[0].iov_len = size;
     }
-    printf("no packets were dropped.\n");
 
-    return 1;
+    stats_add(&stats->receivedPackets, count);
+    stats_add(&stats->receivedBytes, size);
+    tunnel->receivedBytes += size;
+
+    return count;
 }
 
-int queue_enqueue(queue_t *queue, packet_t *packet, int priority) {
-    pthread_mutex_lock(&queue->mutex);
+// Checks that a datagram comes from the other end and belongs to the session.
+// If it does, turns it back into packets for the tun device, gives where they
+// are, and returns their number. Returns 0 if the datagram is ignored.
+int tunnel_acceptDatagram(tunnel_t *tunnel, const void *address, socklen_t addressLength, uint8_t *buffer, uint32_t size, struct iovec *packets) {
+    if(!checkDatagram(tunnel, address, addressLength, buffer, size)) {
+        return 0;
+    }
 
-    if(!queue->freeQueueElements) {
-        if(queue_enqueue_tryReject(queue, priority)) {
-            printf("Failed to enqueue packet with priority %d (no remaining backlog).\n", priority);
-            printf("Queue 0: %d\nQueue 1: %d\nFree: %d\n", getQueueBacklog(queue->queues[0]), getQueueBacklog(queue->queues[1]), getQueueBacklog(queue->freeQueueElements));
-            pthread_mutex_unlock(&queue->mutex);
-            return 1;
+    return unpackDatagram(tunnel, buffer, size, packets);
+}
+
+static void deliverDatagram(void *context, uint8_t *buffer, uint32_t size) {
+    tunnel_t *tunnel = (tunnel_t *)context;
+    struct iovec packets[PROTOCOL_MAX_AGGREGATED_PACKETS];
+    int count = unpackDatagram(tunnel, buffer, size, packets);
+
+    for(int i = 0; i < count; i++) {
+        tunnel_writeTun(tunnel, packets[i].iov_base, packets[i].iov_len);
+    }
+}
+
+// Accepts a datagram and writes its packets to the tun device. Over several
+// paths, datagrams go through the resequencer first. Every datagram received,
+// probe replies included, gives the resequencer a chance to give up on the
+// missing ones, so that they are not waited for longer than a probe interval
+// on an idle tunnel.
+void tunnel_receiveDatagram(tunnel_t *tunnel, const void *address, socklen_t addressLength, uint8_t *buffer, uint32_t size) {
+    if(!tunnel->resequencer) {
+        if(checkDatagram(tunnel, address, addressLength, buffer, size)) {
+            deliverDatagram(tunnel, buffer, size);
         }
+
+        return;
     }
 
-    while(packet->packetSize + queue->size > queue->capacity) {
-        if(queue_enqueue_tryReject(queue, priority)) {
-            printf("Failed to enqueue packet with priority %d (queue is saturated).\n", priority);
-            pthread_mutex_unlock(&queue->mutex);
-            return 1;
+    uint64_t now = getNanoseconds();
+    int heldCount = resequencer_expire(tunnel->resequencer, now, deliverDatagram, tunnel);
+
+    uint16_t sequence;
+
+    if(checkDatagram(tunnel, address, addressLength, buffer, size)) {
+        if(protocol_readSequence(buffer, &size, &sequence)) {
+            log_countEvent(LOG_EVENT_IGNORED_DATAGRAM);
+            log_debug("Ignored datagram without a sequence number.");
+        } else {
+            heldCount += resequencer_push(tunnel->resequencer, sequence, buffer, size, now, deliverDatagram, tunnel);
         }
     }
 
-    queue_element_t *temporaryElement = queue->freeQueueElements;
-    queue->freeQueueElements = queue->freeQueueElements->next;
-    memcpy(&temporaryElement->packet, packet, sizeof(packet_t));
-    temporaryElement->next = NULL;
+    // The slots of the datagrams that were held may take new datagrams
+    // before the end of the batch, so the packets that the coalescer holds
+    // back are written now
+    if(heldCount) {
+        tunnel_flushTun(tunnel);
+    }
+}
 
-    queue_element_t *previousElement = getLastQueueElement(queue->queues[priority]);
+static bool isAggregate(const queue_element_t *element) {
+    return element->packet.buffer[0] == PROTOCOL_TYPE_AGGREGATE;
+}
 
-    if(previousElement) {
-        previousElement->next = temporaryElement;
-    } else {
-        queue->queues[priority] = temporaryElement;
+static bool canTakeSmallPackets(const queue_element_t *element) {
+    return isAggregate(element) || element->packet.packetSize <= TUNNEL_AGGREGATION_MAX_PACKET_SIZE;
+}
+
+// Copies a packet at the end of an aggregate, its packet information header
+// being replaced by the length prefix
+static void appendToAggregate(queue_element_t *aggregate, const queue_element_t *element) {
+    uint8_t *buffer = aggregate->packet.buffer + aggregate->packet.packetSize;
+    uint32_t size = element->packet.packetSize;
+
+    memcpy(buffer, element->packet.buffer, size);
+    protocol_writeAggregatePrefix(buffer, size);
+    aggregate->packet.packetSize += size;
+}
+
+// Adds a packet that leaves now at the end of a batch, and returns what the
+// pacer has to be charged for it: the wire size of its datagram on the link.
+// Consecutive small packets go in the same aggregate (with an aggregate
+// pool), and each one is then charged by how much it makes the aggregate
+// grow on the wire. Packets are never held back, so that only packets that
+// leave together are packed, and their order is kept. When the pool is
+// empty, packets are sent as they are.
+uint32_t tunnel_addToBatch(pool_t *aggregatePool, queue_element_t **batch, int *count, queue_element_t *element, const pacer_link_t *link) {
+    uint32_t size = element->packet.packetSize;
+
+    if(aggregatePool && *count > 0 && size <= TUNNEL_AGGREGATION_MAX_PACKET_SIZE) {
+        queue_element_t *last = batch[*count - 1];
+        uint32_t chargedSize = last->packet.packetSize;
+
+        if(!isAggregate(last) && canTakeSmallPackets(last) && last->packet.packetSize + size <= TUNNEL_MAX_PACKET_SIZE) {
+            queue_element_t *aggregate = pool_getForSize(aggregatePool, TUNNEL_MAX_PACKET_SIZE);
+
+            if(aggregate) {
+                // The aggregate takes the header of its first packet
+                memcpy(aggregate->packet.buffer, last->packet.buffer, PROTOCOL_HEADER_SIZE);
+                aggregate->packet.buffer[0] = PROTOCOL_TYPE_AGGREGATE;
+                aggregate->packet.packetSize = PROTOCOL_HEADER_SIZE;
+                aggregate->enqueueTimestamp = last->enqueueTimestamp;
+                aggregate->segmentSize = 0;
+                appendToAggregate(aggregate, last);
+                pool_release(last);
+
+                batch[*count - 1] = last = aggregate;
+            }
+        }
+
+        if(isAggregate(last) && last->packet.packetSize + size <= TUNNEL_MAX_PACKET_SIZE) {
+            appendToAggregate(last, element);
+            pool_release(element);
+
+            return pacer_getWireSize(link, last->packet.packetSize) - pacer_getWireSize(link, chargedSize);
+        }
     }
 
-    queue->size += packet->packetSize;
+    batch[(*count)++] = element;
 
-    sem_post(&queue->dequeueSemaphore);
+    return pacer_getWireSize(link, size);
+}
 
-    pthread_mutex_unlock(&queue->mutex);
+// Packets that are due later still join a batch when they can be packed in
+// its last datagram, which then leaves no earlier than a full-sized packet
+// would have
+uint64_t tunnel_getLookahead(const pool_t *aggregatePool, queue_element_t **batch, int count, const pacer_t *pacer) {
+    if(aggregatePool && count > 0 && canTakeSmallPackets(batch[count - 1])) {
+        uint64_t lookahead = (TUNNEL_MAX_PACKET_SIZE - batch[count - 1]->packet.packetSize) * PACER_CREDIT_SCALE / pacer->rate;
 
-    return 0;
+        if(lookahead > TUNNEL_AGGREGATION_MAX_LOOKAHEAD) {
+            return TUNNEL_AGGREGATION_MAX_LOOKAHEAD;
+        }
+
+        if(lookahead > TUNNEL_BATCH_LOOKAHEAD) {
+            return lookahead;
+        }
+    }
+
+    return TUNNEL_BATCH_LOOKAHEAD;
 }
 
-packet_t *queue_dequeue(queue_t *queue) {
-    sem_wait(&queue->dequeueSemaphore);
+// Super-packets are segmented lazily: each time the pacer lets a packet
+// leave, only the next segment is cut, so that segments are paced one by one
+// at their own wire size, like any other packet. Takes the packet that the
+// queue gave, or NULL while a super-packet is being segmented, and returns
+// the packet to send.
+static queue_element_t *takeSegment(tunnel_t *tunnel, queue_element_t *element) {
+    if(element && element->segmentSize) {
+        tunnel->superPacket = element;
+        tunnel->segmentOffset = 0;
+    }
+
+    queue_element_t *superPacket = tunnel->superPacket;
+
+    if(!superPacket) {
+        return element;
+    }
+
+    uint32_t headerEnd = TUNNEL_PACKET_INFORMATION_SIZE + superPacket->headerSize;
+    queue_element_t *segment = pool_getForSize(&tunnel->consumerPool, headerEnd + superPacket->segmentSize);
+
+    if(!segment) {
+        log_debug("No buffer left for the next segment of a super-packet.");
+        return NULL;
+    }
+
+    segment->packet.packetSize = offload_writeSegment(superPacket, tunnel->segmentOffset, segment->packet.buffer);
+    segment->segmentSize = 0;
+    tunnel->segmentOffset += segment->packet.packetSize - headerEnd;
+
+    if(headerEnd + tunnel->segmentOffset >= superPacket->packet.packetSize) {
+        queue_release(&tunnel->queue, superPacket);
+        tunnel->superPacket = NULL;
+    }
+
+    return segment;
+}
 
-    pthread_mutex_lock(&queue->mutex);
+// Adds to the batch, after the count packets it already holds, the packets
+// that the pacer allows to send now or within the batch lookahead. Sending
+// them early only moves them ahead by that much, so the long-term rate is
+// unchanged. Sets drained when the queue runs out of packets, and not when
+// its packets are held back by the ceiling of their class.
+int tunnel_pollDuePackets(tunnel_t *tunnel, queue_element_t **batch, int count, uint64_t now, bool *drained) {
+    uint32_t bandwidth = atomic_load_explicit(&tunnel->uploadBandwidth, memory_order_relaxed);
 
-    int i = 0;
-    bool found = false;
-    packet_t *packet = NULL;
+    *drained = false;
 
-    while(!found && i < TUNNEL_QUEUE_COUNT) {
-        if(queue->queues[i]) {
-            found = true;
-            
-            queue_element_t *e = queue->queues[i];
-            queue->queues[i] = e->next;
-            e->next = queue->freeQueueElements;
-            queue->freeQueueElements = e;
+    if(bandwidth != (uint32_t)tunnel->bandwidth) {
+        tunnel_setBandwidth(tunnel, bandwidth, now);
+    }
 
-            packet = &e->packet;
+    while(count < tunnel->batchSize && pacer_isDue(&tunnel->pacer, now, tunnel_getLookahead(tunnel->aggregatePool, batch, count, &tunnel->pacer))) {
+        queue_element_t *element = takeSegment(tunnel, tunnel->superPacket ? NULL : queue_poll(&tunnel->queue, now));
 
-            queue->size -= packet->packetSize;
+        if(!element) {
+            *drained = !queue_isThrottled(&tunnel->queue);
+            break;
         }
 
-        i++;
+        pacer_consume(&tunnel->pacer, tunnel_addToBatch(tunnel->aggregatePool, batch, &count, element, &tunnel->link));
     }
 
-    pthread_mutex_unlock(&queue->mutex);
+    stats_set(&stats_getThread(tunnel->stats, STATS_THREAD_CONSUMER)->pacerCredit, tunnel->pacer.credit);
 
-    return packet;
+    return count;
 }
 
-int tunnel_init(tunnel_t *tunnel, int sock_fd, int tun_fd, int queueCapacity, int overhead, int bandwidth, const struct sockaddr *otherEndSocketAddress) {
-    tunnel->sock_fd = sock_fd;
-    tunnel->tun_fd = tun_fd;
-    tunnel->overhead = overhead;
-    tunnel->bandwidth = bandwidth;
+// Time until the next packet may leave, when the queue is not drained. The
+// queue is only polled once the pacer is due, so a throttled class only
+// counts then.
+uint64_t tunnel_getDelay(tunnel_t *tunnel, uint64_t now) {
+    uint64_t delay = pacer_getDelay(&tunnel->pacer, now);
 
-    memcpy(&tunnel->otherEndSocketAddress, otherEndSocketAddress, sizeof(struct sockaddr));
-    
-    if(queue_init(&tunnel->queue, queueCapacity, 100)) {
-        fprintf(stderr, "Queue initialization failed.\n");
-        return 1;
+    return delay ? delay : queue_getThrottleDelay(&tunnel->queue, now);
+}
+
+// Sends a probe when one is due, and returns when the next one is
+// (UINT64_MAX without probes). Probes are not paced, as they are a few bytes
+// ten times a second. Over several paths, one probe goes on each path, with
+// clocks a nanosecond apart so that each reply tells its path.
+uint64_t tunnel_probe(tunnel_t *tunnel, uint64_t now) {
+    if(!sendsProbes(tunnel)) {
+        return UINT64_MAX;
     }
 
-    return 0;
+    if(now >= tunnel->nextProbeTimestamp) {
+        uint8_t buffer[PROTOCOL_PROBE_SIZE];
+        protocol_probe_t probe = {
+            .timestamp = now,
+            .bandwidth = atomic_load_explicit(&tunnel->downloadBandwidth, memory_order_relaxed)
+        };
+
+        for(int i = 0; i < tunnel->pathCount; i++) {
+            probe.timestamp = now + i;
+            protocol_writeProbe(buffer, tunnel->sessionId, &probe);
+            atomic_store_explicit(&tunnel->paths[i].probeTimestamp, probe.timestamp, memory_order_relaxed);
+
+            if(path_send(tunnel->sock_fd, &tunnel->paths[i], buffer, PROTOCOL_PROBE_SIZE) == -1) {
+                perror("sendmsg() failed while probing");
+            }
+        }
+
+        if(!tunnel->pathCount) {
+            protocol_writeProbe(buffer, tunnel->sessionId, &probe);
+
+            if(sendto(tunnel->sock_fd, buffer, PROTOCOL_PROBE_SIZE, 0, &tunnel->otherEndSocketAddress, sizeof(struct sockaddr_in)) == -1) {
+                perror("sendto() failed while probing");
+            }
+        }
+
+        tunnel->nextProbeTimestamp = now + PROBE_INTERVAL;
+    }
+
+    return tunnel->nextProbeTimestamp;
 }
 
 static void *tunEnqueueThreadMain(void *arg) {
-    tunnel_t *tunnel = (tunnel_t *)arg;
-    packet_t packet;
+    tunnel_reader_t *reader = (tunnel_reader_t *)arg;
+    tunnel_t *tunnel = reader->tunnel;
+    queue_element_t *element = NULL;
+    uint8_t discardBuffer[TUNNEL_MAX_OFFLOAD_PACKET_SIZE];
+    struct virtio_net_hdr vnetHeader;
 
     while(true) {
-        ssize_t size = read(tunnel->tun_fd, packet.buffer, TUNNEL_MAX_PACKET_SIZE);
+        // Take the buffer from the pool before reading, so that the packet is
+        // read straight into the element that will be queued.
+        if(!element) {
+            element = queue_getFreeElement(&tunnel->queue, reader->index);
+        }
+
+        // Without a free element, the packet still has to be read from the
+        // tun device, but only to be dropped.
+        uint8_t *buffer = element ? element->packet.buffer : discardBuffer;
+        ssize_t size = tunnel_readTun(tunnel, reader->tun_fd, buffer, element ? element->packet.bufferSize : sizeof(discardBuffer), &vnetHeader);
 
         if(size == -1) {
             perror("An error occurred while reading from tun device");
@@ -303,81 +795,281 @@ static void *tunEnqueueThreadMain(void *arg) {
             break;
         }
 
-        packet.packetSize = size;
+        if(tunnel_handleTunPacket(tunnel, reader->index, element, buffer, size, tunnel->offload ? &vnetHeader : NULL, getNanoseconds())) {
+            element = NULL;
+        }
+    }
 
-        // Determine IP version
-        int ipVersion = packet.buffer[4] >> 4;
-        int protocol;
+    return NULL;
+}
 
-        if(ipVersion == 4) {
-            protocol = packet.buffer[13];
-        } else if(ipVersion == 6) {
-            protocol = packet.buffer[10];
-        } else {
-            printf("Unknown IP version!\n");
-            continue;
+static void countSentPackets(tunnel_t *tunnel, queue_element_t **elements, int count) {
+    stats_thread_t *stats = stats_getThread(tunnel->stats, STATS_THREAD_CONSUMER);
+    uint64_t byteCount = 0;
+
+    for(int i = 0; i < count; i++) {
+        byteCount += elements[i]->packet.packetSize;
+    }
+
+    stats_add(&stats->sentPackets, count);
+    stats_add(&stats->sentBytes, byteCount);
+}
+
+// Sends a batch of packets with one sendmmsg() call. With UDP GSO, runs of
+// packets of the same size (the last one may be shorter) that leave on the
+// same path are merged into a single message that the kernel splits into one
+// datagram per packet.
+static int sendMessages(tunnel_t *tunnel, queue_element_t **elements, const uint8_t *paths, int count) {
+    struct mmsghdr messages[TUNNEL_MAX_BATCH_SIZE];
+    struct iovec iovecs[TUNNEL_MAX_BATCH_SIZE];
+    int firstElements[TUNNEL_MAX_BATCH_SIZE];
+    struct {
+        _Alignas(struct cmsghdr) char buffer[CMSG_SPACE(sizeof(uint16_t)) + PATH_SOURCE_CONTROL_SIZE];
+    } controls[TUNNEL_MAX_BATCH_SIZE];
+    int messageCount = 0;
+
+    memset(messages, 0, count * sizeof(struct mmsghdr));
+
+    for(int i = 0; i < count; i++) {
+        iovecs[i].iov_base = elements[i]->packet.buffer;
+        iovecs[i].iov_len = elements[i]->packet.packetSize;
+    }
+
+    for(int i = 0; i < count;) {
+        uint32_t segmentSize = elements[i]->packet.packetSize;
+        uint32_t totalSize = segmentSize;
+        int j = i + 1;
+
+        while(tunnel->gsoEnabled && j < count && j - i < TUNNEL_MAX_GSO_SEGMENTS) {
+            uint32_t size = elements[j]->packet.packetSize;
+
+            if(size > segmentSize || totalSize + size > TUNNEL_MAX_GSO_SIZE || (tunnel->pathCount && paths[j] != paths[i])) {
+                break;
+            }
+
+            totalSize += size;
+            j++;
+
+            if(size < segmentSize) {
+                break;
+            }
         }
 
-        int priority = protocol == 6;
+        struct msghdr *message = &messages[messageCount].msg_hdr;
+
+        message->msg_name = tunnel->pathCount ? (void *)&tunnel->paths[paths[i]].address : (void *)&tunnel->otherEndSocketAddress;
+        message->msg_namelen = sizeof(struct sockaddr_in);
+        message->msg_iov = &iovecs[i];
+        message->msg_iovlen = j - i;
 
-        printf("Enqueuing paquet with type %d and priority %d.\n", protocol, priority);
+        struct cmsghdr *cmsg = (struct cmsghdr *)controls[messageCount].buffer;
+        size_t controlSize = 0;
+
+        if(j - i > 1) {
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t *)CMSG_DATA(cmsg) = segmentSize;
+            controlSize = CMSG_SPACE(sizeof(uint16_t));
+        }
 
-        queue_enqueue(&tunnel->queue, &packet, protocol == 6);
+        if(tunnel->pathCount) {
+            controlSize += path_writeSource(&tunnel->paths[paths[i]], (struct cmsghdr *)(controls[messageCount].buffer + controlSize));
+        }
+
+        if(controlSize) {
+            message->msg_control = controls[messageCount].buffer;
+            message->msg_controllen = controlSize;
+        }
+
+        firstElements[messageCount++] = i;
+        i = j;
     }
 
-    return NULL;
+    int sent = 0;
+
+    while(sent < messageCount) {
+        int result = sendmmsg(tunnel->sock_fd, messages + sent, messageCount - sent, 0);
+
+        if(result == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            // The route may go through a device that cannot segment
+            if(tunnel->gsoEnabled && (errno == EIO || errno == EINVAL)) {
+                fprintf(stderr, "UDP GSO failed, sending packets one by one from now on.\n");
+                tunnel->gsoEnabled = false;
+                countSentPackets(tunnel, elements, firstElements[sent]);
+
+                return sendMessages(tunnel, elements + firstElements[sent], paths + firstElements[sent], count - firstElements[sent]);
+            }
+
+            perror("An error occurred sending data through the socket");
+            return 1;
+        }
+
+        sent += result;
+    }
+
+    countSentPackets(tunnel, elements, count);
+
+    return 0;
+}
+
+// Over several paths, each datagram is numbered and scheduled on a path first
+int tunnel_sendBatch(tunnel_t *tunnel, queue_element_t **elements, int count) {
+    uint8_t paths[TUNNEL_MAX_BATCH_SIZE];
+
+    if(tunnel->pathCount) {
+        uint64_t now = getNanoseconds();
+
+        for(int i = 0; i < count; i++) {
+            packet_t *packet = &elements[i]->packet;
+
+            packet->packetSize = protocol_writeSequence(packet->buffer, packet->packetSize, tunnel->sequence++);
+            paths[i] = path_select(tunnel->paths, tunnel->pathCount, packet->packetSize, now);
+        }
+    }
+
+    return sendMessages(tunnel, elements, paths, count);
 }
 
 static void *tunDequeueThreadMain(void *arg) {
     tunnel_t *tunnel = (tunnel_t *)arg;
+    queue_element_t *batch[TUNNEL_MAX_BATCH_SIZE];
+
+    // The default timer slack of 50 us would make every pacing sleep overshoot
+    if(prctl(PR_SET_TIMERSLACK, 1)) {
+        perror("prctl(PR_SET_TIMERSLACK) failed");
+    }
 
     while(true) {
-        packet_t *packet = queue_dequeue(&tunnel->queue);
+        // Wait for credit before picking the packet, so that the packet that
+        // is sent is the most important one at the time it can actually leave.
+        // Credit accrues on the clock, not from the end of sendto(), so the
+        // cost of the syscall is not added to every packet.
+        uint64_t idleTime = pacer_wait(&tunnel->pacer);
 
-        if(packet) {
-            unsigned int totalSize = packet->packetSize + tunnel->overhead;
-            unsigned int transmitTime = (totalSize * 1000000) / tunnel->bandwidth;
-            unsigned int currentTimestamp = getMicroseconds();
+        stats_add(&stats_getThread(tunnel->stats, STATS_THREAD_CONSUMER)->idleTime, idleTime);
 
-            if(sendto(tunnel->sock_fd, packet->buffer, packet->packetSize, 0, &tunnel->otherEndSocketAddress, sizeof(struct sockaddr_in)) == -1) {
-                perror("An error occurred sending data through the socket");
-                break;
-            }
+        int count = 0;
+        queue_element_t *element = takeSegment(tunnel, tunnel->superPacket ? NULL : queue_dequeue(&tunnel->queue));
 
-            // Wait until the packet is received
-            while(getMicroseconds() - currentTimestamp < transmitTime);
+        if(!element) {
+            continue;
+        }
+
+        pacer_consume(&tunnel->pacer, tunnel_addToBatch(tunnel->aggregatePool, batch, &count, element, &tunnel->link));
+
+        // Every other packet that is due now (or very soon) goes in the same
+        // batch
+        bool drained;
+
+        count = tunnel_pollDuePackets(tunnel, batch, count, getNanoseconds(), &drained);
+
+        int result = tunnel_sendBatch(tunnel, batch, count);
+
+        for(int i = 0; i < count; i++) {
+            queue_release(&tunnel->queue, batch[i]);
+        }
+
+        if(result) {
+            break;
         }
     }
 
     return NULL;
 }
 
+static void countTunWriteError(tunnel_t *tunnel) {
+    stats_add(&stats_getThread(tunnel->stats, STATS_THREAD_RECEIVER)->tunWriteErrors, 1);
+    log_countEvent(LOG_EVENT_TUN_WRITE_ERROR);
+    log_debug("write() failed on tun device: %s", strerror(errno));
+}
+
+// Writes a packet received from the other end to the tun device. With
+// offloads, consecutive segments of a TCP flow are held back to be written as
+// one super-packet, so the buffers of a batch have to stay untouched until
+// tunnel_flushTun() is called at the end of the batch.
+void tunnel_writeTun(tunnel_t *tunnel, uint8_t *buffer, uint32_t size) {
+    if(tunnel->offload) {
+        if(offload_coalesce(&tunnel->coalescer, tunnel->tun_fd, buffer, size)) {
+            countTunWriteError(tunnel);
+        }
+    } else if(write(tunnel->tun_fd, buffer, size) == -1) {
+        countTunWriteError(tunnel);
+    } else {
+        log_trace("Successfully received packet.");
+    }
+}
+
+void tunnel_flushTun(tunnel_t *tunnel) {
+    if(tunnel->offload && offload_flush(&tunnel->coalescer, tunnel->tun_fd)) {
+        countTunWriteError(tunnel);
+    }
+}
+
 static void *tunReceivingThreadMain(void *arg) {
     tunnel_t *tunnel = (tunnel_t *)arg;
-    uint8_t packetBuffer[TUNNEL_MAX_PACKET_SIZE];
-    struct sockaddr address;
-    socklen_t addressLength = sizeof(struct sockaddr_in);
+    uint8_t packetBuffers[TUNNEL_MAX_BATCH_SIZE][TUNNEL_MAX_DATAGRAM_SIZE];
+    struct mmsghdr messages[TUNNEL_MAX_BATCH_SIZE];
+    struct iovec iovecs[TUNNEL_MAX_BATCH_SIZE];
+    struct sockaddr addresses[TUNNEL_MAX_BATCH_SIZE];
+
+    memset(messages, 0, sizeof(messages));
+
+    for(int i = 0; i < TUNNEL_MAX_BATCH_SIZE; i++) {
+        iovecs[i].iov_base = packetBuffers[i];
+        iovecs[i].iov_len = TUNNEL_MAX_DATAGRAM_SIZE;
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = &addresses[i];
+    }
 
     while(true) {
-        ssize_t size = recvfrom(tunnel->sock_fd, packetBuffer, TUNNEL_MAX_PACKET_SIZE, 0, &address, &addressLength);
+        for(int i = 0; i < tunnel->batchSize; i++) {
+            messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+
+        // Block until one datagram arrives, then take whatever else is queued
+        int count = recvmmsg(tunnel->sock_fd, messages, tunnel->batchSize, MSG_WAITFORONE, NULL);
+
+        if(count == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
 
-        if(size == -1) {
             perror("An error occurred while reading from socket");
             break;
-        } else if(size == 0) {
-            fprintf(stderr, "Exiting receiving thread because EOF was received from socket.\n");
-            break;
         }
 
-        if(memcmp(&address, &tunnel->otherEndSocketAddress, addressLength) == 0) {
-            if(write(tunnel->tun_fd, packetBuffer, size) == -1) {
-                perror("write() failed on tun device");
-                //break;
-            } else {
-                printf("Successfully received packet.\n");
-            }
-        } else {
-            printf("Ignored packet with wrong socket address.\n");
+        // Empty datagrams are ignored for lack of a header
+        for(int i = 0; i < count; i++) {
+            tunnel_receiveDatagram(tunnel, &addresses[i], messages[i].msg_hdr.msg_namelen, packetBuffers[i], messages[i].msg_len);
+        }
+
+        tunnel_flushTun(tunnel);
+    }
+
+    return NULL;
+}
+
+static void *tunProbingThreadMain(void *arg) {
+    tunnel_t *tunnel = (tunnel_t *)arg;
+
+    while(true) {
+        uint64_t deadline = tunnel_probe(tunnel, getNanoseconds());
+        struct timespec ts = {
+            .tv_sec = deadline / 1000000000,
+            .tv_nsec = deadline % 1000000000
+        };
+
+        int result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+        if(result && result != EINTR) {
+            fprintf(stderr, "clock_nanosleep() failed while probing.\n");
+            break;
         }
     }
 
@@ -1,51 +1,166 @@
 #ifndef __TUNNEL_H_INCLUDED__
 #define __TUNNEL_H_INCLUDED__
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <sys/socket.h>
 
-#define TUNNEL_MAX_PACKET_SIZE 1500
-#define TUNNEL_QUEUE_COUNT 2
+#include <capture.h>
+#include <classifier.h>
+#include <offload.h>
+#include <pacer.h>
+#include <path.h>
+#include <probe.h>
+#include <queue.h>
+#include <resequencer.h>
+#include <stats.h>
 
-typedef struct {
-    uint16_t packetSize;
-    uint8_t buffer[TUNNEL_MAX_PACKET_SIZE];
-} packet_t;
+#define TUNNEL_DEFAULT_BATCH_SIZE 32
+#define TUNNEL_MAX_BATCH_SIZE 64
+
+// Packets that the pacer would release within this time are sent together
+#define TUNNEL_BATCH_LOOKAHEAD 100000
+
+// Limits of UDP GSO: segments per call and size of the whole datagram
+#define TUNNEL_MAX_GSO_SEGMENTS 64
+#define TUNNEL_MAX_GSO_SIZE 65000
+
+// Packets of at most this size (packet information header included) are
+// packed with the other small packets of their batch into one datagram
+#define TUNNEL_AGGREGATION_MAX_PACKET_SIZE 512
+
+// While the last datagram of a batch can take more small packets, packets
+// join the batch as long as the pacer would release them before the room left
+// in the datagram has been sent, and within this latency budget: the next
+// packets then wait no longer than after a full-sized packet.
+#define TUNNEL_AGGREGATION_MAX_LOOKAHEAD 10000000
 
-struct queue_element_s;
+// Segments of super-packets and aggregates are only held from the time they
+// are built to the end of the batch they are sent in. The smaller classes
+// take a part of the budget, so it covers two batches for the MTU class to
+// hold one.
+#define TUNNEL_CONSUMER_POOL_SIZE (2 * TUNNEL_MAX_BATCH_SIZE * TUNNEL_MAX_PACKET_SIZE)
 
-typedef struct queue_element_s {
-    packet_t packet;
-    struct queue_element_s *next;
-} queue_element_t;
+// Maximum number of queues of a multi-queue tun device, each read by its own
+// thread
+#define TUNNEL_MAX_QUEUE_COUNT QUEUE_MAX_PRODUCER_COUNT
+
+// How the tunnel is driven: one thread per task, or a single event loop
+// (epoll, or io_uring where the kernel supports it)
+#define TUNNEL_ENGINE_THREADS 0
+#define TUNNEL_ENGINE_EPOLL 1
+#define TUNNEL_ENGINE_IO_URING 2
 
 typedef struct {
-    queue_element_t *freeQueueElements;
-    queue_element_t *queues[TUNNEL_QUEUE_COUNT];
-    int capacity;
-    int size;
-    pthread_mutex_t mutex;
-    pthread_mutexattr_t mutexAttributes;
-    sem_t dequeueSemaphore;
-} queue_t;
+    int queueCapacity;
+    int overhead;
+    int linkType;
+    int mpu;
+    int bandwidth;
+    int burst;
+    int batchSize;
+    int engine;
+    bool offload;
+    bool aggregate;
+    bool ackFilter;
+    const classifier_t *classifier;
+    capture_t *capture;
+    stats_tunnel_t *stats;
+} tunnel_parameters_t;
+
+struct tunnel_s;
 
+// A thread that reads and classifies the packets of one queue of the tun
+// device. It is the producer of the same index in the queue.
 typedef struct {
+    struct tunnel_s *tunnel;
+    int index;
+    int tun_fd;
+    pthread_t thread;
+    pthread_attr_t attributes;
+} tunnel_reader_t;
+
+typedef struct tunnel_s {
     int sock_fd;
     int tun_fd;
-    int overhead;
+    pacer_link_t link;
     int bandwidth;
-    pthread_t tunEnqueueThread;
+    int burst;
+    int batchSize;
+    int engine;
+    bool gsoEnabled;
+    bool offload;
+    bool ackFilter;
+    uint16_t sessionId;
+    tunnel_reader_t readers[TUNNEL_MAX_QUEUE_COUNT];
+    int readerCount;
     pthread_t tunReceivingThread;
     pthread_t tunDequeueThread;
-    pthread_attr_t tunEnqueueThreadAttributes;
+    pthread_t tunProbingThread;
     pthread_attr_t tunReceivingThreadAttributes;
     pthread_attr_t tunDequeueThreadAttributes;
     struct sockaddr otherEndSocketAddress;
+    const classifier_t *classifier;
+    capture_t *capture;
+    stats_tunnel_t *stats;
     queue_t queue;
+    pacer_t pacer;
+
+    // Buffers of the segments and aggregates, owned by the consumer. The pool
+    // of the aggregates is NULL when small packets are not aggregated.
+    pool_t consumerPool;
+    pool_t *aggregatePool;
+
+    // With offloads, the super-packet being segmented, then the packets
+    // received that are waiting to be coalesced
+    queue_element_t *superPacket;
+    uint32_t segmentOffset;
+    offload_coalescer_t coalescer;
+
+    // With probes, the rate controllers of both directions, which the
+    // receiver runs on each reply. The rates go through the atomics: the
+    // upload rate to the consumer, which owns the pacer, and the download
+    // rate to whoever sends the next probe.
+    bool probing;
+    probe_controller_t uploadController;
+    probe_controller_t downloadController;
+    uint64_t receivedBytes;
+    uint64_t nextProbeTimestamp;
+    _Atomic uint32_t uploadBandwidth;
+    _Atomic uint32_t downloadBandwidth;
+
+    // With several paths, the pacer of the tunnel runs at the sum of their
+    // rates, and each datagram is scheduled on one of them when it leaves.
+    // Datagrams are numbered, and those received out of order wait in the
+    // resequencer. Probes are sent on every path to measure its delay.
+    path_t paths[PATH_MAX_COUNT];
+    int pathCount;
+    uint16_t sequence;
+    resequencer_t *resequencer;
 } tunnel_t;
 
-int tunnel_init(tunnel_t *tunnel, int sock_fd, int tun_fd, int queueCapacity, int overhead, int bandwidth, const struct sockaddr *otherEndSocketAddress);
+int tunnel_init(tunnel_t *tunnel, int sock_fd, const int *tun_fds, int tunQueueCount, const tunnel_parameters_t *parameters, const struct sockaddr *otherEndSocketAddress);
 void tunnel_mainLoop(tunnel_t *tunnel);
+void tunnel_configureQueue(queue_t *queue, const classifier_t *classifier, const pacer_link_t *link, int bandwidth);
+void tunnel_setBandwidth(tunnel_t *tunnel, int bandwidth, uint64_t now);
+int tunnel_addPath(tunnel_t *tunnel, const struct sockaddr_in *address, struct in_addr localAddress, int overhead, int bandwidth, int receiveBandwidth);
+void tunnel_startProbing(tunnel_t *tunnel, const probe_controller_t *uploadController, const probe_controller_t *downloadController);
+
+// Steps shared by every engine
+ssize_t tunnel_readTun(tunnel_t *tunnel, int tun_fd, uint8_t *buffer, uint32_t size, struct virtio_net_hdr *vnetHeader);
+bool tunnel_handleTunPacket(tunnel_t *tunnel, int producer, queue_element_t *element, uint8_t *buffer, uint32_t size, const struct virtio_net_hdr *vnetHeader, uint64_t now);
+int tunnel_acceptDatagram(tunnel_t *tunnel, const void *address, socklen_t addressLength, uint8_t *buffer, uint32_t size, struct iovec *packets);
+void tunnel_receiveDatagram(tunnel_t *tunnel, const void *address, socklen_t addressLength, uint8_t *buffer, uint32_t size);
+uint32_t tunnel_addToBatch(pool_t *aggregatePool, queue_element_t **batch, int *count, queue_element_t *element, const pacer_link_t *link);
+uint64_t tunnel_getLookahead(const pool_t *aggregatePool, queue_element_t **batch, int count, const pacer_t *pacer);
+int tunnel_pollDuePackets(tunnel_t *tunnel, queue_element_t **batch, int count, uint64_t now, bool *drained);
+uint64_t tunnel_getDelay(tunnel_t *tunnel, uint64_t now);
+uint64_t tunnel_probe(tunnel_t *tunnel, uint64_t now);
+int tunnel_sendBatch(tunnel_t *tunnel, queue_element_t **elements, int count);
+void tunnel_writeTun(tunnel_t *tunnel, uint8_t *buffer, uint32_t size);
+void tunnel_flushTun(tunnel_t *tunnel);
 
 #endif
@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <uring.h>
+
+static int setup(unsigned int entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int enter(int fd, unsigned int submitCount, unsigned int waitCount, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, submitCount, waitCount, flags, NULL, 0);
+}
+
+static int registerResource(int fd, unsigned int opcode, void *arg, unsigned int count) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static void unmapRings(uring_t *ring) {
+    if(ring->sqes && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+
+    if(ring->cqRing && ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+
+    if(ring->sqRing && ring->sqRing != MAP_FAILED) {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+}
+
+int uring_init(uring_t *ring, unsigned int entries) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(uring_t));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = setup(entries, &params);
+
+    if(ring->fd == -1) {
+        return 1;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Since Linux 5.4 both rings live in a single mapping
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if(ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        perror("mmap() failed on io_uring");
+        unmapRings(ring);
+        close(ring->fd);
+        return 1;
+    }
+
+    uint8_t *sq = ring->sqRing;
+    uint8_t *cq = ring->cqRing;
+
+    ring->sqHead = (_Atomic unsigned int *)(sq + params.sq_off.head);
+    ring->sqTail = (_Atomic unsigned int *)(sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->sqArray = (unsigned int *)(sq + params.sq_off.array);
+    ring->sqLocalTail = atomic_load_explicit(ring->sqTail, memory_order_relaxed);
+
+    ring->cqHead = (_Atomic unsigned int *)(cq + params.cq_off.head);
+    ring->cqTail = (_Atomic unsigned int *)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+void uring_destroy(uring_t *ring) {
+    unmapRings(ring);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+// Operations were added over many kernel versions, so the ones that are used
+// have to be checked one by one.
+bool uring_supportsOperations(uring_t *ring, const uint8_t *opcodes, int count) {
+    size_t probeSize = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probeSize);
+    bool supported = true;
+
+    if(!probe) {
+        return false;
+    }
+
+    if(registerResource(ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST)) {
+        free(probe);
+        return false;
+    }
+
+    for(int i = 0; i < count; i++) {
+        if(opcodes[i] > probe->last_op || !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED)) {
+            supported = false;
+        }
+    }
+
+    free(probe);
+
+    return supported;
+}
+
+// Registered buffers are pinned once, instead of on every operation
+int uring_registerBuffers(uring_t *ring, const struct iovec *iovecs, unsigned int count) {
+    return registerResource(ring->fd, IORING_REGISTER_BUFFERS, (void *)iovecs, count);
+}
+
+// Returns a cleared submission entry. When the ring is full, the pending
+// entries are submitted first to make room.
+struct io_uring_sqe *uring_getSqe(uring_t *ring) {
+    if(ring->sqLocalTail - atomic_load_explicit(ring->sqHead, memory_order_acquire) >= ring->sqEntries) {
+        if(uring_submit(ring, 0) == -1) {
+            return NULL;
+        }
+
+        if(ring->sqLocalTail - atomic_load_explicit(ring->sqHead, memory_order_acquire) >= ring->sqEntries) {
+            return NULL;
+        }
+    }
+
+    unsigned int index = ring->sqLocalTail & ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqArray[index] = index;
+    ring->sqLocalTail++;
+    ring->pendingCount++;
+
+    return sqe;
+}
+
+// Submits the pending entries and waits for at least waitCount completions
+int uring_submit(uring_t *ring, unsigned int waitCount) {
+    atomic_store_explicit(ring->sqTail, ring->sqLocalTail, memory_order_release);
+
+    while(true) {
+        int result = enter(ring->fd, ring->pendingCount, waitCount, waitCount ? IORING_ENTER_GETEVENTS : 0);
+
+        if(result == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            perror("io_uring_enter() failed");
+            return -1;
+        }
+
+        ring->pendingCount -= result;
+
+        return result;
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef __URING_H_INCLUDED__
+#define __URING_H_INCLUDED__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper on top of the raw system calls, so that the tunnel
+// does not depend on liburing. The submission and completion rings are shared
+// with the kernel, which reads the submission tail and writes the completion
+// tail concurrently.
+typedef struct {
+    int fd;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    _Atomic unsigned int *sqHead;
+    _Atomic unsigned int *sqTail;
+    unsigned int sqMask;
+    unsigned int sqEntries;
+    unsigned int *sqArray;
+    unsigned int sqLocalTail;
+    unsigned int pendingCount;
+
+    _Atomic unsigned int *cqHead;
+    _Atomic unsigned int *cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned int entries);
+void uring_destroy(uring_t *ring);
+bool uring_supportsOperations(uring_t *ring, const uint8_t *opcodes, int count);
+int uring_registerBuffers(uring_t *ring, const struct iovec *iovecs, unsigned int count);
+struct io_uring_sqe *uring_getSqe(uring_t *ring);
+int uring_submit(uring_t *ring, unsigned int waitCount);
+
+static inline struct io_uring_cqe *uring_peekCqe(uring_t *ring) {
+    unsigned int head = atomic_load_explicit(ring->cqHead, memory_order_relaxed);
+
+    if(head == atomic_load_explicit(ring->cqTail, memory_order_acquire)) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & ring->cqMask];
+}
+
+static inline void uring_advanceCq(uring_t *ring) {
+    unsigned int head = atomic_load_explicit(ring->cqHead, memory_order_relaxed);
+
+    atomic_store_explicit(ring->cqHead, head + 1, memory_order_release);
+}
+
+#endif